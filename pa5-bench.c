@@ -0,0 +1,459 @@
+/* pa5-bench.c
+ * In-process benchmark of the pa5-encfs callbacks.
+ *
+ *   pa5-bench [-d dir] [-s MB] [-n ops] [-p password] [workload ...]
+ *
+ * Drives xmp_oper directly through pa5-harness against a temporary mirror
+ * directory, so the numbers carry no kernel or FUSE noise and no privileges
+ * are needed. Offsets come from a fixed seed, so runs are repeatable.
+ *
+ * Workloads (default: all, in this order):
+ *   seqwrite   Sequential 128 KiB writes of a -s MB file
+ *   seqread    Sequential 128 KiB reads of the same file
+ *   randwrite  -n random 4 KiB writes within the file
+ *   randread   -n random 4 KiB reads within the file
+ *   append     -n 4 KiB appends to a new file
+ *   meta       -n files created, stat()ed, listed and unlinked
+ *
+ * Options:
+ *   -d <dir>       Parent of the temporary mirror (default: $TMPDIR or /tmp)
+ *   -s <MB>        Size of the data file (default: 64)
+ *   -n <ops>       Operations for the random, append and meta workloads
+ *                  (default: 20000)
+ *   -p <password>  Mount pass phrase (default: "bench")
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "pa5-harness.h"
+#include "pa5-stats.h"
+
+#define SEQ_BLOCK (128 * 1024)
+#define RAND_BLOCK 4096
+#define DATA_FILE "/bench.dat"
+#define APPEND_FILE "/append.dat"
+#define META_DIR "/meta"
+
+struct bench_result
+{
+	const char *name;
+	uint64_t *lat;      /* Latency of every operation, in ns. */
+	size_t ops;
+	size_t cap;
+	uint64_t bytes;
+	uint64_t elapsed;
+	int errors;
+};
+
+struct bench_config
+{
+	off_t size;
+	size_t nops;
+	char **workloads;
+	int nworkloads;
+};
+
+typedef int (*workload_fn)(const struct fuse_operations *op, const struct bench_config *cfg,
+			   struct bench_result *r);
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* xorshift64*, seeded the same way on every run. */
+static uint64_t next_random(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void record(struct bench_result *r, uint64_t start, int res, size_t bytes)
+{
+	uint64_t ns = pa5_stats_now() - start;
+
+	if (r->ops == r->cap)
+	{
+		size_t cap = r->cap ? r->cap * 2 : 4096;
+		uint64_t *lat = realloc(r->lat, cap * sizeof(uint64_t));
+		if (!lat)
+		{
+			r->errors++;
+			return;
+		}
+		r->lat = lat;
+		r->cap = cap;
+	}
+	r->lat[r->ops++] = ns;
+	if (res < 0)
+		r->errors++;
+	else
+		r->bytes += bytes;
+}
+
+static int open_file(const struct fuse_operations *op, const char *path, int flags,
+		     struct fuse_file_info *fi)
+{
+	memset(fi, 0, sizeof(*fi));
+	fi->flags = flags;
+	if (flags & O_CREAT)
+		return op->create(path, 0644, fi);
+	return op->open(path, fi);
+}
+
+/* Writes the data file without timing it, for read-only workloads run on
+ * their own. */
+static int ensure_data_file(const struct fuse_operations *op, const struct bench_config *cfg)
+{
+	struct stat st;
+	struct fuse_file_info fi;
+	char *buf;
+	off_t pos;
+
+	if (op->getattr(DATA_FILE, &st) == 0 && st.st_size == cfg->size)
+		return 0;
+	if ((buf = malloc(SEQ_BLOCK)) == NULL)
+		return -ENOMEM;
+	memset(buf, 0xa5, SEQ_BLOCK);
+
+	int res = open_file(op, DATA_FILE, O_CREAT | O_RDWR, &fi);
+	for (pos = 0; res == 0 && pos < cfg->size; pos += SEQ_BLOCK)
+	{
+		int n = op->write(DATA_FILE, buf, SEQ_BLOCK, pos, &fi);
+		if (n < 0)
+			res = n;
+	}
+	op->release(DATA_FILE, &fi);
+	free(buf);
+	return res;
+}
+
+static int run_seqwrite(const struct fuse_operations *op, const struct bench_config *cfg,
+			struct bench_result *r)
+{
+	struct fuse_file_info fi;
+	char buf[SEQ_BLOCK];
+	off_t pos;
+
+	memset(buf, 0xa5, sizeof(buf));
+	op->unlink(DATA_FILE);
+	int res = open_file(op, DATA_FILE, O_CREAT | O_RDWR, &fi);
+	if (res < 0)
+		return res;
+
+	for (pos = 0; pos < cfg->size; pos += SEQ_BLOCK)
+	{
+		uint64_t start = pa5_stats_now();
+		record(r, start, op->write(DATA_FILE, buf, SEQ_BLOCK, pos, &fi), SEQ_BLOCK);
+	}
+	op->release(DATA_FILE, &fi);
+	return 0;
+}
+
+static int run_seqread(const struct fuse_operations *op, const struct bench_config *cfg,
+		       struct bench_result *r)
+{
+	struct fuse_file_info fi;
+	char buf[SEQ_BLOCK];
+	off_t pos;
+
+	int res = ensure_data_file(op, cfg);
+	if (res < 0 || (res = open_file(op, DATA_FILE, O_RDONLY, &fi)) < 0)
+		return res;
+
+	for (pos = 0; pos < cfg->size; pos += SEQ_BLOCK)
+	{
+		uint64_t start = pa5_stats_now();
+		record(r, start, op->read(DATA_FILE, buf, SEQ_BLOCK, pos, &fi), SEQ_BLOCK);
+	}
+	op->release(DATA_FILE, &fi);
+	return 0;
+}
+
+static int run_random(const struct fuse_operations *op, const struct bench_config *cfg,
+		      struct bench_result *r, int write)
+{
+	struct fuse_file_info fi;
+	char buf[RAND_BLOCK];
+	off_t blocks = cfg->size / RAND_BLOCK;
+	size_t i;
+
+	memset(buf, 0x5a, sizeof(buf));
+	int res = ensure_data_file(op, cfg);
+	if (res < 0 || (res = open_file(op, DATA_FILE, O_RDWR, &fi)) < 0)
+		return res;
+
+	for (i = 0; i < cfg->nops && blocks > 0; i++)
+	{
+		off_t off = (off_t)(next_random() % blocks) * RAND_BLOCK;
+		uint64_t start = pa5_stats_now();
+		if (write)
+			res = op->write(DATA_FILE, buf, RAND_BLOCK, off, &fi);
+		else
+			res = op->read(DATA_FILE, buf, RAND_BLOCK, off, &fi);
+		record(r, start, res, RAND_BLOCK);
+	}
+	op->release(DATA_FILE, &fi);
+	return 0;
+}
+
+static int run_randwrite(const struct fuse_operations *op, const struct bench_config *cfg,
+			 struct bench_result *r)
+{
+	return run_random(op, cfg, r, 1);
+}
+
+static int run_randread(const struct fuse_operations *op, const struct bench_config *cfg,
+			struct bench_result *r)
+{
+	return run_random(op, cfg, r, 0);
+}
+
+static int run_append(const struct fuse_operations *op, const struct bench_config *cfg,
+		      struct bench_result *r)
+{
+	struct fuse_file_info fi;
+	char buf[RAND_BLOCK];
+	size_t i;
+
+	memset(buf, 0x3c, sizeof(buf));
+	op->unlink(APPEND_FILE);
+	int res = open_file(op, APPEND_FILE, O_CREAT | O_WRONLY | O_APPEND, &fi);
+	if (res < 0)
+		return res;
+
+	/* The kernel turns O_APPEND into writes at the current end. */
+	for (i = 0; i < cfg->nops; i++)
+	{
+		uint64_t start = pa5_stats_now();
+		record(r, start, op->write(APPEND_FILE, buf, RAND_BLOCK, (off_t)i * RAND_BLOCK, &fi),
+		       RAND_BLOCK);
+	}
+	op->release(APPEND_FILE, &fi);
+	op->unlink(APPEND_FILE);
+	return 0;
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(void) name;
+	(void) st;
+	(void) off;
+
+	(*(size_t *)buf)++;
+	return 0;
+}
+
+static int run_meta(const struct fuse_operations *op, const struct bench_config *cfg,
+		    struct bench_result *r)
+{
+	struct fuse_file_info fi;
+	struct stat st;
+	char path[64];
+	size_t entries = 0;
+	size_t i;
+
+	int res = op->mkdir(META_DIR, 0755);
+	if (res < 0 && res != -EEXIST)
+		return res;
+
+	for (i = 0; i < cfg->nops; i++)
+	{
+		snprintf(path, sizeof(path), META_DIR "/f%zu", i);
+		uint64_t start = pa5_stats_now();
+		res = open_file(op, path, O_CREAT | O_WRONLY, &fi);
+		if (res == 0)
+			res = op->release(path, &fi);
+		record(r, start, res, 0);
+	}
+	for (i = 0; i < cfg->nops; i++)
+	{
+		snprintf(path, sizeof(path), META_DIR "/f%zu", i);
+		uint64_t start = pa5_stats_now();
+		record(r, start, op->getattr(path, &st), 0);
+	}
+
+	memset(&fi, 0, sizeof(fi));
+	uint64_t start = pa5_stats_now();
+	record(r, start, op->readdir(META_DIR, &entries, count_entry, 0, &fi), 0);
+
+	for (i = 0; i < cfg->nops; i++)
+	{
+		snprintf(path, sizeof(path), META_DIR "/f%zu", i);
+		start = pa5_stats_now();
+		record(r, start, op->unlink(path), 0);
+	}
+	op->rmdir(META_DIR);
+	return 0;
+}
+
+static const struct
+{
+	const char *name;
+	workload_fn fn;
+} workloads[] = {
+	{ "seqwrite", run_seqwrite },
+	{ "seqread", run_seqread },
+	{ "randwrite", run_randwrite },
+	{ "randread", run_randread },
+	{ "append", run_append },
+	{ "meta", run_meta },
+};
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const struct bench_result *r, double q)
+{
+	size_t i = (size_t)(q * (r->ops - 1) + 0.5);
+	return r->lat[i] / 1000.0;
+}
+
+static void report(const struct bench_result *r)
+{
+	double secs = r->elapsed / 1e9;
+
+	if (r->ops == 0)
+	{
+		printf("%-10s %10s\n", r->name, "no ops");
+		return;
+	}
+	qsort(r->lat, r->ops, sizeof(uint64_t), compare_u64);
+	printf("%-10s %9zu %11.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %6d\n", r->name, r->ops,
+	       r->ops / secs, r->bytes / 1e6 / secs, percentile_us(r, 0.50),
+	       percentile_us(r, 0.90), percentile_us(r, 0.99), percentile_us(r, 0.999),
+	       r->lat[r->ops - 1] / 1000.0, r->errors);
+}
+
+static int bench_body(const struct fuse_operations *op, void *arg)
+{
+	const struct bench_config *cfg = arg;
+	int failed = 0;
+	int w;
+	size_t i;
+
+	printf("%-10s %9s %11s %9s %9s %9s %9s %9s %9s %6s\n", "workload", "ops", "ops/s",
+	       "MB/s", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us", "errors");
+
+	for (i = 0; i < NWORKLOADS; i++)
+	{
+		int selected = (cfg->nworkloads == 0);
+		for (w = 0; w < cfg->nworkloads; w++)
+		{
+			if (strcmp(cfg->workloads[w], workloads[i].name) == 0)
+				selected = 1;
+		}
+		if (!selected)
+			continue;
+
+		struct bench_result r;
+		memset(&r, 0, sizeof(r));
+		r.name = workloads[i].name;
+
+		uint64_t start = pa5_stats_now();
+		int res = workloads[i].fn(op, cfg, &r);
+		r.elapsed = pa5_stats_now() - start;
+
+		if (res < 0)
+		{
+			fprintf(stderr, "%s: %s\n", r.name, strerror(-res));
+			failed = 1;
+		}
+		else
+			report(&r);
+		if (r.errors)
+			failed = 1;
+		free(r.lat);
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int remove_entry(const char *fpath, const struct stat *st, int type, struct FTW *ftw)
+{
+	(void) st;
+	(void) type;
+	(void) ftw;
+
+	return remove(fpath);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d dir] [-s MB] [-n ops] [-p password] [workload ...]\n"
+		"workloads: seqwrite seqread randwrite randread append meta\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_config cfg;
+	const char *parent = getenv("TMPDIR");
+	const char *password = "bench";
+	char mirror[PATH_MAX];
+	int opt;
+	int w;
+	size_t i;
+
+	cfg.size = 64 * 1024 * 1024;
+	cfg.nops = 20000;
+	while ((opt = getopt(argc, argv, "d:s:n:p:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			parent = optarg;
+			break;
+		case 's':
+			cfg.size = (off_t)strtoul(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'n':
+			cfg.nops = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			password = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	cfg.workloads = argv + optind;
+	cfg.nworkloads = argc - optind;
+	for (w = 0; w < cfg.nworkloads; w++)
+	{
+		for (i = 0; i < NWORKLOADS; i++)
+		{
+			if (strcmp(cfg.workloads[w], workloads[i].name) == 0)
+				break;
+		}
+		if (i == NWORKLOADS)
+			usage(argv[0]);
+	}
+
+	snprintf(mirror, sizeof(mirror), "%s/pa5-bench.XXXXXX", parent ? parent : "/tmp");
+	if (!mkdtemp(mirror))
+	{
+		fprintf(stderr, "Error: %s: %s\n", mirror, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	int res = pa5_harness_run(password, mirror, bench_body, &cfg);
+
+	nftw(mirror, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return res;
+}
@@ -0,0 +1,1094 @@
+/* pa5-bulk.c
+ * Offline bulk tool for whole pa5-encfs mirror trees.
+ *
+ *   pa5-bulk encrypt [options] <password> <plain dir> <mirror dir>
+ *   pa5-bulk decrypt [options] <password> <mirror dir> <plain dir>
+ *   pa5-bulk verify  [options] <password> <mirror dir>
+ *   pa5-bulk migrate [options] <password> <mirror dir>
+ *   pa5-bulk rekey <old password> <new password> <mirror dir>
+ *   pa5-bulk copy <file> <new file>
+ *
+ * encrypt seeds a mirror from a plaintext tree in the daemon's chunk format,
+ * decrypt does the reverse, verify authenticates every chunk of every
+ * encrypted file, and migrate converts legacy whole-file CBC files in place.
+ * rekey rewraps the volume master key under a new pass phrase without
+ * touching any file data. Files in the mirror's small-file store (see
+ * pa5-small.h) are decrypted and verified after the walk.
+ *
+ * copy works on a mounted pa5-encfs rather than a mirror: it has the daemon
+ * copy a file to another path in the same mount through the user.pa5.copy
+ * attribute (see pa5-encfs.c), so chunk files are copied without being
+ * decrypted and encrypted again. The new file is created with the mode of
+ * the source if it does not exist.
+ *
+ * The tree is walked on the main thread and files are handed to a pool of
+ * worker threads. Output files are written under a temporary name and
+ * renamed into place, and each finished file is appended to the optional
+ * state file, so an interrupted run picks up where it stopped.
+ *
+ * Options:
+ *   -j <threads>  Worker threads (default: one per online CPU)
+ *   -r <MB/s>     Limit the combined data rate
+ *   -s <file>     State file for resuming an interrupted run
+ *   -z <codec>    Compress chunks written by encrypt and migrate with
+ *                 zlib, lz4 or zstd (default: off)
+ *   -D            Write deduplicated files into the mirror's chunk store
+ *                 (encrypt and migrate); see pa5-dedup.h
+ *   -S <dirs>     Colon separated extra mirror roots, as given to the
+ *                 daemon in PA5_STRIPE_ROOTS; encrypt and migrate stripe
+ *                 new files over them (see pa5-stripe.h)
+ *   -P <policy>   Stripe policy for -S, all or data (default: all)
+ *   -q            Only report errors and the final summary
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/vfs.h>
+
+#include "pa5-io.h"
+#include "pa5-cbc.h"
+#include "pa5-chunk.h"
+#include "pa5-cache.h"
+#include "pa5-inode.h"
+#include "pa5-migrate.h"
+#include "pa5-volume.h"
+#include "pa5-compress.h"
+#include "pa5-dedup.h"
+#include "pa5-small.h"
+#include "pa5-stripe.h"
+
+#define BULK_WINDOW (1024 * 1024)
+#define BULK_QUEUE_MAX 4096
+#define BULK_TMP_PREFIX ".pa5-bulk."
+#define REPORT_INTERVAL 5
+#define FUSE_SUPER_MAGIC 0x65735546  /* statfs() f_type of a FUSE mount. */
+
+enum bulk_mode
+{
+	MODE_ENCRYPT,
+	MODE_DECRYPT,
+	MODE_VERIFY,
+	MODE_MIGRATE
+};
+
+struct bulk_job
+{
+	char *rel;              /* Path relative to the source root. */
+	struct bulk_job *next;
+};
+
+struct bulk_dir
+{
+	char *rel;
+	struct stat st;
+	struct bulk_dir *next;
+};
+
+/* Settings */
+static enum bulk_mode mode;
+static const char *src_root;
+static const char *dst_root;
+static struct pa5_cbc_key cbc_key;
+static struct pa5_keys keys;
+static int quiet = 0;
+static double rate_limit = 0;   /* Bytes per second, 0 for unlimited. */
+
+/* Work queue */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_nonempty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_nonfull = PTHREAD_COND_INITIALIZER;
+static struct bulk_job *queue_head = NULL;
+static struct bulk_job *queue_tail = NULL;
+static int queue_len = 0;
+static int walk_done = 0;
+
+/* Directories get their final mode and times once their contents exist. */
+static struct bulk_dir *dirs = NULL;
+
+/* Progress */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stats_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t files_queued = 0;
+static uint64_t files_done = 0;
+static uint64_t files_skipped = 0;
+static uint64_t files_failed = 0;
+static uint64_t bytes_done = 0;
+static int finished = 0;
+static struct timespec start_time;
+
+/* Resume state: finished paths from an earlier run, and the log. */
+static FILE *state_file = NULL;
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **done_set = NULL;
+static size_t done_cap = 0;
+
+/* Rate limiter */
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+static double rate_next = 0;
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t hash_string(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 0x100000001b3ULL;
+	return h;
+}
+
+static void done_insert(char *rel)
+{
+	size_t i = hash_string(rel) & (done_cap - 1);
+	while (done_set[i])
+	{
+		if (strcmp(done_set[i], rel) == 0)
+		{
+			free(rel);
+			return;
+		}
+		i = (i + 1) & (done_cap - 1);
+	}
+	done_set[i] = rel;
+}
+
+static int done_contains(const char *rel)
+{
+	if (!done_set)
+		return 0;
+
+	size_t i = hash_string(rel) & (done_cap - 1);
+	while (done_set[i])
+	{
+		if (strcmp(done_set[i], rel) == 0)
+			return 1;
+		i = (i + 1) & (done_cap - 1);
+	}
+	return 0;
+}
+
+/* Loads the paths an earlier run finished and opens the log for appending. */
+static int state_open(const char *path)
+{
+	char line[PATH_MAX + 2];
+	size_t count = 0;
+	FILE *in = fopen(path, "r");
+
+	if (in)
+	{
+		while (fgets(line, sizeof(line), in))
+			count++;
+		rewind(in);
+
+		for (done_cap = 1024; done_cap < count * 2; done_cap *= 2)
+			;
+		done_set = calloc(done_cap, sizeof(char *));
+		if (!done_set)
+		{
+			fclose(in);
+			return -ENOMEM;
+		}
+
+		while (fgets(line, sizeof(line), in))
+		{
+			size_t len = strlen(line);
+			/* A torn last line from a crash is simply redone. */
+			if (len == 0 || line[len - 1] != '\n')
+				continue;
+			line[len - 1] = '\0';
+			char *rel = strdup(line);
+			if (rel)
+				done_insert(rel);
+		}
+		fclose(in);
+	}
+
+	state_file = fopen(path, "a");
+	return state_file ? 0 : -errno;
+}
+
+static void state_record(const char *rel)
+{
+	static unsigned since_sync = 0;
+
+	if (!state_file)
+		return;
+
+	pthread_mutex_lock(&state_lock);
+	fprintf(state_file, "%s\n", rel);
+	fflush(state_file);
+	if (++since_sync >= 1000)
+	{
+		fsync(fileno(state_file));
+		since_sync = 0;
+	}
+	pthread_mutex_unlock(&state_lock);
+}
+
+/* Sleeps as needed to keep the combined rate under the limit. */
+static void rate_take(size_t bytes)
+{
+	double wait;
+
+	if (rate_limit <= 0)
+		return;
+
+	pthread_mutex_lock(&rate_lock);
+	double now = now_seconds();
+	if (rate_next < now)
+		rate_next = now;
+	rate_next += bytes / rate_limit;
+	wait = rate_next - now;
+	pthread_mutex_unlock(&rate_lock);
+
+	if (wait > 0)
+	{
+		struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void count_bytes(size_t bytes)
+{
+	pthread_mutex_lock(&stats_lock);
+	bytes_done += bytes;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static int is_encrypted_fd(int fd)
+{
+	char value[5] = { 0 };
+	fgetxattr(fd, "user.encrypted", value, 5);
+	return (strcmp(value, "true") == 0);
+}
+
+static void join_path(char *out, const char *root, const char *rel)
+{
+	snprintf(out, PATH_MAX, "%s%s%s", root, rel[0] ? "/" : "", rel);
+}
+
+/* Temporary name next to the final output path. */
+static void tmp_path(char *out, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	int dirlen = slash ? (int)(slash - path) : 0;
+	snprintf(out, PATH_MAX, "%.*s/%s%lx.tmp", dirlen, path, BULK_TMP_PREFIX,
+		 (unsigned long)pthread_self());
+}
+
+static int finish_output(int fd, const char *tmp, const char *path, const struct stat *st)
+{
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+	if (fchmod(fd, st->st_mode & 07777) == -1 || futimens(fd, times) == -1 ||
+	    fsync(fd) == -1)
+		return -errno;
+	if (rename(tmp, path) == -1)
+		return -errno;
+	return 0;
+}
+
+/* Plaintext file -> chunk format file. */
+static int encrypt_file(const char *src, const char *dst, char *buf)
+{
+	struct stat st;
+	struct pa5_chunk_file cf;
+	char tmp[PATH_MAX];
+	off_t pos = 0;
+	int created = 0;
+	int res = 0;
+	int out = -1;
+
+	int in = open(src, O_RDONLY);
+	if (in == -1)
+		return -errno;
+	if (fstat(in, &st) == -1)
+	{
+		res = -errno;
+		goto out;
+	}
+
+	tmp_path(tmp, dst);
+	out = open(tmp, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	if (out == -1)
+	{
+		res = -errno;
+		goto out;
+	}
+
+	if (fsetxattr(out, "user.encrypted", "true", 5, 0) == -1)
+	{
+		res = -errno;
+		goto out;
+	}
+	if ((res = pa5_chunk_create(out, &keys, PA5_CHUNK_CODEC_MOUNT, &cf)) < 0)
+		goto out;
+	created = 1;
+
+	for (;;)
+	{
+		ssize_t n = pread(in, buf, BULK_WINDOW, pos);
+		if (n < 0)
+		{
+			res = -errno;
+			goto out;
+		}
+		if (n == 0)
+			break;
+
+		rate_take(n);
+		if ((res = pa5_chunk_write(&cf, buf, n, pos)) < 0)
+			goto out;
+		pos += n;
+		count_bytes(n);
+	}
+
+	if ((res = pa5_chunk_sync(&cf, 1)) < 0)
+		goto out;
+	res = finish_output(out, tmp, dst, &st);
+
+out:
+	if (out != -1)
+	{
+		/* Let go of whatever a deduplicated or striped file took. */
+		if (res < 0 && created)
+			pa5_chunk_truncate(&cf, 0);
+		close(out);
+		if (res < 0)
+			unlink(tmp);
+	}
+	close(in);
+	return res;
+}
+
+/* Reads one window of plaintext from an encrypted file in either format. */
+static int read_plain(int fd, const struct pa5_chunk_file *cf, char *buf, size_t size,
+		      off_t pos)
+{
+	if (cf)
+		return pa5_chunk_read(cf, buf, size, pos);
+	return pa5_cbc_read(fd, &cbc_key, buf, size, pos);
+}
+
+/* Opens the chunk header of fd if it has one. Returns 1 for chunk files,
+ * 0 for legacy files. */
+static int open_format(int fd, struct pa5_chunk_file *cf)
+{
+	int version = pa5_chunk_probe(fd);
+	if (version == 0)
+		return 0;
+	if (version != PA5_CHUNK_VERSION)
+		return -EIO;
+
+	int res = pa5_chunk_open(fd, &keys, cf);
+	return (res < 0) ? res : 1;
+}
+
+/* Encrypted mirror file -> plaintext file. Plain mirror files are copied. */
+static int decrypt_file(const char *src, const char *dst, char *buf)
+{
+	struct stat st;
+	struct pa5_chunk_file cf;
+	char tmp[PATH_MAX];
+	int encrypted;
+	int chunked = 0;
+	off_t pos = 0;
+	int res = 0;
+	int out = -1;
+
+	int in = open(src, O_RDONLY);
+	if (in == -1)
+		return -errno;
+	if (fstat(in, &st) == -1)
+	{
+		res = -errno;
+		goto out;
+	}
+
+	encrypted = is_encrypted_fd(in);
+	if (encrypted && (chunked = open_format(in, &cf)) < 0)
+	{
+		res = chunked;
+		goto out;
+	}
+
+	tmp_path(tmp, dst);
+	out = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (out == -1)
+	{
+		res = -errno;
+		goto out;
+	}
+
+	for (;;)
+	{
+		ssize_t n;
+		if (encrypted)
+			n = read_plain(in, chunked ? &cf : NULL, buf, BULK_WINDOW, pos);
+		else if ((n = pread(in, buf, BULK_WINDOW, pos)) < 0)
+			n = -errno;
+
+		if (n < 0)
+		{
+			res = n;
+			goto out;
+		}
+		if (n == 0)
+			break;
+
+		rate_take(n);
+		if (pwrite(out, buf, n, pos) != n)
+		{
+			res = -EIO;
+			goto out;
+		}
+		pos += n;
+		count_bytes(n);
+	}
+
+	res = finish_output(out, tmp, dst, &st);
+
+out:
+	if (out != -1)
+	{
+		close(out);
+		if (res < 0)
+			unlink(tmp);
+	}
+	close(in);
+	return res;
+}
+
+/* Authenticates every chunk, reporting each bad one. Legacy files have no
+ * authentication, so for them only the padding can be checked. Returns 1 if
+ * the file is intact, 0 if it is not encrypted. */
+static int verify_file(const char *src, char *buf)
+{
+	struct pa5_chunk_file cf;
+	int bad = 0;
+	off_t pos = 0;
+
+	int in = open(src, O_RDONLY);
+	if (in == -1)
+		return -errno;
+
+	if (!is_encrypted_fd(in))
+	{
+		close(in);
+		return 0;
+	}
+
+	int chunked = open_format(in, &cf);
+	if (chunked < 0)
+	{
+		fprintf(stderr, "%s: bad header\n", src);
+		close(in);
+		return -EIO;
+	}
+
+	for (;;)
+	{
+		int n = read_plain(in, chunked ? &cf : NULL, buf, BULK_WINDOW, pos);
+		if (n == 0)
+			break;
+		if (n < 0)
+		{
+			if (!chunked)
+			{
+				fprintf(stderr, "%s: bad padding\n", src);
+				bad++;
+				break;
+			}
+			/* Report the chunk and carry on with the next one. */
+			fprintf(stderr, "%s: chunk %lld failed verification\n", src,
+				(long long)(pos / cf.chunk_size));
+			bad++;
+			pos = (pos / cf.chunk_size + 1) * cf.chunk_size;
+			continue;
+		}
+
+		rate_take(n);
+		pos += n;
+		count_bytes(n);
+	}
+
+	close(in);
+	return bad ? -EIO : 1;
+}
+
+static int process(const char *rel, char *buf)
+{
+	char src[PATH_MAX];
+	char dst[PATH_MAX];
+	struct stat st;
+	int res;
+
+	join_path(src, src_root, rel);
+	switch (mode)
+	{
+	case MODE_ENCRYPT:
+		join_path(dst, dst_root, rel);
+		return encrypt_file(src, dst, buf);
+	case MODE_DECRYPT:
+		join_path(dst, dst_root, rel);
+		return decrypt_file(src, dst, buf);
+	case MODE_VERIFY:
+		return verify_file(src, buf);
+	case MODE_MIGRATE:
+		if (lstat(src, &st) == -1)
+			return -errno;
+		rate_take(st.st_size);
+		res = pa5_migrate_file(src, &cbc_key, &keys);
+		if (res == 1)
+			count_bytes(st.st_size);
+		return res;
+	}
+	return -EINVAL;
+}
+
+/* Decrypts or verifies one file of the small-file store. */
+static int small_visit(void *arg, const char *path, const char *data,
+		       const struct stat *st, int res)
+{
+	const char *rel = path + 1;
+
+	(void) arg;
+	if (done_contains(rel))
+	{
+		pthread_mutex_lock(&stats_lock);
+		files_skipped++;
+		pthread_mutex_unlock(&stats_lock);
+		return 0;
+	}
+
+	if (res == 0 && mode == MODE_DECRYPT)
+	{
+		char dst[PATH_MAX];
+		char tmp[PATH_MAX];
+		join_path(dst, dst_root, rel);
+		tmp_path(tmp, dst);
+		int out = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+		if (out == -1)
+			res = -errno;
+		else
+		{
+			rate_take(st->st_size);
+			if (pwrite(out, data, st->st_size, 0) != st->st_size)
+				res = -EIO;
+			else
+				res = finish_output(out, tmp, dst, st);
+			close(out);
+			if (res < 0)
+				unlink(tmp);
+		}
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	files_queued++;
+	if (res < 0)
+		files_failed++;
+	else
+		files_done++;
+	pthread_mutex_unlock(&stats_lock);
+
+	if (res < 0)
+	{
+		fprintf(stderr, "%s: %s\n", rel, res == -EIO ? "failed verification" :
+			strerror(-res));
+		return 0;
+	}
+	count_bytes(st->st_size);
+	state_record(rel);
+	return 0;
+}
+
+static void *worker(void *arg)
+{
+	char *buf = malloc(BULK_WINDOW);
+
+	(void) arg;
+	if (!buf)
+	{
+		fprintf(stderr, "Error: Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (;;)
+	{
+		pthread_mutex_lock(&queue_lock);
+		while (!queue_head && !walk_done)
+			pthread_cond_wait(&queue_nonempty, &queue_lock);
+		struct bulk_job *job = queue_head;
+		if (!job)
+		{
+			pthread_mutex_unlock(&queue_lock);
+			break;
+		}
+		queue_head = job->next;
+		if (!queue_head)
+			queue_tail = NULL;
+		queue_len--;
+		pthread_cond_signal(&queue_nonfull);
+		pthread_mutex_unlock(&queue_lock);
+
+		int res = process(job->rel, buf);
+
+		pthread_mutex_lock(&stats_lock);
+		if (res < 0)
+			files_failed++;
+		else if (res == 0 && mode != MODE_ENCRYPT && mode != MODE_DECRYPT)
+			files_skipped++;
+		else
+			files_done++;
+		pthread_mutex_unlock(&stats_lock);
+
+		if (res < 0)
+			fprintf(stderr, "%s: %s\n", job->rel, strerror(-res));
+		else
+			state_record(job->rel);
+
+		free(job->rel);
+		free(job);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void enqueue(const char *rel)
+{
+	struct bulk_job *job = malloc(sizeof(*job));
+	if (!job || (job->rel = strdup(rel)) == NULL)
+	{
+		fprintf(stderr, "Error: Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	job->next = NULL;
+
+	pthread_mutex_lock(&queue_lock);
+	while (queue_len >= BULK_QUEUE_MAX)
+		pthread_cond_wait(&queue_nonfull, &queue_lock);
+	if (queue_tail)
+		queue_tail->next = job;
+	else
+		queue_head = job;
+	queue_tail = job;
+	queue_len++;
+	pthread_cond_signal(&queue_nonempty);
+	pthread_mutex_unlock(&queue_lock);
+
+	pthread_mutex_lock(&stats_lock);
+	files_queued++;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static int walk_visit(const char *fpath, const struct stat *st, int type, struct FTW *ftw)
+{
+	const char *rel = fpath + strlen(src_root);
+	const char *name = fpath + ftw->base;
+	char dst[PATH_MAX];
+
+	while (*rel == '/')
+		rel++;
+
+	/* Internal files of the daemon and of this tool are never copied. */
+	if (ftw->level > 0 && (strncmp(name, ".pa5-", 5) == 0))
+		return (type == FTW_D) ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+
+	int writes = (mode == MODE_ENCRYPT || mode == MODE_DECRYPT);
+	if (writes)
+		join_path(dst, dst_root, rel);
+
+	if (type == FTW_D)
+	{
+		if (writes && ftw->level > 0)
+		{
+			if (mkdir(dst, 0700) == -1 && errno != EEXIST)
+			{
+				fprintf(stderr, "%s: %s\n", dst, strerror(errno));
+				return FTW_SKIP_SUBTREE;
+			}
+			struct bulk_dir *d = malloc(sizeof(*d));
+			if (d && (d->rel = strdup(rel)) != NULL)
+			{
+				d->st = *st;
+				d->next = dirs;
+				dirs = d;
+			}
+			else
+				free(d);
+		}
+		return FTW_CONTINUE;
+	}
+
+	if (type == FTW_SL && writes)
+	{
+		char target[PATH_MAX];
+		ssize_t len = readlink(fpath, target, sizeof(target) - 1);
+		if (len >= 0)
+		{
+			target[len] = '\0';
+			unlink(dst);
+			if (symlink(target, dst) == -1)
+				fprintf(stderr, "%s: %s\n", dst, strerror(errno));
+		}
+		return FTW_CONTINUE;
+	}
+
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return FTW_CONTINUE;
+
+	if (done_contains(rel))
+	{
+		pthread_mutex_lock(&stats_lock);
+		files_skipped++;
+		pthread_mutex_unlock(&stats_lock);
+		return FTW_CONTINUE;
+	}
+
+	enqueue(rel);
+	return FTW_CONTINUE;
+}
+
+static void report(int final)
+{
+	pthread_mutex_lock(&stats_lock);
+	double elapsed = now_seconds() - (start_time.tv_sec + start_time.tv_nsec / 1e9);
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+	fprintf(stderr, "%s%llu/%llu files, %llu skipped, %llu failed, %.1f MB, %.1f MB/s, %.0f files/s\n",
+		final ? "Done: " : "",
+		(unsigned long long)files_done, (unsigned long long)files_queued,
+		(unsigned long long)files_skipped, (unsigned long long)files_failed,
+		bytes_done / 1e6, bytes_done / 1e6 / elapsed, files_done / elapsed);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void *reporter(void *arg)
+{
+	(void) arg;
+
+	pthread_mutex_lock(&stats_lock);
+	while (!finished)
+	{
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += REPORT_INTERVAL;
+		pthread_cond_timedwait(&stats_cond, &stats_lock, &until);
+		if (finished)
+			break;
+		pthread_mutex_unlock(&stats_lock);
+		report(0);
+		pthread_mutex_lock(&stats_lock);
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	return NULL;
+}
+
+/* Asks the pa5-encfs mount holding from to copy it to to, which must be in
+ * the same mount. The source is named by its path below the mount root,
+ * the topmost directory above it on the same device.
+ * Return: 0 on success, -errno on error */
+static int copy_in_mount(const char *from, const char *to)
+{
+	char *src = realpath(from, NULL);
+	char root[PATH_MAX];
+	struct stat st, dst_st, up;
+	struct statfs fs;
+	int res = 0;
+
+	if (!src)
+		return -errno;
+	if (stat(src, &st) == -1)
+	{
+		res = -errno;
+		goto out;
+	}
+	if (!S_ISREG(st.st_mode))
+	{
+		res = -EINVAL;
+		goto out;
+	}
+	if (statfs(src, &fs) == -1 || fs.f_type != FUSE_SUPER_MAGIC)
+	{
+		res = -EOPNOTSUPP;
+		goto out;
+	}
+
+	int fd = open(to, O_WRONLY | O_CREAT, st.st_mode & 07777);
+	if (fd == -1 || fstat(fd, &dst_st) == -1)
+		res = -errno;
+	if (fd != -1)
+		close(fd);
+	if (res == 0 && dst_st.st_dev != st.st_dev)
+		res = -EXDEV;
+	if (res < 0)
+		goto out;
+
+	/* The mount root is where the device changes going up. */
+	size_t len = strlen(src);
+	while (len > 1)
+	{
+		char *slash = memrchr(src, '/', len);
+		size_t parent = (slash == src) ? 1 : (size_t)(slash - src);
+		snprintf(root, sizeof(root), "%.*s", (int)parent, src);
+		if (stat(root, &up) == -1 || up.st_dev != st.st_dev)
+			break;
+		len = parent;
+	}
+	const char *rel = src + ((len > 1) ? len : 0);
+
+	/* Any other file system keeps the attribute, which pa5-encfs never
+	 * shows, and copies nothing. */
+	if (setxattr(to, "user.pa5.copy", rel, strlen(rel), 0) == -1)
+		res = (errno == ENOTSUP) ? -EOPNOTSUPP : -errno;
+	else if (getxattr(to, "user.pa5.copy", NULL, 0) >= 0)
+	{
+		removexattr(to, "user.pa5.copy");
+		res = -EOPNOTSUPP;
+	}
+out:
+	free(src);
+	return res;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s encrypt [options] <password> <plain dir> <mirror dir>\n"
+		"       %s decrypt [options] <password> <mirror dir> <plain dir>\n"
+		"       %s verify  [options] <password> <mirror dir>\n"
+		"       %s migrate [options] <password> <mirror dir>\n"
+		"       %s rekey <old password> <new password> <mirror dir>\n"
+		"       %s copy <file> <new file>\n"
+		"options: -j <threads> -r <MB/s> -s <state file> -z <codec> -D\n"
+		"         -S <dirs> -P <policy> -q\n",
+		prog, prog, prog, prog, prog, prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *state_path = NULL;
+	const char *stripe_roots = NULL;
+	int stripe_policy = PA5_STRIPE_ALL;
+	int dedup = 0;
+	int opt;
+	long i;
+
+	if (argc < 2)
+		usage(argv[0]);
+
+	if (!strcmp(argv[1], "rekey"))
+	{
+		if (argc != 5)
+			usage(argv[0]);
+		int res = pa5_volume_rekey(argv[4], argv[2], argv[3]);
+		if (res < 0)
+		{
+			fprintf(stderr, "Error: %s\n", res == -EACCES ? "Wrong password for this mirror." :
+				strerror(-res));
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	if (!strcmp(argv[1], "copy"))
+	{
+		if (argc != 4)
+			usage(argv[0]);
+		int res = copy_in_mount(argv[2], argv[3]);
+		if (res < 0)
+		{
+			fprintf(stderr, "Error: %s\n", (res == -EOPNOTSUPP) ?
+				"Not a file in a pa5-encfs mount." : strerror(-res));
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	if (!strcmp(argv[1], "encrypt"))
+		mode = MODE_ENCRYPT;
+	else if (!strcmp(argv[1], "decrypt"))
+		mode = MODE_DECRYPT;
+	else if (!strcmp(argv[1], "verify"))
+		mode = MODE_VERIFY;
+	else if (!strcmp(argv[1], "migrate"))
+		mode = MODE_MIGRATE;
+	else
+		usage(argv[0]);
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "j:r:s:z:DS:P:q")) != -1)
+	{
+		switch (opt)
+		{
+		case 'j':
+			threads = strtol(optarg, NULL, 10);
+			break;
+		case 'r':
+			rate_limit = strtod(optarg, NULL) * 1e6;
+			break;
+		case 's':
+			state_path = optarg;
+			break;
+		case 'z':
+			if (pa5_compress_parse(optarg) < 0)
+			{
+				fprintf(stderr, "Error: Unknown or unavailable codec %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			pa5_chunk_set_codec(pa5_compress_parse(optarg));
+			break;
+		case 'D':
+			dedup = 1;
+			break;
+		case 'S':
+			stripe_roots = optarg;
+			break;
+		case 'P':
+			if ((stripe_policy = pa5_stripe_parse_policy(optarg)) < 0)
+			{
+				fprintf(stderr, "Error: Unknown stripe policy %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	int writes = (mode == MODE_ENCRYPT || mode == MODE_DECRYPT);
+	if (argc - optind != (writes ? 3 : 2) || threads < 1)
+		usage(argv[0]);
+
+	const char *password = argv[optind];
+	src_root = realpath(argv[optind + 1], NULL);
+	dst_root = writes ? argv[optind + 2] : NULL;
+	if (!src_root)
+	{
+		fprintf(stderr, "Error: %s: %s\n", argv[optind + 1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (writes && mkdir(dst_root, 0700) == -1 && errno != EEXIST)
+	{
+		fprintf(stderr, "Error: %s: %s\n", dst_root, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	const char *mirror = (mode == MODE_ENCRYPT) ? dst_root : src_root;
+	int res = pa5_volume_open(mirror, password, &cbc_key, &keys);
+	if (res < 0)
+	{
+		fprintf(stderr, "Error: %s: %s\n", mirror, res == -EACCES ?
+			"Wrong password for this mirror." : strerror(-res));
+		return EXIT_FAILURE;
+	}
+	res = pa5_dedup_open(mirror, &keys, dedup && (mode == MODE_ENCRYPT || mode == MODE_MIGRATE));
+	if (res < 0 && res != -ENOENT)
+	{
+		fprintf(stderr, "Error: %s: dedup store: %s\n", mirror, strerror(-res));
+		return EXIT_FAILURE;
+	}
+	if (stripe_roots &&
+	    (res = pa5_stripe_open(mirror, stripe_roots, &keys, stripe_policy,
+				   PA5_STRIPE_DEFAULT_UNIT)) < 0)
+	{
+		fprintf(stderr, "Error: %s: stripe roots: %s\n", stripe_roots, strerror(-res));
+		return EXIT_FAILURE;
+	}
+	res = pa5_small_open(mirror, &keys, 0);
+	if (res < 0 && res != -ENOENT)
+	{
+		fprintf(stderr, "Error: %s: small file store: %s\n", mirror, strerror(-res));
+		return EXIT_FAILURE;
+	}
+	if (state_path && state_open(state_path) < 0)
+	{
+		fprintf(stderr, "Error: %s: %s\n", state_path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* Every file is touched once, so caching chunks would only cost memory. */
+	pa5_cache_init(0);
+	pa5_inode_init();
+	pa5_io_init(PA5_IO_DEFAULT_DEPTH, 1);
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	pthread_t *pool = calloc(threads, sizeof(pthread_t));
+	pthread_t report_thread;
+	if (!pool)
+		return EXIT_FAILURE;
+	for (i = 0; i < threads; i++)
+		pthread_create(&pool[i], NULL, worker, NULL);
+	if (!quiet)
+		pthread_create(&report_thread, NULL, reporter, NULL);
+
+	nftw(src_root, walk_visit, 64, FTW_PHYS | FTW_ACTIONRETVAL);
+
+	pthread_mutex_lock(&queue_lock);
+	walk_done = 1;
+	pthread_cond_broadcast(&queue_nonempty);
+	pthread_mutex_unlock(&queue_lock);
+	for (i = 0; i < threads; i++)
+		pthread_join(pool[i], NULL);
+	if ((mode == MODE_DECRYPT || mode == MODE_VERIFY) && pa5_small_ready())
+		pa5_small_each(small_visit, NULL);
+
+	pthread_mutex_lock(&stats_lock);
+	finished = 1;
+	pthread_cond_signal(&stats_cond);
+	pthread_mutex_unlock(&stats_lock);
+	if (!quiet)
+		pthread_join(report_thread, NULL);
+
+	/* Deepest directories were recorded last, so they are fixed up first. */
+	while (dirs)
+	{
+		struct bulk_dir *d = dirs;
+		char dst[PATH_MAX];
+		struct timespec times[2] = { d->st.st_atim, d->st.st_mtim };
+
+		join_path(dst, dst_root, d->rel);
+		chmod(dst, d->st.st_mode & 07777);
+		utimensat(AT_FDCWD, dst, times, 0);
+		dirs = d->next;
+		free(d->rel);
+		free(d);
+	}
+
+	if (state_file)
+	{
+		fsync(fileno(state_file));
+		fclose(state_file);
+	}
+
+	pa5_small_close();
+	pa5_dedup_close();
+	pa5_stripe_close();
+	report(1);
+	free(pool);
+	return files_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,447 @@
+/* pa5-cache.c
+ * Cache of decrypted, already verified plaintext chunks.
+ *
+ * Entries come from two pa5-pool size classes, one for whole default-size
+ * chunks and one for the short tail chunks of small files, and are charged
+ * to the budget at the size of their class. Anything bigger uses malloc().
+ *
+ * Every entry is also on the list of its file, kept in a table of its own
+ * under locks taken inside the shard locks, so that dropping the chunks of
+ * a file costs the entries the file has rather than a walk of every
+ * shard. A dropper collects the indexes off the list first and then
+ * removes each entry under its shard lock, never holding both.
+ */
+
+#include "pa5-cache.h"
+#include "pa5-chunk.h"
+#include "pa5-pool.h"
+#include "pa5-stats.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 1024
+#define FILE_BUCKETS 1024
+#define SMALL_ENTRY 1024
+#define DROP_BATCH 64
+
+struct cache_file;
+
+struct cache_entry
+{
+	uint64_t file;
+	uint64_t chunk;
+	size_t len;
+	size_t charge;               /* Bytes counted against the budget. */
+	struct pa5_pool *pool;       /* Or NULL if malloc()ed. */
+	struct cache_entry *hnext;   /* Hash chain. */
+	struct cache_entry *prev;    /* LRU list, most recent at the head. */
+	struct cache_entry *next;
+	struct cache_file *owner;    /* List of the file's entries. */
+	struct cache_entry *fprev;
+	struct cache_entry *fnext;
+	unsigned char data[];
+};
+
+/* A file with chunks in the cache. */
+struct cache_file
+{
+	uint64_t file;
+	struct cache_entry *entries;
+	struct cache_file *hnext;
+};
+
+struct file_shard
+{
+	pthread_mutex_t lock;
+	struct cache_file *buckets[FILE_BUCKETS];
+};
+
+struct cache_shard
+{
+	pthread_mutex_t lock;
+	size_t bytes;
+	size_t budget;
+	size_t limit;                /* The budget, or less while capped. */
+	struct cache_entry *head;
+	struct cache_entry *tail;
+	struct cache_entry *buckets[CACHE_BUCKETS];
+};
+
+static struct cache_shard shards[CACHE_SHARDS];
+static struct file_shard file_shards[CACHE_SHARDS];
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t resize_lock = PTHREAD_MUTEX_INITIALIZER;   /* Budget and cap. */
+static size_t cache_cap = SIZE_MAX;
+
+static struct pa5_pool small_pool =
+	PA5_POOL_INIT("cache_s", sizeof(struct cache_entry) + SMALL_ENTRY, 64, 32);
+static struct pa5_pool chunk_pool =
+	PA5_POOL_INIT("cache", sizeof(struct cache_entry) + PA5_CHUNK_SIZE, 64, 16);
+static struct pa5_pool file_pool = PA5_POOL_INIT("cache_f", sizeof(struct cache_file), 0, 32);
+
+static struct cache_entry *entry_alloc(size_t len)
+{
+	struct pa5_pool *pool = NULL;
+	struct cache_entry *e;
+
+	if (len <= SMALL_ENTRY)
+		pool = &small_pool;
+	else if (len <= PA5_CHUNK_SIZE)
+		pool = &chunk_pool;
+
+	e = pool ? pa5_pool_get(pool) : malloc(sizeof(*e) + len);
+	if (e)
+	{
+		e->len = len;
+		e->pool = pool;
+		e->charge = pool ? pool->size : sizeof(*e) + len;
+	}
+	return e;
+}
+
+static void entry_free(struct cache_entry *e)
+{
+	if (e->pool)
+		pa5_pool_put(e->pool, e);
+	else
+		free(e);
+}
+
+static uint64_t cache_hash(uint64_t file, uint64_t chunk)
+{
+	uint64_t h = file ^ (chunk * 0x9e3779b97f4a7c15ULL);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static struct cache_shard *shard_of(uint64_t hash)
+{
+	return &shards[hash % CACHE_SHARDS];
+}
+
+static void cache_locks_init(void)
+{
+	int i;
+	for (i = 0; i < CACHE_SHARDS; i++)
+	{
+		pthread_mutex_init(&shards[i].lock, NULL);
+		pthread_mutex_init(&file_shards[i].lock, NULL);
+	}
+}
+
+/* Locks the shard of file and finds the link to its record, which holds
+ * NULL if it has none. */
+static struct cache_file **file_lock(uint64_t file, struct file_shard **fs)
+{
+	uint64_t hash = cache_hash(file, 0);
+	struct cache_file **pp;
+
+	*fs = &file_shards[hash % CACHE_SHARDS];
+	pa5_mutex_lock(&(*fs)->lock, PA5_LOCK_CACHE_FILE);
+	pp = &(*fs)->buckets[(hash / CACHE_SHARDS) % FILE_BUCKETS];
+	while (*pp && (*pp)->file != file)
+		pp = &(*pp)->hnext;
+	return pp;
+}
+
+/* Puts e on the list of its file. Called with e's shard locked.
+ * Return: 0 on success, -ENOMEM if the file needed a record */
+static int file_link(struct cache_entry *e)
+{
+	struct file_shard *fs;
+	struct cache_file **pp = file_lock(e->file, &fs);
+	struct cache_file *f = *pp;
+
+	if (!f)
+	{
+		if ((f = pa5_pool_get(&file_pool)) == NULL)
+		{
+			pthread_mutex_unlock(&fs->lock);
+			return -ENOMEM;
+		}
+		f->file = e->file;
+		f->entries = NULL;
+		f->hnext = NULL;
+		*pp = f;
+	}
+	e->owner = f;
+	e->fprev = NULL;
+	e->fnext = f->entries;
+	if (f->entries)
+		f->entries->fprev = e;
+	f->entries = e;
+	pthread_mutex_unlock(&fs->lock);
+	return 0;
+}
+
+/* Takes e off the list of its file, and drops the file's record with its
+ * last entry. Called with e's shard locked. */
+static void file_unlink(struct cache_entry *e)
+{
+	struct file_shard *fs;
+	struct cache_file **pp = file_lock(e->file, &fs);
+	struct cache_file *f = e->owner;
+
+	if (e->fprev)
+		e->fprev->fnext = e->fnext;
+	else
+		f->entries = e->fnext;
+	if (e->fnext)
+		e->fnext->fprev = e->fprev;
+	if (!f->entries)
+	{
+		*pp = f->hnext;
+		pa5_pool_put(&file_pool, f);
+	}
+	pthread_mutex_unlock(&fs->lock);
+}
+
+static void lru_unlink(struct cache_shard *s, struct cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		s->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		s->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void lru_push(struct cache_shard *s, struct cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = s->head;
+	if (s->head)
+		s->head->prev = e;
+	s->head = e;
+	if (!s->tail)
+		s->tail = e;
+}
+
+/* Unlinks e from its hash chain and the LRU list and frees it. */
+static void entry_remove(struct cache_shard *s, struct cache_entry *e, uint64_t hash)
+{
+	struct cache_entry **pp = &s->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+	while (*pp && *pp != e)
+		pp = &(*pp)->hnext;
+	if (*pp)
+		*pp = e->hnext;
+
+	lru_unlink(s, e);
+	file_unlink(e);
+	s->bytes -= e->charge;
+	entry_free(e);
+}
+
+static struct cache_entry *entry_find(struct cache_shard *s, uint64_t hash,
+				      uint64_t file, uint64_t chunk)
+{
+	struct cache_entry *e = s->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+	while (e && (e->file != file || e->chunk != chunk))
+		e = e->hnext;
+	return e;
+}
+
+static void shard_shrink(struct cache_shard *s, size_t budget)
+{
+	while (s->tail && s->bytes > budget)
+	{
+		struct cache_entry *victim = s->tail;
+		entry_remove(s, victim, cache_hash(victim->file, victim->chunk));
+	}
+}
+
+/* Sets the budget and cap of every shard and evicts down to them. */
+static void cache_resize(size_t budget, size_t cap)
+{
+	int i;
+
+	pthread_once(&cache_once, cache_locks_init);
+	for (i = 0; i < CACHE_SHARDS; i++)
+	{
+		pa5_mutex_lock(&shards[i].lock, PA5_LOCK_CACHE);
+		shards[i].budget = budget / CACHE_SHARDS;
+		shards[i].limit = (cap / CACHE_SHARDS < shards[i].budget) ? cap / CACHE_SHARDS :
+			shards[i].budget;
+		shard_shrink(&shards[i], shards[i].limit);
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+}
+
+void pa5_cache_init(size_t budget)
+{
+	pa5_mutex_lock(&resize_lock, PA5_LOCK_CACHE_RESIZE);
+	cache_resize(budget, cache_cap);
+	pthread_mutex_unlock(&resize_lock);
+}
+
+void pa5_cache_cap(size_t cap)
+{
+	pa5_mutex_lock(&resize_lock, PA5_LOCK_CACHE_RESIZE);
+	cache_cap = cap;
+	cache_resize(pa5_cache_budget(), cap);
+	pthread_mutex_unlock(&resize_lock);
+}
+
+size_t pa5_cache_memory(void)
+{
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < CACHE_SHARDS; i++)
+		total += __atomic_load_n(&shards[i].bytes, __ATOMIC_RELAXED);
+	return total;
+}
+
+size_t pa5_cache_budget(void)
+{
+	return __atomic_load_n(&shards[0].budget, __ATOMIC_RELAXED) * CACHE_SHARDS;
+}
+
+int pa5_cache_get(uint64_t file, uint64_t chunk, void *dst, size_t max, size_t *len)
+{
+	uint64_t hash = cache_hash(file, chunk);
+	struct cache_shard *s = shard_of(hash);
+	int hit = 0;
+
+	pa5_mutex_lock(&s->lock, PA5_LOCK_CACHE);
+	struct cache_entry *e = entry_find(s, hash, file, chunk);
+	if (e && e->len <= max)
+	{
+		memcpy(dst, e->data, e->len);
+		*len = e->len;
+		lru_unlink(s, e);
+		lru_push(s, e);
+		hit = 1;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	pa5_stats_add(hit ? PA5_CTR_CACHE_HIT : PA5_CTR_CACHE_MISS, 1);
+	return hit;
+}
+
+void pa5_cache_put(uint64_t file, uint64_t chunk, const void *src, size_t len)
+{
+	uint64_t hash = cache_hash(file, chunk);
+	struct cache_shard *s = shard_of(hash);
+
+	/* Oversized chunks are not cached, but a stale copy must still go. */
+	struct cache_entry *fresh = NULL;
+	if (len <= s->limit)
+		fresh = entry_alloc(len);
+	if (fresh)
+	{
+		fresh->file = file;
+		fresh->chunk = chunk;
+		memcpy(fresh->data, src, len);
+	}
+
+	pa5_mutex_lock(&s->lock, PA5_LOCK_CACHE);
+	struct cache_entry *old = entry_find(s, hash, file, chunk);
+	if (old)
+		entry_remove(s, old, hash);
+	if (fresh && file_link(fresh) < 0)
+	{
+		entry_free(fresh);
+		fresh = NULL;
+	}
+	if (fresh)
+	{
+		struct cache_entry **bucket = &s->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+		fresh->hnext = *bucket;
+		*bucket = fresh;
+		lru_push(s, fresh);
+		s->bytes += fresh->charge;
+		shard_shrink(s, s->limit);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+void pa5_cache_drop(uint64_t file, uint64_t from)
+{
+	uint64_t batch[DROP_BATCH];
+	uint64_t *chunks = batch;
+	size_t cap = DROP_BATCH;
+	int more = 1;
+
+	pthread_once(&cache_once, cache_locks_init);
+	while (more)
+	{
+		struct file_shard *fs;
+		struct cache_entry *e;
+		size_t n = 0;
+		size_t i;
+
+		more = 0;
+		struct cache_file *f = *file_lock(file, &fs);
+		for (e = f ? f->entries : NULL; e; e = e->fnext)
+		{
+			if (e->chunk < from)
+				continue;
+			if (n == cap)
+			{
+				/* Whatever does not fit is left for another pass. */
+				uint64_t *grown = malloc(2 * cap * sizeof(*chunks));
+				if (!grown)
+				{
+					more = 1;
+					break;
+				}
+				memcpy(grown, chunks, n * sizeof(*chunks));
+				if (chunks != batch)
+					free(chunks);
+				chunks = grown;
+				cap *= 2;
+			}
+			chunks[n++] = e->chunk;
+		}
+		pthread_mutex_unlock(&fs->lock);
+
+		for (i = 0; i < n; i++)
+		{
+			uint64_t hash = cache_hash(file, chunks[i]);
+			struct cache_shard *s = shard_of(hash);
+
+			pa5_mutex_lock(&s->lock, PA5_LOCK_CACHE);
+			if ((e = entry_find(s, hash, file, chunks[i])) != NULL)
+				entry_remove(s, e, hash);
+			pthread_mutex_unlock(&s->lock);
+		}
+	}
+	if (chunks != batch)
+		free(chunks);
+}
+
+size_t pa5_cache_hot(struct pa5_cache_key *keys, size_t max)
+{
+	size_t per_shard = (max + CACHE_SHARDS - 1) / CACHE_SHARDS;
+	size_t n = 0;
+	int i;
+
+	for (i = 0; i < CACHE_SHARDS && n < max; i++)
+	{
+		struct cache_shard *s = &shards[i];
+		struct cache_entry *e;
+		size_t taken = 0;
+
+		pa5_mutex_lock(&s->lock, PA5_LOCK_CACHE);
+		for (e = s->head; e && taken < per_shard && n < max; e = e->next)
+		{
+			keys[n].file = e->file;
+			keys[n].chunk = e->chunk;
+			n++;
+			taken++;
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	return n;
+}
@@ -0,0 +1,51 @@
+/* pa5-cache.h
+ * Cache of decrypted, already verified plaintext chunks.
+ *
+ * Entries are keyed by a 64 bit file identity and a chunk index. The table is
+ * split into shards, each with its own lock and LRU list, and the byte
+ * budget is divided evenly between the shards. Lookups copy the chunk out
+ * under the shard lock so callers never hold references into the cache.
+ */
+
+#ifndef PA5_CACHE_H
+#define PA5_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PA5_CACHE_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+/* Sets the byte budget, evicting down to it at once. A budget of 0
+ * disables the cache. */
+void pa5_cache_init(size_t budget);
+size_t pa5_cache_budget(void);
+
+/* Holds the cache to at most cap bytes, below its budget, evicting down to
+ * it at once. SIZE_MAX lifts the cap. */
+void pa5_cache_cap(size_t cap);
+
+/* Bytes the cache holds. */
+size_t pa5_cache_memory(void);
+
+/* Copies a cached chunk into dst (at least max bytes long) and stores its
+ * length in len. Returns 1 on a hit and 0 on a miss. */
+int pa5_cache_get(uint64_t file, uint64_t chunk, void *dst, size_t max, size_t *len);
+
+/* Inserts or replaces a chunk, evicting least recently used entries. */
+void pa5_cache_put(uint64_t file, uint64_t chunk, const void *src, size_t len);
+
+/* Drops every chunk of file with an index of at least from, at a cost in
+ * the chunks file has cached rather than in the size of the cache. */
+void pa5_cache_drop(uint64_t file, uint64_t from);
+
+struct pa5_cache_key
+{
+	uint64_t file;
+	uint64_t chunk;
+};
+
+/* Copies the keys of up to max cached chunks into keys, taking the most
+ * recently used of every shard in turn. Returns how many. */
+size_t pa5_cache_hot(struct pa5_cache_key *keys, size_t max);
+
+#endif
@@ -0,0 +1,373 @@
+/* pa5-cbc.c
+ * Random-access helpers for files in the whole-file AES-256-CBC format that
+ * do_crypt() produces.
+ *
+ * Reads are split into PA5_CBC_CHUNK requests that each carry the ciphertext
+ * block in front of them, so every chunk can be decrypted on its own as soon
+ * as the I/O engine completes it. Rewrites stream through the file a window
+ * at a time: old ciphertext is read and decrypted before the new ciphertext
+ * for the same window overwrites it in place.
+ */
+
+#include "pa5-cbc.h"
+#include "pa5-io.h"
+#include "pa5-stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <openssl/evp.h>
+
+#define CBC_WINDOW (4 * PA5_CBC_CHUNK)
+
+#define ROUND_DOWN(x) ((x) & ~((off_t)PA5_CBC_BLOCK - 1))
+#define ROUND_UP(x) ROUND_DOWN((x) + PA5_CBC_BLOCK - 1)
+
+struct cbc_chunk
+{
+	const struct pa5_cbc_key *k;
+	off_t pos;        /* Offset of the first block decrypted from this chunk. */
+	char *dst;        /* Caller buffer holding plaintext [dst_start, dst_end). */
+	off_t dst_start;
+	off_t dst_end;
+};
+
+int pa5_cbc_derive_key(const char *password, struct pa5_cbc_key *k)
+{
+	/* Same parameters as do_crypt(): SHA1, no salt, five rounds. */
+	int i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
+			       (const unsigned char *)password, strlen(password), 5,
+			       k->key, k->iv);
+	return (i == 32) ? 0 : -EINVAL;
+}
+
+/* Runs CBC over whole blocks in place with padding disabled. */
+static int cbc_crypt(const struct pa5_cbc_key *k, int enc, const unsigned char *iv,
+		     unsigned char *buf, int len)
+{
+	int outlen;
+	int ok;
+	uint64_t start = pa5_stats_now();
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (!ctx)
+		return -ENOMEM;
+
+	ok = EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, k->key, iv, enc) &&
+	     EVP_CIPHER_CTX_set_padding(ctx, 0) &&
+	     EVP_CipherUpdate(ctx, buf, &outlen, buf, len) &&
+	     outlen == len;
+
+	EVP_CIPHER_CTX_free(ctx);
+	pa5_stats_time(PA5_TIME_CRYPTO, start, ok ? 0 : -EIO);
+	return ok ? 0 : -EIO;
+}
+
+/* Reads or writes len bytes at off through the engine in chunk requests. */
+static int cbc_transfer(int fd, int write, unsigned char *buf, size_t len, off_t off)
+{
+	struct pa5_io_req reqs[CBC_WINDOW / PA5_CBC_CHUNK + 1];
+	size_t done;
+	int n = 0;
+	int i;
+
+	for (done = 0; done < len; done += PA5_CBC_CHUNK)
+	{
+		memset(&reqs[n], 0, sizeof(reqs[n]));
+		reqs[n].fd = fd;
+		reqs[n].write = write;
+		reqs[n].buf = buf + done;
+		reqs[n].len = (len - done < PA5_CBC_CHUNK) ? len - done : PA5_CBC_CHUNK;
+		reqs[n].off = off + done;
+		n++;
+	}
+
+	int res = pa5_io_submit(reqs, n, NULL);
+	if (res < 0)
+		return res;
+	for (i = 0; i < n; i++)
+	{
+		if (reqs[i].res < 0)
+			return reqs[i].res;
+		if ((size_t)reqs[i].res != reqs[i].len)
+			return -EIO;
+	}
+	return 0;
+}
+
+/* Gets the ciphertext length and the plaintext length of the file. */
+static int cbc_sizes(int fd, const struct pa5_cbc_key *k, off_t *ct_size, off_t *pt_size)
+{
+	struct stat st;
+	unsigned char tail[2 * PA5_CBC_BLOCK];
+
+	if (fstat(fd, &st) == -1)
+		return -errno;
+
+	*ct_size = st.st_size;
+	*pt_size = 0;
+	if (st.st_size == 0)
+		return 0;
+	if (st.st_size % PA5_CBC_BLOCK != 0)
+		return -EIO;
+
+	/* The last block is decrypted with the one in front of it as IV. */
+	size_t len = (st.st_size >= (off_t)sizeof(tail)) ? sizeof(tail) : PA5_CBC_BLOCK;
+	int res = cbc_transfer(fd, 0, tail, len, st.st_size - len);
+	if (res < 0)
+		return res;
+
+	unsigned char *last = tail + len - PA5_CBC_BLOCK;
+	res = cbc_crypt(k, 0, (len == sizeof(tail)) ? tail : k->iv, last, PA5_CBC_BLOCK);
+	if (res < 0)
+		return res;
+
+	int pad = last[PA5_CBC_BLOCK - 1];
+	int i;
+	if (pad < 1 || pad > PA5_CBC_BLOCK)
+		return -EIO;
+	for (i = PA5_CBC_BLOCK - pad; i < PA5_CBC_BLOCK; i++)
+		if (last[i] != pad)
+			return -EIO;
+
+	*pt_size = st.st_size - pad;
+	return 0;
+}
+
+int pa5_cbc_size(int fd, const struct pa5_cbc_key *k, off_t *size)
+{
+	off_t ct_size;
+	return cbc_sizes(fd, k, &ct_size, size);
+}
+
+/* Decrypts one completed chunk and copies out the part the caller wants. */
+static int cbc_read_done(struct pa5_io_req *req)
+{
+	struct cbc_chunk *c = req->data;
+	unsigned char *data = req->buf;
+	const unsigned char *iv = c->k->iv;
+	size_t len = req->len;
+
+	if (req->res < 0)
+		return req->res;
+	if ((size_t)req->res != req->len)
+		return -EIO;
+
+	if (c->pos > 0)
+	{
+		iv = data;
+		data += PA5_CBC_BLOCK;
+		len -= PA5_CBC_BLOCK;
+	}
+
+	int res = cbc_crypt(c->k, 0, iv, data, len);
+	if (res < 0)
+		return res;
+
+	off_t lo = (c->pos > c->dst_start) ? c->pos : c->dst_start;
+	off_t hi = (c->pos + (off_t)len < c->dst_end) ? c->pos + (off_t)len : c->dst_end;
+	if (lo < hi)
+		memcpy(c->dst + (lo - c->dst_start), data + (lo - c->pos), hi - lo);
+	return 0;
+}
+
+int pa5_cbc_read(int fd, const struct pa5_cbc_key *k, char *buf, size_t size,
+		 off_t offset)
+{
+	off_t ct_size;
+	off_t pt_size;
+	int res = cbc_sizes(fd, k, &ct_size, &pt_size);
+	if (res < 0)
+		return res;
+
+	if (offset >= pt_size || size == 0)
+		return 0;
+
+	off_t end = offset + (off_t)size;
+	if (end > pt_size)
+		end = pt_size;
+
+	off_t first = ROUND_DOWN(offset);
+	off_t last = ROUND_UP(end);
+	int nchunks = (last - first + PA5_CBC_CHUNK - 1) / PA5_CBC_CHUNK;
+	int i;
+
+	struct pa5_io_req *reqs = calloc(nchunks, sizeof(*reqs));
+	struct cbc_chunk *chunks = calloc(nchunks, sizeof(*chunks));
+	unsigned char *mem = malloc((last - first) + nchunks * PA5_CBC_BLOCK);
+	if (!reqs || !chunks || !mem)
+	{
+		free(reqs);
+		free(chunks);
+		free(mem);
+		return -ENOMEM;
+	}
+
+	unsigned char *p = mem;
+	for (i = 0; i < nchunks; i++)
+	{
+		off_t pos = first + (off_t)i * PA5_CBC_CHUNK;
+		size_t len = (last - pos < PA5_CBC_CHUNK) ? (size_t)(last - pos) : PA5_CBC_CHUNK;
+
+		chunks[i].k = k;
+		chunks[i].pos = pos;
+		chunks[i].dst = buf;
+		chunks[i].dst_start = offset;
+		chunks[i].dst_end = end;
+
+		/* Every chunk but the first in the file carries its IV block. */
+		reqs[i].fd = fd;
+		reqs[i].buf = p;
+		reqs[i].off = (pos > 0) ? pos - PA5_CBC_BLOCK : 0;
+		reqs[i].len = len + ((pos > 0) ? PA5_CBC_BLOCK : 0);
+		reqs[i].data = &chunks[i];
+		p += reqs[i].len;
+	}
+
+	res = pa5_io_submit(reqs, nchunks, cbc_read_done);
+
+	free(reqs);
+	free(chunks);
+	free(mem);
+	return (res < 0) ? res : (int)(end - offset);
+}
+
+/* Re-encrypts plaintext [start, new_size) in place, where the new plaintext
+ * is the old plaintext, zero filled past old_size, with buf laid over it at
+ * offset. start must be block aligned; ciphertext before it is unchanged. */
+static int cbc_rewrite(int fd, const struct pa5_cbc_key *k, off_t ct_size, off_t old_size,
+		       off_t start, off_t new_size, const char *buf, size_t size, off_t offset)
+{
+	unsigned char iv[PA5_CBC_BLOCK];
+	unsigned char *ct = NULL;
+	unsigned char *pt = NULL;
+	EVP_CIPHER_CTX *dec = NULL;
+	EVP_CIPHER_CTX *enc = NULL;
+	int outlen;
+	int res;
+
+	if (new_size == 0)
+		return (ftruncate(fd, 0) == -1) ? -errno : 0;
+
+	if (start == 0)
+		memcpy(iv, k->iv, PA5_CBC_BLOCK);
+	else if ((res = cbc_transfer(fd, 0, iv, PA5_CBC_BLOCK, start - PA5_CBC_BLOCK)) < 0)
+		return res;
+
+	ct = malloc(CBC_WINDOW + PA5_CBC_BLOCK);
+	pt = malloc(CBC_WINDOW + PA5_CBC_BLOCK);
+	dec = EVP_CIPHER_CTX_new();
+	enc = EVP_CIPHER_CTX_new();
+	res = -ENOMEM;
+	if (!ct || !pt || !dec || !enc)
+		goto out;
+
+	res = -EIO;
+	if (!EVP_DecryptInit_ex(dec, EVP_aes_256_cbc(), NULL, k->key, iv) ||
+	    !EVP_EncryptInit_ex(enc, EVP_aes_256_cbc(), NULL, k->key, iv))
+		goto out;
+	EVP_CIPHER_CTX_set_padding(dec, 0);
+	EVP_CIPHER_CTX_set_padding(enc, 0);
+
+	off_t pos = start;
+	int final = 0;
+	while (!final)
+	{
+		off_t wend = pos + CBC_WINDOW;
+		if (wend >= new_size)
+		{
+			wend = new_size;
+			final = 1;
+		}
+		size_t len = wend - pos;
+
+		memset(pt, 0, len + PA5_CBC_BLOCK);
+		if (pos < old_size)
+		{
+			off_t rend = ROUND_UP(wend);
+			if (rend > ct_size)
+				rend = ct_size;
+
+			if ((res = cbc_transfer(fd, 0, ct, rend - pos, pos)) < 0)
+				goto out;
+			res = -EIO;
+			if (!EVP_DecryptUpdate(dec, pt, &outlen, ct, rend - pos) ||
+			    outlen != rend - pos)
+				goto out;
+
+			/* Drop the old padding and anything else past the old end. */
+			if (old_size < wend)
+				memset(pt + (old_size - pos), 0, wend - old_size);
+		}
+
+		if (buf && size > 0)
+		{
+			off_t lo = (offset > pos) ? offset : pos;
+			off_t hi = (offset + (off_t)size < wend) ? offset + (off_t)size : wend;
+			if (lo < hi)
+				memcpy(pt + (lo - pos), buf + (lo - offset), hi - lo);
+		}
+
+		if (final)
+		{
+			/* PKCS#7 padding, as EVP_CipherFinal_ex() would add it. */
+			int pad = PA5_CBC_BLOCK - (len % PA5_CBC_BLOCK);
+			memset(pt + len, pad, pad);
+			len += pad;
+		}
+
+		res = -EIO;
+		if (!EVP_EncryptUpdate(enc, ct, &outlen, pt, len) || (size_t)outlen != len)
+			goto out;
+		if ((res = cbc_transfer(fd, 1, ct, len, pos)) < 0)
+			goto out;
+		pos += len;
+	}
+
+	res = 0;
+	if (ct_size > pos && ftruncate(fd, pos) == -1)
+		res = -errno;
+
+out:
+	EVP_CIPHER_CTX_free(dec);
+	EVP_CIPHER_CTX_free(enc);
+	free(ct);
+	free(pt);
+	return res;
+}
+
+int pa5_cbc_write(int fd, const struct pa5_cbc_key *k, const char *buf,
+		  size_t size, off_t offset)
+{
+	off_t ct_size;
+	off_t old_size;
+	int res = cbc_sizes(fd, k, &ct_size, &old_size);
+	if (res < 0)
+		return res;
+	if (size == 0)
+		return 0;
+
+	off_t new_size = offset + (off_t)size;
+	if (new_size < old_size)
+		new_size = old_size;
+	off_t start = ROUND_DOWN((offset < old_size) ? offset : old_size);
+
+	res = cbc_rewrite(fd, k, ct_size, old_size, start, new_size, buf, size, offset);
+	return (res < 0) ? res : (int)size;
+}
+
+int pa5_cbc_truncate(int fd, const struct pa5_cbc_key *k, off_t size)
+{
+	off_t ct_size;
+	off_t old_size;
+	int res = cbc_sizes(fd, k, &ct_size, &old_size);
+	if (res < 0)
+		return res;
+	if (size == old_size)
+		return 0;
+
+	off_t start = ROUND_DOWN((size < old_size) ? size : old_size);
+	return cbc_rewrite(fd, k, ct_size, old_size, start, size, NULL, 0, 0);
+}
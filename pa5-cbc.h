@@ -0,0 +1,44 @@
+/* pa5-cbc.h
+ * Random-access helpers for files in the whole-file AES-256-CBC format that
+ * do_crypt() produces.
+ *
+ * CBC decryption of a block only needs the ciphertext block in front of it,
+ * so a read decrypts just the blocks covering the requested range. A write
+ * has to re-encrypt from the first modified block to the end of the file,
+ * which keeps appends cheap. All functions work on an open backing file
+ * descriptor and return 0 (or a byte count) on success and -errno on error.
+ */
+
+#ifndef PA5_CBC_H
+#define PA5_CBC_H
+
+#include <sys/types.h>
+
+#define PA5_CBC_BLOCK 16
+#define PA5_CBC_CHUNK 65536  /* Ciphertext bytes per I/O request. */
+
+struct pa5_cbc_key
+{
+	unsigned char key[32];
+	unsigned char iv[32];
+};
+
+/* Derives the key and IV from a pass phrase exactly as do_crypt() does. */
+int pa5_cbc_derive_key(const char *password, struct pa5_cbc_key *k);
+
+/* Plaintext length of the file, found by decrypting its last block. */
+int pa5_cbc_size(int fd, const struct pa5_cbc_key *k, off_t *size);
+
+/* Reads up to size plaintext bytes at offset. Returns the byte count. */
+int pa5_cbc_read(int fd, const struct pa5_cbc_key *k, char *buf, size_t size,
+		 off_t offset);
+
+/* Writes size plaintext bytes at offset, zero filling any gap past the end
+ * of the file. Returns the byte count. */
+int pa5_cbc_write(int fd, const struct pa5_cbc_key *k, const char *buf,
+		  size_t size, off_t offset);
+
+/* Shrinks or zero extends the plaintext to size bytes. */
+int pa5_cbc_truncate(int fd, const struct pa5_cbc_key *k, off_t size);
+
+#endif
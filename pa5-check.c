@@ -0,0 +1,476 @@
+/* pa5-check.c
+ * Regression checks of the pa5-encfs callbacks.
+ *
+ *   pa5-check [-d dir] [-p password] [check ...]
+ *
+ * Drives xmp_oper through pa5-harness against a temporary mirror directory,
+ * like pa5-bench, and prints one line per check. Files are checked through
+ * copies of their backing files made behind the daemon's back: a copy has
+ * an inode of its own, so none of its chunks are in pa5-cache and every
+ * read verifies what is on disk.
+ *
+ * Checks (default: all, in this order):
+ *   resize   A file grown and cut at and off chunk boundaries reads back
+ *   cut      A file cut short in the mirror at a slot boundary, or inside
+ *            a slot header, fails with EIO rather than reading shorter;
+ *            with PA5_DEDUP set its manifest is cut at and inside entries
+ *   reserved The daemon's own .pa5- files can be neither reached nor made
+ *            through the mount, and the volume key survives the attempts
+ *
+ * Options:
+ *   -d <dir>       Parent of the temporary mirror (default: $TMPDIR or /tmp)
+ *   -p <password>  Mount pass phrase (default: "check")
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "pa5-harness.h"
+#include "pa5-chunk.h"
+#include "pa5-dedup.h"
+#include "pa5-volume.h"
+
+#define CS PA5_CHUNK_SIZE
+#define SLOT (PA5_CHUNK_SLOT_HEADER + PA5_CHUNK_SIZE)
+#define MAX_SIZE (8 * CS)
+#define RESIZE_FILE "/resize.dat"
+#define CUT_FILE "/cut.dat"
+#define RESERVED_FILE "/reserved.dat"
+#define CUT_SIZE 94552          /* Five full chunks and a partial one. */
+
+struct check_config
+{
+	const char *mirror;
+	char **checks;
+	int nchecks;
+};
+
+typedef int (*check_fn)(const struct fuse_operations *op, const struct check_config *cfg);
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static unsigned copies;
+
+/* xorshift64*, seeded the same way on every run. */
+static uint64_t next_random(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void fill_random(char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (char)next_random();
+}
+
+static int open_file(const struct fuse_operations *op, const char *path, int flags,
+		     struct fuse_file_info *fi)
+{
+	memset(fi, 0, sizeof(fi[0]));
+	fi->flags = flags;
+	if (flags & O_CREAT)
+		return op->create(path, 0644, fi);
+	return op->open(path, fi);
+}
+
+static int write_at(const struct fuse_operations *op, const char *path, const char *buf,
+		    size_t size, off_t offset)
+{
+	struct fuse_file_info fi;
+	int res = open_file(op, path, O_WRONLY, &fi);
+
+	if (res < 0)
+		return res;
+	res = op->write(path, buf, size, offset, &fi);
+	op->release(path, &fi);
+	return (res < 0) ? res : 0;
+}
+
+/* Copies the first len bytes of the backing file of path, or all of it for
+ * len -1, to a new backing file, and names the copy's path in copy. */
+static int copy_backing(const struct check_config *cfg, const char *path, off_t len,
+			char *copy, size_t copy_size)
+{
+	char from[PATH_MAX];
+	char to[PATH_MAX];
+	char buf[65536];
+	ssize_t n;
+	int res = 0;
+
+	snprintf(copy, copy_size, "/copy%u.dat", copies++);
+	snprintf(from, sizeof(from), "%s%s", cfg->mirror, path);
+	snprintf(to, sizeof(to), "%s%s", cfg->mirror, copy);
+
+	int in = open(from, O_RDONLY);
+	if (in == -1)
+		return -errno;
+	int out = open(to, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (out == -1)
+	{
+		res = -errno;
+		close(in);
+		return res;
+	}
+	while (len != 0 && (n = read(in, buf, (len > 0 && len < (off_t)sizeof(buf)) ?
+				     (size_t)len : sizeof(buf))) > 0)
+	{
+		if (write(out, buf, n) != n)
+		{
+			res = -EIO;
+			break;
+		}
+		if (len > 0)
+			len -= n;
+	}
+	if (res == 0 && fsetxattr(out, "user.encrypted", "true", 5, 0) == -1)
+		res = -errno;
+	close(out);
+	close(in);
+	return res;
+}
+
+/* Reads path whole through the callbacks and compares it with want.
+ * Return: 0 if it matches, 1 if it does not, -errno if it fails */
+static int read_back(const struct fuse_operations *op, const char *path, const char *want,
+		     off_t size)
+{
+	static char got[MAX_SIZE + CS];
+	struct fuse_file_info fi;
+	struct stat st;
+	off_t pos = 0;
+	int res;
+
+	if ((res = op->getattr(path, &st)) < 0)
+		return res;
+	if (st.st_size != size)
+		return 1;
+	if ((res = open_file(op, path, O_RDONLY, &fi)) < 0)
+		return res;
+	while ((res = op->read(path, got + pos, CS, pos, &fi)) > 0)
+		pos += res;
+	op->release(path, &fi);
+	if (res < 0)
+		return res;
+	return (pos != size || memcmp(got, want, size) != 0);
+}
+
+static int check_resize(const struct fuse_operations *op, const struct check_config *cfg)
+{
+	static char model[MAX_SIZE];
+	struct fuse_file_info fi;
+	char copy[64];
+	off_t size = 0;
+	int step;
+	int res;
+
+	op->unlink(RESIZE_FILE);
+	if ((res = open_file(op, RESIZE_FILE, O_CREAT | O_WRONLY, &fi)) < 0)
+		return res;
+	op->release(RESIZE_FILE, &fi);
+
+	for (step = 0; step < 6; step++)
+	{
+		off_t off = 0;
+		size_t len = 0;
+		off_t cut = -1;
+
+		switch (step)
+		{
+		case 0:                 /* Three full chunks. */
+			len = 3 * CS;
+			break;
+		case 1:                 /* Append at a chunk boundary. */
+			off = 3 * CS;
+			len = 100;
+			break;
+		case 2:                 /* Cut to a chunk boundary. */
+			cut = 2 * CS;
+			break;
+		case 3:                 /* Extend from a chunk boundary. */
+			cut = 4 * CS;
+			break;
+		case 4:                 /* Write past the end of a full last chunk. */
+			off = 5 * CS + 7;
+			len = 10;
+			break;
+		case 5:                 /* Cut into the middle of a chunk. */
+			cut = CS + CS / 2;
+			break;
+		}
+
+		if (cut >= 0)
+		{
+			if (cut > size)
+				memset(model + size, 0, cut - size);
+			size = cut;
+			res = op->truncate(RESIZE_FILE, cut);
+		}
+		else
+		{
+			if (off > size)
+				memset(model + size, 0, off - size);
+			fill_random(model + off, len);
+			if (off + (off_t)len > size)
+				size = off + len;
+			res = write_at(op, RESIZE_FILE, model + off, len, off);
+		}
+		if (res < 0)
+			return res;
+
+		if ((res = read_back(op, RESIZE_FILE, model, size)) != 0 ||
+		    (res = copy_backing(cfg, RESIZE_FILE, -1, copy, sizeof(copy))) < 0 ||
+		    (res = read_back(op, copy, model, size)) != 0)
+		{
+			fprintf(stderr, "resize: step %d: %s\n", step,
+				(res < 0) ? strerror(-res) : "contents differ");
+			return (res < 0) ? res : -EIO;
+		}
+	}
+	return 0;
+}
+
+static int check_cut(const struct fuse_operations *op, const struct check_config *cfg)
+{
+	static char model[CUT_SIZE];
+	static const off_t slot_cuts[] = {
+		PA5_CHUNK_HEADER + 3 * SLOT,
+		PA5_CHUNK_HEADER + 5 * SLOT,
+		PA5_CHUNK_HEADER + 2 * SLOT + PA5_CHUNK_SLOT_HEADER / 2
+	};
+	static const off_t entry_cuts[] = {
+		PA5_CHUNK_HEADER + 3 * PA5_DEDUP_ENTRY,
+		PA5_CHUNK_HEADER + 5 * PA5_DEDUP_ENTRY,
+		PA5_CHUNK_HEADER + 2 * PA5_DEDUP_ENTRY + PA5_DEDUP_ENTRY / 2
+	};
+	const off_t *cuts = slot_cuts;
+	struct fuse_file_info fi;
+	unsigned char hdr[PA5_CHUNK_HEADER];
+	char path[PATH_MAX];
+	char copy[64];
+	size_t i;
+	int res;
+
+	op->unlink(CUT_FILE);
+	if ((res = open_file(op, CUT_FILE, O_CREAT | O_WRONLY, &fi)) < 0)
+		return res;
+	op->release(CUT_FILE, &fi);
+	fill_random(model, sizeof(model));
+	if ((res = write_at(op, CUT_FILE, model, sizeof(model), 0)) < 0)
+		return res;
+
+	/* A deduplicated file keeps a manifest where the slots would be. */
+	snprintf(path, sizeof(path), "%s%s", cfg->mirror, CUT_FILE);
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+	if (pread(fd, hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) && (hdr[5] & PA5_CHUNK_FLAG_DEDUP))
+		cuts = entry_cuts;
+	close(fd);
+
+	/* The whole copy still reads back, so the cuts are what fail. */
+	if ((res = copy_backing(cfg, CUT_FILE, -1, copy, sizeof(copy))) < 0)
+		return res;
+	if ((res = read_back(op, copy, model, sizeof(model))) != 0)
+	{
+		fprintf(stderr, "cut: whole copy: %s\n",
+			(res < 0) ? strerror(-res) : "contents differ");
+		return (res < 0) ? res : -EIO;
+	}
+
+	for (i = 0; i < sizeof(slot_cuts) / sizeof(slot_cuts[0]); i++)
+	{
+		struct stat st;
+		char buf[CS];
+		off_t pos = 0;
+
+		if ((res = copy_backing(cfg, CUT_FILE, cuts[i], copy, sizeof(copy))) < 0)
+			return res;
+		if ((res = op->getattr(copy, &st)) != -EIO)
+		{
+			fprintf(stderr, "cut at %lld: getattr gave %d, size %lld\n",
+				(long long)cuts[i], res, (long long)st.st_size);
+			return -EIO;
+		}
+		if ((res = open_file(op, copy, O_RDONLY, &fi)) == -EIO)
+			continue;
+		if (res < 0)
+			return res;
+		while ((res = op->read(copy, buf, sizeof(buf), pos, &fi)) > 0)
+			pos += res;
+		op->release(copy, &fi);
+		if (res != -EIO)
+		{
+			fprintf(stderr, "cut at %lld: read %lld bytes without error\n",
+				(long long)cuts[i], (long long)pos);
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+static int check_reserved(const struct fuse_operations *op, const struct check_config *cfg)
+{
+	static const char key[] = "/" PA5_VOLUME_FILE;
+	struct fuse_file_info fi;
+	struct stat before, st;
+	char path[PATH_MAX];
+	int res;
+
+	snprintf(path, sizeof(path), "%s%s", cfg->mirror, key);
+	if (stat(path, &before) == -1)
+		return -errno;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	if ((res = op->getattr(key, &st)) != -ENOENT ||
+	    (res = op->open(key, &fi)) != -ENOENT ||
+	    (res = op->truncate(key, 0)) != -ENOENT ||
+	    (res = op->unlink(key)) != -ENOENT ||
+	    (res = op->rename(key, "/key")) != -ENOENT)
+	{
+		fprintf(stderr, "reserved: %s reached, %d\n", key, res);
+		return -EIO;
+	}
+	if ((res = open_file(op, "/.pa5-notes", O_CREAT | O_WRONLY, &fi)) != -EPERM ||
+	    (res = op->mkdir("/.pa5-dir", 0755)) != -EPERM ||
+	    (res = open_file(op, RESERVED_FILE, O_CREAT | O_WRONLY, &fi)) < 0)
+	{
+		fprintf(stderr, "reserved: name made, %d\n", res);
+		return (res < 0 && res != -EPERM) ? res : -EIO;
+	}
+	op->release(RESERVED_FILE, &fi);
+	if ((res = op->rename(RESERVED_FILE, key)) != -EPERM ||
+	    (res = op->link(RESERVED_FILE, key)) != -EPERM)
+	{
+		fprintf(stderr, "reserved: %s replaced, %d\n", key, res);
+		return -EIO;
+	}
+
+	if (stat(path, &st) == -1 || st.st_size != before.st_size || st.st_ino != before.st_ino)
+	{
+		fprintf(stderr, "reserved: %s changed\n", key);
+		return -EIO;
+	}
+	return 0;
+}
+
+static const struct
+{
+	const char *name;
+	check_fn fn;
+} checks[] = {
+	{ "resize", check_resize },
+	{ "cut", check_cut },
+	{ "reserved", check_reserved }
+};
+
+#define NCHECKS (sizeof(checks) / sizeof(checks[0]))
+
+static int check_body(const struct fuse_operations *op, void *arg)
+{
+	const struct check_config *cfg = arg;
+	int failed = 0;
+	int c;
+	size_t i;
+
+	for (i = 0; i < NCHECKS; i++)
+	{
+		int selected = (cfg->nchecks == 0);
+		for (c = 0; c < cfg->nchecks; c++)
+		{
+			if (strcmp(cfg->checks[c], checks[i].name) == 0)
+				selected = 1;
+		}
+		if (!selected)
+			continue;
+
+		int res = checks[i].fn(op, cfg);
+		printf("%-10s %s\n", checks[i].name, (res < 0) ? "FAIL" : "ok");
+		if (res < 0)
+			failed = 1;
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int remove_entry(const char *fpath, const struct stat *st, int type, struct FTW *ftw)
+{
+	(void) st;
+	(void) type;
+	(void) ftw;
+
+	return remove(fpath);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d dir] [-p password] [check ...]\n"
+		"checks: resize cut reserved\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct check_config cfg;
+	const char *parent = getenv("TMPDIR");
+	const char *password = "check";
+	char mirror[PATH_MAX];
+	int opt;
+	int c;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "d:p:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			parent = optarg;
+			break;
+		case 'p':
+			password = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	cfg.checks = argv + optind;
+	cfg.nchecks = argc - optind;
+	for (c = 0; c < cfg.nchecks; c++)
+	{
+		for (i = 0; i < NCHECKS; i++)
+		{
+			if (strcmp(cfg.checks[c], checks[i].name) == 0)
+				break;
+		}
+		if (i == NCHECKS)
+			usage(argv[0]);
+	}
+
+	snprintf(mirror, sizeof(mirror), "%s/pa5-check.XXXXXX", parent ? parent : "/tmp");
+	if (!mkdtemp(mirror))
+	{
+		fprintf(stderr, "Error: %s: %s\n", mirror, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	cfg.mirror = mirror;
+
+	int res = pa5_harness_run(password, mirror, check_body, &cfg);
+
+	nftw(mirror, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return res;
+}
@@ -0,0 +1,1166 @@
+/* pa5-chunk.c
+ * Authenticated, random-access chunk format for encrypted files.
+ *
+ * Reads and writes work on batches of up to PA5_CHUNK_BATCH chunks. Chunk
+ * slots are fetched through the pa5-io engine and each one is verified and
+ * decrypted in the completion callback. Verified plaintext is kept in
+ * pa5-cache so hot chunks skip the backing read and the GCM pass entirely.
+ *
+ * Slot and plaintext buffers come from a page-aligned pa5-pool and each
+ * thread keeps its own GCM contexts, so reading or writing files with the
+ * default chunk size allocates nothing once the pools are warm.
+ *
+ * With a codec set, each chunk is compressed before it is sealed and kept
+ * compressed if that saves at least an eighth. Only the compressed bytes
+ * are encrypted and written; the rest of the slot is left as a hole (or as
+ * stale bytes the info word says to ignore), so slots stay at fixed offsets
+ * and random access still costs one chunk.
+ *
+ * For a striped file each request of a batch goes to the descriptor of the
+ * root its chunk lives on. The batch takes a reference on each stripe file
+ * it touches and drops them when it is freed.
+ *
+ * With a cache tier, each batch asks pa5-tier where its chunks are and
+ * reads those in the tier from the tier file. Writes go there too while it
+ * has room. A chunk the tier wants promoted has its sealed slot copied into
+ * the tier file as it comes in, before a compressed one is decrypted in
+ * place.
+ *
+ * With the journal on, each batch of a write hands its sealed slots to
+ * pa5-journal before writing them in place, and a write that shrinks the
+ * file cuts it before the batch is done with the journal.
+ */
+
+#include "pa5-chunk.h"
+#include "pa5-io.h"
+#include "pa5-cache.h"
+#include "pa5-stats.h"
+#include "pa5-pool.h"
+#include "pa5-compress.h"
+#include "pa5-dedup.h"
+#include "pa5-stripe.h"
+#include "pa5-tier.h"
+#include "pa5-journal.h"
+#include "pa5-sched.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#define NONCE_LEN 12
+#define TAG_LEN 16
+#define AAD_LEN 28
+
+#define MIN_CHUNK 512
+#define MAX_CHUNK (1 << 24)
+#define BUFFER_ALIGN 4096
+#define MIN_COMPRESS 128      /* Smaller chunks are always stored raw. */
+#define KEY_RECORD 48         /* Key id and its MAC. */
+
+#define CODEC_MASK (3 << PA5_CHUNK_CODEC_SHIFT)   /* Header flag bits of the codec. */
+
+#define INFO_CODEC(info) ((info) & 0x7f)
+#define INFO_LEN(info) ((info) >> 8)
+#define INFO_FINAL 0x80       /* Set in the last slot of the file only. */
+
+/* Room for one slot, or one chunk of plaintext, at the default chunk size. */
+static struct pa5_pool buffer_pool =
+	PA5_POOL_INIT("chunk", PA5_CHUNK_SLOT_HEADER + PA5_CHUNK_SIZE, BUFFER_ALIGN, 16);
+
+/* GCM contexts of this thread, set up for AES-256-GCM once and then only
+ * rekeyed per chunk. */
+struct cipher_ctxs
+{
+	EVP_CIPHER_CTX *enc;
+	EVP_CIPHER_CTX *dec;
+};
+
+static int chunk_codec = PA5_CODEC_NONE;
+
+static pthread_key_t ctx_key;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+static __thread struct cipher_ctxs *thread_ctxs = NULL;
+
+/* State for one chunk of a batch. */
+struct chunk_io
+{
+	const struct pa5_chunk_file *cf;
+	uint64_t index;
+	size_t len;           /* Plaintext bytes to decrypt from the slot. */
+	int final;            /* Whether it is the last chunk of the file. */
+	unsigned char *pt;    /* Plaintext buffer, chunk_size bytes. */
+	int tier_fd;          /* Tier file to copy the slot into, or -1. */
+	int status;
+};
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+	put_le32(p, (uint32_t)v);
+	put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static void ctxs_free(void *ptr)
+{
+	struct cipher_ctxs *ctxs = ptr;
+	EVP_CIPHER_CTX_free(ctxs->enc);
+	EVP_CIPHER_CTX_free(ctxs->dec);
+	free(ctxs);
+}
+
+static void ctx_key_create(void)
+{
+	pthread_key_create(&ctx_key, ctxs_free);
+}
+
+static struct cipher_ctxs *get_ctxs(void)
+{
+	struct cipher_ctxs *ctxs;
+
+	if (thread_ctxs)
+		return thread_ctxs;
+
+	pthread_once(&ctx_once, ctx_key_create);
+	if ((ctxs = calloc(1, sizeof(*ctxs))) == NULL)
+		return NULL;
+	ctxs->enc = EVP_CIPHER_CTX_new();
+	ctxs->dec = EVP_CIPHER_CTX_new();
+	if (!ctxs->enc || !ctxs->dec ||
+	    !EVP_EncryptInit_ex(ctxs->enc, EVP_aes_256_gcm(), NULL, NULL, NULL) ||
+	    !EVP_CIPHER_CTX_ctrl(ctxs->enc, EVP_CTRL_GCM_SET_IVLEN, NONCE_LEN, NULL) ||
+	    !EVP_DecryptInit_ex(ctxs->dec, EVP_aes_256_gcm(), NULL, NULL, NULL) ||
+	    !EVP_CIPHER_CTX_ctrl(ctxs->dec, EVP_CTRL_GCM_SET_IVLEN, NONCE_LEN, NULL))
+	{
+		ctxs_free(ctxs);
+		return NULL;
+	}
+
+	pthread_setspecific(ctx_key, ctxs);
+	thread_ctxs = ctxs;
+	return ctxs;
+}
+
+static void hmac_sha256(const unsigned char *key, const void *data, size_t len,
+			unsigned char out[32])
+{
+	unsigned int outlen = 32;
+	HMAC(EVP_sha256(), key, 32, data, len, out, &outlen);
+}
+
+static size_t slot_size(const struct pa5_chunk_file *cf)
+{
+	return PA5_CHUNK_SLOT_HEADER + cf->chunk_size;
+}
+
+static off_t slot_offset(const struct pa5_chunk_file *cf, uint64_t index)
+{
+	return PA5_CHUNK_HEADER + (off_t)index * slot_size(cf);
+}
+
+/* Backing length needed to hold size plaintext bytes. */
+static off_t backing_size(const struct pa5_chunk_file *cf, off_t size)
+{
+	off_t full = size / cf->chunk_size;
+	off_t rem = size % cf->chunk_size;
+	return PA5_CHUNK_HEADER + full * slot_size(cf) + (rem ? PA5_CHUNK_SLOT_HEADER + rem : 0);
+}
+
+static void build_aad(const struct pa5_chunk_file *cf, uint64_t index,
+		      const unsigned char *info, unsigned char aad[AAD_LEN])
+{
+	memcpy(aad, cf->key_id, 16);
+	put_le64(aad + 16, index);
+	memcpy(aad + 24, info, 4);
+}
+
+/* Encrypts len plaintext bytes into a slot under a fresh nonce, compressing
+ * them first if that pays, and marks it final if it is the last chunk of
+ * the file. Returns the number of ciphertext bytes, which is what has to be
+ * written after the slot header, or -errno. */
+static int chunk_seal(const struct pa5_chunk_file *cf, uint64_t index,
+		      const unsigned char *pt, size_t len, int final, unsigned char *slot)
+{
+	unsigned char aad[AAD_LEN];
+	unsigned char *ct = slot + PA5_CHUNK_SLOT_HEADER;
+	const unsigned char *src = pt;
+	size_t ct_len = len;
+	uint32_t info = 0;
+	int outlen;
+	int ok;
+
+	if (RAND_bytes(slot, NONCE_LEN) != 1)
+		return -EIO;
+
+	/* Compress into the slot and encrypt there in place. */
+	int codec = cf->codec;
+	if (codec == PA5_CHUNK_CODEC_MOUNT)
+		codec = __atomic_load_n(&chunk_codec, __ATOMIC_RELAXED);
+	if (codec != PA5_CODEC_NONE && len >= MIN_COMPRESS)
+	{
+		uint64_t start = pa5_stats_now();
+		size_t z = pa5_compress(codec, pt, len, ct, len - len / 8);
+		pa5_stats_time(PA5_TIME_COMPRESS, start, 0);
+		pa5_stats_add(PA5_CTR_COMPRESS_IN, len);
+		pa5_stats_add(PA5_CTR_COMPRESS_OUT, z ? z : len);
+		if (z > 0)
+		{
+			info = codec | (uint32_t)z << 8;
+			src = ct;
+			ct_len = z;
+		}
+	}
+	if (final)
+		info |= INFO_FINAL;
+	put_le32(slot + NONCE_LEN + TAG_LEN, info);
+	build_aad(cf, index, slot + NONCE_LEN + TAG_LEN, aad);
+
+	uint64_t start = pa5_stats_now();
+	struct cipher_ctxs *ctxs = get_ctxs();
+	if (!ctxs)
+		return -ENOMEM;
+	EVP_CIPHER_CTX *ctx = ctxs->enc;
+
+	ok = EVP_EncryptInit_ex(ctx, NULL, NULL, cf->key, slot) &&
+	     EVP_EncryptUpdate(ctx, NULL, &outlen, aad, AAD_LEN) &&
+	     EVP_EncryptUpdate(ctx, ct, &outlen, src, ct_len) &&
+	     EVP_EncryptFinal_ex(ctx, ct + outlen, &outlen) &&
+	     EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_LEN, slot + NONCE_LEN);
+
+	pa5_stats_time(PA5_TIME_CRYPTO, start, ok ? 0 : -EIO);
+	return ok ? (int)ct_len : -EIO;
+}
+
+/* Verifies a slot and decrypts its len plaintext bytes into pt. A
+ * compressed chunk is decrypted in place and then inflated into pt. A slot
+ * whose final mark is not what the file's length says fails, so that a
+ * file cut short at a slot boundary does not read as a shorter file. */
+static int chunk_unseal(const struct pa5_chunk_file *cf, uint64_t index,
+			unsigned char *slot, size_t len, int final, unsigned char *pt)
+{
+	unsigned char aad[AAD_LEN];
+	unsigned char *ct = slot + PA5_CHUNK_SLOT_HEADER;
+	uint32_t info = get_le32(slot + NONCE_LEN + TAG_LEN);
+	unsigned codec = INFO_CODEC(info);
+	size_t ct_len = len;
+	int outlen;
+	int ok;
+
+	if (!(info & INFO_FINAL) != !final)
+		return -EIO;
+	if (codec == PA5_CODEC_NONE && INFO_LEN(info) != 0)
+		return -EIO;
+	if (codec != PA5_CODEC_NONE)
+	{
+		ct_len = INFO_LEN(info);
+		if (ct_len == 0 || ct_len >= len)
+			return -EIO;
+	}
+	build_aad(cf, index, slot + NONCE_LEN + TAG_LEN, aad);
+
+	uint64_t start = pa5_stats_now();
+	struct cipher_ctxs *ctxs = get_ctxs();
+	if (!ctxs)
+		return -ENOMEM;
+	EVP_CIPHER_CTX *ctx = ctxs->dec;
+	unsigned char *out = (codec == PA5_CODEC_NONE) ? pt : ct;
+
+	ok = EVP_DecryptInit_ex(ctx, NULL, NULL, cf->key, slot) &&
+	     EVP_DecryptUpdate(ctx, NULL, &outlen, aad, AAD_LEN) &&
+	     EVP_DecryptUpdate(ctx, out, &outlen, ct, ct_len) &&
+	     EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, slot + NONCE_LEN) &&
+	     EVP_DecryptFinal_ex(ctx, out + outlen, &outlen);
+
+	pa5_stats_time(PA5_TIME_CRYPTO, start, ok ? 0 : -EIO);
+	if (!ok)
+		return -EIO;
+	if (codec == PA5_CODEC_NONE)
+		return 0;
+
+	start = pa5_stats_now();
+	int res = pa5_decompress(codec, ct, ct_len, pt, len);
+	pa5_stats_time(PA5_TIME_COMPRESS, start, res);
+	return res;
+}
+
+static int chunk_read_done(struct pa5_io_req *req)
+{
+	struct chunk_io *c = req->data;
+
+	if (req->res < 0)
+		c->status = req->res;
+	else if ((size_t)req->res != req->len)
+		c->status = -EIO;
+	else
+	{
+		if (c->tier_fd >= 0 &&
+		    pwrite(c->tier_fd, req->buf, req->len, req->off) != (ssize_t)req->len)
+			c->tier_fd = -1;
+		c->status = chunk_unseal(c->cf, c->index, req->buf, c->len, c->final, c->pt);
+	}
+
+	if (c->status == 0)
+		pa5_cache_put(c->cf->cache_id, c->index, c->pt, c->len);
+
+	/* Failures are judged per chunk by the caller, so keep going. */
+	return 0;
+}
+
+/* Fills c->pt with the first c->len plaintext bytes of a chunk if the
+ * cache has them. */
+static int chunk_cached(struct chunk_io *c)
+{
+	size_t got;
+
+	c->status = 0;
+	c->tier_fd = -1;
+	return pa5_cache_get(c->cf->cache_id, c->index, c->pt, c->cf->chunk_size, &got) &&
+	       got == c->len;
+}
+
+/* Adds the read of a chunk to reqs for the caller to submit; fd is the
+ * descriptor holding the chunk, or -errno if it cannot be had. */
+static void chunk_queue(struct chunk_io *c, struct pa5_io_req *reqs, int *nreqs,
+			unsigned char *slot, int fd)
+{
+	if (fd < 0)
+	{
+		c->status = (fd == -ENOENT) ? -EIO : fd;
+		return;
+	}
+
+	struct pa5_io_req *req = &reqs[(*nreqs)++];
+	memset(req, 0, sizeof(*req));
+	req->fd = fd;
+	req->buf = slot;
+	req->len = PA5_CHUNK_SLOT_HEADER + c->len;
+	req->off = slot_offset(c->cf, c->index);
+	req->data = c;
+}
+
+/* Fills c->pt from the cache when possible and queues a read otherwise. */
+static void chunk_fetch(struct chunk_io *c, struct pa5_io_req *reqs, int *nreqs,
+			unsigned char *slot, int fd)
+{
+	if (!chunk_cached(c))
+		chunk_queue(c, reqs, nreqs, slot, fd);
+}
+
+/* One batch of chunks. The bookkeeping lives on the caller's stack and the
+ * buffers are taken from buffer_pool, or from malloc() for files with
+ * chunks bigger than the pool's. */
+struct chunk_batch
+{
+	struct chunk_io ios[PA5_CHUNK_BATCH];
+	struct pa5_io_req reqs[PA5_CHUNK_BATCH];
+	unsigned char *slots[PA5_CHUNK_BATCH];
+	unsigned char *pts[PA5_CHUNK_BATCH];
+	int fds[PA5_STRIPE_MAX];   /* Stripe files taken, -1 for none. */
+	int count;
+	int pooled;
+};
+
+/* Descriptor of the backing file that holds chunk index, or -errno. */
+static int batch_fd(const struct pa5_chunk_file *cf, struct chunk_batch *b, uint64_t index,
+		    int create)
+{
+	unsigned root = pa5_stripe_root(cf, index);
+
+	if (root == 0)
+		return cf->fd;
+	if (b->fds[root] < 0)
+		b->fds[root] = pa5_stripe_get(cf, root, create);
+	return b->fds[root];
+}
+
+static void batch_free(struct chunk_batch *b)
+{
+	int i;
+
+	for (i = 0; i < PA5_STRIPE_MAX; i++)
+	{
+		if (b->fds[i] >= 0)
+			pa5_stripe_put(b->fds[i]);
+		b->fds[i] = -1;
+	}
+
+	for (i = 0; i < b->count; i++)
+	{
+		if (b->pooled)
+		{
+			pa5_pool_put(&buffer_pool, b->slots[i]);
+			pa5_pool_put(&buffer_pool, b->pts[i]);
+		}
+		else
+		{
+			free(b->slots[i]);
+			free(b->pts[i]);
+		}
+	}
+	b->count = 0;
+}
+
+/* Gets buffers for the first nchunks chunks of a batch. */
+static int batch_alloc(const struct pa5_chunk_file *cf, struct chunk_batch *b,
+		       uint64_t nchunks)
+{
+	int want = (nchunks < PA5_CHUNK_BATCH) ? (int)nchunks : PA5_CHUNK_BATCH;
+	int i;
+
+	for (i = 0; i < PA5_STRIPE_MAX; i++)
+		b->fds[i] = -1;
+	b->count = 0;
+	b->pooled = (slot_size(cf) <= buffer_pool.size);
+	while (b->count < want)
+	{
+		unsigned char *slot, *pt;
+		if (b->pooled)
+		{
+			slot = pa5_pool_get(&buffer_pool);
+			pt = pa5_pool_get(&buffer_pool);
+		}
+		else
+		{
+			slot = malloc(slot_size(cf));
+			pt = malloc(cf->chunk_size);
+		}
+		b->slots[b->count] = slot;
+		b->pts[b->count] = pt;
+		b->count++;
+		if (!slot || !pt)
+		{
+			batch_free(b);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+int pa5_chunk_derive_keys(const unsigned char master[32], struct pa5_keys *keys)
+{
+	hmac_sha256(master, "pa5 chunk root", 14, keys->chunk_root);
+	hmac_sha256(master, "pa5 header mac", 14, keys->header_mac);
+	hmac_sha256(master, "pa5 dedup id", 12, keys->dedup_id);
+	hmac_sha256(master, "pa5 dedup store", 15, keys->dedup_store);
+	hmac_sha256(master, "pa5 small store", 15, keys->small_store);
+	return 0;
+}
+
+void pa5_chunk_set_codec(int codec)
+{
+	__atomic_store_n(&chunk_codec, codec, __ATOMIC_RELAXED);
+}
+
+int pa5_chunk_codec(void)
+{
+	return __atomic_load_n(&chunk_codec, __ATOMIC_RELAXED);
+}
+
+int pa5_chunk_probe(int fd)
+{
+	unsigned char hdr[5];
+	if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr, PA5_CHUNK_MAGIC, 4) != 0)
+		return 0;
+	return hdr[4];
+}
+
+/* MAC of the key record of a PA5_CHUNK_FLAG_KEYED file with header hdr. */
+static void key_record_mac(const struct pa5_keys *keys, const unsigned char *hdr,
+			   const unsigned char *key_id, unsigned char mac[32])
+{
+	unsigned char buf[48];
+
+	memcpy(buf, hdr, 32);
+	memcpy(buf + 32, key_id, 16);
+	hmac_sha256(keys->header_mac, buf, sizeof(buf), mac);
+}
+
+/* Codec a file with the given header flags compresses its chunks with. */
+static int file_codec(unsigned flags)
+{
+	if (!(flags & PA5_CHUNK_FLAG_CODEC) || (flags & PA5_CHUNK_FLAG_DEDUP))
+		return PA5_CHUNK_CODEC_MOUNT;
+	return (flags & CODEC_MASK) >> PA5_CHUNK_CODEC_SHIFT;
+}
+
+/* Fills in the derived fields of cf once the file id is known. */
+static int chunk_file_init(int fd, const struct pa5_keys *keys, struct pa5_chunk_file *cf)
+{
+	struct stat st;
+	unsigned char id[32];
+
+	if (fstat(fd, &st) == -1)
+		return -errno;
+
+	cf->fd = fd;
+	cf->tier = NULL;
+	hmac_sha256(keys->chunk_root, cf->key_id, sizeof(cf->key_id), cf->key);
+
+	/* Inode and file id together, so neither inode reuse nor a copied
+	 * header can alias another file's cached chunks. */
+	memcpy(id, &st.st_dev, sizeof(uint64_t));
+	memcpy(id + 8, &st.st_ino, sizeof(uint64_t));
+	memcpy(id + 16, cf->file_id, 16);
+	hmac_sha256(keys->chunk_root, id, sizeof(id), id);
+	memcpy(&cf->cache_id, id, sizeof(cf->cache_id));
+	return 0;
+}
+
+int pa5_chunk_create(int fd, const struct pa5_keys *keys, int codec,
+		     struct pa5_chunk_file *cf)
+{
+	unsigned char hdr[PA5_CHUNK_HEADER];
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, PA5_CHUNK_MAGIC, 4);
+	hdr[4] = PA5_CHUNK_VERSION;
+	hdr[5] = pa5_dedup_enabled() ? PA5_CHUNK_FLAG_DEDUP :
+		 pa5_stripe_enabled() ? PA5_CHUNK_FLAG_STRIPE : 0;
+	if (hdr[5] & PA5_CHUNK_FLAG_STRIPE)
+		pa5_stripe_header(hdr);
+	if (codec != PA5_CHUNK_CODEC_MOUNT && !(hdr[5] & PA5_CHUNK_FLAG_DEDUP))
+		hdr[5] |= PA5_CHUNK_FLAG_CODEC | codec << PA5_CHUNK_CODEC_SHIFT;
+	put_le32(hdr + 8, PA5_CHUNK_SIZE);
+	if (RAND_bytes(hdr + 16, 16) != 1)
+		return -EIO;
+	hmac_sha256(keys->header_mac, hdr, 32, hdr + 32);
+
+	cf->chunk_size = PA5_CHUNK_SIZE;
+	cf->flags = hdr[5];
+	cf->codec = file_codec(cf->flags);
+	if (cf->flags & PA5_CHUNK_FLAG_STRIPE)
+		pa5_stripe_check(hdr, cf);
+	memcpy(cf->file_id, hdr + 16, 16);
+	memcpy(cf->key_id, hdr + 16, 16);
+	int journaled = pa5_journal_ready();
+	int res = chunk_file_init(fd, keys, cf);
+	if (res < 0)
+		return res;
+
+	/* Journaled so that replay knows the records before it belong to
+	 * whatever the path held before. */
+	if (journaled && (res = pa5_journal_commit(cf, hdr, sizeof(hdr), NULL, 0)) < 0)
+		return res;
+	if (pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+		res = -EIO;
+	if (journaled)
+		pa5_journal_done();
+	if (res == 0)
+		pa5_tier_attach(cf);
+	return res;
+}
+
+int pa5_chunk_open(int fd, const struct pa5_keys *keys, struct pa5_chunk_file *cf)
+{
+	unsigned char hdr[PA5_CHUNK_HEADER];
+	unsigned char mac[32];
+	int res;
+
+	if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return -EIO;
+	if (memcmp(hdr, PA5_CHUNK_MAGIC, 4) != 0 || hdr[4] != PA5_CHUNK_VERSION)
+		return -EIO;
+
+	hmac_sha256(keys->header_mac, hdr, 32, mac);
+	if (CRYPTO_memcmp(mac, hdr + 32, 32) != 0)
+		return -EIO;
+
+	cf->chunk_size = get_le32(hdr + 8);
+	if (cf->chunk_size < MIN_CHUNK || cf->chunk_size > MAX_CHUNK)
+		return -EIO;
+	cf->flags = hdr[5];
+	unsigned layout = cf->flags & ~(PA5_CHUNK_FLAG_CODEC | CODEC_MASK | PA5_CHUNK_FLAG_KEYED);
+	if (layout != 0 && layout != PA5_CHUNK_FLAG_DEDUP && layout != PA5_CHUNK_FLAG_STRIPE)
+		return -EIO;
+	if (!(cf->flags & PA5_CHUNK_FLAG_CODEC) && (cf->flags & CODEC_MASK))
+		return -EIO;
+	cf->codec = file_codec(cf->flags);
+	if ((cf->flags & PA5_CHUNK_FLAG_DEDUP) && !pa5_dedup_ready())
+		return -ENOTSUP;
+	if ((cf->flags & PA5_CHUNK_FLAG_STRIPE) && (res = pa5_stripe_check(hdr, cf)) < 0)
+		return res;
+	memcpy(cf->file_id, hdr + 16, 16);
+	memcpy(cf->key_id, hdr + 16, 16);
+	if (cf->flags & PA5_CHUNK_FLAG_KEYED)
+	{
+		unsigned char rec[KEY_RECORD];
+		if (fgetxattr(fd, PA5_CHUNK_KEY_XATTR, rec, sizeof(rec)) != sizeof(rec))
+			return -EIO;
+		key_record_mac(keys, hdr, rec, mac);
+		if (CRYPTO_memcmp(mac, rec + 16, 32) != 0)
+			return -EIO;
+		memcpy(cf->key_id, rec, 16);
+	}
+	if ((res = chunk_file_init(fd, keys, cf)) == 0)
+		pa5_tier_attach(cf);
+	return res;
+}
+
+int pa5_chunk_clone(const struct pa5_chunk_file *src, int fd, const struct pa5_keys *keys,
+		    struct pa5_chunk_file *cf)
+{
+	unsigned char hdr[PA5_CHUNK_HEADER];
+	unsigned char rec[KEY_RECORD];
+	struct stat st;
+	unsigned root;
+	int res;
+
+	if (src->flags & PA5_CHUNK_FLAG_DEDUP)
+		return -ENOTSUP;
+	if ((res = pa5_tier_writeback(src)) < 0)
+		return res;
+	if (pread(src->fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return -EIO;
+	if (fstat(src->fd, &st) == -1)
+		return -errno;
+	if ((res = pa5_io_copy(src->fd, fd, st.st_size)) < 0)
+		return res;
+
+	/* A new id for the copy, so that it has stripe and tier files of its
+	 * own, bound to the key id its chunks are sealed under. */
+	hdr[5] |= PA5_CHUNK_FLAG_KEYED;
+	if (RAND_bytes(hdr + 16, 16) != 1)
+		return -EIO;
+	hmac_sha256(keys->header_mac, hdr, 32, hdr + 32);
+	memcpy(rec, src->key_id, 16);
+	key_record_mac(keys, hdr, rec, rec + 16);
+	if (fsetxattr(fd, PA5_CHUNK_KEY_XATTR, rec, sizeof(rec), 0) == -1)
+		return -errno;
+	if (pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return -EIO;
+
+	*cf = *src;
+	cf->flags = hdr[5];
+	memcpy(cf->file_id, hdr + 16, 16);
+	if ((res = chunk_file_init(fd, keys, cf)) < 0)
+		return res;
+
+	for (root = 1; (cf->flags & PA5_CHUNK_FLAG_STRIPE) && root < cf->stripe_width; root++)
+	{
+		int in = pa5_stripe_get(src, root, 0);
+		if (in == -ENOENT)
+			continue;
+		if (in < 0)
+			return in;
+		int out = pa5_stripe_get(cf, root, 1);
+		if (out < 0)
+			res = out;
+		else if (fstat(in, &st) == -1)
+			res = -errno;
+		else
+			res = pa5_io_copy(in, out, st.st_size);
+		if (out >= 0)
+			pa5_stripe_put(out);
+		pa5_stripe_put(in);
+		if (res < 0)
+			return res;
+	}
+
+	/* The copy bypasses the journal, so it is on disk before it exists
+	 * as far as the caller is concerned. */
+	if (pa5_journal_ready())
+	{
+		if (fdatasync(fd) == -1)
+			return -errno;
+		if ((res = pa5_stripe_sync(cf)) < 0)
+			return res;
+	}
+	pa5_tier_attach(cf);
+	return 0;
+}
+
+void pa5_chunk_close(struct pa5_chunk_file *cf)
+{
+	pa5_tier_detach(cf);
+}
+
+off_t pa5_chunk_plain_size(off_t backing_size, unsigned chunk_size)
+{
+	if (backing_size <= PA5_CHUNK_HEADER)
+		return 0;
+
+	off_t body = backing_size - PA5_CHUNK_HEADER;
+	off_t slot = PA5_CHUNK_SLOT_HEADER + chunk_size;
+	off_t rem = body % slot;
+
+	/* No write leaves a last slot without a byte of ciphertext. */
+	if (rem > 0 && rem <= PA5_CHUNK_SLOT_HEADER)
+		return -EIO;
+	return (body / slot) * chunk_size + (rem ? rem - PA5_CHUNK_SLOT_HEADER : 0);
+}
+
+int pa5_chunk_size(const struct pa5_chunk_file *cf, off_t *size)
+{
+	struct stat st;
+	if (cf->flags & PA5_CHUNK_FLAG_DEDUP)
+		return pa5_dedup_size(cf, size);
+	if (fstat(cf->fd, &st) == -1)
+		return -errno;
+
+	off_t plain = pa5_chunk_plain_size(st.st_size, cf->chunk_size);
+	if (plain < 0)
+		return (int)plain;
+	*size = plain;
+	return 0;
+}
+
+int pa5_chunk_verify_size(const struct pa5_chunk_file *cf, off_t *size)
+{
+	char last;
+	int res = pa5_chunk_size(cf, size);
+
+	if (res < 0 || *size == 0 || (cf->flags & PA5_CHUNK_FLAG_DEDUP))
+		return res;
+	res = pa5_chunk_read(cf, &last, 1, *size - 1);
+	return (res < 0) ? res : 0;
+}
+
+static int chunk_read(const struct pa5_chunk_file *cf, char *buf, size_t size, off_t offset)
+{
+	struct chunk_batch b;
+	off_t plain;
+	if (cf->flags & PA5_CHUNK_FLAG_DEDUP)
+		return pa5_dedup_read(cf, buf, size, offset);
+	int res = pa5_chunk_size(cf, &plain);
+	if (res < 0)
+		return res;
+
+	if (offset >= plain || size == 0)
+		return 0;
+
+	off_t end = offset + (off_t)size;
+	if (end > plain)
+		end = plain;
+
+	uint64_t cs = cf->chunk_size;
+	uint64_t first = offset / cs;
+	uint64_t last = (end - 1) / cs + 1;
+	off_t pos = offset;
+
+	pa5_tier_begin(cf);
+	if ((res = batch_alloc(cf, &b, last - first)) < 0)
+		goto out;
+
+	uint64_t base;
+	for (base = first; base < last; base += PA5_CHUNK_BATCH)
+	{
+		int n = (last - base < PA5_CHUNK_BATCH) ? (int)(last - base) : PA5_CHUNK_BATCH;
+		unsigned char cached[PA5_CHUNK_BATCH];
+		unsigned char where[PA5_CHUNK_BATCH];
+		int nreqs = 0;
+		int i;
+
+		for (i = 0; i < n; i++)
+		{
+			struct chunk_io *c = &b.ios[i];
+			c->cf = cf;
+			c->index = base + i;
+			c->len = (plain - c->index * cs < cs) ? plain - c->index * cs : cs;
+			c->final = ((off_t)(c->index * cs + c->len) == plain);
+			c->pt = b.pts[i];
+			cached[i] = chunk_cached(c);
+		}
+
+		pa5_tier_lookup(cf, base, n, cached, where);
+		for (i = 0; i < n; i++)
+		{
+			struct chunk_io *c = &b.ios[i];
+			if (cached[i])
+				continue;
+			chunk_queue(c, b.reqs, &nreqs, b.slots[i],
+				    (where[i] == PA5_TIER_HIT) ? pa5_tier_fd(cf, 0) :
+				    batch_fd(cf, &b, c->index, 0));
+			if (where[i] == PA5_TIER_HOT && c->status == 0)
+				c->tier_fd = pa5_tier_fd(cf, 1);
+		}
+
+		if ((res = pa5_io_submit(b.reqs, nreqs, chunk_read_done)) < 0)
+			goto out;
+
+		for (i = 0; i < n; i++)
+		{
+			struct chunk_io *c = &b.ios[i];
+			off_t cstart = c->index * cs;
+			off_t hi = (cstart + (off_t)c->len < end) ? cstart + (off_t)c->len : end;
+
+			if (c->status == 0 && c->tier_fd >= 0)
+				pa5_tier_promoted(cf, c->index);
+
+			/* Stop at the first chunk that failed verification. */
+			if (c->status < 0)
+			{
+				res = (pos > offset) ? (int)(pos - offset) : c->status;
+				goto out;
+			}
+
+			memcpy(buf + (pos - offset), c->pt + (pos - cstart), hi - pos);
+			pos = hi;
+		}
+	}
+	res = end - offset;
+
+out:
+	batch_free(&b);
+	pa5_tier_end(cf);
+	return res;
+}
+
+/* Cuts the backing files of cf from old_size bytes of plaintext down to
+ * size. */
+static int chunk_cut(const struct pa5_chunk_file *cf, off_t old_size, off_t size)
+{
+	int res;
+
+	if (ftruncate(cf->fd, backing_size(cf, size)) == -1)
+		return -errno;
+	if ((res = pa5_stripe_truncate(cf, backing_size(cf, size))) < 0 ||
+	    (res = pa5_tier_truncate(cf, old_size, size, backing_size(cf, size))) < 0)
+		return res;
+	pa5_cache_drop(cf->cache_id, (size + cf->chunk_size - 1) / cf->chunk_size);
+	return 0;
+}
+
+/* Re-encrypts chunks [first, last). The new plaintext of each is its old
+ * plaintext, cut or zero extended to new_size, with buf laid over it at
+ * offset. A new_size below old_size cuts the file too. */
+static int chunk_rewrite(const struct pa5_chunk_file *cf, off_t old_size, off_t new_size,
+			 uint64_t first, uint64_t last, const char *buf, size_t size,
+			 off_t offset)
+{
+	struct chunk_batch b;
+	uint64_t cs = cf->chunk_size;
+	uint64_t base;
+	int short_tail = 0;
+	int tail_elsewhere = 0;
+	off_t stripe_end[PA5_STRIPE_MAX] = { 0 };
+	off_t tier_end = 0;
+	int journaled = 0;
+	unsigned r;
+	int res;
+
+	pa5_tier_begin(cf);
+	if ((res = batch_alloc(cf, &b, last - first)) < 0)
+		goto out;
+
+	for (base = first; base < last; base += PA5_CHUNK_BATCH)
+	{
+		int n = (last - base < PA5_CHUNK_BATCH) ? (int)(last - base) : PA5_CHUNK_BATCH;
+		struct pa5_journal_entry ents[PA5_CHUNK_BATCH];
+		int nents = 0;
+		size_t kept[PA5_CHUNK_BATCH];
+		size_t new_len[PA5_CHUNK_BATCH];
+		unsigned char where[PA5_CHUNK_BATCH];
+		int nreqs = 0;
+		int failed = 0;
+		int i;
+
+		pa5_tier_lookup(cf, base, n, NULL, where);
+
+		/* Fetch the old plaintext of chunks that are only partly replaced. */
+		for (i = 0; i < n; i++)
+		{
+			struct chunk_io *c = &b.ios[i];
+			off_t cstart = (base + i) * cs;
+
+			c->cf = cf;
+			c->index = base + i;
+			c->pt = b.pts[i];
+			c->status = 0;
+			new_len[i] = (new_size - cstart < (off_t)cs) ? (size_t)(new_size - cstart) : cs;
+
+			kept[i] = 0;
+			if (cstart < old_size &&
+			    !(buf && offset <= cstart && offset + (off_t)size >= cstart + (off_t)new_len[i]))
+			{
+				c->len = (old_size - cstart < (off_t)cs) ? (size_t)(old_size - cstart) : cs;
+				c->final = (cstart + (off_t)c->len == old_size);
+				kept[i] = (c->len < new_len[i]) ? c->len : new_len[i];
+				chunk_fetch(c, b.reqs, &nreqs, b.slots[i],
+					    (where[i] == PA5_TIER_HIT) ? pa5_tier_fd(cf, 0) :
+					    batch_fd(cf, &b, c->index, 0));
+			}
+		}
+
+		if ((res = pa5_io_submit(b.reqs, nreqs, chunk_read_done)) < 0)
+			goto out;
+
+		/* Build and seal the new chunk images. */
+		nreqs = 0;
+		pa5_tier_place(cf, base, n, where);
+		for (i = 0; i < n; i++)
+		{
+			struct chunk_io *c = &b.ios[i];
+			off_t cstart = c->index * cs;
+			unsigned char *slot = b.slots[i];
+
+			if (c->status < 0)
+			{
+				res = c->status;
+				goto out;
+			}
+
+			c->len = new_len[i];
+			memset(c->pt + kept[i], 0, c->len - kept[i]);
+			if (buf && size > 0)
+			{
+				off_t lo = (offset > cstart) ? offset : cstart;
+				off_t hi = offset + (off_t)size;
+				if (hi > cstart + (off_t)c->len)
+					hi = cstart + c->len;
+				if (lo < hi)
+					memcpy(c->pt + (lo - cstart), buf + (lo - offset), hi - lo);
+			}
+
+			int final = ((off_t)(cstart + c->len) == new_size);
+			if ((res = chunk_seal(cf, c->index, c->pt, c->len, final, slot)) < 0)
+				goto out;
+			if ((size_t)res < c->len && final)
+				short_tail = 1;
+
+			int fd = (where[i] == PA5_TIER_HIT) ? pa5_tier_fd(cf, 1) :
+				 batch_fd(cf, &b, c->index, 1);
+			if (fd < 0)
+			{
+				res = fd;
+				goto out;
+			}
+			off_t slot_end = slot_offset(cf, c->index) + PA5_CHUNK_SLOT_HEADER + c->len;
+			r = pa5_stripe_root(cf, c->index);
+			if (final && (r != 0 || where[i] == PA5_TIER_HIT))
+				tail_elsewhere = 1;
+			if (where[i] == PA5_TIER_HIT)
+			{
+				if ((size_t)res < c->len && tier_end < slot_end)
+					tier_end = slot_end;
+			}
+			else if (r != 0 && (size_t)res < c->len && stripe_end[r] < slot_end)
+				stripe_end[r] = slot_end;
+
+			struct pa5_io_req *req = &b.reqs[nreqs++];
+			memset(req, 0, sizeof(*req));
+			req->fd = fd;
+			req->write = 1;
+			req->buf = slot;
+			req->len = PA5_CHUNK_SLOT_HEADER + res;
+			req->off = slot_offset(cf, c->index);
+			if (where[i] != PA5_TIER_HIT)
+			{
+				struct pa5_journal_entry *e = &ents[nents++];
+				e->root = r;
+				e->off = req->off;
+				e->buf = slot;
+				e->len = req->len;
+				e->span = PA5_CHUNK_SLOT_HEADER + c->len;
+			}
+		}
+
+		/* The record carries the backing length the file has once the
+		 * batch is in place: the end of the batch, or new_size after the
+		 * last one. */
+		if (pa5_journal_ready())
+		{
+			off_t reach = (off_t)(base + n) * cs;
+			if (base + n >= last || reach > new_size)
+				reach = new_size;
+			else if (reach < old_size)
+				reach = old_size;
+			if (journaled)
+				pa5_journal_done();
+			journaled = 0;
+			if ((res = pa5_journal_commit(cf, NULL, backing_size(cf, reach), ents, nents)) < 0)
+				goto out;
+			journaled = 1;
+		}
+
+		if ((res = pa5_io_submit(b.reqs, nreqs, NULL)) < 0)
+			goto out;
+
+		/* Every chunk has its request; the tier learns of those that
+		 * landed there. */
+		for (i = 0; i < nreqs; i++)
+		{
+			if (b.reqs[i].res < 0)
+			{
+				failed = b.reqs[i].res;
+				where[i] = PA5_TIER_MISS;
+			}
+		}
+		pa5_tier_written(cf, base, n, where);
+		if (failed < 0)
+		{
+			res = failed;
+			goto out;
+		}
+
+		for (i = 0; i < n; i++)
+			pa5_cache_put(cf->cache_id, b.ios[i].index, b.ios[i].pt, b.ios[i].len);
+	}
+
+	/* A compressed last chunk leaves the backing file short of its full
+	 * slot, and the plaintext size is read off the backing length. So does
+	 * a last chunk that went to another root or to the tier. */
+	if (short_tail || tail_elsewhere)
+	{
+		struct stat st;
+		if (fstat(cf->fd, &st) == -1 ||
+		    (st.st_size < backing_size(cf, new_size) &&
+		     ftruncate(cf->fd, backing_size(cf, new_size)) == -1))
+		{
+			res = -errno;
+			goto out;
+		}
+	}
+
+	/* Stripe and tier files hold no size, but a slot is read whole, so a
+	 * compressed chunk at the end of one must not leave it short either. */
+	for (r = 1; r < PA5_STRIPE_MAX; r++)
+	{
+		struct stat st;
+		if (stripe_end[r] && (fstat(b.fds[r], &st) == -1 ||
+				      (st.st_size < stripe_end[r] &&
+				       ftruncate(b.fds[r], stripe_end[r]) == -1)))
+		{
+			res = -errno;
+			goto out;
+		}
+	}
+	if (tier_end)
+	{
+		struct stat st;
+		int fd = pa5_tier_fd(cf, 0);
+		if (fd < 0 || fstat(fd, &st) == -1 ||
+		    (st.st_size < tier_end && ftruncate(fd, tier_end) == -1))
+		{
+			res = (fd < 0) ? fd : -errno;
+			goto out;
+		}
+	}
+	res = 0;
+
+out:
+	batch_free(&b);
+	pa5_tier_end(cf);
+	if (res == 0 && new_size < old_size)
+		res = chunk_cut(cf, old_size, new_size);
+	if (journaled)
+		pa5_journal_done();
+	return res;
+}
+
+static int chunk_write(const struct pa5_chunk_file *cf, const char *buf, size_t size,
+		       off_t offset)
+{
+	off_t old_size;
+	if (cf->flags & PA5_CHUNK_FLAG_DEDUP)
+		return pa5_dedup_write(cf, buf, size, offset);
+	int res = pa5_chunk_size(cf, &old_size);
+	if (res < 0)
+		return res;
+	if (size == 0)
+		return 0;
+
+	off_t end = offset + (off_t)size;
+	off_t new_size = (end > old_size) ? end : old_size;
+	uint64_t first = ((offset < old_size) ? offset : old_size) / cf->chunk_size;
+	uint64_t last = (end - 1) / cf->chunk_size + 1;
+
+	/* A file that grows has its old last chunk sealed again, without the
+	 * final mark, even when the write starts past it. */
+	if (new_size > old_size && old_size > 0 && first > (uint64_t)(old_size - 1) / cf->chunk_size)
+		first = (old_size - 1) / cf->chunk_size;
+
+	res = chunk_rewrite(cf, old_size, new_size, first, last, buf, size, offset);
+	return (res < 0) ? res : (int)size;
+}
+
+static int chunk_truncate(const struct pa5_chunk_file *cf, off_t size)
+{
+	off_t old_size;
+	uint64_t cs = cf->chunk_size;
+	if (cf->flags & PA5_CHUNK_FLAG_DEDUP)
+		return pa5_dedup_truncate(cf, size);
+	int res = pa5_chunk_size(cf, &old_size);
+	if (res < 0)
+		return res;
+
+	/* The old last chunk loses its final mark and the new one gains it. */
+	if (size > old_size)
+		return chunk_rewrite(cf, old_size, size, old_size ? (old_size - 1) / cs : 0,
+				     (size - 1) / cs + 1, NULL, 0, 0);
+
+	if (size < old_size)
+	{
+		if (size > 0)
+			return chunk_rewrite(cf, old_size, size, (size - 1) / cs, (size - 1) / cs + 1,
+					     NULL, 0, 0);
+
+		int journaled = pa5_journal_ready();
+		if (journaled &&
+		    (res = pa5_journal_commit(cf, NULL, backing_size(cf, size), NULL, 0)) < 0)
+			return res;
+		res = chunk_cut(cf, old_size, size);
+		if (journaled)
+			pa5_journal_done();
+	}
+	return res;
+}
+
+/* The entry points that seal, open or move chunks hold a pa5-sched slot
+ * for the whole call. */
+int pa5_chunk_read(const struct pa5_chunk_file *cf, char *buf, size_t size, off_t offset)
+{
+	pa5_sched_enter();
+	int res = chunk_read(cf, buf, size, offset);
+	pa5_sched_leave();
+	return res;
+}
+
+int pa5_chunk_write(const struct pa5_chunk_file *cf, const char *buf, size_t size,
+		    off_t offset)
+{
+	pa5_sched_enter();
+	int res = chunk_write(cf, buf, size, offset);
+	pa5_sched_leave();
+	return res;
+}
+
+int pa5_chunk_truncate(const struct pa5_chunk_file *cf, off_t size)
+{
+	pa5_sched_enter();
+	int res = chunk_truncate(cf, size);
+	pa5_sched_leave();
+	return res;
+}
+
+int pa5_chunk_sync(const struct pa5_chunk_file *cf, int datasync)
+{
+	int res;
+
+	if ((datasync ? fdatasync(cf->fd) : fsync(cf->fd)) == -1)
+		return -errno;
+	if (cf->flags & PA5_CHUNK_FLAG_DEDUP)
+		return pa5_dedup_sync();
+	if ((res = pa5_stripe_sync(cf)) < 0)
+		return res;
+	return pa5_tier_sync(cf);
+}
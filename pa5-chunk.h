@@ -0,0 +1,161 @@
+/* pa5-chunk.h
+ * Authenticated, random-access chunk format for encrypted files.
+ *
+ * Layout on disk:
+ *
+ *   header (64 bytes)
+ *     0   magic "PA5C"
+ *     4   format version
+ *     5   flags, PA5_CHUNK_FLAG_DEDUP, PA5_CHUNK_FLAG_STRIPE or 0, plus
+ *         PA5_CHUNK_FLAG_CODEC with the file's own codec in bits 4-5, and
+ *         PA5_CHUNK_FLAG_KEYED
+ *     6   stripe layout for PA5_CHUNK_FLAG_STRIPE, see pa5-stripe.h
+ *     8   plaintext bytes per chunk, little endian
+ *     16  random file id
+ *     32  HMAC-SHA256 of bytes 0-31 under the volume header key
+ *   slot i at PA5_CHUNK_HEADER + i * (PA5_CHUNK_SLOT_HEADER + chunk size)
+ *     0   GCM nonce, fresh on every write of the chunk
+ *     12  GCM tag
+ *     28  chunk info word: codec in bits 0-6 (see pa5-compress.h), bit 7
+ *         set in the last slot of the file and no other, and for a
+ *         compressed chunk its compressed length in bits 8-31
+ *     32  AES-256-GCM ciphertext of the chunk, or of its compressed form
+ *
+ * Each file is encrypted under its own key, derived from the volume master
+ * key (see pa5-volume.h) and the random file id. The file id, chunk index
+ * and info word are additional data, so chunks cannot be moved within or
+ * between files. Every slot but the last holds a full chunk, so the
+ * plaintext length follows from the backing file length. The final mark
+ * makes that length authentic: a file cut at a slot boundary ends in an
+ * unmarked slot and fails to read, as does a marked slot anywhere else.
+ * Reads verify only the chunks they touch; a bad chunk ends the read with a
+ * short count, or with -EIO when it is the first chunk of the request.
+ *
+ * A file with PA5_CHUNK_FLAG_DEDUP set holds a manifest of chunk ids after
+ * its header instead of slots; see pa5-dedup.h. A file with
+ * PA5_CHUNK_FLAG_STRIPE keeps some of its slots in stripe files on other
+ * mirror roots; see pa5-stripe.h. The functions below handle every kind.
+ * When the mount has a cache tier (pa5-tier.h), the slots of any file but
+ * a deduplicated one may also be held or written there.
+ * With the journal of pa5-journal.h on, writes that change slots or the
+ * backing length are logged there first, so a crash cannot tear them.
+ *
+ * A file made by pa5_chunk_clone() has PA5_CHUNK_FLAG_KEYED set: it has a
+ * file id of its own but keeps the chunks of the file it was copied from,
+ * sealed under that file's id (its key id). The key id is kept in the
+ * PA5_CHUNK_KEY_XATTR attribute of the backing file, followed by an
+ * HMAC-SHA256 under the volume header key of header bytes 0-31 and the key
+ * id, so it cannot be moved to another file or stripped off.
+ *
+ * Chunks are compressed with the mount's codec, unless the file was
+ * created with a codec of its own (PA5_CHUNK_FLAG_CODEC), as the
+ * encryption policy of pa5-policy.h can ask for.
+ *
+ * All functions return 0 (or a byte count) on success and -errno on error.
+ */
+
+#ifndef PA5_CHUNK_H
+#define PA5_CHUNK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PA5_CHUNK_MAGIC "PA5C"
+#define PA5_CHUNK_VERSION 1
+#define PA5_CHUNK_HEADER 64
+#define PA5_CHUNK_SLOT_HEADER 32
+#define PA5_CHUNK_SIZE 16384
+#define PA5_CHUNK_BATCH 32     /* Chunks per I/O batch. */
+#define PA5_CHUNK_FLAG_DEDUP 0x01
+#define PA5_CHUNK_FLAG_STRIPE 0x02
+#define PA5_CHUNK_FLAG_CODEC 0x04
+#define PA5_CHUNK_FLAG_KEYED 0x08
+#define PA5_CHUNK_KEY_XATTR "user.pa5.key"
+#define PA5_CHUNK_CODEC_SHIFT 4
+#define PA5_CHUNK_CODEC_MOUNT (-1)   /* Follow pa5_chunk_set_codec(). */
+
+struct pa5_tier_file;
+
+/* Volume-wide secrets, derived from the master key once at mount time. */
+struct pa5_keys
+{
+	unsigned char chunk_root[32];
+	unsigned char header_mac[32];
+	unsigned char dedup_id[32];      /* Keys the chunk ids of pa5-dedup. */
+	unsigned char dedup_store[32];   /* Seals the chunks in its store. */
+	unsigned char small_store[32];   /* Seals the records of pa5-small. */
+};
+
+struct pa5_chunk_file
+{
+	int fd;
+	unsigned chunk_size;
+	unsigned flags;
+	unsigned char file_id[16];
+	unsigned char key_id[16];   /* Id the chunks are sealed under. */
+	unsigned char key[32];
+	uint64_t cache_id;     /* Identity of this file in pa5-cache. */
+	unsigned stripe_width; /* Layout of PA5_CHUNK_FLAG_STRIPE files. */
+	unsigned stripe_policy;
+	unsigned stripe_unit;
+	int codec;             /* Codec of new chunks, or PA5_CHUNK_CODEC_MOUNT. */
+	struct pa5_tier_file *tier;   /* Cache tier state, or NULL. */
+};
+
+/* Derives the volume keys from the 32-byte master key. */
+int pa5_chunk_derive_keys(const unsigned char master[32], struct pa5_keys *keys);
+
+/* Sets the codec (enum pa5_codec) that chunks written from now on are
+ * compressed with. Chunks of any built-in codec can always be read. */
+void pa5_chunk_set_codec(int codec);
+int pa5_chunk_codec(void);
+
+/* Returns the format version of the chunk header at the start of fd, or 0
+ * if the file has none. */
+int pa5_chunk_probe(int fd);
+
+/* Writes a fresh header with a new file id to an empty file. The file is
+ * deduplicated if pa5_dedup_enabled(), and otherwise striped if
+ * pa5_stripe_enabled(). A codec other than PA5_CHUNK_CODEC_MOUNT is kept
+ * in the header and used for the file's chunks on every mount; a
+ * deduplicated file ignores it. */
+int pa5_chunk_create(int fd, const struct pa5_keys *keys, int codec,
+		     struct pa5_chunk_file *cf);
+
+/* Reads and verifies the header of an existing file. */
+int pa5_chunk_open(int fd, const struct pa5_keys *keys, struct pa5_chunk_file *cf);
+
+/* int pa5_chunk_clone(const struct pa5_chunk_file *src, int fd, const struct pa5_keys *keys,
+ *                     struct pa5_chunk_file *cf)
+ * Purpose: Make fd a copy of src without decrypting anything. The backing
+ *          file and any stripe files are copied with pa5_io_copy(), after
+ *          writing back what src has dirty in the cache tier, and the copy
+ *          is given a header with a fresh file id that keeps src's key id.
+ *          src must not be written meanwhile.
+ * Return: 0 on success, -ENOTSUP for a deduplicated file
+ */
+int pa5_chunk_clone(const struct pa5_chunk_file *src, int fd, const struct pa5_keys *keys,
+		    struct pa5_chunk_file *cf);
+
+/* Lets go of what pa5_chunk_open(), pa5_chunk_create() or pa5_chunk_clone()
+ * took besides the descriptor, which stays the caller's to close. */
+void pa5_chunk_close(struct pa5_chunk_file *cf);
+
+/* Plaintext length for a backing file of backing_size bytes, or -EIO for a
+ * length that ends inside a slot header. */
+off_t pa5_chunk_plain_size(off_t backing_size, unsigned chunk_size);
+
+int pa5_chunk_size(const struct pa5_chunk_file *cf, off_t *size);
+
+/* Like pa5_chunk_size(), but also reads the last chunk, so that a file cut
+ * short at a slot boundary gives -EIO rather than a shorter length. */
+int pa5_chunk_verify_size(const struct pa5_chunk_file *cf, off_t *size);
+int pa5_chunk_read(const struct pa5_chunk_file *cf, char *buf, size_t size, off_t offset);
+int pa5_chunk_write(const struct pa5_chunk_file *cf, const char *buf, size_t size,
+		    off_t offset);
+int pa5_chunk_truncate(const struct pa5_chunk_file *cf, off_t size);
+
+/* Flushes the file to disk, with its chunks kept elsewhere. */
+int pa5_chunk_sync(const struct pa5_chunk_file *cf, int datasync);
+
+#endif
@@ -0,0 +1,228 @@
+/* pa5-compress.c
+ * Chunk compression codecs.
+ *
+ * zlib is used as raw deflate at level 1, with no header or checksum since
+ * GCM already authenticates every byte. LZ4 keeps its state on the stack.
+ */
+
+#include "pa5-compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define ZLIB_LEVEL 1
+#define ZSTD_LEVEL 1
+
+static const char *codec_names[] = { "off", "zlib", "lz4", "zstd" };
+
+/* Compressor state of one thread, created on first use. */
+struct codec_state
+{
+#ifdef HAVE_ZLIB
+	z_stream deflate;
+	z_stream inflate;
+	int deflate_ready;
+	int inflate_ready;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+#endif
+	int unused;
+};
+
+static pthread_key_t state_key;
+static pthread_once_t state_once = PTHREAD_ONCE_INIT;
+static __thread struct codec_state *thread_state = NULL;
+
+static void state_free(void *ptr)
+{
+	struct codec_state *st = ptr;
+
+#ifdef HAVE_ZLIB
+	if (st->deflate_ready)
+		deflateEnd(&st->deflate);
+	if (st->inflate_ready)
+		inflateEnd(&st->inflate);
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx(st->cctx);
+	ZSTD_freeDCtx(st->dctx);
+#endif
+	free(st);
+}
+
+static void state_key_create(void)
+{
+	pthread_key_create(&state_key, state_free);
+}
+
+static struct codec_state *get_state(void)
+{
+	struct codec_state *st;
+
+	if (thread_state)
+		return thread_state;
+
+	pthread_once(&state_once, state_key_create);
+	if ((st = calloc(1, sizeof(*st))) == NULL)
+		return NULL;
+	pthread_setspecific(state_key, st);
+	thread_state = st;
+	return st;
+}
+
+int pa5_compress_parse(const char *name)
+{
+	if (strcmp(name, "off") == 0)
+		return PA5_CODEC_NONE;
+#ifdef HAVE_ZLIB
+	if (strcmp(name, "zlib") == 0)
+		return PA5_CODEC_ZLIB;
+#endif
+#ifdef HAVE_LZ4
+	if (strcmp(name, "lz4") == 0)
+		return PA5_CODEC_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+	if (strcmp(name, "zstd") == 0)
+		return PA5_CODEC_ZSTD;
+#endif
+	return -1;
+}
+
+const char *pa5_compress_name(int codec)
+{
+	if (codec < PA5_CODEC_NONE || codec > PA5_CODEC_ZSTD)
+		return "unknown";
+	return codec_names[codec];
+}
+
+#ifdef HAVE_ZLIB
+static size_t zlib_compress(struct codec_state *st, const void *src, size_t len, void *dst,
+			    size_t cap)
+{
+	z_stream *zs = &st->deflate;
+
+	if (!st->deflate_ready)
+	{
+		if (deflateInit2(zs, ZLIB_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return 0;
+		st->deflate_ready = 1;
+	}
+	else if (deflateReset(zs) != Z_OK)
+		return 0;
+
+	zs->next_in = (Bytef *)src;
+	zs->avail_in = len;
+	zs->next_out = dst;
+	zs->avail_out = cap;
+	if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+		return 0;
+	return cap - zs->avail_out;
+}
+
+static int zlib_decompress(struct codec_state *st, const void *src, size_t len, void *dst,
+			   size_t out_len)
+{
+	z_stream *zs = &st->inflate;
+
+	if (!st->inflate_ready)
+	{
+		if (inflateInit2(zs, -15) != Z_OK)
+			return -ENOMEM;
+		st->inflate_ready = 1;
+	}
+	else if (inflateReset(zs) != Z_OK)
+		return -EIO;
+
+	zs->next_in = (Bytef *)src;
+	zs->avail_in = len;
+	zs->next_out = dst;
+	zs->avail_out = out_len;
+	if (inflate(zs, Z_FINISH) != Z_STREAM_END || zs->avail_out != 0 || zs->avail_in != 0)
+		return -EIO;
+	return 0;
+}
+#endif
+
+size_t pa5_compress(int codec, const void *src, size_t len, void *dst, size_t cap)
+{
+	struct codec_state *st = get_state();
+
+	if (!st)
+		return 0;
+
+	switch (codec)
+	{
+#ifdef HAVE_ZLIB
+	case PA5_CODEC_ZLIB:
+		return zlib_compress(st, src, len, dst, cap);
+#endif
+#ifdef HAVE_LZ4
+	case PA5_CODEC_LZ4:
+	{
+		int n = LZ4_compress_default(src, dst, (int)len, (int)cap);
+		return n > 0 ? (size_t)n : 0;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case PA5_CODEC_ZSTD:
+	{
+		if (!st->cctx && (st->cctx = ZSTD_createCCtx()) == NULL)
+			return 0;
+		size_t n = ZSTD_compressCCtx(st->cctx, dst, cap, src, len, ZSTD_LEVEL);
+		return ZSTD_isError(n) ? 0 : n;
+	}
+#endif
+	default:
+		return 0;
+	}
+}
+
+int pa5_decompress(int codec, const void *src, size_t len, void *dst, size_t out_len)
+{
+	struct codec_state *st = get_state();
+
+	if (!st)
+		return -ENOMEM;
+
+	switch (codec)
+	{
+#ifdef HAVE_ZLIB
+	case PA5_CODEC_ZLIB:
+		return zlib_decompress(st, src, len, dst, out_len);
+#endif
+#ifdef HAVE_LZ4
+	case PA5_CODEC_LZ4:
+	{
+		int n = LZ4_decompress_safe(src, dst, (int)len, (int)out_len);
+		return (n >= 0 && (size_t)n == out_len) ? 0 : -EIO;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case PA5_CODEC_ZSTD:
+	{
+		if (!st->dctx && (st->dctx = ZSTD_createDCtx()) == NULL)
+			return -ENOMEM;
+		size_t n = ZSTD_decompressDCtx(st->dctx, dst, out_len, src, len);
+		return (!ZSTD_isError(n) && n == out_len) ? 0 : -EIO;
+	}
+#endif
+	default:
+		/* A codec this build lacks: the chunk cannot be read here. */
+		return -EIO;
+	}
+}
@@ -0,0 +1,41 @@
+/* pa5-compress.h
+ * Chunk compression codecs.
+ *
+ * zlib, LZ4 and zstd are each built in when their headers are found at
+ * build time (HAVE_ZLIB, HAVE_LZ4, HAVE_ZSTD). Every thread keeps its own
+ * compressor state, so compressing a chunk allocates nothing after the
+ * thread's first call.
+ */
+
+#ifndef PA5_COMPRESS_H
+#define PA5_COMPRESS_H
+
+#include <stddef.h>
+
+/* Codec numbers are stored on disk; see the chunk info word in pa5-chunk.h. */
+enum pa5_codec
+{
+	PA5_CODEC_NONE = 0,
+	PA5_CODEC_ZLIB = 1,
+	PA5_CODEC_LZ4 = 2,
+	PA5_CODEC_ZSTD = 3
+};
+
+/* Parses "off", "zlib", "lz4" or "zstd". Returns -1 if the name is unknown
+ * or the codec was not built in. */
+int pa5_compress_parse(const char *name);
+const char *pa5_compress_name(int codec);
+
+/* size_t pa5_compress(int codec, const void *src, size_t len, void *dst, size_t cap)
+ * Purpose: Compress src into at most cap bytes of dst.
+ * Return: Compressed length, or 0 if it does not fit or the codec failed
+ */
+size_t pa5_compress(int codec, const void *src, size_t len, void *dst, size_t cap);
+
+/* int pa5_decompress(int codec, const void *src, size_t len, void *dst, size_t out_len)
+ * Purpose: Decompress src into exactly out_len bytes of dst.
+ * Return: 0 on success, -EIO if the data is corrupt or of another length
+ */
+int pa5_decompress(int codec, const void *src, size_t len, void *dst, size_t out_len);
+
+#endif
@@ -0,0 +1,148 @@
+/* pa5-control.c
+ * Live tuning through the synthetic PA5_CONTROL_FILE in the mount root.
+ *
+ * Settings are registered in main() before any thread runs and never
+ * change afterwards, so only applying them takes the lock, which keeps two
+ * writers from interleaving their changes.
+ */
+
+#include "pa5-control.h"
+#include "pa5-log.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define MAX_SETTINGS 32
+#define MAX_LINE 1024
+
+static struct
+{
+	pthread_mutex_t lock;
+	struct
+	{
+		const char *name;
+		pa5_control_get_t get;
+		pa5_control_set_t set;
+	} settings[MAX_SETTINGS];
+	unsigned nsettings;
+	unsigned long long applied;
+	unsigned long long refused;
+} control = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void pa5_control_register(const char *name, pa5_control_get_t get, pa5_control_set_t set)
+{
+	if (control.nsettings < MAX_SETTINGS)
+	{
+		control.settings[control.nsettings].name = name;
+		control.settings[control.nsettings].get = get;
+		control.settings[control.nsettings].set = set;
+		control.nsettings++;
+	}
+}
+
+int pa5_control_format(char **text, size_t *len)
+{
+	FILE *out = open_memstream(text, len);
+	unsigned i;
+
+	if (!out)
+		return -errno;
+	for (i = 0; i < control.nsettings; i++)
+	{
+		fprintf(out, "%s ", control.settings[i].name);
+		control.settings[i].get(out);
+		fprintf(out, "\n");
+	}
+	if (fclose(out) == EOF)
+	{
+		free(*text);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/* Applies one "<name> <value>" line, without its newline. Called locked.
+ * Return: 1 if it set something, 0 if it was blank, -errno on error */
+static int apply_line(char *line)
+{
+	char *value;
+	unsigned i;
+	int res;
+
+	while (*line == ' ' || *line == '\t')
+		line++;
+	size_t n = strlen(line);
+	while (n > 0 && (line[n - 1] == ' ' || line[n - 1] == '\t' || line[n - 1] == '\r'))
+		line[--n] = '\0';
+	if (n == 0 || line[0] == '#')
+		return 0;
+
+	value = line + strcspn(line, " \t");
+	if (*value)
+		*value++ = '\0';
+	while (*value == ' ' || *value == '\t')
+		value++;
+
+	for (i = 0; i < control.nsettings; i++)
+		if (strcmp(control.settings[i].name, line) == 0)
+			break;
+	if (i == control.nsettings)
+	{
+		pa5_warn("Unknown setting %s.", line);
+		return -ENOENT;
+	}
+	if ((res = control.settings[i].set(value)) < 0)
+	{
+		pa5_warn("Could not set %s to %s: %d.", line, value, res);
+		return res;
+	}
+	pa5_info("Set %s to %s.", line, value);
+	return 1;
+}
+
+int pa5_control_apply(const char *text, size_t len)
+{
+	char line[MAX_LINE];
+	int res = 0;
+
+	pa5_mutex_lock(&control.lock, PA5_LOCK_CONTROL);
+	while (len > 0 && res == 0)
+	{
+		const char *end = memchr(text, '\n', len);
+		size_t n = end ? (size_t)(end - text) : len;
+
+		if (n >= sizeof(line))
+			res = -EINVAL;
+		else
+		{
+			memcpy(line, text, n);
+			line[n] = '\0';
+			res = apply_line(line);
+		}
+		if (end)
+			n++;
+		text += n;
+		len -= n;
+		if (res > 0)
+		{
+			control.applied++;
+			res = 0;
+		}
+		else if (res < 0)
+			control.refused++;
+	}
+	pthread_mutex_unlock(&control.lock);
+	return res;
+}
+
+void pa5_control_stats(FILE *out)
+{
+	pa5_mutex_lock(&control.lock, PA5_LOCK_CONTROL);
+	fprintf(out, "settings %u\n", control.nsettings);
+	fprintf(out, "applied %llu\n", control.applied);
+	fprintf(out, "refused %llu\n", control.refused);
+	pthread_mutex_unlock(&control.lock);
+}
@@ -0,0 +1,48 @@
+/* pa5-control.h
+ * Live tuning through the synthetic PA5_CONTROL_FILE in the mount root.
+ *
+ * Settings that can change on a mounted file system are registered here by
+ * name, each with a function that prints its current value and one that
+ * applies a new value. Reading the file lists them as "<name> <value>"
+ * lines. Writing lines of the same form applies them in order, stopping at
+ * the first that fails, whose error the write returns. Blank lines and
+ * lines starting with '#' are skipped, so the file can be read, edited and
+ * written back whole.
+ *
+ * Only the admin uid and root may open the file.
+ */
+
+#ifndef PA5_CONTROL_H
+#define PA5_CONTROL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define PA5_CONTROL_FILE "/.encfs-control"
+
+/* Prints the current value, without a newline. */
+typedef void (*pa5_control_get_t)(FILE *out);
+
+/* Applies value. Return: 0 on success, -EINVAL if it is malformed */
+typedef int (*pa5_control_set_t)(const char *value);
+
+/* Registers a setting. */
+void pa5_control_register(const char *name, pa5_control_get_t get, pa5_control_set_t set);
+
+/* int pa5_control_format(char **text, size_t *len)
+ * Purpose: Render every setting with its current value.
+ * Return: 0 with a malloc()ed buffer in text, -errno on error
+ */
+int pa5_control_format(char **text, size_t *len);
+
+/* int pa5_control_apply(const char *text, size_t len)
+ * Purpose: Apply the settings in text, in order.
+ * Return: 0 on success, -ENOENT for an unknown setting, or the error of
+ *         the first setting that failed
+ */
+int pa5_control_apply(const char *text, size_t len);
+
+/* Stats section with the changes applied and refused. */
+void pa5_control_stats(FILE *out);
+
+#endif
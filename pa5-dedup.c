@@ -0,0 +1,1438 @@
+/* pa5-dedup.c
+ * Content-addressed chunk store for deduplicated files.
+ *
+ * Index lookups, reference counts and pack space are handed out under one
+ * store lock; hashing, sealing and all pack I/O happen outside it. A new
+ * chunk is written to space reserved in a pack first and only entered in
+ * the index afterwards, so the index never names a record that is not on
+ * disk yet. Two writers racing with the same new chunk both write it, and
+ * the one that comes second punches its copy out again. Manifest entries
+ * are written before the references they replace are dropped, so a crash
+ * can leak a chunk but never leave a file naming one that is gone.
+ *
+ * The index grows without stopping the store. The full table is kept as
+ * the old one while an empty table twice its size is mapped next to it;
+ * every insert then moves a few of the old table's probe runs across, and
+ * lookups search both until the old table is empty. Only then is the new
+ * table written back and renamed over the old one, outside the lock.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-dedup.h"
+#include "pa5-io.h"
+#include "pa5-cache.h"
+#include "pa5-stats.h"
+#include "pa5-pool.h"
+#include "pa5-compress.h"
+#include "pa5-log.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#define NONCE_LEN 12
+#define TAG_LEN 16
+#define ID_LEN 32
+#define KEY_LEN 16              /* Leading id bytes kept in the index. */
+#define META_LEN 24             /* GCM tag, info word, plaintext length. */
+#define RECORD_AAD (ID_LEN + 8)
+#define PACK_ALIGN 4096         /* So freed records can be punched out whole. */
+#define ENTRY_DATA 48           /* Entry bytes covered by its MAC. */
+#define ENTRY_FLAGS 36
+#define ENTRY_FINAL 0x01        /* In the last entry of a manifest and no other. */
+#define INDEX_MAGIC "PA5D"
+#define INDEX_HEADER 4096
+#define INDEX_MIN_BUCKETS (1 << 16)
+#define MIGRATE_STEP 64         /* Old buckets looked at per insert while growing. */
+#define MAX_PACKS 65535
+#define MIN_COMPRESS 128
+
+#define LOC(pack, off) ((uint64_t)(pack) << 48 | (uint64_t)(off))
+#define LOC_PACK(loc) ((unsigned)((loc) >> 48))
+#define LOC_OFF(loc) ((off_t)((loc) & ((1ULL << 48) - 1)))
+
+#define INFO_CODEC(info) ((info) & 0xff)
+#define INFO_LEN(info) ((info) >> 8)
+
+/* One index bucket, little endian. refs == 0 marks it empty. */
+struct bucket
+{
+	unsigned char key[KEY_LEN];
+	uint64_t loc;
+	uint32_t len;                  /* Ciphertext bytes in the pack. */
+	uint32_t refs;
+	unsigned char meta[META_LEN];
+	unsigned char reserved[8];
+};
+
+/* One hash table of the index and the file it is mapped from. */
+struct table
+{
+	int fd;
+	unsigned char *map;        /* Header, then the buckets. */
+	size_t map_len;
+	struct bucket *buckets;
+	uint64_t nbuckets;         /* Power of two. */
+	uint64_t count;
+};
+
+struct store
+{
+	pthread_mutex_t lock;
+	int ready;
+	int enabled;
+	int dirfd;
+	unsigned char id_key[32];
+	unsigned char seal_key[32];
+
+	struct table cur;          /* "index", or "index.new" while growing. */
+	struct table old;          /* Table being grown out of, map NULL if none. */
+	struct table retired;      /* Emptied old table, until it is let go. */
+	uint64_t cursor;           /* Next old bucket to look at... */
+	uint64_t left;             /* ...and how many are still to come. */
+	int retiring;              /* The grown table is being written back. */
+
+	int *packs;                /* Descriptors, -1 until first used. */
+	unsigned npacks;
+	unsigned packs_cap;
+	off_t pack_end;            /* Append offset in the last pack. */
+
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long freed;
+	unsigned long long saved;  /* Plaintext bytes not written thanks to a hit. */
+};
+
+static struct store store = {
+	.lock = PTHREAD_MUTEX_INITIALIZER, .dirfd = -1,
+	.cur = { .fd = -1 }, .old = { .fd = -1 }, .retired = { .fd = -1 }
+};
+
+/* Room for one chunk, plain or sealed, at the default chunk size. */
+static struct pa5_pool record_pool =
+	PA5_POOL_INIT("dedup", PA5_CHUNK_SIZE, 4096, 16);
+
+struct cipher_ctxs
+{
+	EVP_CIPHER_CTX *enc;
+	EVP_CIPHER_CTX *dec;
+};
+
+static pthread_key_t ctx_key;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+static __thread struct cipher_ctxs *thread_ctxs = NULL;
+
+/* State for one chunk of a batch. */
+struct dedup_io
+{
+	const struct pa5_chunk_file *cf;
+	uint64_t index;
+	size_t len;                  /* Plaintext bytes of the chunk. */
+	unsigned char id[ID_LEN];
+	unsigned char *pt;
+	unsigned char *rec;          /* Ciphertext. */
+	unsigned char meta[META_LEN];
+	uint64_t loc;
+	uint32_t rec_len;
+	int fresh;                   /* Not in the store yet. */
+	int status;
+};
+
+/* One batch of chunks, with the manifest entries that cover it. */
+struct dedup_batch
+{
+	struct dedup_io ios[PA5_CHUNK_BATCH];
+	struct pa5_io_req reqs[PA5_CHUNK_BATCH];
+	unsigned char entries[PA5_CHUNK_BATCH * PA5_DEDUP_ENTRY];
+	unsigned char mkey[32];      /* Manifest MAC key of the file. */
+	int count;
+	int pooled;
+};
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+	put_le32(p, (uint32_t)v);
+	put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+	return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static void hmac_sha256(const unsigned char *key, const void *data, size_t len,
+			unsigned char out[32])
+{
+	unsigned int outlen = 32;
+	HMAC(EVP_sha256(), key, 32, data, len, out, &outlen);
+}
+
+static void ctxs_free(void *ptr)
+{
+	struct cipher_ctxs *ctxs = ptr;
+	EVP_CIPHER_CTX_free(ctxs->enc);
+	EVP_CIPHER_CTX_free(ctxs->dec);
+	free(ctxs);
+}
+
+static void ctx_key_create(void)
+{
+	pthread_key_create(&ctx_key, ctxs_free);
+}
+
+static struct cipher_ctxs *get_ctxs(void)
+{
+	struct cipher_ctxs *ctxs;
+
+	if (thread_ctxs)
+		return thread_ctxs;
+
+	pthread_once(&ctx_once, ctx_key_create);
+	if ((ctxs = calloc(1, sizeof(*ctxs))) == NULL)
+		return NULL;
+	ctxs->enc = EVP_CIPHER_CTX_new();
+	ctxs->dec = EVP_CIPHER_CTX_new();
+	if (!ctxs->enc || !ctxs->dec ||
+	    !EVP_EncryptInit_ex(ctxs->enc, EVP_aes_256_gcm(), NULL, NULL, NULL) ||
+	    !EVP_CIPHER_CTX_ctrl(ctxs->enc, EVP_CTRL_GCM_SET_IVLEN, NONCE_LEN, NULL) ||
+	    !EVP_DecryptInit_ex(ctxs->dec, EVP_aes_256_gcm(), NULL, NULL, NULL) ||
+	    !EVP_CIPHER_CTX_ctrl(ctxs->dec, EVP_CTRL_GCM_SET_IVLEN, NONCE_LEN, NULL))
+	{
+		ctxs_free(ctxs);
+		return NULL;
+	}
+
+	pthread_setspecific(ctx_key, ctxs);
+	thread_ctxs = ctxs;
+	return ctxs;
+}
+
+/* ---- Index ---- */
+
+static uint64_t home_bucket(const unsigned char *key, uint64_t nbuckets)
+{
+	return get_le64(key) & (nbuckets - 1);
+}
+
+static struct bucket *table_find(const struct table *t, const unsigned char *id)
+{
+	uint64_t mask = t->nbuckets - 1;
+	uint64_t i = home_bucket(id, t->nbuckets);
+
+	for (;; i = (i + 1) & mask)
+	{
+		struct bucket *b = &t->buckets[i];
+		if (b->refs == 0)
+			return NULL;
+		if (memcmp(b->key, id, KEY_LEN) == 0)
+			return b;
+	}
+}
+
+/* Returns the bucket holding id, or NULL, and the table it is in at *tp.
+ * Called with the store locked. */
+static struct bucket *index_find(const unsigned char *id, struct table **tp)
+{
+	struct bucket *b;
+
+	if (store.old.map && (b = table_find(&store.old, id)) != NULL)
+	{
+		*tp = &store.old;
+		return b;
+	}
+	*tp = &store.cur;
+	return table_find(&store.cur, id);
+}
+
+static void index_place(struct table *t, const struct bucket *b)
+{
+	uint64_t i = home_bucket(b->key, t->nbuckets);
+
+	while (t->buckets[i].refs != 0)
+		i = (i + 1) & (t->nbuckets - 1);
+	t->buckets[i] = *b;
+	t->count++;
+}
+
+/* Empties a bucket of t, shifting later members of its probe run back so
+ * that lookups need no tombstones. Called with the store locked. */
+static void index_remove(struct table *t, struct bucket *b)
+{
+	uint64_t mask = t->nbuckets - 1;
+	uint64_t hole = b - t->buckets;
+	uint64_t i = hole;
+
+	for (;;)
+	{
+		i = (i + 1) & mask;
+		struct bucket *next = &t->buckets[i];
+		if (next->refs == 0)
+			break;
+		uint64_t home = home_bucket(next->key, t->nbuckets);
+		if (((i - home) & mask) >= ((i - hole) & mask))
+		{
+			t->buckets[hole] = *next;
+			hole = i;
+		}
+	}
+	memset(&t->buckets[hole], 0, sizeof(struct bucket));
+	t->count--;
+}
+
+static void index_header_update(void)
+{
+	put_le64(store.cur.map + 16, store.cur.count);
+	put_le32(store.cur.map + 24, store.npacks);
+	if (store.old.map)
+	{
+		put_le64(store.old.map + 16, store.old.count);
+		put_le32(store.old.map + 24, store.npacks);
+	}
+}
+
+/* Creates an empty table of nbuckets at name and maps it. The file is
+ * sparse, so this costs the same at any size. */
+static int index_create(const char *name, uint64_t nbuckets, struct table *t)
+{
+	size_t len = INDEX_HEADER + nbuckets * sizeof(struct bucket);
+	unsigned char *map;
+	int fd = openat(store.dirfd, name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		return -errno;
+	if (ftruncate(fd, len) == -1 ||
+	    (map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		int res = -errno;
+		close(fd);
+		return res;
+	}
+
+	memcpy(map, INDEX_MAGIC, 4);
+	map[4] = PA5_DEDUP_VERSION;
+	put_le64(map + 8, nbuckets);
+	t->fd = fd;
+	t->map = map;
+	t->map_len = len;
+	t->buckets = (struct bucket *)(map + INDEX_HEADER);
+	t->nbuckets = nbuckets;
+	t->count = 0;
+	return 0;
+}
+
+/* Maps the table at name.
+ * Return: 0 on success, -EINVAL if its header is not a table's, -errno on
+ *         other errors */
+static int index_map(const char *name, struct table *t)
+{
+	struct stat st;
+	unsigned char *map;
+	int fd = openat(store.dirfd, name, O_RDWR);
+
+	if (fd == -1)
+		return -errno;
+	if (fstat(fd, &st) == -1)
+	{
+		close(fd);
+		return -EIO;
+	}
+	if (st.st_size < INDEX_HEADER)
+	{
+		close(fd);
+		return -EINVAL;
+	}
+	if ((map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return -EIO;
+	}
+
+	uint64_t nbuckets = get_le64(map + 8);
+	if (memcmp(map, INDEX_MAGIC, 4) != 0 || map[4] != PA5_DEDUP_VERSION ||
+	    nbuckets == 0 || (nbuckets & (nbuckets - 1)) != 0 ||
+	    (uint64_t)st.st_size != INDEX_HEADER + nbuckets * sizeof(struct bucket))
+	{
+		munmap(map, st.st_size);
+		close(fd);
+		return -EINVAL;
+	}
+
+	t->fd = fd;
+	t->map = map;
+	t->map_len = st.st_size;
+	t->buckets = (struct bucket *)(map + INDEX_HEADER);
+	t->nbuckets = nbuckets;
+	t->count = get_le64(map + 16);
+	return 0;
+}
+
+static void table_close(struct table *t)
+{
+	if (t->map)
+		munmap(t->map, t->map_len);
+	if (t->fd != -1)
+		close(t->fd);
+	memset(t, 0, sizeof(*t));
+	t->fd = -1;
+}
+
+/* Starts moving the entries of the old table, from an empty bucket so that
+ * no probe run is split. Called with the store locked. */
+static void migrate_start(void)
+{
+	uint64_t i = 0;
+
+	while (store.old.buckets[i].refs != 0)
+		i++;
+	store.cursor = i;
+	store.left = store.old.nbuckets;
+}
+
+/* Moves whole probe runs of the old table to the new one until at least
+ * budget buckets have been looked at. An emptied run leaves no gap in any
+ * other, so lookups in the old table stay right throughout. Called with
+ * the store locked.
+ * Return: 1 if the old table is empty now and has to be retired */
+static int index_migrate(uint64_t budget)
+{
+	uint64_t mask = store.old.nbuckets - 1;
+	uint64_t done = 0;
+	int in_run = 0;
+
+	/* Only stop right after an empty bucket. */
+	while (store.left > 0 && (done < budget || in_run))
+	{
+		struct bucket *b = &store.old.buckets[store.cursor];
+		in_run = (b->refs != 0);
+		if (in_run)
+		{
+			index_place(&store.cur, b);
+			memset(b, 0, sizeof(*b));
+			store.old.count--;
+		}
+		store.cursor = (store.cursor + 1) & mask;
+		store.left--;
+		done++;
+	}
+	if (store.left > 0)
+		return 0;
+
+	store.retired = store.old;
+	memset(&store.old, 0, sizeof(store.old));
+	store.old.fd = -1;
+	store.retiring = 1;
+	return 1;
+}
+
+/* Starts doubling the index: the full table becomes the old one and an
+ * empty "index.new" takes its place. Called with the store locked. */
+static int index_grow(void)
+{
+	struct table t;
+	int res;
+
+	if ((res = index_create("index.new", store.cur.nbuckets * 2, &t)) < 0)
+		return res;
+
+	store.old = store.cur;
+	store.cur = t;
+	migrate_start();
+	index_header_update();
+	pa5_info("Dedup index growing to %llu buckets.", (unsigned long long)t.nbuckets);
+	return 0;
+}
+
+/* Writes back the grown table, renames it over the old one and lets the
+ * old one go. Called without the store lock by the thread whose insert
+ * emptied the old table; no one else touches the retired table, and no
+ * new growth starts until this is done. Should the rename not happen, the
+ * next open finds "index.new" and finishes the move itself. */
+static void index_retire(void)
+{
+	unsigned char *map = store.cur.map;
+	size_t len = store.cur.map_len;
+	uint64_t nbuckets = store.cur.nbuckets;
+
+	if (msync(map, len, MS_SYNC) == -1 ||
+	    renameat(store.dirfd, "index.new", store.dirfd, "index") == -1)
+		pa5_warn("Dedup index not renamed: %s", strerror(errno));
+	else
+		pa5_info("Dedup index grown to %llu buckets.", (unsigned long long)nbuckets);
+	table_close(&store.retired);
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_DEDUP);
+	store.retiring = 0;
+	pthread_mutex_unlock(&store.lock);
+}
+
+/* Maps "index", creating it on first use, and picks up a growth that was
+ * cut short by finishing the move of its old table on the next inserts. */
+static int index_open(void)
+{
+	struct table t;
+	int res = index_map("index", &store.cur);
+
+	if (res == -ENOENT)
+	{
+		if ((res = index_create("index", INDEX_MIN_BUCKETS, &t)) < 0)
+			return res;
+		put_le32(t.map + 24, 1);
+		table_close(&t);
+		res = index_map("index", &store.cur);
+	}
+	if (res < 0)
+		return (res == -EINVAL) ? -EIO : res;
+	store.npacks = get_le32(store.cur.map + 24);
+
+	/* A new table with no header yet never held an entry. */
+	res = index_map("index.new", &t);
+	if (res == -EINVAL)
+		unlinkat(store.dirfd, "index.new", 0);
+	else if (res < 0 && res != -ENOENT)
+	{
+		table_close(&store.cur);
+		return res;
+	}
+	else if (res == 0)
+	{
+		store.old = store.cur;
+		store.cur = t;
+		if (get_le32(t.map + 24) > store.npacks)
+			store.npacks = get_le32(t.map + 24);
+		migrate_start();
+		pa5_info("Dedup index still growing to %llu buckets.",
+			 (unsigned long long)t.nbuckets);
+	}
+
+	if (store.npacks == 0)
+		store.npacks = 1;
+	return 0;
+}
+
+/* ---- Packs ---- */
+
+/* Returns the descriptor of a pack, opening it on first use. Called with
+ * the store locked. Descriptors stay open until pa5_dedup_close(). */
+static int pack_fd(unsigned pack)
+{
+	if (pack >= store.packs_cap)
+	{
+		unsigned cap = store.packs_cap ? store.packs_cap * 2 : 16;
+		while (cap <= pack)
+			cap *= 2;
+		int *packs = realloc(store.packs, cap * sizeof(int));
+		if (!packs)
+			return -ENOMEM;
+		for (unsigned i = store.packs_cap; i < cap; i++)
+			packs[i] = -1;
+		store.packs = packs;
+		store.packs_cap = cap;
+	}
+	if (store.packs[pack] == -1)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "pack.%05u", pack);
+		if ((store.packs[pack] = openat(store.dirfd, name, O_RDWR | O_CREAT, 0600)) == -1)
+			return -errno;
+	}
+	return store.packs[pack];
+}
+
+/* Reserves len bytes at the end of the last pack, starting a new pack when
+ * it is full. Called with the store locked. */
+static int pack_reserve(uint32_t len, uint64_t *loc, int *fd)
+{
+	unsigned pack = store.npacks - 1;
+
+	len = (len + PACK_ALIGN - 1) & ~(PACK_ALIGN - 1);
+	if (store.pack_end > 0 && store.pack_end + len > PA5_DEDUP_PACK_MAX)
+	{
+		if (store.npacks == MAX_PACKS)
+			return -ENOSPC;
+		pack = store.npacks++;
+		store.pack_end = 0;
+		index_header_update();
+	}
+	if ((*fd = pack_fd(pack)) < 0)
+		return *fd;
+
+	*loc = LOC(pack, store.pack_end);
+	store.pack_end += len;
+	return 0;
+}
+
+/* Gives the space of a record back to the file system. */
+static void pack_punch(uint64_t loc, uint32_t len)
+{
+	int fd = pack_fd(LOC_PACK(loc));
+	len = (len + PACK_ALIGN - 1) & ~(PACK_ALIGN - 1);
+	if (fd >= 0)
+		fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, LOC_OFF(loc), len);
+}
+
+/* Drops one reference to id. Called with the store locked. */
+static void store_unref(const unsigned char *id)
+{
+	struct table *t;
+	struct bucket *b = index_find(id, &t);
+	uint32_t refs;
+
+	if (!b)
+	{
+		pa5_warn("Dedup chunk with no index entry dropped.");
+		return;
+	}
+	refs = le32toh(b->refs);
+	if (refs == UINT32_MAX)
+		return;   /* Saturated: kept for good. */
+	if (refs > 1)
+	{
+		b->refs = htole32(refs - 1);
+		return;
+	}
+
+	pack_punch(le64toh(b->loc), le32toh(b->len));
+	index_remove(t, b);
+	store.freed++;
+	index_header_update();
+}
+
+/* ---- Records ---- */
+
+/* Seals len plaintext bytes for id into ct, compressing them first when
+ * that pays, and fills in the record's meta data for the index. Returns
+ * the number of ciphertext bytes or -errno. */
+static int record_seal(const unsigned char *id, const unsigned char *pt, size_t len,
+		       unsigned char *ct, unsigned char meta[META_LEN])
+{
+	unsigned char aad[RECORD_AAD];
+	const unsigned char *src = pt;
+	size_t ct_len = len;
+	uint32_t info = 0;
+	int outlen;
+	int ok;
+
+	int codec = pa5_chunk_codec();
+	if (codec != PA5_CODEC_NONE && len >= MIN_COMPRESS)
+	{
+		uint64_t start = pa5_stats_now();
+		size_t z = pa5_compress(codec, pt, len, ct, len - len / 8);
+		pa5_stats_time(PA5_TIME_COMPRESS, start, 0);
+		pa5_stats_add(PA5_CTR_COMPRESS_IN, len);
+		pa5_stats_add(PA5_CTR_COMPRESS_OUT, z ? z : len);
+		if (z > 0)
+		{
+			info = codec | (uint32_t)z << 8;
+			src = ct;
+			ct_len = z;
+		}
+	}
+	put_le32(meta + TAG_LEN, info);
+	put_le32(meta + TAG_LEN + 4, len);
+	memcpy(aad, id, ID_LEN);
+	memcpy(aad + ID_LEN, meta + TAG_LEN, 8);
+
+	uint64_t start = pa5_stats_now();
+	struct cipher_ctxs *ctxs = get_ctxs();
+	if (!ctxs)
+		return -ENOMEM;
+	EVP_CIPHER_CTX *ctx = ctxs->enc;
+
+	ok = EVP_EncryptInit_ex(ctx, NULL, NULL, store.seal_key, id + KEY_LEN) &&
+	     EVP_EncryptUpdate(ctx, NULL, &outlen, aad, RECORD_AAD) &&
+	     EVP_EncryptUpdate(ctx, ct, &outlen, src, ct_len) &&
+	     EVP_EncryptFinal_ex(ctx, ct + outlen, &outlen) &&
+	     EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_LEN, meta);
+
+	pa5_stats_time(PA5_TIME_CRYPTO, start, ok ? 0 : -EIO);
+	return ok ? (int)ct_len : -EIO;
+}
+
+/* Verifies ct_len bytes of ciphertext for id against its meta data and
+ * decrypts its len plaintext bytes into pt. */
+static int record_unseal(const unsigned char *id, const unsigned char meta[META_LEN],
+			 unsigned char *ct, size_t ct_len, unsigned char *pt, size_t len)
+{
+	unsigned char aad[RECORD_AAD];
+	unsigned char tag[TAG_LEN];
+	uint32_t info = get_le32(meta + TAG_LEN);
+	unsigned codec = INFO_CODEC(info);
+	int outlen;
+	int ok;
+
+	if (get_le32(meta + TAG_LEN + 4) != len)
+		return -EIO;
+	if (codec == PA5_CODEC_NONE ? (INFO_LEN(info) != 0 || ct_len != len) :
+	    (INFO_LEN(info) != ct_len || ct_len >= len))
+		return -EIO;
+	memcpy(aad, id, ID_LEN);
+	memcpy(aad + ID_LEN, meta + TAG_LEN, 8);
+	memcpy(tag, meta, TAG_LEN);
+
+	uint64_t start = pa5_stats_now();
+	struct cipher_ctxs *ctxs = get_ctxs();
+	if (!ctxs)
+		return -ENOMEM;
+	EVP_CIPHER_CTX *ctx = ctxs->dec;
+	unsigned char *out = (codec == PA5_CODEC_NONE) ? pt : ct;
+
+	ok = EVP_DecryptInit_ex(ctx, NULL, NULL, store.seal_key, id + KEY_LEN) &&
+	     EVP_DecryptUpdate(ctx, NULL, &outlen, aad, RECORD_AAD) &&
+	     EVP_DecryptUpdate(ctx, out, &outlen, ct, ct_len) &&
+	     EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag) &&
+	     EVP_DecryptFinal_ex(ctx, out + outlen, &outlen);
+
+	pa5_stats_time(PA5_TIME_CRYPTO, start, ok ? 0 : -EIO);
+	if (!ok)
+		return -EIO;
+	if (codec == PA5_CODEC_NONE)
+		return 0;
+
+	start = pa5_stats_now();
+	int res = pa5_decompress(codec, ct, ct_len, pt, len);
+	pa5_stats_time(PA5_TIME_COMPRESS, start, res);
+	return res;
+}
+
+/* ---- Manifests ---- */
+
+static void manifest_key(const struct pa5_chunk_file *cf, unsigned char mkey[32])
+{
+	hmac_sha256(cf->key, "pa5 manifest", 12, mkey);
+}
+
+static void entry_mac(const unsigned char mkey[32], uint64_t index, const unsigned char *entry,
+		      unsigned char mac[32])
+{
+	unsigned char msg[8 + ENTRY_DATA];
+
+	put_le64(msg, index);
+	memcpy(msg + 8, entry, ENTRY_DATA);
+	hmac_sha256(mkey, msg, sizeof(msg), mac);
+}
+
+static void entry_build(const unsigned char mkey[32], uint64_t index, const unsigned char *id,
+			size_t len, int final, unsigned char *entry)
+{
+	unsigned char mac[32];
+
+	memset(entry, 0, PA5_DEDUP_ENTRY);
+	memcpy(entry, id, ID_LEN);
+	put_le32(entry + ID_LEN, len);
+	if (final)
+		entry[ENTRY_FLAGS] = ENTRY_FINAL;
+	entry_mac(mkey, index, entry, mac);
+	memcpy(entry + ENTRY_DATA, mac, PA5_DEDUP_ENTRY - ENTRY_DATA);
+}
+
+/* Number of chunks in the manifest. */
+static int manifest_chunks(const struct pa5_chunk_file *cf, uint64_t *n)
+{
+	struct stat st;
+	if (fstat(cf->fd, &st) == -1)
+		return -errno;
+	*n = (st.st_size > PA5_CHUNK_HEADER) ?
+		(uint64_t)(st.st_size - PA5_CHUNK_HEADER) / PA5_DEDUP_ENTRY : 0;
+	return 0;
+}
+
+/* Reads and verifies entries [first, first + n), of which only entry last
+ * may carry the final mark, and must if it is among them. */
+static int manifest_load(const struct pa5_chunk_file *cf, const unsigned char mkey[32],
+			 uint64_t first, int n, uint64_t last, unsigned char *entries)
+{
+	size_t len = (size_t)n * PA5_DEDUP_ENTRY;
+	unsigned char mac[32];
+	int i;
+
+	if (pread(cf->fd, entries, len, PA5_CHUNK_HEADER + first * PA5_DEDUP_ENTRY) != (ssize_t)len)
+		return -EIO;
+	for (i = 0; i < n; i++)
+	{
+		unsigned char *entry = entries + i * PA5_DEDUP_ENTRY;
+		uint32_t clen = get_le32(entry + ID_LEN);
+
+		entry_mac(mkey, first + i, entry, mac);
+		if (CRYPTO_memcmp(mac, entry + ENTRY_DATA, PA5_DEDUP_ENTRY - ENTRY_DATA) != 0 ||
+		    clen == 0 || clen > cf->chunk_size ||
+		    !(entry[ENTRY_FLAGS] & ENTRY_FINAL) != (first + i != last))
+			return -EIO;
+	}
+	return 0;
+}
+
+/* Rewrites entry index with or without the final mark, for a manifest whose
+ * last entry is last until then. */
+static int manifest_mark(const struct pa5_chunk_file *cf, const unsigned char mkey[32],
+			 uint64_t index, uint64_t last, int final)
+{
+	unsigned char entry[PA5_DEDUP_ENTRY];
+	unsigned char id[ID_LEN];
+	int res = manifest_load(cf, mkey, index, 1, last, entry);
+	if (res < 0)
+		return res;
+
+	memcpy(id, entry, ID_LEN);
+	entry_build(mkey, index, id, get_le32(entry + ID_LEN), final, entry);
+	if (pwrite(cf->fd, entry, PA5_DEDUP_ENTRY, PA5_CHUNK_HEADER + index * PA5_DEDUP_ENTRY) !=
+	    PA5_DEDUP_ENTRY)
+		return -EIO;
+	pa5_stats_add(PA5_CTR_BACKING_WRITTEN, PA5_DEDUP_ENTRY);
+	return 0;
+}
+
+/* ---- Batches ---- */
+
+static void batch_free(struct dedup_batch *b)
+{
+	int i;
+
+	for (i = 0; i < b->count; i++)
+	{
+		if (b->pooled)
+		{
+			pa5_pool_put(&record_pool, b->ios[i].rec);
+			pa5_pool_put(&record_pool, b->ios[i].pt);
+		}
+		else
+		{
+			free(b->ios[i].rec);
+			free(b->ios[i].pt);
+		}
+	}
+	b->count = 0;
+}
+
+static int batch_alloc(const struct pa5_chunk_file *cf, struct dedup_batch *b, uint64_t nchunks)
+{
+	int want = (nchunks < PA5_CHUNK_BATCH) ? (int)nchunks : PA5_CHUNK_BATCH;
+
+	manifest_key(cf, b->mkey);
+	b->count = 0;
+	b->pooled = (cf->chunk_size <= record_pool.size);
+	while (b->count < want)
+	{
+		struct dedup_io *c = &b->ios[b->count++];
+		if (b->pooled)
+		{
+			c->rec = pa5_pool_get(&record_pool);
+			c->pt = pa5_pool_get(&record_pool);
+		}
+		else
+		{
+			c->rec = malloc(cf->chunk_size);
+			c->pt = malloc(cf->chunk_size);
+		}
+		if (!c->rec || !c->pt)
+		{
+			batch_free(b);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static int fetch_done(struct pa5_io_req *req)
+{
+	struct dedup_io *c = req->data;
+
+	if (req->res < 0)
+		c->status = req->res;
+	else if ((size_t)req->res != req->len)
+		c->status = -EIO;
+	else
+		c->status = record_unseal(c->id, c->meta, c->rec, c->rec_len, c->pt, c->len);
+
+	if (c->status == 0)
+		pa5_cache_put(c->cf->cache_id, c->index, c->pt, c->len);
+	return 0;
+}
+
+/* Fills in the plaintext of the first n chunks of b whose want flag is
+ * set, from the cache or the store. c->id and c->len must be set. */
+static int batch_fetch(struct dedup_batch *b, int n, const int *want)
+{
+	int nreqs = 0;
+	int i;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_DEDUP);
+	for (i = 0; i < n; i++)
+	{
+		struct dedup_io *c = &b->ios[i];
+		size_t got;
+
+		c->status = 0;
+		if (!want[i] ||
+		    (pa5_cache_get(c->cf->cache_id, c->index, c->pt, c->cf->chunk_size, &got) &&
+		     got == c->len))
+			continue;
+
+		struct table *t;
+		struct bucket *bk = index_find(c->id, &t);
+		int fd;
+		if (!bk || (fd = pack_fd(LOC_PACK(le64toh(bk->loc)))) < 0)
+		{
+			c->status = -EIO;
+			continue;
+		}
+
+		c->rec_len = le32toh(bk->len);
+		memcpy(c->meta, bk->meta, META_LEN);
+		struct pa5_io_req *req = &b->reqs[nreqs++];
+		memset(req, 0, sizeof(*req));
+		req->fd = fd;
+		req->buf = c->rec;
+		req->len = c->rec_len;
+		req->off = LOC_OFF(le64toh(bk->loc));
+		req->data = c;
+	}
+	pthread_mutex_unlock(&store.lock);
+
+	return pa5_io_submit(b->reqs, nreqs, fetch_done);
+}
+
+/* Takes a reference on the chunk of every c in the first n of b, writing
+ * the ones the store does not have yet. c->pt and c->len must be set. */
+static int batch_store(struct dedup_batch *b, int n)
+{
+	int nreqs = 0;
+	int retire = 0;
+	int res = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		struct dedup_io *c = &b->ios[i];
+		hmac_sha256(store.id_key, c->pt, c->len, c->id);
+	}
+
+	/* Chunks already stored only need a reference. */
+	pa5_mutex_lock(&store.lock, PA5_LOCK_DEDUP);
+	for (i = 0; i < n; i++)
+	{
+		struct dedup_io *c = &b->ios[i];
+		struct table *t;
+		struct bucket *bk = index_find(c->id, &t);
+
+		c->fresh = !bk;
+		if (bk)
+		{
+			if (le32toh(bk->refs) != UINT32_MAX)
+				bk->refs = htole32(le32toh(bk->refs) + 1);
+			store.hits++;
+			store.saved += c->len;
+		}
+	}
+	pthread_mutex_unlock(&store.lock);
+
+	for (i = 0; i < n; i++)
+	{
+		struct dedup_io *c = &b->ios[i];
+		if (c->fresh && (res = record_seal(c->id, c->pt, c->len, c->rec, c->meta)) < 0)
+			goto unref;
+		if (c->fresh)
+			c->rec_len = res;
+	}
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_DEDUP);
+	for (i = 0; i < n; i++)
+	{
+		struct dedup_io *c = &b->ios[i];
+		int fd;
+
+		if (!c->fresh)
+			continue;
+		if ((res = pack_reserve(c->rec_len, &c->loc, &fd)) < 0)
+			break;
+
+		struct pa5_io_req *req = &b->reqs[nreqs++];
+		memset(req, 0, sizeof(*req));
+		req->fd = fd;
+		req->write = 1;
+		req->buf = c->rec;
+		req->len = c->rec_len;
+		req->off = LOC_OFF(c->loc);
+	}
+	pthread_mutex_unlock(&store.lock);
+
+	if (res >= 0)
+		res = pa5_io_submit(b->reqs, nreqs, NULL);
+	for (i = 0; res >= 0 && i < nreqs; i++)
+		if (b->reqs[i].res != (ssize_t)b->reqs[i].len)
+			res = (b->reqs[i].res < 0) ? (int)b->reqs[i].res : -EIO;
+	if (res < 0)
+		goto unref;
+
+	/* Enter the new records, unless someone stored the same chunk first. */
+	pa5_mutex_lock(&store.lock, PA5_LOCK_DEDUP);
+	for (i = 0; i < n; i++)
+	{
+		struct dedup_io *c = &b->ios[i];
+		struct table *t;
+		struct bucket *bk;
+
+		if (!c->fresh)
+			continue;
+		c->fresh = 0;
+		if ((bk = index_find(c->id, &t)) != NULL)
+		{
+			if (le32toh(bk->refs) != UINT32_MAX)
+				bk->refs = htole32(le32toh(bk->refs) + 1);
+			pack_punch(c->loc, c->rec_len);
+			continue;
+		}
+		/* A growth moves the whole old table within a small part of
+		 * the inserts the new one has room for, so a growth never has
+		 * to start while the last is still going. */
+		if ((store.cur.count + 1) * 4 > store.cur.nbuckets * 3 && !store.old.map &&
+		    !store.retiring && (res = index_grow()) < 0)
+		{
+			pack_punch(c->loc, c->rec_len);
+			c->fresh = 1;
+			continue;
+		}
+
+		struct bucket nb;
+		memset(&nb, 0, sizeof(nb));
+		memcpy(nb.key, c->id, KEY_LEN);
+		nb.loc = htole64(c->loc);
+		nb.len = htole32(c->rec_len);
+		nb.refs = htole32(1);
+		memcpy(nb.meta, c->meta, META_LEN);
+		index_place(&store.cur, &nb);
+		store.misses++;
+		if (store.old.map && index_migrate(MIGRATE_STEP))
+			retire = 1;
+	}
+	index_header_update();
+	pthread_mutex_unlock(&store.lock);
+	if (retire)
+		index_retire();
+	if (res >= 0)
+		return 0;
+
+unref:
+	/* Give back the references already taken for this batch. */
+	pa5_mutex_lock(&store.lock, PA5_LOCK_DEDUP);
+	for (i = 0; i < n; i++)
+		if (!b->ios[i].fresh)
+			store_unref(b->ios[i].id);
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+/* Drops the references held by entries [first, first + n) of a manifest. */
+static void batch_unref(const unsigned char *entries, int n)
+{
+	int i;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_DEDUP);
+	for (i = 0; i < n; i++)
+		store_unref(entries + i * PA5_DEDUP_ENTRY);
+	pthread_mutex_unlock(&store.lock);
+}
+
+/* ---- Public interface ---- */
+
+int pa5_dedup_open(const char *rootdir, const struct pa5_keys *keys, int enable)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int res;
+
+	snprintf(path, sizeof(path), "%s/%s", rootdir, PA5_DEDUP_DIR);
+	if (enable && mkdir(path, 0700) == -1 && errno != EEXIST)
+		return -errno;
+	if ((store.dirfd = open(path, O_RDONLY | O_DIRECTORY)) == -1)
+		return -errno;
+
+	if ((res = index_open()) < 0)
+	{
+		close(store.dirfd);
+		store.dirfd = -1;
+		return res;
+	}
+
+	int fd = pack_fd(store.npacks - 1);
+	if (fd < 0 || fstat(fd, &st) == -1)
+	{
+		pa5_dedup_close();
+		return -EIO;
+	}
+	store.pack_end = st.st_size;
+
+	memcpy(store.id_key, keys->dedup_id, 32);
+	memcpy(store.seal_key, keys->dedup_store, 32);
+	store.enabled = enable;
+	store.ready = 1;
+	return 0;
+}
+
+void pa5_dedup_close(void)
+{
+	unsigned i;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_DEDUP);
+	if (store.cur.map)
+		msync(store.cur.map, store.cur.map_len, MS_SYNC);
+	if (store.old.map)
+		msync(store.old.map, store.old.map_len, MS_SYNC);
+	table_close(&store.cur);
+	table_close(&store.old);
+	for (i = 0; i < store.packs_cap; i++)
+		if (store.packs[i] != -1)
+			close(store.packs[i]);
+	free(store.packs);
+	store.packs = NULL;
+	store.packs_cap = 0;
+	if (store.dirfd != -1)
+		close(store.dirfd);
+	store.dirfd = -1;
+	store.ready = store.enabled = 0;
+	pthread_mutex_unlock(&store.lock);
+}
+
+int pa5_dedup_ready(void)
+{
+	return store.ready;
+}
+
+int pa5_dedup_enabled(void)
+{
+	return store.enabled;
+}
+
+int pa5_dedup_sync(void)
+{
+	int res = 0;
+	unsigned i;
+
+	if (!store.ready)
+		return 0;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_DEDUP);
+	for (i = 0; i < store.packs_cap; i++)
+		if (store.packs[i] != -1 && fdatasync(store.packs[i]) == -1)
+			res = -errno;
+	if (msync(store.cur.map, store.cur.map_len, MS_SYNC) == -1 ||
+	    (store.old.map && msync(store.old.map, store.old.map_len, MS_SYNC) == -1))
+		res = -errno;
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_dedup_size(const struct pa5_chunk_file *cf, off_t *size)
+{
+	unsigned char mkey[32];
+	unsigned char entry[PA5_DEDUP_ENTRY];
+	uint64_t n = 0;
+	int res;
+
+	if ((res = manifest_chunks(cf, &n)) < 0)
+		return res;
+	if (n == 0)
+	{
+		*size = 0;
+		return 0;
+	}
+
+	manifest_key(cf, mkey);
+	if ((res = manifest_load(cf, mkey, n - 1, 1, n - 1, entry)) < 0)
+		return res;
+	*size = (off_t)(n - 1) * cf->chunk_size + get_le32(entry + ID_LEN);
+	return 0;
+}
+
+int pa5_dedup_read(const struct pa5_chunk_file *cf, char *buf, size_t size, off_t offset)
+{
+	struct dedup_batch b;
+	int want[PA5_CHUNK_BATCH];
+	off_t plain;
+	int res = pa5_dedup_size(cf, &plain);
+	if (res < 0)
+		return res;
+
+	if (offset >= plain || size == 0)
+		return 0;
+
+	off_t end = offset + (off_t)size;
+	if (end > plain)
+		end = plain;
+
+	uint64_t cs = cf->chunk_size;
+	uint64_t first = offset / cs;
+	uint64_t last = (end - 1) / cs + 1;
+	off_t pos = offset;
+
+	if ((res = batch_alloc(cf, &b, last - first)) < 0)
+		return res;
+
+	uint64_t base;
+	for (base = first; base < last; base += PA5_CHUNK_BATCH)
+	{
+		int n = (last - base < PA5_CHUNK_BATCH) ? (int)(last - base) : PA5_CHUNK_BATCH;
+		int i;
+
+		if ((res = manifest_load(cf, b.mkey, base, n, (plain - 1) / cs, b.entries)) < 0)
+		{
+			res = (pos > offset) ? (int)(pos - offset) : res;
+			goto out;
+		}
+		for (i = 0; i < n; i++)
+		{
+			struct dedup_io *c = &b.ios[i];
+			c->cf = cf;
+			c->index = base + i;
+			c->len = get_le32(b.entries + i * PA5_DEDUP_ENTRY + ID_LEN);
+			memcpy(c->id, b.entries + i * PA5_DEDUP_ENTRY, ID_LEN);
+			want[i] = 1;
+		}
+
+		if ((res = batch_fetch(&b, n, want)) < 0)
+			goto out;
+
+		for (i = 0; i < n; i++)
+		{
+			struct dedup_io *c = &b.ios[i];
+			off_t cstart = c->index * cs;
+			off_t hi = (cstart + (off_t)c->len < end) ? cstart + (off_t)c->len : end;
+
+			if (c->status < 0)
+			{
+				res = (pos > offset) ? (int)(pos - offset) : c->status;
+				goto out;
+			}
+
+			memcpy(buf + (pos - offset), c->pt + (pos - cstart), hi - pos);
+			pos = hi;
+		}
+	}
+	res = end - offset;
+
+out:
+	batch_free(&b);
+	return res;
+}
+
+/* Same contract as chunk_rewrite() in pa5-chunk.c: chunks [first, last)
+ * get their old plaintext, cut or zero extended to new_size, with buf laid
+ * over it at offset. */
+static int dedup_rewrite(const struct pa5_chunk_file *cf, off_t old_size, off_t new_size,
+			 uint64_t first, uint64_t last, const char *buf, size_t size,
+			 off_t offset)
+{
+	struct dedup_batch b;
+	uint64_t cs = cf->chunk_size;
+	uint64_t old_chunks = (old_size + cs - 1) / cs;
+	uint64_t new_last = (new_size - 1) / cs;
+	uint64_t base;
+	int res;
+
+	if ((res = batch_alloc(cf, &b, last - first)) < 0)
+		return res;
+
+	for (base = first; base < last; base += PA5_CHUNK_BATCH)
+	{
+		int n = (last - base < PA5_CHUNK_BATCH) ? (int)(last - base) : PA5_CHUNK_BATCH;
+		int nold = (base < old_chunks) ?
+			((old_chunks - base < (uint64_t)n) ? (int)(old_chunks - base) : n) : 0;
+		unsigned char old[PA5_CHUNK_BATCH * PA5_DEDUP_ENTRY];
+		size_t kept[PA5_CHUNK_BATCH];
+		int want[PA5_CHUNK_BATCH];
+		int i;
+
+		if (nold > 0 &&
+		    (res = manifest_load(cf, b.mkey, base, nold, old_chunks - 1, old)) < 0)
+			goto out;
+
+		/* Fetch the old plaintext of chunks that are only partly replaced. */
+		for (i = 0; i < n; i++)
+		{
+			struct dedup_io *c = &b.ios[i];
+			off_t cstart = (base + i) * cs;
+			size_t new_len = (new_size - cstart < (off_t)cs) ? (size_t)(new_size - cstart) : cs;
+
+			c->cf = cf;
+			c->index = base + i;
+			kept[i] = 0;
+			want[i] = 0;
+			if (i < nold &&
+			    !(buf && offset <= cstart && offset + (off_t)size >= cstart + (off_t)new_len))
+			{
+				c->len = get_le32(old + i * PA5_DEDUP_ENTRY + ID_LEN);
+				memcpy(c->id, old + i * PA5_DEDUP_ENTRY, ID_LEN);
+				kept[i] = (c->len < new_len) ? c->len : new_len;
+				want[i] = 1;
+			}
+		}
+
+		if ((res = batch_fetch(&b, n, want)) < 0)
+			goto out;
+
+		/* Build the new chunk images. */
+		for (i = 0; i < n; i++)
+		{
+			struct dedup_io *c = &b.ios[i];
+			off_t cstart = c->index * cs;
+
+			if (c->status < 0)
+			{
+				res = c->status;
+				goto out;
+			}
+
+			c->len = (new_size - cstart < (off_t)cs) ? (size_t)(new_size - cstart) : cs;
+			memset(c->pt + kept[i], 0, c->len - kept[i]);
+			if (buf && size > 0)
+			{
+				off_t lo = (offset > cstart) ? offset : cstart;
+				off_t hi = offset + (off_t)size;
+				if (hi > cstart + (off_t)c->len)
+					hi = cstart + c->len;
+				if (lo < hi)
+					memcpy(c->pt + (lo - cstart), buf + (lo - offset), hi - lo);
+			}
+		}
+
+		if ((res = batch_store(&b, n)) < 0)
+			goto out;
+
+		for (i = 0; i < n; i++)
+			entry_build(b.mkey, b.ios[i].index, b.ios[i].id, b.ios[i].len,
+				    b.ios[i].index == new_last, b.entries + i * PA5_DEDUP_ENTRY);
+		size_t len = (size_t)n * PA5_DEDUP_ENTRY;
+		if (pwrite(cf->fd, b.entries, len, PA5_CHUNK_HEADER + base * PA5_DEDUP_ENTRY) !=
+		    (ssize_t)len)
+		{
+			res = -EIO;
+			batch_unref(b.entries, n);
+			goto out;
+		}
+		pa5_stats_add(PA5_CTR_BACKING_WRITTEN, len);
+
+		batch_unref(old, nold);
+		for (i = 0; i < n; i++)
+			pa5_cache_put(cf->cache_id, b.ios[i].index, b.ios[i].pt, b.ios[i].len);
+	}
+
+	/* An old last chunk left alone is not the last any more. */
+	res = 0;
+	if (old_chunks > 0 && old_chunks - 1 < first && old_chunks - 1 != new_last)
+		res = manifest_mark(cf, b.mkey, old_chunks - 1, old_chunks - 1, 0);
+
+out:
+	batch_free(&b);
+	return res;
+}
+
+int pa5_dedup_write(const struct pa5_chunk_file *cf, const char *buf, size_t size,
+		    off_t offset)
+{
+	off_t old_size;
+	int res = pa5_dedup_size(cf, &old_size);
+	if (res < 0)
+		return res;
+	if (size == 0)
+		return 0;
+
+	off_t end = offset + (off_t)size;
+	off_t new_size = (end > old_size) ? end : old_size;
+	uint64_t first = ((offset < old_size) ? offset : old_size) / cf->chunk_size;
+	uint64_t last = (end - 1) / cf->chunk_size + 1;
+
+	res = dedup_rewrite(cf, old_size, new_size, first, last, buf, size, offset);
+	return (res < 0) ? res : (int)size;
+}
+
+int pa5_dedup_truncate(const struct pa5_chunk_file *cf, off_t size)
+{
+	unsigned char mkey[32];
+	unsigned char entries[PA5_CHUNK_BATCH * PA5_DEDUP_ENTRY];
+	uint64_t cs = cf->chunk_size;
+	off_t old_size;
+	uint64_t n = 0;
+	int res = pa5_dedup_size(cf, &old_size);
+	if (res < 0)
+		return res;
+
+	if (size > old_size)
+		return dedup_rewrite(cf, old_size, size, old_size / cs, (size - 1) / cs + 1,
+				     NULL, 0, 0);
+	if (size == old_size)
+		return 0;
+
+	/* Only a new partial last chunk has to be stored again. */
+	if (size % cs != 0 &&
+	    (res = dedup_rewrite(cf, old_size, size, size / cs, size / cs + 1, NULL, 0, 0)) < 0)
+		return res;
+
+	/* Cut the manifest from the end a batch at a time, dropping each
+	 * batch's references only once its entries are gone. */
+	uint64_t keep = (size + cs - 1) / cs;
+	if ((res = manifest_chunks(cf, &n)) < 0)
+		return res;
+	uint64_t last = n - 1;
+	manifest_key(cf, mkey);
+
+	/* A full new last chunk only needs its final mark. */
+	if (size % cs == 0 && keep > 0 && (res = manifest_mark(cf, mkey, keep - 1, last, 1)) < 0)
+		return res;
+
+	while (n > keep)
+	{
+		int batch = (n - keep < PA5_CHUNK_BATCH) ? (int)(n - keep) : PA5_CHUNK_BATCH;
+		if ((res = manifest_load(cf, mkey, n - batch, batch, last, entries)) < 0)
+			return res;
+		n -= batch;
+		if (ftruncate(cf->fd, PA5_CHUNK_HEADER + n * PA5_DEDUP_ENTRY) == -1)
+			return -errno;
+		batch_unref(entries, batch);
+	}
+	pa5_cache_drop(cf->cache_id, keep);
+	return 0;
+}
+
+void pa5_dedup_stats(FILE *out)
+{
+	pa5_mutex_lock(&store.lock, PA5_LOCK_DEDUP);
+	fprintf(out, "enabled %d\n", store.enabled);
+	if (store.ready)
+	{
+		uint64_t count = store.cur.count + store.old.count;
+		fprintf(out, "chunks %llu\n", (unsigned long long)count);
+		fprintf(out, "buckets %llu\n", (unsigned long long)store.cur.nbuckets);
+		fprintf(out, "load %.3f\n", (double)count / store.cur.nbuckets);
+		fprintf(out, "growing %llu\n", store.old.map ?
+			(unsigned long long)store.old.count : 0ULL);
+		fprintf(out, "packs %u\n", store.npacks);
+		fprintf(out, "hits %llu\n", store.hits);
+		fprintf(out, "misses %llu\n", store.misses);
+		fprintf(out, "freed %llu\n", store.freed);
+		fprintf(out, "bytes_saved %llu\n", store.saved);
+	}
+	pthread_mutex_unlock(&store.lock);
+}
@@ -0,0 +1,85 @@
+/* pa5-dedup.h
+ * Content-addressed chunk store for deduplicated files.
+ *
+ * A deduplicated file is a chunk file (see pa5-chunk.h) with
+ * PA5_CHUNK_FLAG_DEDUP set in its header. Its body holds no data, only a
+ * manifest with one entry per chunk:
+ *
+ *   entry i at PA5_CHUNK_HEADER + i * PA5_DEDUP_ENTRY
+ *     0   chunk id, HMAC-SHA256 of the plaintext under the volume dedup key
+ *     32  plaintext length, little endian
+ *     36  flags: 0x01 in the last entry of the manifest and no other
+ *     37  reserved, zero
+ *     48  HMAC-SHA256 of the index and bytes 0-47 under the file key,
+ *         first 16 bytes
+ *
+ * The final flag makes the manifest's length authentic, as the final mark
+ * of a slot does for other chunk files: a manifest cut short at an entry
+ * boundary ends in an unmarked entry and fails to read.
+ *
+ * The chunks themselves are kept once per distinct id in the store under
+ * PA5_DEDUP_DIR in the mirror root, with a reference count per chunk:
+ *
+ *   index       open addressed hash table of 64-byte buckets, mapped into
+ *               memory, so a lookup costs one probe however many chunks
+ *               the store holds; it doubles once it is three quarters full
+ *   index.new   the doubled table while the entries of index are moved
+ *               over a few at a time; it replaces index when they are all
+ *               across, and a mount that finds it finishes the move
+ *   pack.NNNNN  append-only chunk ciphertext, up to PA5_DEDUP_PACK_MAX bytes
+ *
+ * A bucket holds the leading 16 bytes of the id, the place of the chunk in
+ * the packs, its reference count, and its GCM tag, info word (as in
+ * pa5-chunk.h) and plaintext length. Chunks are sealed under the volume
+ * store key with the id as additional data and bytes 16-27 of the id as the
+ * nonce. The same id always encrypts the same plaintext, so the nonce is
+ * never reused for different data. Writing a chunk the store already has
+ * only takes a reference. Chunks start on 4 KiB boundaries, so when the
+ * last reference goes the chunk's blocks are punched out of its pack.
+ *
+ * All functions return 0 (or a byte count) on success and -errno on error.
+ */
+
+#ifndef PA5_DEDUP_H
+#define PA5_DEDUP_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "pa5-chunk.h"
+
+#define PA5_DEDUP_DIR ".pa5-dedup"
+#define PA5_DEDUP_VERSION 1
+#define PA5_DEDUP_ENTRY 64
+#define PA5_DEDUP_PACK_MAX (1LL << 30)
+
+/* int pa5_dedup_open(const char *rootdir, const struct pa5_keys *keys, int enable)
+ * Purpose: Open the chunk store of the mirror at rootdir so that
+ *          deduplicated files can be used. With enable set the store is
+ *          created if needed and new chunk files are deduplicated.
+ * Return: 0 on success, -ENOENT if there is no store and enable is 0
+ */
+int pa5_dedup_open(const char *rootdir, const struct pa5_keys *keys, int enable);
+
+/* Writes back and closes the store. */
+void pa5_dedup_close(void);
+
+/* Returns 1 once the store is open, and whether new files use it. */
+int pa5_dedup_ready(void);
+int pa5_dedup_enabled(void);
+
+/* Flushes the packs and the index to disk. */
+int pa5_dedup_sync(void);
+
+/* Chunk file operations for files with PA5_CHUNK_FLAG_DEDUP; pa5-chunk.c
+ * hands these over. Truncating to 0 drops every reference of the file. */
+int pa5_dedup_size(const struct pa5_chunk_file *cf, off_t *size);
+int pa5_dedup_read(const struct pa5_chunk_file *cf, char *buf, size_t size, off_t offset);
+int pa5_dedup_write(const struct pa5_chunk_file *cf, const char *buf, size_t size,
+		    off_t offset);
+int pa5_dedup_truncate(const struct pa5_chunk_file *cf, off_t size);
+
+/* Stats section with the size and hit rate of the store. */
+void pa5_dedup_stats(FILE *out);
+
+#endif
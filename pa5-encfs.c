@@ -12,13 +12,23 @@
 
   gcc -Wall `pkg-config fuse --cflags` fusexmp.c -o fusexmp `pkg-config fuse --libs`
 
-  Note: This implementation is largely stateless and does not maintain
-        open file handels between open and release calls (fi->fh).
-        Instead, files are opened and closed as necessary inside read(), write(),
-        etc calls. As such, the functions that rely on maintaining file handles are
-        not implmented (fgetattr(), etc). Those seeking a more efficient and
-        more complete implementation may wish to add fi->fh support to minimize
-        open() and close() calls and support fh dependent functions.
+  Note: Backing files are opened once in open()/create() and kept in a
+        pa5_file handle in fi->fh until release(). Backing reads and writes
+        go through the pa5-io engine, which batches chunk requests on
+        io_uring when the kernel supports it.
+
+  Copies: FUSE 2.8 has no copy_file_range operation, so cp and server-side
+        copies by NFS or SMB servers go through read() and write(). A copy
+        that skips the crypto is asked for by setting the user.pa5.copy
+        attribute (PA5_COPY_XATTR) of an existing destination file to the
+        path of the source below the mount root, such as "/dir/file", with
+        no terminating NUL. Plaintext and chunk files are then copied at the
+        backing store's speed without decrypting anything; other formats
+        are decrypted and encrypted again inside the daemon (copy_file()).
+        The call fails with EINVAL for a bad path or a copy onto itself and
+        EBUSY while the destination is open. The attribute can only be set:
+        it never shows in listings and reads as ENODATA. pa5-bulk copy sets
+        it for a source and destination given as paths in the mount.
 
 */
 
@@ -43,21 +53,113 @@
 #include <dirent.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/time.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <signal.h>
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
 
 #include "aes-crypt.h"
+#include "pa5-io.h"
+#include "pa5-cbc.h"
+#include "pa5-chunk.h"
+#include "pa5-cache.h"
+#include "pa5-inode.h"
+#include "pa5-migrate.h"
+#include "pa5-volume.h"
+#include "pa5-stats.h"
+#include "pa5-log.h"
+#include "pa5-trace.h"
+#include "pa5-pool.h"
+#include "pa5-compress.h"
+#include "pa5-dedup.h"
+#include "pa5-small.h"
+#include "pa5-stripe.h"
+#include "pa5-tier.h"
+#include "pa5-journal.h"
+#include "pa5-sched.h"
+#include "pa5-policy.h"
+#include "pa5-control.h"
+#include "pa5-mem.h"
+#include "pa5-warm.h"
+#include "pa5-lock.h"
+
+/* Names starting with this are internal to pa5-encfs: hidden from listings,
+ * and not found or made through the mount (see reserved()). */
+#define PA5_HIDDEN_PREFIX ".pa5-"
+
+/* Extended attributes the daemon keeps on backing files for itself. */
+#define PA5_XATTR_PREFIX "user.pa5."
+
+/* Setting this attribute copies a file inside the mount; see copy_file(). */
+#define PA5_COPY_XATTR "user.pa5.copy"
+#define COPY_BUFFER (1 << 20)
 
 struct pa5_state
 {
 	char *rootdir;
 	char *password;
+	struct pa5_cbc_key cbc_key;
+	struct pa5_keys keys;
+	int migrate;              /* Convert legacy files once they are released. */
+	unsigned migrate_scan;    /* Seconds between idle scans for legacy files. */
+	FILE *log_out;            /* Log stream, opened before fuse_main() changes directory. */
+	int trace_fd;             /* Trace file, or -1 when not tracing. */
+	uid_t admin_uid;          /* May use PA5_CONTROL_FILE, besides root. */
+	int oom_adj;              /* oom_score_adj the daemon runs with. */
 };
 #define STATE_DATA ((struct pa5_state *) fuse_get_context()->private_data)
 
+/* On-disk formats a backing file can be in. */
+enum pa5_format
+{
+	FORMAT_PLAIN,  /* Not encrypted. */
+	FORMAT_CBC,    /* Whole-file AES-256-CBC as written by do_crypt(). */
+	FORMAT_CHUNK,  /* Authenticated chunks, see pa5-chunk.h. */
+	FORMAT_STATS,  /* Snapshot of PA5_STATS_FILE, no backing file. */
+	FORMAT_SMALL,  /* In the small-file store, see pa5-small.h. */
+	FORMAT_CONTROL /* PA5_CONTROL_FILE, no backing file. */
+};
+
+/* Per-open state kept in fi->fh. */
+struct pa5_file
+{
+	int fd;
+	enum pa5_format format;
+	dev_t dev;
+	ino_t ino;
+	pthread_rwlock_t *lock;
+	struct pa5_chunk_file chunk;
+	char *text;       /* FORMAT_STATS and FORMAT_CONTROL contents. */
+	size_t text_len;
+	struct pa5_small *small;  /* FORMAT_SMALL file. */
+	int small_handle; /* Opened on a small file, which may since have moved. */
+	int flags;        /* Open flags, for moving to the promoted file. */
+};
+
+/* Copies made with PA5_COPY_XATTR, by how the data was copied. */
+static struct
+{
+	uint64_t cloned;    /* Chunk files, without any crypto. */
+	uint64_t plain;
+	uint64_t through;   /* Decrypted and encrypted again. */
+} copies;
+
+/* Write locked to move a small file handle to its promoted backing file. */
+static pthread_rwlock_t small_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static struct pa5_pool file_pool = PA5_POOL_INIT("file", sizeof(struct pa5_file), 64, 16);
+
 /* Helper Functions */
+static struct pa5_file *get_file(struct fuse_file_info *fi)
+{
+	return (struct pa5_file *)(uintptr_t)fi->fh;
+}
+
 static void get_full_path(char fpath[512], const char *path)
 {
 	strcpy(fpath, STATE_DATA->rootdir);
@@ -73,10 +175,453 @@ static int add_encrypted_flag(const char* path)
 /* Gets the encryped status of the file, returns 1 if encrypted, 0 otherwise. */
 static int is_encrypted(const char* path)
 {
-	char value[5];
+	char value[5] = { 0 };
 	getxattr(path, "user.encrypted", value, 5);
 	return (strcmp(value, "true") == 0);
 }
+
+static int is_stats_file(const char *path)
+{
+	return (strcmp(path, PA5_STATS_FILE) == 0);
+}
+
+static int is_control_file(const char *path)
+{
+	return (strcmp(path, PA5_CONTROL_FILE) == 0);
+}
+
+/* Returns err if a component of path is one of the daemon's own names, such
+ * as the volume key, the stores or the journal in the mirror root, which
+ * must not be reached or made through the mount; 0 otherwise. */
+static int reserved(const char *path, int err)
+{
+	const char *p = path;
+
+	while ((p = strchr(p, '/')) != NULL)
+	{
+		p++;
+		if (strncmp(p, PA5_HIDDEN_PREFIX, strlen(PA5_HIDDEN_PREFIX)) == 0)
+			return err;
+	}
+	return 0;
+}
+
+/* For rename() and link(): from is looked up, to is made. */
+static int reserved_pair(const char *from, const char *to)
+{
+	int res = reserved(from, -ENOENT);
+	return res ? res : reserved(to, -EPERM);
+}
+
+/* Whether the caller may open PA5_CONTROL_FILE. */
+static int is_admin(void)
+{
+	uid_t uid = fuse_get_context()->uid;
+	return (uid == 0 || uid == STATE_DATA->admin_uid);
+}
+
+/* Opens the backing file of an encrypted file and works out its format from
+ * the header version, falling back to whole-file CBC for files without one.
+ * Its contents are rewritten in place, so it needs read access even when
+ * opened write only, and O_APPEND must not reach the ciphertext. Empty files
+ * opened for writing are given a fresh chunk header, whose chunks use codec
+ * (see pa5_chunk_create()). The handle is counted in pa5-inode until
+ * file_close(). */
+static int open_encrypted(const char *fpath, int flags, int codec, struct pa5_file *file)
+{
+	int res = 0;
+	int version;
+	struct stat st;
+
+	for (;;)
+	{
+		file->fd = open(fpath, (flags & ~(O_APPEND | O_ACCMODE)) | O_RDWR);
+		if (file->fd == -1 && errno == EACCES && (flags & O_ACCMODE) == O_RDONLY)
+			file->fd = open(fpath, flags & ~O_APPEND);
+		if (file->fd == -1)
+			return -errno;
+		if (fstat(file->fd, &st) == -1)
+		{
+			res = -errno;
+			close(file->fd);
+			return res;
+		}
+
+		file->dev = st.st_dev;
+		file->ino = st.st_ino;
+		file->lock = pa5_inode_lock(st.st_dev, st.st_ino);
+		pa5_rwlock_wrlock(file->lock, PA5_LOCK_INODE);
+
+		/* A migration may have renamed a new file over this one while we
+		 * waited for the lock; if so, open the new one instead. */
+		if (fstat(file->fd, &st) == 0 && st.st_nlink > 0)
+			break;
+		pthread_rwlock_unlock(file->lock);
+		close(file->fd);
+	}
+
+	pa5_inode_get(file->dev, file->ino);
+	file->format = FORMAT_CBC;
+	version = pa5_chunk_probe(file->fd);
+	if (version == PA5_CHUNK_VERSION)
+	{
+		file->format = FORMAT_CHUNK;
+		res = pa5_chunk_open(file->fd, &STATE_DATA->keys, &file->chunk);
+		if (res < 0)
+			pa5_error("Could not verify the header of %s: %d.", fpath, res);
+		else
+			pa5_warm_note(&file->chunk, file->ino);
+	}
+	else if (version > PA5_CHUNK_VERSION)
+	{
+		pa5_error("%s uses unknown format version %d.", fpath, version);
+		res = -EIO;
+	}
+	else if (st.st_size == 0 && (flags & O_ACCMODE) != O_RDONLY)
+	{
+		file->format = FORMAT_CHUNK;
+		res = pa5_chunk_create(file->fd, &STATE_DATA->keys, codec, &file->chunk);
+		if (res == 0)
+			pa5_warm_note(&file->chunk, file->ino);
+	}
+	pthread_rwlock_unlock(file->lock);
+
+	if (res < 0)
+	{
+		pa5_inode_put(file->dev, file->ino);
+		close(file->fd);
+	}
+	return res;
+}
+
+/* Opens the backing file for fpath into file. */
+static int file_open(const char *fpath, int flags, struct pa5_file *file)
+{
+	if (is_encrypted(fpath))
+		return open_encrypted(fpath, flags, PA5_CHUNK_CODEC_MOUNT, file);
+
+	file->format = FORMAT_PLAIN;
+	file->fd = open(fpath, flags);
+	if (file->fd == -1)
+		return -errno;
+
+	return 0;
+}
+
+/* Chunk files whose chunks live outside their backing file. */
+#define CHUNK_FLAGS_ELSEWHERE (PA5_CHUNK_FLAG_DEDUP | PA5_CHUNK_FLAG_STRIPE)
+
+static int chunks_elsewhere(const struct pa5_chunk_file *cf)
+{
+	return (cf->flags & CHUNK_FLAGS_ELSEWHERE) || cf->tier;
+}
+
+/* Drops the store references of a deduplicated file, or the stripe and
+ * tier files of another, whose last link is gone, once no handle is left
+ * on it. Called with the inode lock held, so that only the last of
+ * unlink() and the final close does it. */
+static void chunks_release(int fd, dev_t dev, ino_t ino)
+{
+	struct pa5_chunk_file cf;
+	struct stat st;
+
+	if (fstat(fd, &st) == 0 && st.st_nlink == 0 && !pa5_inode_busy(dev, ino) &&
+	    pa5_chunk_open(fd, &STATE_DATA->keys, &cf) == 0)
+	{
+		if (chunks_elsewhere(&cf))
+			pa5_chunk_truncate(&cf, 0);
+		pa5_chunk_close(&cf);
+	}
+}
+
+static void file_close(struct pa5_file *file)
+{
+	if (file->format == FORMAT_STATS || file->format == FORMAT_CONTROL)
+	{
+		free(file->text);
+		return;
+	}
+	if (file->format == FORMAT_SMALL)
+	{
+		pa5_small_put(file->small);
+		return;
+	}
+	if (file->format == FORMAT_CHUNK && chunks_elsewhere(&file->chunk))
+	{
+		pa5_rwlock_wrlock(file->lock, PA5_LOCK_INODE);
+		pa5_inode_put(file->dev, file->ino);
+		chunks_release(file->fd, file->dev, file->ino);
+		pthread_rwlock_unlock(file->lock);
+	}
+	else if (file->format != FORMAT_PLAIN)
+		pa5_inode_put(file->dev, file->ino);
+	if (file->format == FORMAT_CHUNK)
+		pa5_chunk_close(&file->chunk);
+	close(file->fd);
+}
+
+/* Unlinks fpath, or renames from over it when from is set. A deduplicated,
+ * striped or tiered file that loses its last link gives up its chunks
+ * elsewhere. */
+static int remove_backing(const char *from, const char *fpath)
+{
+	pthread_rwlock_t *lock = NULL;
+	struct stat st;
+	int fd = -1;
+	int res;
+
+	if ((pa5_dedup_ready() || pa5_stripe_enabled() || pa5_tier_ready()) &&
+	    lstat(fpath, &st) == 0 &&
+	    S_ISREG(st.st_mode) &&
+	    is_encrypted(fpath) && (fd = open(fpath, O_RDWR)) != -1 &&
+	    fstat(fd, &st) == 0)
+	{
+		lock = pa5_inode_lock(st.st_dev, st.st_ino);
+		pa5_rwlock_wrlock(lock, PA5_LOCK_INODE);
+	}
+
+	res = from ? rename(from, fpath) : unlink(fpath);
+	res = (res == -1) ? -errno : 0;
+
+	if (lock)
+	{
+		if (res == 0)
+			chunks_release(fd, st.st_dev, st.st_ino);
+		pthread_rwlock_unlock(lock);
+	}
+	if (fd != -1)
+		close(fd);
+	return res;
+}
+
+/* Gives the new, empty backing file fpath the format the policy action
+ * asks for. A file with a codec of its own gets its chunk header now, so
+ * that the choice sticks; others get it on their first open for writing. */
+static int policy_apply(const char *fpath, enum pa5_policy_action action)
+{
+	struct pa5_file file;
+	int res;
+
+	if (action == PA5_POLICY_PLAIN)
+	{
+		if (removexattr(fpath, "user.encrypted") == -1 && errno != ENODATA)
+			return -errno;
+		return 0;
+	}
+	add_encrypted_flag(fpath);
+	if (action == PA5_POLICY_DEFAULT)
+		return 0;
+
+	if ((res = open_encrypted(fpath, O_RDWR, pa5_policy_codec(action), &file)) < 0)
+		return res;
+	file_close(&file);
+	return 0;
+}
+
+/* Verifies the plaintext size of file and remembers it for getattr. */
+static int file_size(struct pa5_file *file, off_t *size)
+{
+	struct stat st;
+	int res;
+
+	pa5_rwlock_rdlock(file->lock, PA5_LOCK_INODE);
+	if (file->format == FORMAT_CHUNK)
+		res = pa5_chunk_verify_size(&file->chunk, size);
+	else
+		res = pa5_cbc_size(file->fd, &STATE_DATA->cbc_key, size);
+	if (res == 0 && fstat(file->fd, &st) == 0)
+		pa5_inode_size_set(&st, *size);
+	pthread_rwlock_unlock(file->lock);
+
+	return res;
+}
+
+/* Updates the remembered size of file after a write or truncate that
+ * returned res. Legacy files are only forgotten, as their size costs a
+ * decryption. Called with the inode lock held. */
+static void size_note(struct pa5_file *file, int res)
+{
+	struct stat st;
+	off_t size;
+
+	if (res >= 0 && file->format == FORMAT_CHUNK && fstat(file->fd, &st) == 0 &&
+	    pa5_chunk_size(&file->chunk, &size) == 0)
+		pa5_inode_size_set(&st, size);
+	else
+		pa5_inode_size_drop(file->dev, file->ino);
+}
+
+static int file_truncate(struct pa5_file *file, off_t size)
+{
+	int res;
+
+	if (file->format == FORMAT_STATS)
+		return -EACCES;
+	if (file->format == FORMAT_CONTROL)
+		return 0;
+	if (file->format == FORMAT_PLAIN)
+		return (ftruncate(file->fd, size) == -1) ? -errno : 0;
+
+	pa5_rwlock_wrlock(file->lock, PA5_LOCK_INODE);
+	if (file->format == FORMAT_CHUNK)
+		res = pa5_chunk_truncate(&file->chunk, size);
+	else
+		res = pa5_cbc_truncate(file->fd, &STATE_DATA->cbc_key, size);
+	size_note(file, res);
+	pthread_rwlock_unlock(file->lock);
+
+	return res;
+}
+
+static int small_exists(const char *path)
+{
+	struct stat st;
+	return pa5_small_ready() && pa5_small_stat(path, &st) == 0;
+}
+
+/* Small files have no backing file for open() to check, so their mode is
+ * checked here the way the mirror would check it for the daemon. */
+static int small_access(const struct stat *st, int mask)
+{
+	mode_t bits = st->st_mode;
+
+	if (getuid() == 0)
+		return 0;
+	if (st->st_uid == getuid())
+		bits >>= 6;
+	else if (st->st_gid == getgid())
+		bits >>= 3;
+	if (((mask & R_OK) && !(bits & 4)) || ((mask & W_OK) && !(bits & 2)) ||
+	    ((mask & X_OK) && !(bits & 1)))
+		return -EACCES;
+	return 0;
+}
+
+/* Creates the backing file of a small file that is leaving the store, in
+ * the format the policy picks for it now that its size is known. */
+static int small_export(void *arg, const char *data, const struct stat *st)
+{
+	const char *fpath = arg;
+	struct pa5_file file;
+	struct timeval tv[2];
+	int res;
+
+	enum pa5_policy_action action =
+		pa5_policy_decide(fpath + strlen(STATE_DATA->rootdir), fuse_get_context()->uid,
+				  st->st_size);
+	int fd = open(fpath, O_CREAT | O_EXCL | O_WRONLY, 0600);
+	if (fd == -1)
+		return -errno;
+
+	if (action == PA5_POLICY_PLAIN)
+	{
+		res = (st->st_size > 0 && pwrite(fd, data, st->st_size, 0) != st->st_size) ? -EIO : 0;
+		close(fd);
+	}
+	else
+	{
+		close(fd);
+		add_encrypted_flag(fpath);
+		res = open_encrypted(fpath, O_RDWR, pa5_policy_codec(action), &file);
+	}
+	if (res == 0 && action != PA5_POLICY_PLAIN)
+	{
+		pa5_rwlock_wrlock(file.lock, PA5_LOCK_INODE);
+		if (st->st_size > 0 && (res = pa5_chunk_write(&file.chunk, data, st->st_size, 0)) > 0)
+			res = 0;
+		pthread_rwlock_unlock(file.lock);
+		file_close(&file);
+	}
+	if (res < 0)
+	{
+		unlink(fpath);
+		return res;
+	}
+
+	tv[0].tv_sec = st->st_atime;
+	tv[0].tv_usec = 0;
+	tv[1].tv_sec = st->st_mtime;
+	tv[1].tv_usec = 0;
+	if (lchown(fpath, st->st_uid, st->st_gid) == -1 && errno != EPERM)
+		pa5_warn("Could not set the owner of %s: %d.", fpath, -errno);
+	chmod(fpath, st->st_mode & 07777);
+	utimes(fpath, tv);
+	return 0;
+}
+
+/* Moves a small file out of the store to a backing file of its own, when
+ * it outgrows the store or needs something only a real file has. */
+static int promote_small(const char *path, struct pa5_small *small)
+{
+	char fpath[512] = { 0 };
+	get_full_path(fpath, path);
+
+	int res = pa5_small_promote(small, small_export, fpath);
+	if (res < 0)
+		pa5_error("Could not promote small file %s: %d.", path, res);
+	return res;
+}
+
+static int promote_path(const char *path)
+{
+	struct pa5_small *small;
+	int res;
+
+	if (!pa5_small_ready() || (res = pa5_small_get(path, &small)) == -ENOENT)
+		return 0;
+	if (res < 0)
+		return res;
+	res = promote_small(path, small);
+	pa5_small_put(small);
+	return res;
+}
+
+/* Moves a handle whose small file was promoted to the new backing file.
+ * Called with small_lock write locked. */
+static int small_switch(const char *path, struct pa5_file *file)
+{
+	struct pa5_small *small = file->small;
+	char fpath[512] = { 0 };
+	int res;
+
+	get_full_path(fpath, path);
+	if ((res = file_open(fpath, file->flags, file)) < 0)
+	{
+		file->format = FORMAT_SMALL;
+		file->small = small;
+		return res;
+	}
+	pa5_small_put(small);
+	return 0;
+}
+
+/* Handles opened on a small file run their operations under small_lock.
+ * Returns 1 with small_lock read locked while the handle is on the store,
+ * 0 once it is on a backing file, or -errno. */
+static int small_enter(const char *path, struct pa5_file *file)
+{
+	int res;
+
+	if (!file->small_handle)
+		return 0;
+	for (;;)
+	{
+		pa5_rwlock_rdlock(&small_lock, PA5_LOCK_SMALL_HANDLE);
+		if (file->format != FORMAT_SMALL)
+			break;
+		if (!pa5_small_promoted(file->small))
+			return 1;
+		pthread_rwlock_unlock(&small_lock);
+
+		pa5_rwlock_wrlock(&small_lock, PA5_LOCK_SMALL_HANDLE);
+		res = (file->format == FORMAT_SMALL) ? small_switch(path, file) : 0;
+		pthread_rwlock_unlock(&small_lock);
+		if (res < 0)
+			return res;
+	}
+	pthread_rwlock_unlock(&small_lock);
+	return 0;
+}
 /* ================================ */
 
 static int xmp_getattr(const char *path, struct stat *stbuf)
@@ -85,19 +630,71 @@ static int xmp_getattr(const char *path, struct stat *stbuf)
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
+	if (is_stats_file(path))
+	{
+		/* Size 0 with direct I/O, as the contents change on every open. */
+		memset(stbuf, 0, sizeof(*stbuf));
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_uid = getuid();
+		stbuf->st_gid = getgid();
+		stbuf->st_mtime = stbuf->st_ctime = stbuf->st_atime = time(NULL);
+		return 0;
+	}
+	if (is_control_file(path))
+	{
+		memset(stbuf, 0, sizeof(*stbuf));
+		stbuf->st_mode = S_IFREG | 0600;
+		stbuf->st_nlink = 1;
+		stbuf->st_uid = STATE_DATA->admin_uid;
+		stbuf->st_gid = getgid();
+		stbuf->st_mtime = stbuf->st_ctime = stbuf->st_atime = time(NULL);
+		return 0;
+	}
+	if (pa5_small_ready() && pa5_small_stat(path, stbuf) == 0)
+		return 0;
+
 	res = lstat(fpath, stbuf);
 	if (res == -1)
 		return -errno;
 
+	/* Report the plaintext length of encrypted files, and fail for one whose
+	 * header or length does not verify. The length is only worked out again
+	 * once the backing file has changed. */
+	if (S_ISREG(stbuf->st_mode) && stbuf->st_size > 0 && is_encrypted(fpath))
+	{
+		struct pa5_file file;
+		off_t size;
+
+		if (!pa5_inode_size_get(stbuf, &size))
+		{
+			if ((res = open_encrypted(fpath, O_RDONLY, PA5_CHUNK_CODEC_MOUNT, &file)) < 0)
+				return res;
+			res = file_size(&file, &size);
+			file_close(&file);
+			if (res < 0)
+				return res;
+		}
+		stbuf->st_size = size;
+	}
+
 	return 0;
 }
 
 static int xmp_access(const char *path, int mask)
 {
 	int res;
+	struct stat st;
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
+	if (is_stats_file(path))
+		return (mask & (W_OK | X_OK)) ? -EACCES : 0;
+	if (is_control_file(path))
+		return (!is_admin() || (mask & X_OK)) ? -EACCES : 0;
+	if (pa5_small_ready() && pa5_small_stat(path, &st) == 0)
+		return small_access(&st, mask);
+
 	res = access(fpath, mask);
 	if (res == -1)
 		return -errno;
@@ -119,6 +716,20 @@ static int xmp_readlink(const char *path, char *buf, size_t size)
 	return 0;
 }
 
+struct small_fill
+{
+	void *buf;
+	fuse_fill_dir_t filler;
+};
+
+static int small_fill(void *arg, const char *name, const struct stat *st)
+{
+	struct small_fill *fill = arg;
+
+	if (strncmp(name, PA5_HIDDEN_PREFIX, strlen(PA5_HIDDEN_PREFIX)) == 0)
+		return 0;
+	return fill->filler(fill->buf, name, st, 0);
+}
 
 static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi)
@@ -138,6 +749,8 @@ static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 	while ((de = readdir(dp)) != NULL) {
 		struct stat st;
+		if (strncmp(de->d_name, PA5_HIDDEN_PREFIX, strlen(PA5_HIDDEN_PREFIX)) == 0)
+			continue;
 		memset(&st, 0, sizeof(st));
 		st.st_ino = de->d_ino;
 		st.st_mode = de->d_type << 12;
@@ -146,6 +759,12 @@ static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	}
 
 	closedir(dp);
+
+	if (pa5_small_ready())
+	{
+		struct small_fill fill = { buf, filler };
+		pa5_small_list(path, small_fill, &fill);
+	}
 	return 0;
 }
 
@@ -156,6 +775,9 @@ static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
+	if (small_exists(path))
+		return -EEXIST;
+
 	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
 	   is more portable */
 	if (S_ISREG(mode)) {
@@ -169,6 +791,13 @@ static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
 	if (res == -1)
 		return -errno;
 
+	/* Regular files get the format the policy picks, as in create(). */
+	if (S_ISREG(mode) &&
+	    (res = policy_apply(fpath, pa5_policy_decide(path, fuse_get_context()->uid, 0))) < 0)
+	{
+		unlink(fpath);
+		return res;
+	}
 	return 0;
 }
 
@@ -178,6 +807,9 @@ static int xmp_mkdir(const char *path, mode_t mode)
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
+	if (small_exists(path))
+		return -EEXIST;
+
 	res = mkdir(fpath, mode);
 	if (res == -1)
 		return -errno;
@@ -188,15 +820,20 @@ static int xmp_mkdir(const char *path, mode_t mode)
 static int xmp_unlink(const char *path)
 {
 	int res;
-
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
-	res = unlink(fpath);
-	if (res == -1)
-		return -errno;
+	if (pa5_small_ready() && (res = pa5_small_unlink(path)) != -ENOENT)
+		return res;
 
-	return 0;
+	/* The journal names files by path, so one that keeps other links
+	 * must not lose its records along with this one. */
+	struct stat st;
+	if (pa5_journal_ready() && lstat(fpath, &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_nlink > 1 && (res = pa5_journal_moving(path)) < 0)
+		return res;
+
+	return remove_backing(NULL, fpath);
 }
 
 static int xmp_rmdir(const char *path)
@@ -206,6 +843,10 @@ static int xmp_rmdir(const char *path)
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
+	/* Small files do not show up in the mirror directory itself. */
+	if (pa5_small_ready() && pa5_small_has_files(path))
+		return -ENOTEMPTY;
+
 	res = rmdir(fpath);
 	if (res == -1)
 		return -errno;
@@ -221,6 +862,9 @@ static int xmp_symlink(const char *from, const char *to)
 	get_full_path(fpath, from);
 	get_full_path(tpath, to);
 
+	if (small_exists(to))
+		return -EEXIST;
+
 	res = symlink(fpath, tpath);
 	if (res == -1)
 		return -errno;
@@ -230,16 +874,47 @@ static int xmp_symlink(const char *from, const char *to)
 
 static int xmp_rename(const char *from, const char *to)
 {
+	struct stat st;
 	int res;
 	char fpath[512] = { 0 };
 	char tpath[512] = { 0 };
 	get_full_path(fpath, from);
 	get_full_path(tpath, to);
 
-	res = rename(fpath, tpath);
-	if (res == -1)
-		return -errno;
+	if ((res = pa5_journal_moving(from)) < 0)
+		return res;
+	if (!pa5_small_ready())
+		return remove_backing(fpath, tpath);
+
+	/* A small file only moves in the store, after whatever the mirror
+	 * has at the target makes way for it. */
+	if (small_exists(from))
+	{
+		if (lstat(tpath, &st) == 0)
+		{
+			if (S_ISDIR(st.st_mode))
+				return -EISDIR;
+			if ((res = remove_backing(NULL, tpath)) < 0)
+				return res;
+		}
+		return pa5_small_rename(from, to);
+	}
 
+	int dir = (lstat(fpath, &st) == 0 && S_ISDIR(st.st_mode));
+	if (dir)
+	{
+		if (small_exists(to))
+			return -ENOTDIR;
+		if (pa5_small_has_files(to))
+			return -ENOTEMPTY;
+	}
+	if ((res = remove_backing(fpath, tpath)) < 0)
+		return res;
+
+	/* The files of a renamed directory move with it. */
+	pa5_small_unlink(to);
+	if (dir)
+		return pa5_small_rename_dir(from, to);
 	return 0;
 }
 
@@ -251,6 +926,11 @@ static int xmp_link(const char *from, const char *to)
 	get_full_path(fpath, from);
 	get_full_path(tpath, to);
 
+	if (small_exists(to))
+		return -EEXIST;
+	if ((res = promote_path(from)) < 0)
+		return res;
+
 	res = link(fpath, tpath);
 	if (res == -1)
 		return -errno;
@@ -265,6 +945,9 @@ static int xmp_chmod(const char *path, mode_t mode)
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
+	if (pa5_small_ready() && (res = pa5_small_chmod(path, mode)) != -ENOENT)
+		return res;
+
 	res = chmod(fpath, mode);
 	if (res == -1)
 		return -errno;
@@ -279,6 +962,9 @@ static int xmp_chown(const char *path, uid_t uid, gid_t gid)
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
+	if (pa5_small_ready() && (res = pa5_small_chown(path, uid, gid)) != -ENOENT)
+		return res;
+
 	res = lchown(fpath, uid, gid);
 	if (res == -1)
 		return -errno;
@@ -289,10 +975,36 @@ static int xmp_chown(const char *path, uid_t uid, gid_t gid)
 static int xmp_truncate(const char *path, off_t size)
 {
 	int res;
+	struct pa5_small *small;
 
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
+	/* Opening PA5_CONTROL_FILE with O_TRUNC to write it truncates it. */
+	if (is_control_file(path))
+		return is_admin() ? 0 : -EACCES;
+	if (pa5_small_ready() && pa5_small_get(path, &small) == 0)
+	{
+		res = pa5_small_truncate(small, size);
+		int promoted = (res == -ESTALE ||
+				(res == -EFBIG && (res = promote_small(path, small)) == 0));
+		pa5_small_put(small);
+		if (!promoted)
+			return res;
+	}
+
+	if (is_encrypted(fpath))
+	{
+		struct pa5_file file;
+		res = open_encrypted(fpath, O_WRONLY, PA5_CHUNK_CODEC_MOUNT, &file);
+		if (res < 0)
+			return res;
+
+		res = file_truncate(&file, size);
+		file_close(&file);
+		return res;
+	}
+
 	res = truncate(fpath, size);
 	if (res == -1)
 		return -errno;
@@ -308,6 +1020,9 @@ static int xmp_utimens(const char *path, const struct timespec ts[2])
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
+	if (pa5_small_ready() && (res = pa5_small_utimens(path, ts)) != -ENOENT)
+		return res;
+
 	tv[0].tv_sec = ts[0].tv_sec;
 	tv[0].tv_usec = ts[0].tv_nsec / 1000;
 	tv[1].tv_sec = ts[1].tv_sec;
@@ -320,96 +1035,174 @@ static int xmp_utimens(const char *path, const struct timespec ts[2])
 	return 0;
 }
 
-static int xmp_open(const char *path, struct fuse_file_info *fi)
+/* Opens the backing file and attaches a pa5_file handle to fi->fh. */
+static int open_file(const char *fpath, int flags, struct fuse_file_info *fi)
 {
-	int res;
+	struct pa5_file *file = pa5_pool_get(&file_pool);
+	if (!file)
+		return -ENOMEM;
 
-	char fpath[512] = { 0 };
-	get_full_path(fpath, path);
-
-	res = open(fpath, fi->flags);
-	if (res == -1)
-		return -errno;
+	int res = file_open(fpath, flags, file);
+	if (res < 0)
+	{
+		pa5_pool_put(&file_pool, file);
+		return res;
+	}
 
-	close(res);
+	file->small_handle = 0;
+	file->flags = flags;
+	fi->fh = (uintptr_t)file;
 	return 0;
 }
 
-static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+/* Attaches a handle on an open small file to fi->fh. */
+static int open_small(struct pa5_small *small, int flags, struct fuse_file_info *fi)
 {
-	int res;
+	struct pa5_file *file = pa5_pool_get(&file_pool);
+	if (!file)
+	{
+		pa5_small_put(small);
+		return -ENOMEM;
+	}
 
+	memset(file, 0, sizeof(*file));
+	file->format = FORMAT_SMALL;
+	file->fd = -1;
+	file->small = small;
+	file->small_handle = 1;
+	file->flags = flags;
+	fi->fh = (uintptr_t)file;
+	return 0;
+}
+
+/* Renders the stats snapshot once per open, so a reader sees one
+ * consistent copy however it splits its reads. */
+static int open_stats(struct fuse_file_info *fi)
+{
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	struct pa5_file *file = pa5_pool_get(&file_pool);
+	if (!file)
+		return -ENOMEM;
+
+	memset(file, 0, sizeof(*file));
+	file->format = FORMAT_STATS;
+	file->fd = -1;
+	int res = pa5_stats_format(&file->text, &file->text_len);
+	if (res < 0)
+	{
+		pa5_pool_put(&file_pool, file);
+		return res;
+	}
+
+	fi->direct_io = 1;
+	fi->fh = (uintptr_t)file;
+	return 0;
+}
+
+/* Renders the settings once per open like open_stats(). Writes are applied
+ * as they come, each on its own. */
+static int open_control(struct fuse_file_info *fi)
+{
+	if (!is_admin())
+		return -EACCES;
+
+	struct pa5_file *file = pa5_pool_get(&file_pool);
+	if (!file)
+		return -ENOMEM;
+
+	memset(file, 0, sizeof(*file));
+	file->format = FORMAT_CONTROL;
+	file->fd = -1;
+	int res = pa5_control_format(&file->text, &file->text_len);
+	if (res < 0)
+	{
+		pa5_pool_put(&file_pool, file);
+		return res;
+	}
+
+	fi->direct_io = 1;
+	fi->fh = (uintptr_t)file;
+	return 0;
+}
+
+static int xmp_open(const char *path, struct fuse_file_info *fi)
+{
+	struct pa5_small *small;
+	struct stat st;
+	int res;
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
-	char tmppath[512] = { 0 };
-	get_full_path(tmppath, "/.xmp_crypt_tmp");
 
-	(void) fi;
+	if (is_stats_file(path))
+		return open_stats(fi);
+	if (is_control_file(path))
+		return open_control(fi);
 
-	if (is_encrypted(fpath))
+	if (pa5_small_ready() && pa5_small_stat(path, &st) == 0)
 	{
-		FILE *in = fopen(fpath, "rb");
-		if (!in)
-		{
-			printf("ERROR: Could not open file for reading: %d.\n", -errno);
-			return -errno;
-		}
-		FILE *tmp = fopen(tmppath, "w");
-		if (!tmp)
-		{
-			fclose(in);
-			printf("ERROR: Could not open temporary decryption file: %d.\n", -errno);
-			return -errno;
-		}
+		int acc = fi->flags & O_ACCMODE;
+		int mask = (acc == O_RDONLY) ? R_OK : (acc == O_WRONLY) ? W_OK : R_OK | W_OK;
+		if ((res = small_access(&st, mask)) < 0)
+			return res;
+		if ((res = pa5_small_get(path, &small)) == 0)
+			return open_small(small, fi->flags, fi);
+		if (res != -ENOENT)
+			return res;
+	}
 
-		fseek(in, 0L, SEEK_END);
-		int sz = ftell(in); /* Get the file size, if there is nothing, then dont decrypt it. */
-		fseek(in, 0L, SEEK_SET);
-		if (sz != 0 && !do_crypt(in, tmp, 0, STATE_DATA->password))
-		{
-			fclose(in);
-			fclose(tmp);
-			printf("ERROR: do_crypt failed to decrypt a file: %d.\n", -errno);
-			remove(tmppath);
-			return -errno;
-		}
+	return open_file(fpath, fi->flags, fi);
+}
 
-		fclose(in);
-		fseek(tmp, 0L, SEEK_SET);
-		fclose(tmp);
+static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	int res;
+	struct pa5_file *file = get_file(fi);
 
-		int fd = open(tmppath, O_RDONLY);
-		if (fd == -1)
-		{
-			printf("ERROR: Could not open temporary decryption file for readback: %d.\n", -errno);
-			remove(tmppath);
-			return -errno;
-		}
+	if (file->format == FORMAT_STATS || file->format == FORMAT_CONTROL)
+	{
+		if (offset >= (off_t)file->text_len)
+			return 0;
+		if (size > file->text_len - offset)
+			size = file->text_len - offset;
+		memcpy(buf, file->text + offset, size);
+		return size;
+	}
 
-		res = pread(fd, buf, size, offset);
-		if (res == -1)
-			res = -errno;
+	pa5_migrate_activity();
+	while ((res = small_enter(path, file)) == 1)
+	{
+		res = pa5_small_read(file->small, buf, size, offset);
+		pthread_rwlock_unlock(&small_lock);
+		if (res != -ESTALE)
+			goto out;
+	}
+	if (res < 0)
+		return res;
 
-		close(fd);
-		remove(tmppath);
+	if (file->format != FORMAT_PLAIN)
+	{
+		pa5_rwlock_rdlock(file->lock, PA5_LOCK_INODE);
+		if (file->format == FORMAT_CHUNK)
+			res = pa5_chunk_read(&file->chunk, buf, size, offset);
+		else
+			res = pa5_cbc_read(file->fd, &STATE_DATA->cbc_key, buf, size, offset);
+		pthread_rwlock_unlock(file->lock);
+		if (res < 0)
+			pa5_error("Could not decrypt file for reading: %d.", res);
 	}
 	else
 	{
-		int fd = open(fpath, O_RDONLY);
-		if (fd == -1)
-		{
-			printf("ERROR: Could not open file for reading: %d.\n", -errno);
-			return -errno;
-		}
-
-		res = pread(fd, buf, size, offset);
+		res = pread(file->fd, buf, size, offset);
 		if (res == -1)
 			res = -errno;
-
-		close(fd);
 	}
 
+out:
+	if (res > 0)
+		pa5_stats_add(PA5_CTR_BYTES_OUT, res);
 	return res;
 }
 
@@ -417,95 +1210,51 @@ static int xmp_write(const char *path, const char *buf, size_t size,
 		     off_t offset, struct fuse_file_info *fi)
 {
 	int res;
+	struct pa5_file *file = get_file(fi);
 
-	char fpath[512] = { 0 };
-	get_full_path(fpath, path);
-	char tmppath[512] = { 0 };
-	get_full_path(tmppath, "/.xmp_crypt_tmp");
-
-	(void) fi;
-
-	if (is_encrypted(fpath))
+	if (file->format == FORMAT_CONTROL)
 	{
-		FILE *tmp = fopen(tmppath, "w+");
-		if (!tmp)
-		{
-			printf("Could not open temp file to write to: %d.\n", errno);
-			return -errno;
-		}
-
-		FILE *out = fopen(fpath, "rb");
-		if (!out)
-		{
-			fclose(tmp);
-			printf("Could not open file for reading in existing data: %d.\n", errno);
-			return -errno;
-		}
-		fseek(out, 0L, SEEK_END);
-		int len = ftell(out);
-		printf("DEBUG: reporting length of %d\n", len);
-		fseek(out, 0L, SEEK_SET);
-		if (len > 0) /* If there is already existing data. */
-		{
-			if (!do_crypt(out, tmp, 0, STATE_DATA->password))
-			{
-				fclose(tmp);
-				fclose(out);
-				remove(tmppath);
-				printf("Failed to decrypt existing data: %d.\n", errno);
-				return -errno;
-			}
-		}
-		fseek(tmp, len, SEEK_SET);
-		fputs(buf, tmp);
-		fclose(tmp);
-		fclose(out);
-		tmp = NULL;
-		out = NULL;
-
-		tmp = fopen(tmppath, "r");
-		if (!tmp)
-		{
-			printf("Could not open temp file for reading out of: %d.\n", -errno);
-			remove(tmppath);
-			return -errno;
-		}
-		fseek(tmp, 0L, SEEK_SET);
+		res = pa5_control_apply(buf, size);
+		return (res < 0) ? res : (int)size;
+	}
 
-		out = fopen(fpath, "wb");
-		if (!out)
-		{
-			fclose(tmp);
-			remove(tmppath);
-			printf("Could not open output file for writing: %d.\n", -errno);
-			return -errno;
-		}
-		if (!do_crypt(tmp, out, 1, STATE_DATA->password))
-		{
-			fclose(tmp);
-			fclose(out);
-			remove(tmppath);
-			printf("Could not encrypt file: %d.\n", -errno);
-			return -errno;
-		}
+	/* A small file that would grow past the limit is promoted first and
+	 * the write goes to its new backing file. */
+	pa5_migrate_activity();
+	while ((res = small_enter(path, file)) == 1)
+	{
+		res = pa5_small_write(file->small, buf, size, offset);
+		if (res == -EFBIG && (res = promote_small(path, file->small)) == 0)
+			res = -ESTALE;
+		pthread_rwlock_unlock(&small_lock);
+		if (res != -ESTALE)
+			goto out;
+	}
+	if (res < 0)
+		return res;
 
-		fclose(tmp);
-		fclose(out);
-		remove(tmppath);
+	if (file->format != FORMAT_PLAIN)
+	{
+		pa5_rwlock_wrlock(file->lock, PA5_LOCK_INODE);
+		if (file->format == FORMAT_CHUNK)
+			res = pa5_chunk_write(&file->chunk, buf, size, offset);
+		else
+			res = pa5_cbc_write(file->fd, &STATE_DATA->cbc_key, buf, size, offset);
+		size_note(file, res);
+		pthread_rwlock_unlock(file->lock);
+		if (res < 0)
+			pa5_error("Could not encrypt file: %d.", res);
 	}
 	else
 	{
-		int fd = open(fpath, O_WRONLY);
-		if (fd == -1)
-			return -errno;
-
-		res = pwrite(fd, buf, size, offset);
+		res = pwrite(file->fd, buf, size, offset);
 		if (res == -1)
 			res = -errno;
-
-		close(fd);
 	}
 
+out:
+	if (res > 0)
+		pa5_stats_add(PA5_CTR_BYTES_IN, res);
 	return res;
 }
 
@@ -520,52 +1269,299 @@ static int xmp_statfs(const char *path, struct statvfs *stbuf)
 	if (res == -1)
 		return -errno;
 
+	/* Large files take their space from every root. */
+	pa5_stripe_statfs(stbuf);
 	return 0;
 }
 
 static int xmp_create(const char* path, mode_t mode, struct fuse_file_info* fi)
 {
-  (void) fi;
-
+	struct stat st;
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
 	int res;
-	res = creat(fpath, mode);
-	if(res == -1)
-		return -errno;
+	int flags = fi->flags & ~(O_CREAT | O_EXCL | O_TRUNC);
+	enum pa5_policy_action action = pa5_policy_decide(path, fuse_get_context()->uid, 0);
 
-	close(res);
+	/* New files start out in the small-file store when it is enabled,
+	 * unless the policy keeps them in plaintext. */
+	if (action != PA5_POLICY_PLAIN && pa5_small_max() > 0 && S_ISREG(mode) &&
+	    lstat(fpath, &st) == -1 && errno == ENOENT)
+	{
+		struct pa5_small *small;
+		res = pa5_small_create(path, mode, getuid(), getgid(), fi->flags & O_EXCL, &small);
+		if (res < 0)
+			return res;
+		return open_small(small, flags, fi);
+	}
 
-	add_encrypted_flag(fpath);
+	/* A new file stays owner-writable until its flag and header are in
+	 * place, so that a read-only mode cannot lock us out of it; if setting
+	 * it up fails, it is removed again. */
+	int created = 1;
+	int fd = open(fpath, O_CREAT | O_EXCL | O_WRONLY, 0600);
+	if (fd == -1 && errno == EEXIST && !(fi->flags & O_EXCL))
+	{
+		created = 0;
+		fd = open(fpath, O_WRONLY | O_TRUNC);
+	}
+	if (fd == -1)
+		return -errno;
 
-	return 0;
+	if ((res = policy_apply(fpath, action)) == 0 &&
+	    (res = open_file(fpath, flags, fi)) == 0 &&
+	    created && fchmod(fd, mode & 07777) == -1)
+	{
+		res = -errno;
+		file_close(get_file(fi));
+		pa5_pool_put(&file_pool, get_file(fi));
+	}
+	close(fd);
+
+	if (res < 0 && created)
+		unlink(fpath);
+	return res;
 }
 
+static int xmp_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	struct pa5_file *file = get_file(fi);
+	int res;
+
+	while ((res = small_enter(path, file)) == 1)
+	{
+		res = pa5_small_truncate(file->small, size);
+		if (res == -EFBIG && (res = promote_small(path, file->small)) == 0)
+			res = -ESTALE;
+		pthread_rwlock_unlock(&small_lock);
+		if (res != -ESTALE)
+			return res;
+	}
+	if (res < 0)
+		return res;
+
+	return file_truncate(file, size);
+}
 
 static int xmp_release(const char *path, struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	struct pa5_file *file = get_file(fi);
+	int legacy = (file->format == FORMAT_CBC);
 
-	(void) path;
-	(void) fi;
+	file_close(file);
+
+	/* Convert legacy files once the last handle on them is gone. */
+	if (legacy && STATE_DATA->migrate && !pa5_inode_busy(file->dev, file->ino))
+	{
+		char fpath[512] = { 0 };
+		get_full_path(fpath, path);
+		pa5_migrate_queue(fpath);
+	}
+
+	pa5_pool_put(&file_pool, file);
 	return 0;
 }
 
 static int xmp_fsync(const char *path, int isdatasync,
 		     struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	int res;
+	struct pa5_file *file = get_file(fi);
+
+	if (file->format == FORMAT_STATS || file->format == FORMAT_CONTROL)
+		return 0;
+	while ((res = small_enter(path, file)) == 1)
+	{
+		res = pa5_small_sync(file->small);
+		pthread_rwlock_unlock(&small_lock);
+		if (res != -ESTALE)
+			return res;
+	}
+	if (res < 0)
+		return res;
+
+	/* Chunks of deduplicated and striped files live elsewhere too. */
+	if (file->format == FORMAT_CHUNK)
+		return pa5_chunk_sync(&file->chunk, isdatasync);
+
+	if (isdatasync)
+		res = fdatasync(file->fd);
+	else
+		res = fsync(file->fd);
+	if (res == -1)
+		return -errno;
 
-	(void) path;
-	(void) isdatasync;
-	(void) fi;
 	return 0;
 }
 
+/* Copies from to to through the read and write paths, for files whose
+ * data cannot be copied as it is. to keeps its own format. */
+static int copy_through(const char *from, const char *to)
+{
+	struct fuse_file_info in, out;
+	off_t off = 0;
+	int res;
+
+	char *buf = malloc(COPY_BUFFER);
+	if (!buf)
+		return -ENOMEM;
+
+	memset(&in, 0, sizeof(in));
+	memset(&out, 0, sizeof(out));
+	in.flags = O_RDONLY;
+	out.flags = O_WRONLY;
+	if ((res = xmp_truncate(to, 0)) < 0 || (res = xmp_open(from, &in)) < 0)
+	{
+		free(buf);
+		return res;
+	}
+	if ((res = xmp_open(to, &out)) == 0)
+	{
+		while ((res = xmp_read(from, buf, COPY_BUFFER, off, &in)) > 0 &&
+		       (res = xmp_write(to, buf, res, off, &out)) > 0)
+			off += res;
+		xmp_release(to, &out);
+	}
+	xmp_release(from, &in);
+	free(buf);
+
+	if (res < 0)
+		return res;
+	__atomic_fetch_add(&copies.through, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Replaces the contents of tpath with a copy of the backing file of src,
+ * which is plaintext or a chunk file kept in the mirror, in src's format.
+ * Nothing is decrypted: chunk files are cloned with pa5_chunk_clone(). */
+static int copy_backing(struct pa5_file *src, const char *tpath)
+{
+	pthread_rwlock_t *src_lock = (src->format == FORMAT_PLAIN) ? NULL : src->lock;
+	struct pa5_chunk_file cf;
+	struct stat src_st, st;
+	int res;
+
+	if (lstat(tpath, &st) == -1 || fstat(src->fd, &src_st) == -1)
+		return -errno;
+	if (!S_ISREG(st.st_mode) || !S_ISREG(src_st.st_mode) ||
+	    (st.st_dev == src_st.st_dev && st.st_ino == src_st.st_ino))
+		return -EINVAL;
+	if (pa5_inode_busy(st.st_dev, st.st_ino))
+		return -EBUSY;
+
+	/* Let go of what the old contents hold elsewhere first. */
+	if (is_encrypted(tpath))
+	{
+		struct pa5_file old;
+		if ((res = open_encrypted(tpath, O_RDWR, PA5_CHUNK_CODEC_MOUNT, &old)) < 0)
+			return res;
+		res = file_truncate(&old, 0);
+		file_close(&old);
+		if (res < 0)
+			return res;
+	}
+
+	int fd = open(tpath, O_RDWR);
+	if (fd == -1)
+		return -errno;
+	if (fstat(fd, &st) == -1)
+	{
+		res = -errno;
+		close(fd);
+		return res;
+	}
+
+	/* Both inodes locked, in address order as they may share a stripe. */
+	pthread_rwlock_t *lock = pa5_inode_lock(st.st_dev, st.st_ino);
+	if (src_lock == lock)
+		src_lock = NULL;
+	if (src_lock && src_lock < lock)
+		pa5_rwlock_rdlock(src_lock, PA5_LOCK_INODE);
+	pa5_rwlock_wrlock(lock, PA5_LOCK_INODE);
+	if (src_lock && src_lock > lock)
+		pa5_rwlock_rdlock(src_lock, PA5_LOCK_INODE);
+
+	if (pa5_inode_busy(st.st_dev, st.st_ino))
+		res = -EBUSY;
+	else if (src->format == FORMAT_PLAIN)
+	{
+		if (fremovexattr(fd, "user.encrypted") == -1 && errno != ENODATA)
+			res = -errno;
+		else if ((res = pa5_io_copy(src->fd, fd, src_st.st_size)) == 0)
+			__atomic_fetch_add(&copies.plain, 1, __ATOMIC_RELAXED);
+	}
+	else if (fsetxattr(fd, "user.encrypted", "true", 5, 0) == -1)
+		res = -errno;
+	else if ((res = pa5_chunk_clone(&src->chunk, fd, &STATE_DATA->keys, &cf)) == 0)
+	{
+		pa5_chunk_close(&cf);
+		__atomic_fetch_add(&copies.cloned, 1, __ATOMIC_RELAXED);
+	}
+
+	if (src_lock)
+		pthread_rwlock_unlock(src_lock);
+	pthread_rwlock_unlock(lock);
+	close(fd);
+	return res;
+}
+
+/* Makes to a copy of from without the data passing through the client.
+ * Plaintext and chunk files are copied at the backing store's speed,
+ * reflinked where it can; the others go through copy_through(). */
+static int copy_file(const char *from, const char *to)
+{
+	struct pa5_file src;
+	char fpath[512] = { 0 };
+	char tpath[512] = { 0 };
+	int res;
+
+	get_full_path(fpath, from);
+	get_full_path(tpath, to);
+
+	if (small_exists(from) || small_exists(to))
+		return copy_through(from, to);
+	if ((res = file_open(fpath, O_RDONLY, &src)) < 0)
+		return res;
+	if (src.format == FORMAT_PLAIN ||
+	    (src.format == FORMAT_CHUNK && !(src.chunk.flags & PA5_CHUNK_FLAG_DEDUP)))
+		res = copy_backing(&src, tpath);
+	else
+		res = 1;
+	file_close(&src);
+
+	if (res == 1)
+		return copy_through(from, to);
+	if (res < 0)
+		pa5_error("Could not copy %s to %s: %d.", from, to, res);
+	return res;
+}
+
 #ifdef HAVE_SETXATTR
+static int is_private_xattr(const char *name)
+{
+	return strncmp(name, PA5_XATTR_PREFIX, strlen(PA5_XATTR_PREFIX)) == 0;
+}
+
+/* Drops the daemon's own names from a list of len bytes of names. */
+static ssize_t hide_private_xattrs(char *list, ssize_t len)
+{
+	ssize_t in = 0;
+	ssize_t out = 0;
+
+	while (in < len)
+	{
+		size_t n = strlen(list + in) + 1;
+		if (!is_private_xattr(list + in))
+		{
+			memmove(list + out, list + in, n);
+			out += n;
+		}
+		in += n;
+	}
+	return out;
+}
+
 static int xmp_setxattr(const char *path, const char *name, const char *value,
 			size_t size, int flags)
 {
@@ -573,7 +1569,29 @@ static int xmp_setxattr(const char *path, const char *name, const char *value,
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
-	int res = lsetxattr(fpath, name, value, size, flags);
+	/* Setting PA5_COPY_XATTR to the path of a file below the mount copies
+	 * that file here; the daemon's other attributes are its own. */
+	if (strcmp(name, PA5_COPY_XATTR) == 0)
+	{
+		char from[512];
+		if (size == 0 || size >= sizeof(from) - strlen(STATE_DATA->rootdir) ||
+		    value[0] != '/' || memchr(value, '\0', size))
+			return -EINVAL;
+		memcpy(from, value, size);
+		from[size] = '\0';
+		if (reserved(from, -ENOENT))
+			return -ENOENT;
+		return copy_file(from, path);
+	}
+	if (is_private_xattr(name))
+		return -EPERM;
+
+	/* Small files have nowhere to keep attributes. */
+	int res = promote_path(path);
+	if (res < 0)
+		return res;
+
+	res = lsetxattr(fpath, name, value, size, flags);
 	if (res == -1)
 		return -errno;
 	return 0;
@@ -585,6 +1603,22 @@ static int xmp_getxattr(const char *path, const char *name, char *value,
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
+	if (is_private_xattr(name))
+		return -ENODATA;
+
+	/* Small files only carry the encrypted flag. */
+	if (small_exists(path))
+	{
+		if (strcmp(name, "user.encrypted") != 0)
+			return -ENODATA;
+		if (size == 0)
+			return 5;
+		if (size < 5)
+			return -ERANGE;
+		memcpy(value, "true", 5);
+		return 5;
+	}
+
 	int res = lgetxattr(fpath, name, value, size);
 	if (res == -1)
 		return -errno;
@@ -596,9 +1630,30 @@ static int xmp_listxattr(const char *path, char *list, size_t size)
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
-	int res = llistxattr(fpath, list, size);
+	if (small_exists(path))
+	{
+		static const char names[] = "user.encrypted";
+		if (size == 0)
+			return sizeof(names);
+		if (size < sizeof(names))
+			return -ERANGE;
+		memcpy(list, names, sizeof(names));
+		return sizeof(names);
+	}
+
+	ssize_t res = llistxattr(fpath, list, size);
 	if (res == -1)
 		return -errno;
+	if (size > 0)
+		return hide_private_xattrs(list, res);
+
+	/* Only a size was asked for; it must be that of the list returned. */
+	char *names = malloc(res);
+	if (!names)
+		return -ENOMEM;
+	res = llistxattr(fpath, names, res);
+	res = (res == -1) ? -errno : hide_private_xattrs(names, res);
+	free(names);
 	return res;
 }
 
@@ -607,44 +1662,457 @@ static int xmp_removexattr(const char *path, const char *name)
 	char fpath[512] = { 0 };
 	get_full_path(fpath, path);
 
-	int res = lremovexattr(fpath, name);
+	if (is_private_xattr(name))
+		return -EPERM;
+
+	int res = promote_path(path);
+	if (res < 0)
+		return res;
+
+	res = lremovexattr(fpath, name);
 	if (res == -1)
 		return -errno;
 	return 0;
 }
 #endif /* HAVE_SETXATTR */
 
+static void stats_io_section(FILE *out)
+{
+	fprintf(out, "backend %s\n", pa5_io_backend());
+}
+
+static void stats_log_section(FILE *out)
+{
+	fprintf(out, "level %s\n", pa5_log_level_name(pa5_log_threshold));
+	fprintf(out, "dropped %llu\n", pa5_log_dropped());
+}
+
+static void stats_trace_section(FILE *out)
+{
+	fprintf(out, "active %d\n", pa5_tracing());
+	fprintf(out, "records %llu\n", pa5_trace_records());
+	fprintf(out, "dropped %llu\n", pa5_trace_dropped());
+}
+
+static void stats_copy_section(FILE *out)
+{
+	fprintf(out, "cloned %llu\n",
+		(unsigned long long)__atomic_load_n(&copies.cloned, __ATOMIC_RELAXED));
+	fprintf(out, "plain %llu\n",
+		(unsigned long long)__atomic_load_n(&copies.plain, __ATOMIC_RELAXED));
+	fprintf(out, "through %llu\n",
+		(unsigned long long)__atomic_load_n(&copies.through, __ATOMIC_RELAXED));
+}
+
+static void stats_compress_section(FILE *out)
+{
+	fprintf(out, "codec %s\n", pa5_compress_name(pa5_chunk_codec()));
+}
+
+/* ---- Settings changed through PA5_CONTROL_FILE ---- */
+
+/* Parses a whole decimal number. Return: 0 on success, -EINVAL if not */
+static int parse_number(const char *text, uint64_t *n)
+{
+	char *end;
+
+	if (text[0] < '0' || text[0] > '9')
+		return -EINVAL;
+	errno = 0;
+	*n = strtoull(text, &end, 10);
+	return (*end || errno) ? -EINVAL : 0;
+}
+
+static void control_get_cache_size(FILE *out)
+{
+	fprintf(out, "%zu", pa5_cache_budget());
+}
+
+static int control_set_cache_size(const char *value)
+{
+	uint64_t n;
+
+	if (parse_number(value, &n) < 0)
+		return -EINVAL;
+	pa5_cache_init(n);
+	return 0;
+}
+
+static void control_get_log_level(FILE *out)
+{
+	fprintf(out, "%s", pa5_log_level_name(pa5_log_threshold));
+}
+
+static int control_set_log_level(const char *value)
+{
+	int level = pa5_log_parse_level(value);
+
+	if (level < 0)
+		return -EINVAL;
+	pa5_log_set_level(level);
+	return 0;
+}
+
+static void control_get_compress(FILE *out)
+{
+	fprintf(out, "%s", pa5_compress_name(pa5_chunk_codec()));
+}
+
+static int control_set_compress(const char *value)
+{
+	int codec = pa5_compress_parse(value);
+
+	if (codec < 0)
+		return -EINVAL;
+	pa5_chunk_set_codec(codec);
+	return 0;
+}
+
+static void control_get_sched_slots(FILE *out)
+{
+	fprintf(out, "%u", pa5_sched_slots());
+}
+
+/* Most scheduler slots PA5_SCHED_SLOTS or sched_slots may ask for. */
+#define SCHED_MAX_SLOTS (1u << 16)
+
+/* A new slot count takes the default class limits for it. The gate cannot
+ * be turned off while mounted, as callers may be queued on it. */
+static int control_set_sched_slots(const char *value)
+{
+	uint64_t n;
+
+	if (parse_number(value, &n) < 0 || n == 0 || n > SCHED_MAX_SLOTS)
+		return -EINVAL;
+	/* The class limits set at mount or through sched_limits stay. */
+	return pa5_sched_init(n, NULL);
+}
+
+static void control_get_sched_limits(FILE *out)
+{
+	unsigned limits[PA5_SCHED_CLASSES];
+	int cls;
+
+	pa5_sched_limits(limits);
+	for (cls = 0; cls < PA5_SCHED_CLASSES; cls++)
+		fprintf(out, "%s%u", cls ? "," : "", limits[cls]);
+}
+
+static int control_set_sched_limits(const char *value)
+{
+	unsigned limits[PA5_SCHED_CLASSES];
+
+	if (pa5_sched_parse_limits(value, limits) < 0 || pa5_sched_slots() == 0)
+		return -EINVAL;
+	return pa5_sched_init(pa5_sched_slots(), limits);
+}
+
+static int control_set_sched_weights(const char *value)
+{
+	return pa5_sched_set_fairness(NULL, value);
+}
+
+static void control_get_mem_limit(FILE *out)
+{
+	fprintf(out, "%llu", (unsigned long long)pa5_mem_limit());
+}
+
+static int control_set_mem_limit(const char *value)
+{
+	uint64_t n;
+
+	if (parse_number(value, &n) < 0)
+		return -EINVAL;
+	pa5_mem_set_limit(n);
+	return 0;
+}
+
+/* SIGUSR1 makes the log more verbose and SIGUSR2 quieter, one level at a
+ * time, so a running mount can be debugged without a remount. */
+static void log_level_signal(int sig)
+{
+	int level = __atomic_load_n(&pa5_log_threshold, __ATOMIC_RELAXED);
+	pa5_log_set_level(sig == SIGUSR1 ? level + 1 : level - 1);
+}
+
+/* Background workers are started here rather than in main() because
+ * fuse_main() forks into the background first. */
+static void *xmp_init(struct fuse_conn_info *conn)
+{
+	struct pa5_state *state = STATE_DATA;
+
+	(void) conn;
+
+	pa5_log_start(state->log_out);
+	pa5_info("Mounted %s (io %s, log level %s).", state->rootdir, pa5_io_backend(),
+		 pa5_log_level_name(pa5_log_threshold));
+
+	if (state->trace_fd >= 0 && pa5_trace_start(state->trace_fd) < 0)
+	{
+		pa5_error("Could not start the trace.");
+		close(state->trace_fd);
+	}
+
+	if (state->migrate || state->migrate_scan > 0)
+	{
+		struct pa5_migrate_config config;
+		config.rootdir = state->rootdir;
+		config.cbc_key = &state->cbc_key;
+		config.keys = &state->keys;
+		config.scan_interval = state->migrate_scan;
+		if (pa5_migrate_start(&config) < 0)
+			pa5_error("Could not start the migration worker.");
+	}
+
+	if (pa5_small_start() < 0)
+		pa5_error("Could not start the small file compaction worker.");
+	if (pa5_tier_start() < 0)
+		pa5_error("Could not start the cache tier worker.");
+	if (pa5_journal_start() < 0)
+		pa5_error("Could not start the journal checkpoint worker.");
+	if (pa5_warm_start() < 0)
+		pa5_error("Could not start the cache warming worker.");
+	if (pa5_mem_start(state->oom_adj) < 0)
+		pa5_error("Could not start the memory accounting worker.");
+
+	return state;
+}
+
+static void xmp_destroy(void *private_data)
+{
+	(void) private_data;
+
+	pa5_warm_close();
+	pa5_mem_stop();
+	pa5_migrate_stop();
+	pa5_trace_stop();
+	pa5_dedup_close();
+	pa5_small_close();
+	pa5_journal_close();
+	pa5_tier_close();
+	pa5_stripe_close();
+	pa5_log_stop();
+}
+
+static uint64_t trace_handle(const struct fuse_file_info *fi)
+{
+	return fi ? fi->fh : 0;
+}
+
+/* Every callback goes through a wrapper that times it into pa5-stats and,
+ * when tracing, records it with the arguments listed in trace: path, second
+ * path, offset, size, flags, mode and the fuse_file_info. The callback only
+ * runs if guard, which checks its paths for reserved names, gives 0. */
+#define TRACE_ARGS(path, path2, offset, size, flags, mode, fi) \
+	path, path2, offset, size, flags, mode, trace_handle(fi)
+#define OP_WRAPPER(timer, name, params, args, trace, guard) \
+	static int op_##name params \
+	{ \
+		uint64_t start = pa5_stats_now(); \
+		struct fuse_context *context = fuse_get_context(); \
+		pa5_sched_set_class((timer) == PA5_OP_READ ? PA5_SCHED_READ : PA5_SCHED_WRITE); \
+		pa5_sched_set_tenant(context->uid, context->gid, context->pid); \
+		int res = (guard); \
+		if (res == 0) \
+			res = xmp_##name args; \
+		pa5_stats_time(timer, start, res); \
+		if ((timer) == PA5_OP_READ || (timer) == PA5_OP_WRITE) \
+			pa5_sched_account(start, res); \
+		if (pa5_tracing()) \
+			pa5_trace_op(timer, start, res, TRACE_ARGS trace); \
+		return res; \
+	}
+
+OP_WRAPPER(PA5_OP_GETATTR, getattr, (const char *path, struct stat *stbuf), (path, stbuf),
+	   (path, NULL, 0, 0, 0, 0, NULL), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_ACCESS, access, (const char *path, int mask), (path, mask),
+	   (path, NULL, 0, 0, mask, 0, NULL), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_READLINK, readlink, (const char *path, char *buf, size_t size),
+	   (path, buf, size), (path, NULL, 0, size, 0, 0, NULL), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_READDIR, readdir, (const char *path, void *buf, fuse_fill_dir_t filler,
+	   off_t offset, struct fuse_file_info *fi), (path, buf, filler, offset, fi),
+	   (path, NULL, offset, 0, 0, 0, fi), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_MKNOD, mknod, (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev),
+	   (path, NULL, rdev, 0, 0, mode, NULL), reserved(path, -EPERM))
+OP_WRAPPER(PA5_OP_MKDIR, mkdir, (const char *path, mode_t mode), (path, mode),
+	   (path, NULL, 0, 0, 0, mode, NULL), reserved(path, -EPERM))
+OP_WRAPPER(PA5_OP_SYMLINK, symlink, (const char *from, const char *to), (from, to),
+	   (to, NULL, 0, strlen(from), 0, 0, NULL), reserved(to, -EPERM))
+OP_WRAPPER(PA5_OP_UNLINK, unlink, (const char *path), (path),
+	   (path, NULL, 0, 0, 0, 0, NULL), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_RMDIR, rmdir, (const char *path), (path),
+	   (path, NULL, 0, 0, 0, 0, NULL), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_RENAME, rename, (const char *from, const char *to), (from, to),
+	   (from, to, 0, 0, 0, 0, NULL), reserved_pair(from, to))
+OP_WRAPPER(PA5_OP_LINK, link, (const char *from, const char *to), (from, to),
+	   (from, to, 0, 0, 0, 0, NULL), reserved_pair(from, to))
+OP_WRAPPER(PA5_OP_CHMOD, chmod, (const char *path, mode_t mode), (path, mode),
+	   (path, NULL, 0, 0, 0, mode, NULL), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_CHOWN, chown, (const char *path, uid_t uid, gid_t gid), (path, uid, gid),
+	   (path, NULL, 0, 0, uid, gid, NULL), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_TRUNCATE, truncate, (const char *path, off_t size), (path, size),
+	   (path, NULL, size, 0, 0, 0, NULL), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_FTRUNCATE, ftruncate, (const char *path, off_t size,
+	   struct fuse_file_info *fi), (path, size, fi), (path, NULL, size, 0, 0, 0, fi), 0)
+OP_WRAPPER(PA5_OP_UTIMENS, utimens, (const char *path, const struct timespec ts[2]), (path, ts),
+	   (path, NULL, 0, 0, 0, 0, NULL), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_OPEN, open, (const char *path, struct fuse_file_info *fi), (path, fi),
+	   (path, NULL, 0, 0, fi->flags, 0, fi), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_READ, read, (const char *path, char *buf, size_t size, off_t offset,
+	   struct fuse_file_info *fi), (path, buf, size, offset, fi),
+	   (path, NULL, offset, size, 0, 0, fi), 0)
+OP_WRAPPER(PA5_OP_WRITE, write, (const char *path, const char *buf, size_t size,
+	   off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi),
+	   (path, NULL, offset, size, 0, 0, fi), 0)
+OP_WRAPPER(PA5_OP_STATFS, statfs, (const char *path, struct statvfs *stbuf), (path, stbuf),
+	   (path, NULL, 0, 0, 0, 0, NULL), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_CREATE, create, (const char *path, mode_t mode, struct fuse_file_info *fi),
+	   (path, mode, fi), (path, NULL, 0, 0, fi->flags, mode, fi), reserved(path, -EPERM))
+OP_WRAPPER(PA5_OP_RELEASE, release, (const char *path, struct fuse_file_info *fi), (path, fi),
+	   (path, NULL, 0, 0, fi->flags, 0, fi), 0)
+OP_WRAPPER(PA5_OP_FSYNC, fsync, (const char *path, int isdatasync, struct fuse_file_info *fi),
+	   (path, isdatasync, fi), (path, NULL, 0, 0, isdatasync, 0, fi), 0)
+#ifdef HAVE_SETXATTR
+OP_WRAPPER(PA5_OP_SETXATTR, setxattr, (const char *path, const char *name, const char *value,
+	   size_t size, int flags), (path, name, value, size, flags),
+	   (path, NULL, 0, size, flags, 0, NULL), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_GETXATTR, getxattr, (const char *path, const char *name, char *value,
+	   size_t size), (path, name, value, size), (path, NULL, 0, size, 0, 0, NULL),
+	   reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_LISTXATTR, listxattr, (const char *path, char *list, size_t size),
+	   (path, list, size), (path, NULL, 0, size, 0, 0, NULL), reserved(path, -ENOENT))
+OP_WRAPPER(PA5_OP_REMOVEXATTR, removexattr, (const char *path, const char *name), (path, name),
+	   (path, NULL, 0, 0, 0, 0, NULL), reserved(path, -ENOENT))
+#endif
+
 static struct fuse_operations xmp_oper = {
-	.getattr	= xmp_getattr,
-	.access		= xmp_access,
-	.readlink	= xmp_readlink,
-	.readdir	= xmp_readdir,
-	.mknod		= xmp_mknod,
-	.mkdir		= xmp_mkdir,
-	.symlink	= xmp_symlink,
-	.unlink		= xmp_unlink,
-	.rmdir		= xmp_rmdir,
-	.rename		= xmp_rename,
-	.link		= xmp_link,
-	.chmod		= xmp_chmod,
-	.chown		= xmp_chown,
-	.truncate	= xmp_truncate,
-	.utimens	= xmp_utimens,
-	.open		= xmp_open,
-	.read		= xmp_read,
-	.write		= xmp_write,
-	.statfs		= xmp_statfs,
-	.create         = xmp_create,
-	.release	= xmp_release,
-	.fsync		= xmp_fsync,
+	.getattr	= op_getattr,
+	.access		= op_access,
+	.readlink	= op_readlink,
+	.readdir	= op_readdir,
+	.mknod		= op_mknod,
+	.mkdir		= op_mkdir,
+	.symlink	= op_symlink,
+	.unlink		= op_unlink,
+	.rmdir		= op_rmdir,
+	.rename		= op_rename,
+	.link		= op_link,
+	.chmod		= op_chmod,
+	.chown		= op_chown,
+	.truncate	= op_truncate,
+	.ftruncate	= op_ftruncate,
+	.utimens	= op_utimens,
+	.open		= op_open,
+	.read		= op_read,
+	.write		= op_write,
+	.statfs		= op_statfs,
+	.create         = op_create,
+	.release	= op_release,
+	.fsync		= op_fsync,
+	.init		= xmp_init,
+	.destroy	= xmp_destroy,
 #ifdef HAVE_SETXATTR
-	.setxattr	= xmp_setxattr,
-	.getxattr	= xmp_getxattr,
-	.listxattr	= xmp_listxattr,
-	.removexattr	= xmp_removexattr,
+	.setxattr	= op_setxattr,
+	.getxattr	= op_getxattr,
+	.listxattr	= op_listxattr,
+	.removexattr	= op_removexattr,
 #endif
 };
 
+/* Settings are mount options, -o <name>=<value>, and can also be given in
+ * the environment as PA5_ and the name in capitals, PA5_SCHED_SLOTS for
+ * sched_slots. An option wins over the environment. */
+struct pa5_options
+{
+	const char *migrate;
+	const char *migrate_scan;
+	const char *io_engine;
+	const char *cache_size;
+	const char *sched_slots;
+	const char *sched_limits;
+	const char *sched_fair;
+	const char *sched_weights;
+	const char *log_level;
+	const char *log_file;
+	const char *trace_file;
+	const char *compress;
+	const char *policy;
+	const char *dedup;
+	const char *small_files;
+	const char *stripe_roots;
+	const char *stripe_policy;
+	const char *stripe_unit;
+	const char *tier_root;
+	const char *tier_size;
+	const char *journal;
+	const char *admin_uid;
+	const char *mem_limit;
+	const char *oom_score_adj;
+	const char *warm;
+	char *password;
+	char *mount;
+	int positional;           /* Arguments other than options seen so far. */
+};
+
+#define PA5_OPTION(name) { #name "=%s", offsetof(struct pa5_options, name), 0 }
+
+static const struct fuse_opt pa5_option_spec[] = {
+	PA5_OPTION(migrate),
+	PA5_OPTION(migrate_scan),
+	PA5_OPTION(io_engine),
+	PA5_OPTION(cache_size),
+	PA5_OPTION(sched_slots),
+	PA5_OPTION(sched_limits),
+	PA5_OPTION(sched_fair),
+	PA5_OPTION(sched_weights),
+	PA5_OPTION(log_level),
+	PA5_OPTION(log_file),
+	PA5_OPTION(trace_file),
+	PA5_OPTION(compress),
+	PA5_OPTION(policy),
+	PA5_OPTION(dedup),
+	PA5_OPTION(small_files),
+	PA5_OPTION(stripe_roots),
+	PA5_OPTION(stripe_policy),
+	PA5_OPTION(stripe_unit),
+	PA5_OPTION(tier_root),
+	PA5_OPTION(tier_size),
+	PA5_OPTION(journal),
+	PA5_OPTION(admin_uid),
+	PA5_OPTION(mem_limit),
+	PA5_OPTION(oom_score_adj),
+	PA5_OPTION(warm),
+	FUSE_OPT_END
+};
+
+/* Takes the password and the directory of backing files out of the
+ * arguments, leaving the mount point and FUSE's own options for
+ * fuse_main(). */
+static int option_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+	struct pa5_options *options = data;
+
+	(void) outargs;
+	if (key != FUSE_OPT_KEY_NONOPT)
+		return 1;
+	switch (options->positional++)
+	{
+	case 0:
+		options->password = strdup(arg);
+		return 0;
+	case 2:
+		options->mount = strdup(arg);
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+static const char *setting(const char *option, const char *name)
+{
+	return option ? option : getenv(name);
+}
+
 int main(int argc, char *argv[])
 {
 	umask(0);
@@ -652,21 +2120,18 @@ int main(int argc, char *argv[])
 	struct pa5_state *settings;
 	settings = (struct pa5_state *)malloc(sizeof(struct pa5_state));
 
-	if (argc < 4)
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct pa5_options options;
+	memset(&options, 0, sizeof(options));
+	if (fuse_opt_parse(&args, &options, pa5_option_spec, option_proc) == -1 ||
+	    options.positional != 3)
 	{
 		printf("Usage: ./pa5-encfs [Options] <password> <mirror> <mount>\n");
 		return EXIT_FAILURE;
 	}
 
-	char *password = argv[argc - 3];
-	char *mirror = argv[argc - 2];
-	char *mount = argv[argc - 1];
-
-	if (mirror[0] == '-' || mount[0] == '-')
-	{
-		printf("Error: The mount and mirror directories must not start with a hyphen.\n");
-		return EXIT_FAILURE;
-	}
+	char *password = options.password;
+	char *mount = options.mount;
 
 	if ((settings->rootdir = realpath(mount, NULL)) == NULL)
 	{
@@ -679,10 +2144,318 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	argv[argc - 3] = argv[argc - 2];
-	argc -= 2;
+	int res = pa5_volume_open(settings->rootdir, settings->password, &settings->cbc_key,
+				  &settings->keys);
+	if (res == -EACCES)
+	{
+		printf("Error: Wrong password for this mirror.\n");
+		return EXIT_FAILURE;
+	}
+	else if (res < 0)
+	{
+		printf("Error: Could not load the volume key: %s.\n", strerror(-res));
+		return EXIT_FAILURE;
+	}
+
+	pa5_inode_init();
+
+	/* PA5_MIGRATE=0 keeps legacy files as they are; PA5_MIGRATE_SCAN sets
+	 * the idle scan interval in seconds. */
+	const char *migrate = setting(options.migrate, "PA5_MIGRATE");
+	const char *scan = setting(options.migrate_scan, "PA5_MIGRATE_SCAN");
+	settings->migrate = !(migrate && strcmp(migrate, "0") == 0);
+	uint64_t scan_interval = 0;
+	if (scan && (parse_number(scan, &scan_interval) < 0 || scan_interval > UINT_MAX))
+	{
+		printf("Error: Bad migrate scan interval %s.\n", scan);
+		return EXIT_FAILURE;
+	}
+	settings->migrate_scan = scan_interval;
 
-	int ret = fuse_main(argc, argv, &xmp_oper, settings);
+	/* PA5_CACHE_SIZE is the byte budget of the plaintext chunk cache. */
+	const char *cache_size = setting(options.cache_size, "PA5_CACHE_SIZE");
+	uint64_t cache_bytes = PA5_CACHE_DEFAULT_BUDGET;
+	if (cache_size && parse_number(cache_size, &cache_bytes) < 0)
+	{
+		printf("Error: Bad cache size %s.\n", cache_size);
+		return EXIT_FAILURE;
+	}
+	pa5_cache_init(cache_bytes);
+
+	/* PA5_IO_ENGINE=sync forces the plain syscall backend. */
+	const char *engine = setting(options.io_engine, "PA5_IO_ENGINE");
+	pa5_io_init(PA5_IO_DEFAULT_DEPTH, !(engine && strcmp(engine, "sync") == 0));
+	pa5_stats_register("io", stats_io_section);
+
+	/* PA5_SCHED_SLOTS caps the chunk operations running at once (twice the
+	 * CPUs by default, 0 for no cap) and PA5_SCHED_LIMITS=<read>,<write>,
+	 * <prefetch>,<writeback>,<maint> caps each class, 0 for its default. */
+	const char *sched_slots = setting(options.sched_slots, "PA5_SCHED_SLOTS");
+	const char *sched_limits = setting(options.sched_limits, "PA5_SCHED_LIMITS");
+	unsigned limits[PA5_SCHED_CLASSES];
+	uint64_t slots = 0;
+	if (sched_slots && (parse_number(sched_slots, &slots) < 0 || slots > SCHED_MAX_SLOTS))
+	{
+		printf("Error: PA5_SCHED_SLOTS %s is not a number from 0 to %u.\n", sched_slots,
+		       SCHED_MAX_SLOTS);
+		return EXIT_FAILURE;
+	}
+	if (sched_limits && pa5_sched_parse_limits(sched_limits, limits) < 0)
+	{
+		printf("Error: PA5_SCHED_LIMITS needs five comma-separated numbers.\n");
+		return EXIT_FAILURE;
+	}
+	/* PA5_SCHED_FAIR shares slots fairly by uid (the default), gid, pid or
+	 * cgroup, or is off, and PA5_SCHED_WEIGHTS=<tenant>:<weight>,... gives
+	 * some tenants a bigger share. */
+	const char *sched_fair = setting(options.sched_fair, "PA5_SCHED_FAIR");
+	const char *sched_weights = setting(options.sched_weights, "PA5_SCHED_WEIGHTS");
+	if (pa5_sched_set_fairness(sched_fair, sched_weights) < 0)
+	{
+		printf("Error: Bad PA5_SCHED_FAIR or PA5_SCHED_WEIGHTS.\n");
+		return EXIT_FAILURE;
+	}
+	if (!(sched_slots && slots == 0))
+		pa5_sched_init(slots, sched_limits ? limits : NULL);
+	pa5_stats_register("sched", pa5_sched_stats);
+
+	/* PA5_LOG_LEVEL is one of off, error, warn, info or debug, and
+	 * PA5_LOG_FILE sends the log to a file instead of stderr. */
+	const char *level = setting(options.log_level, "PA5_LOG_LEVEL");
+	const char *logfile = setting(options.log_file, "PA5_LOG_FILE");
+	if (level && pa5_log_parse_level(level) < 0)
+	{
+		printf("Error: Unknown log level %s.\n", level);
+		return EXIT_FAILURE;
+	}
+	if (level)
+		pa5_log_set_level(pa5_log_parse_level(level));
+	settings->log_out = stderr;
+	if (logfile && (settings->log_out = fopen(logfile, "a")) == NULL)
+	{
+		printf("Error: Could not open log file %s: %s.\n", logfile, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	signal(SIGUSR1, log_level_signal);
+	signal(SIGUSR2, log_level_signal);
+	pa5_stats_register("log", stats_log_section);
+
+	/* PA5_TRACE_FILE records every callback there for pa5-replay. */
+	const char *tracefile = setting(options.trace_file, "PA5_TRACE_FILE");
+	settings->trace_fd = -1;
+	if (tracefile &&
+	    (settings->trace_fd = open(tracefile, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600)) < 0)
+	{
+		printf("Error: Could not open trace file %s: %s.\n", tracefile, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	pa5_stats_register("trace", stats_trace_section);
+
+	/* PA5_COMPRESS is off, zlib, lz4 or zstd, whichever were built in.
+	 * It only affects chunks written from now on. */
+	const char *compress = setting(options.compress, "PA5_COMPRESS");
+	if (compress && pa5_compress_parse(compress) < 0)
+	{
+		printf("Error: Unknown or unavailable compression codec %s.\n", compress);
+		return EXIT_FAILURE;
+	}
+	if (compress)
+		pa5_chunk_set_codec(pa5_compress_parse(compress));
+	pa5_stats_register("compress", stats_compress_section);
+
+	/* PA5_POLICY=<file> decides per new file whether it is encrypted,
+	 * compressed and encrypted, or kept in plaintext; see pa5-policy.h. */
+	const char *policy = setting(options.policy, "PA5_POLICY");
+	unsigned policy_line;
+	if (policy && policy[0] && (res = pa5_policy_load(policy, &policy_line)) < 0)
+	{
+		if (policy_line > 0)
+			printf("Error: Bad rule on line %u of policy file %s.\n", policy_line, policy);
+		else
+			printf("Error: Could not load policy file %s: %s.\n", policy, strerror(-res));
+		return EXIT_FAILURE;
+	}
+	pa5_stats_register("policy", pa5_policy_stats);
+	pa5_stats_register("copy", stats_copy_section);
+
+	/* PA5_DEDUP=1 stores new files in the content-addressed chunk store,
+	 * creating it if needed. An existing store is opened either way. */
+	const char *dedup = setting(options.dedup, "PA5_DEDUP");
+	res = pa5_dedup_open(settings->rootdir, &settings->keys, dedup && strcmp(dedup, "1") == 0);
+	if (res < 0 && res != -ENOENT)
+	{
+		printf("Error: Could not open the dedup store: %s.\n", strerror(-res));
+		return EXIT_FAILURE;
+	}
+	pa5_stats_register("dedup", pa5_dedup_stats);
+
+	/* PA5_SMALL_FILES=<bytes> keeps new files in the small-file store
+	 * until they grow past that size (1 for the default of 64 KiB),
+	 * creating the store if needed. An existing store is opened either
+	 * way. */
+	const char *small = setting(options.small_files, "PA5_SMALL_FILES");
+	uint64_t small_max = 0;
+	if (small && (parse_number(small, &small_max) < 0 || small_max > PA5_SMALL_MAX_LIMIT))
+	{
+		printf("Error: PA5_SMALL_FILES %s is not a size from 0 to %d bytes.\n", small,
+		       PA5_SMALL_MAX_LIMIT);
+		return EXIT_FAILURE;
+	}
+	if (small_max == 1)
+		small_max = PA5_SMALL_DEFAULT_MAX;
+	res = pa5_small_open(settings->rootdir, &settings->keys, small_max);
+	if (res < 0 && res != -ENOENT)
+	{
+		printf("Error: Could not open the small file store: %s.\n", strerror(-res));
+		return EXIT_FAILURE;
+	}
+	pa5_stats_register("small", pa5_small_stats);
+
+	/* PA5_STRIPE_ROOTS=<dir>[:<dir>...] adds mirror roots that the chunks
+	 * of new files are striped over, PA5_STRIPE_UNIT bytes at a time (1 MiB
+	 * by default). PA5_STRIPE_POLICY=data keeps the primary root to the
+	 * first unit of each file. The roots must be given in the same order
+	 * on every mount. */
+	const char *stripe_roots = setting(options.stripe_roots, "PA5_STRIPE_ROOTS");
+	const char *stripe_policy = setting(options.stripe_policy, "PA5_STRIPE_POLICY");
+	const char *stripe_unit = setting(options.stripe_unit, "PA5_STRIPE_UNIT");
+	uint64_t stripe_bytes = PA5_STRIPE_DEFAULT_UNIT;
+	if (stripe_unit && (parse_number(stripe_unit, &stripe_bytes) < 0 || stripe_bytes == 0 ||
+			    stripe_bytes > PA5_STRIPE_MAX_UNIT))
+	{
+		printf("Error: PA5_STRIPE_UNIT %s is not a size from 1 to %llu bytes.\n", stripe_unit,
+		       (unsigned long long)PA5_STRIPE_MAX_UNIT);
+		return EXIT_FAILURE;
+	}
+	if (stripe_policy && pa5_stripe_parse_policy(stripe_policy) < 0)
+	{
+		printf("Error: Unknown stripe policy %s.\n", stripe_policy);
+		return EXIT_FAILURE;
+	}
+	if (stripe_roots && stripe_roots[0] &&
+	    (res = pa5_stripe_open(settings->rootdir, stripe_roots, &settings->keys,
+				   stripe_policy ? pa5_stripe_parse_policy(stripe_policy) : PA5_STRIPE_ALL,
+				   stripe_bytes)) < 0)
+	{
+		printf("Error: Could not open the stripe roots: %s.\n", strerror(-res));
+		return EXIT_FAILURE;
+	}
+	pa5_stats_register("stripe", pa5_stripe_stats);
+
+	/* PA5_TIER_ROOT=<dir> puts a cache tier on a fast disk in front of the
+	 * mirror roots, holding up to PA5_TIER_SIZE bytes of chunks (1 GiB by
+	 * default). A mount that has used a tier should keep using it, since
+	 * chunks written there reach the mirror only in the background. */
+	const char *tier_root = setting(options.tier_root, "PA5_TIER_ROOT");
+	const char *tier_size = setting(options.tier_size, "PA5_TIER_SIZE");
+	uint64_t tier_bytes = PA5_TIER_DEFAULT_SIZE;
+	if (tier_size && (parse_number(tier_size, &tier_bytes) < 0 ||
+			  tier_bytes < PA5_CHUNK_SLOT_HEADER + PA5_CHUNK_SIZE ||
+			  tier_bytes > PA5_TIER_MAX_SIZE))
+	{
+		printf("Error: PA5_TIER_SIZE %s is not a size from %d to %llu bytes.\n", tier_size,
+		       PA5_CHUNK_SLOT_HEADER + PA5_CHUNK_SIZE, (unsigned long long)PA5_TIER_MAX_SIZE);
+		return EXIT_FAILURE;
+	}
+	if (tier_root && tier_root[0] &&
+	    (res = pa5_tier_open(tier_root, &settings->keys, tier_bytes)) < 0)
+	{
+		printf("Error: Could not open the cache tier: %s.\n", strerror(-res));
+		return EXIT_FAILURE;
+	}
+	pa5_stats_register("tier", pa5_tier_stats);
+
+	/* PA5_JOURNAL=<bytes> (1 for the default 64 MiB) logs chunk writes to
+	 * a journal in the mirror before they are made in place, so a crash
+	 * cannot leave a torn chunk behind. An existing journal is replayed
+	 * either way. */
+	const char *journal_size = setting(options.journal, "PA5_JOURNAL");
+	uint64_t journal_bytes = 0;
+	if (journal_size && (parse_number(journal_size, &journal_bytes) < 0 ||
+			     journal_bytes > PA5_JOURNAL_MAX_SIZE))
+	{
+		printf("Error: PA5_JOURNAL %s is not a size from 0 to %llu bytes.\n", journal_size,
+		       (unsigned long long)PA5_JOURNAL_MAX_SIZE);
+		return EXIT_FAILURE;
+	}
+	if (journal_bytes == 1)
+		journal_bytes = PA5_JOURNAL_DEFAULT_SIZE;
+	if (journal_bytes && pa5_tier_ready())
+	{
+		printf("Error: The journal cannot be combined with a cache tier.\n");
+		return EXIT_FAILURE;
+	}
+	if ((res = pa5_journal_open(settings->rootdir, &settings->keys, journal_bytes)) < 0 &&
+	    res != -ENOENT)
+	{
+		printf("Error: Could not open the journal: %s.\n", strerror(-res));
+		return EXIT_FAILURE;
+	}
+	pa5_stats_register("journal", pa5_journal_stats);
+	pa5_stats_register("pool", pa5_pool_stats);
+
+	/* PA5_MEM_LIMIT=<bytes> bounds what the chunk cache and the pools hold
+	 * together; they are also shrunk whenever the kernel reports memory
+	 * pressure, limit or not. PA5_OOM_SCORE_ADJ defaults to -1000, which
+	 * keeps the OOM killer off the daemon if it is allowed to lower it. */
+	const char *mem_limit = setting(options.mem_limit, "PA5_MEM_LIMIT");
+	const char *oom_score_adj = setting(options.oom_score_adj, "PA5_OOM_SCORE_ADJ");
+	uint64_t mem_bytes = 0;
+	if (mem_limit && parse_number(mem_limit, &mem_bytes) < 0)
+	{
+		printf("Error: Bad memory limit %s.\n", mem_limit);
+		return EXIT_FAILURE;
+	}
+	settings->oom_adj = oom_score_adj ? atoi(oom_score_adj) : PA5_MEM_DEFAULT_OOM_ADJ;
+	if (settings->oom_adj < -1000 || settings->oom_adj > 1000)
+	{
+		printf("Error: oom_score_adj %s is outside -1000 to 1000.\n", oom_score_adj);
+		return EXIT_FAILURE;
+	}
+	pa5_mem_set_limit(mem_bytes);
+	pa5_mem_register("cache", pa5_cache_memory, pa5_cache_cap);
+	pa5_mem_register("pool", pa5_pool_memory, pa5_pool_trim);
+	pa5_stats_register("memory", pa5_mem_stats);
+
+	/* PA5_WARM=<seconds> is how often the hot chunks of the cache are
+	 * listed for warming it at the next mount, 0 to neither list them nor
+	 * warm. */
+	const char *warm = setting(options.warm, "PA5_WARM");
+	uint64_t warm_interval = PA5_WARM_DEFAULT_INTERVAL;
+	if (warm && (parse_number(warm, &warm_interval) < 0 || warm_interval > UINT_MAX))
+	{
+		printf("Error: Bad warm interval %s.\n", warm);
+		return EXIT_FAILURE;
+	}
+	if ((res = pa5_warm_open(settings->rootdir, &settings->keys, warm_interval)) < 0)
+	{
+		printf("Error: Could not open the warm manifest: %s.\n", strerror(-res));
+		return EXIT_FAILURE;
+	}
+	pa5_stats_register("warm", pa5_warm_stats);
+	pa5_stats_register("locks", pa5_lock_stats);
+
+	/* PA5_ADMIN_UID may change the settings below through PA5_CONTROL_FILE
+	 * while mounted; it defaults to the user mounting. */
+	const char *admin_uid = setting(options.admin_uid, "PA5_ADMIN_UID");
+	uint64_t admin = getuid();
+	if (admin_uid && (parse_number(admin_uid, &admin) < 0 || admin != (uid_t)admin))
+	{
+		printf("Error: Bad admin uid %s.\n", admin_uid);
+		return EXIT_FAILURE;
+	}
+	settings->admin_uid = admin;
+	pa5_control_register("cache_size", control_get_cache_size, control_set_cache_size);
+	pa5_control_register("log_level", control_get_log_level, control_set_log_level);
+	pa5_control_register("compress", control_get_compress, control_set_compress);
+	pa5_control_register("sched_slots", control_get_sched_slots, control_set_sched_slots);
+	pa5_control_register("sched_limits", control_get_sched_limits, control_set_sched_limits);
+	pa5_control_register("sched_weights", pa5_sched_print_weights, control_set_sched_weights);
+	pa5_control_register("mem_limit", control_get_mem_limit, control_set_mem_limit);
+	pa5_stats_register("control", pa5_control_stats);
+
+	int ret = fuse_main(args.argc, args.argv, &xmp_oper, settings);
+	fuse_opt_free_args(&args);
 	free(settings);
 	return ret;
 }
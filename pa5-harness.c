@@ -0,0 +1,55 @@
+/* pa5-harness.c
+ * Runs the pa5-encfs callbacks in process, without mounting anything.
+ */
+
+#include "pa5-harness.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static struct fuse_context context;
+static pa5_harness_body_t harness_body;
+static void *harness_arg;
+
+/* Every thread shares one context; the callbacks only use private_data. */
+struct fuse_context *fuse_get_context(void)
+{
+	return &context;
+}
+
+int fuse_main_real(int argc, char *argv[], const struct fuse_operations *op, size_t op_size,
+		   void *user_data)
+{
+	struct fuse_conn_info conn;
+	int res;
+
+	(void) argc;
+	(void) argv;
+	(void) op_size;
+
+	context.uid = getuid();
+	context.gid = getgid();
+	context.pid = getpid();
+	context.private_data = user_data;
+
+	memset(&conn, 0, sizeof(conn));
+	if (op->init)
+		context.private_data = op->init(&conn);
+
+	res = harness_body(op, harness_arg);
+
+	if (op->destroy)
+		op->destroy(context.private_data);
+	return res;
+}
+
+int pa5_harness_run(const char *password, const char *mirror, pa5_harness_body_t body,
+		    void *arg)
+{
+	char *argv[] = { "pa5-harness", (char *)password, "pa5-harness", (char *)mirror, NULL };
+
+	harness_body = body;
+	harness_arg = arg;
+	return pa5_encfs_main(4, argv);
+}
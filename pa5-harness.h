@@ -0,0 +1,31 @@
+/* pa5-harness.h
+ * Runs the pa5-encfs callbacks in process, without mounting anything.
+ *
+ * Link against pa5-encfs.c compiled with -Dmain=pa5_encfs_main. The harness
+ * supplies fuse_get_context() and fuse_main_real(), so the daemon's own
+ * main() does all of its usual setup and then hands the callbacks to the
+ * harness instead of the kernel. No privileges and no FUSE device are
+ * needed.
+ */
+
+#ifndef PA5_HARNESS_H
+#define PA5_HARNESS_H
+
+#define FUSE_USE_VERSION 28
+#include <fuse.h>
+
+/* Runs with init() done and before destroy(). Returns the exit status. */
+typedef int (*pa5_harness_body_t)(const struct fuse_operations *op, void *arg);
+
+/* int pa5_harness_run(const char *password, const char *mirror, ...)
+ * Purpose: Start the daemon on the mirror directory and run body against
+ *          its callbacks.
+ * Return: body's return value, or EXIT_FAILURE if startup failed
+ */
+int pa5_harness_run(const char *password, const char *mirror, pa5_harness_body_t body,
+		    void *arg);
+
+/* Entry point of pa5-encfs.c when built for the harness. */
+int pa5_encfs_main(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,155 @@
+/* pa5-inode.c
+ * Per-inode state shared by the FUSE callbacks and the background workers.
+ */
+
+#include "pa5-inode.h"
+#include "pa5-pool.h"
+#include "pa5-lock.h"
+
+#include <string.h>
+
+#define INODE_LOCKS 64
+#define INODE_BUCKETS 256
+#define INODE_SIZES 1024
+
+struct open_inode
+{
+	dev_t dev;
+	ino_t ino;
+	int opens;
+	struct open_inode *next;
+};
+
+/* A plaintext size and the backing file state it was taken from. */
+struct inode_size
+{
+	dev_t dev;
+	ino_t ino;
+	off_t backing;
+	struct timespec mtime;
+	struct timespec ctime;
+	off_t size;
+};
+
+static pthread_rwlock_t inode_locks[INODE_LOCKS];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct open_inode *table[INODE_BUCKETS];
+static struct inode_size sizes[INODE_SIZES];
+static struct pa5_pool inode_pool = PA5_POOL_INIT("inode", sizeof(struct open_inode), 0, 32);
+
+static unsigned inode_hash(dev_t dev, ino_t ino)
+{
+	return (unsigned)(ino ^ (dev << 7) ^ (ino >> 17));
+}
+
+void pa5_inode_init(void)
+{
+	int i;
+	for (i = 0; i < INODE_LOCKS; i++)
+		pthread_rwlock_init(&inode_locks[i], NULL);
+}
+
+pthread_rwlock_t *pa5_inode_lock(dev_t dev, ino_t ino)
+{
+	return &inode_locks[inode_hash(dev, ino) % INODE_LOCKS];
+}
+
+void pa5_inode_get(dev_t dev, ino_t ino)
+{
+	struct open_inode **bucket = &table[inode_hash(dev, ino) % INODE_BUCKETS];
+	struct open_inode *e;
+
+	pa5_mutex_lock(&table_lock, PA5_LOCK_INODE_TABLE);
+	for (e = *bucket; e; e = e->next)
+		if (e->dev == dev && e->ino == ino)
+			break;
+
+	if (!e && (e = pa5_pool_get(&inode_pool)) != NULL)
+	{
+		memset(e, 0, sizeof(*e));
+		e->dev = dev;
+		e->ino = ino;
+		e->next = *bucket;
+		*bucket = e;
+	}
+	if (e)
+		e->opens++;
+	pthread_mutex_unlock(&table_lock);
+}
+
+void pa5_inode_put(dev_t dev, ino_t ino)
+{
+	struct open_inode **pp = &table[inode_hash(dev, ino) % INODE_BUCKETS];
+
+	pa5_mutex_lock(&table_lock, PA5_LOCK_INODE_TABLE);
+	while (*pp && ((*pp)->dev != dev || (*pp)->ino != ino))
+		pp = &(*pp)->next;
+
+	if (*pp && --(*pp)->opens == 0)
+	{
+		struct open_inode *e = *pp;
+		*pp = e->next;
+		pa5_pool_put(&inode_pool, e);
+	}
+	pthread_mutex_unlock(&table_lock);
+}
+
+int pa5_inode_busy(dev_t dev, ino_t ino)
+{
+	struct open_inode *e;
+	int busy = 0;
+
+	pa5_mutex_lock(&table_lock, PA5_LOCK_INODE_TABLE);
+	for (e = table[inode_hash(dev, ino) % INODE_BUCKETS]; e; e = e->next)
+	{
+		if (e->dev == dev && e->ino == ino)
+		{
+			busy = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&table_lock);
+
+	return busy;
+}
+
+void pa5_inode_size_set(const struct stat *st, off_t size)
+{
+	struct inode_size *e = &sizes[inode_hash(st->st_dev, st->st_ino) % INODE_SIZES];
+
+	pa5_mutex_lock(&table_lock, PA5_LOCK_INODE_TABLE);
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->backing = st->st_size;
+	e->mtime = st->st_mtim;
+	e->ctime = st->st_ctim;
+	e->size = size;
+	pthread_mutex_unlock(&table_lock);
+}
+
+void pa5_inode_size_drop(dev_t dev, ino_t ino)
+{
+	struct inode_size *e = &sizes[inode_hash(dev, ino) % INODE_SIZES];
+
+	pa5_mutex_lock(&table_lock, PA5_LOCK_INODE_TABLE);
+	if (e->dev == dev && e->ino == ino)
+		memset(e, 0, sizeof(*e));
+	pthread_mutex_unlock(&table_lock);
+}
+
+int pa5_inode_size_get(const struct stat *st, off_t *size)
+{
+	struct inode_size *e = &sizes[inode_hash(st->st_dev, st->st_ino) % INODE_SIZES];
+	int known;
+
+	pa5_mutex_lock(&table_lock, PA5_LOCK_INODE_TABLE);
+	known = (e->ino != 0 && e->dev == st->st_dev && e->ino == st->st_ino &&
+		 e->backing == st->st_size &&
+		 e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+		 e->ctime.tv_sec == st->st_ctim.tv_sec && e->ctime.tv_nsec == st->st_ctim.tv_nsec);
+	if (known)
+		*size = e->size;
+	pthread_mutex_unlock(&table_lock);
+
+	return known;
+}
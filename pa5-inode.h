@@ -0,0 +1,44 @@
+/* pa5-inode.h
+ * Per-inode state shared by the FUSE callbacks and the background workers.
+ *
+ * Encrypted files are rewritten in place, so readers and writers of the same
+ * backing inode are serialised through a fixed set of lock stripes. The
+ * number of pa5-encfs handles open on each backing inode is also tracked, so
+ * workers that replace a backing file can tell whether anyone still holds
+ * the old one. The plaintext size of recently seen encrypted files is kept
+ * against the backing file's size and times, so that stat() need not open
+ * and verify the file each time.
+ */
+
+#ifndef PA5_INODE_H
+#define PA5_INODE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+void pa5_inode_init(void);
+
+/* Lock stripe guarding the backing inode. */
+pthread_rwlock_t *pa5_inode_lock(dev_t dev, ino_t ino);
+
+/* Count a handle opened or closed on the inode. */
+void pa5_inode_get(dev_t dev, ino_t ino);
+void pa5_inode_put(dev_t dev, ino_t ino);
+
+/* Returns 1 while any handle is open on the inode. */
+int pa5_inode_busy(dev_t dev, ino_t ino);
+
+/* Remembers size as the plaintext size of the backing file st describes.
+ * Called with the inode lock held, right after the size was read or
+ * changed. */
+void pa5_inode_size_set(const struct stat *st, off_t size);
+
+/* Forgets the plaintext size of the inode, as after a failed write. */
+void pa5_inode_size_drop(dev_t dev, ino_t ino);
+
+/* Returns 1 and the plaintext size at *size if it is known for the backing
+ * file st describes and the file has not changed since, 0 otherwise. */
+int pa5_inode_size_get(const struct stat *st, off_t *size);
+
+#endif
@@ -0,0 +1,460 @@
+/* pa5-io.c
+ * Backing-store I/O engine for pa5-encfs.
+ *
+ * The io_uring backend talks to the kernel through the raw syscalls so that
+ * no extra library is needed. Each FUSE worker thread lazily sets up its own
+ * ring the first time it submits a batch, which keeps submission lock free;
+ * the ring is torn down when the thread exits.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-io.h"
+#include "pa5-stats.h"
+#include "pa5-log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#define COPY_BUFFER (1 << 20)
+#define URING_MAX_FAILS 16   /* Enters in a row that fail before a ring is given up. */
+
+static unsigned io_depth = PA5_IO_DEFAULT_DEPTH;
+static int uring_enabled = 0;
+
+/* Synchronous fallback, also used for single requests where a ring round
+ * trip buys nothing. Writes are always completed in full. */
+static void sync_one(struct pa5_io_req *req)
+{
+	size_t done = 0;
+	ssize_t err = 0;
+	uint64_t start = pa5_stats_now();
+
+	while (done < req->len)
+	{
+		ssize_t res;
+		if (req->write)
+			res = pwrite(req->fd, (char *)req->buf + done, req->len - done, req->off + done);
+		else
+			res = pread(req->fd, (char *)req->buf + done, req->len - done, req->off + done);
+
+		if (res == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			break;
+		}
+		if (res == 0)
+			break;
+		done += res;
+	}
+
+	req->res = err ? err : (ssize_t)done;
+	pa5_stats_add(req->write ? PA5_CTR_BACKING_WRITTEN : PA5_CTR_BACKING_READ, done);
+	pa5_stats_time(PA5_TIME_IO, start, err);
+}
+
+static int sync_submit(struct pa5_io_req *reqs, int nreqs, pa5_io_done_t done)
+{
+	int i;
+	int err = 0;
+
+	for (i = 0; i < nreqs; i++)
+	{
+		sync_one(&reqs[i]);
+		if (done)
+		{
+			int res = done(&reqs[i]);
+			if (res < 0 && err == 0)
+				err = res;
+		}
+	}
+	return err;
+}
+
+#ifdef HAVE_IO_URING
+
+struct pa5_ring
+{
+	int fd;
+	unsigned entries;
+
+	void *sq_ptr;
+	size_t sq_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	void *cq_ptr;
+	size_t cq_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static __thread struct pa5_ring *thread_ring = NULL;
+
+static void ring_free(struct pa5_ring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring);
+}
+
+static void ring_destructor(void *ptr)
+{
+	if (ptr)
+		ring_free((struct pa5_ring *)ptr);
+}
+
+static void ring_key_create(void)
+{
+	pthread_key_create(&ring_key, ring_destructor);
+}
+
+static struct pa5_ring *ring_setup(unsigned entries)
+{
+	struct io_uring_params p;
+	struct pa5_ring *ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+	{
+		free(ring);
+		return NULL;
+	}
+	ring->entries = p.sq_entries;
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+	{
+		ring->sq_ptr = NULL;
+		ring_free(ring);
+		return NULL;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ptr = ring->sq_ptr;
+	else
+	{
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+		{
+			ring->cq_ptr = NULL;
+			ring_free(ring);
+			return NULL;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		ring->sqes = NULL;
+		ring_free(ring);
+		return NULL;
+	}
+
+	ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+	ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+	return ring;
+}
+
+static struct pa5_ring *get_ring(void)
+{
+	if (thread_ring)
+		return thread_ring;
+
+	pthread_once(&ring_once, ring_key_create);
+	thread_ring = ring_setup(io_depth);
+	if (thread_ring)
+		pthread_setspecific(ring_key, thread_ring);
+	return thread_ring;
+}
+
+/* Finishes a short write synchronously so callers only ever see full writes
+ * or errors, the same guarantee the fallback gives. */
+static void finish_write(struct pa5_io_req *req)
+{
+	if (req->res < 0 || (size_t)req->res >= req->len)
+		return;
+
+	struct pa5_io_req rest = *req;
+	rest.buf = (char *)req->buf + req->res;
+	rest.len = req->len - req->res;
+	rest.off = req->off + req->res;
+	sync_one(&rest);
+	req->res = (rest.res < 0) ? rest.res : (ssize_t)(req->res + rest.res);
+}
+
+static int uring_submit(struct pa5_ring *ring, struct pa5_io_req *reqs, int nreqs,
+			pa5_io_done_t done)
+{
+	int next = 0;
+	unsigned queued = 0;   /* Placed in the SQ but not yet taken by the kernel. */
+	unsigned inflight = 0; /* Taken by the kernel, completion outstanding. */
+	unsigned fails = 0;    /* Enters in a row that failed and reaped nothing. */
+	int enter_err = 0;
+	int err = 0;
+
+	while (next < nreqs || queued > 0 || inflight > 0)
+	{
+		unsigned tail = *ring->sq_tail;
+		unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+		while (next < nreqs && inflight + queued < ring->entries &&
+		       tail - head < ring->entries)
+		{
+			struct pa5_io_req *req = &reqs[next];
+			unsigned idx = tail & *ring->sq_mask;
+			struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+			req->iov.iov_base = req->buf;
+			req->iov.iov_len = req->len;
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = req->fd;
+			sqe->addr = (unsigned long)&req->iov;
+			sqe->len = 1;
+			sqe->off = req->off;
+			sqe->user_data = next;
+			ring->sq_array[idx] = idx;
+			req->res = -EINPROGRESS;
+
+			tail++;
+			next++;
+			queued++;
+		}
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+		/* Block for a completion only when nothing more can be queued. */
+		unsigned wait = (next == nreqs || inflight + queued == ring->entries) ? 1 : 0;
+		uint64_t start = pa5_stats_now();
+		int res = syscall(__NR_io_uring_enter, ring->fd, queued, wait,
+				  IORING_ENTER_GETEVENTS, NULL, 0);
+		pa5_stats_time(PA5_TIME_IO, start, res);
+		if (res < 0)
+		{
+			/* Transient failures still reap below, as EBUSY asks for. A
+			 * ring that keeps failing is given up on. */
+			enter_err = errno;
+			int transient = (errno == EINTR || errno == EAGAIN || errno == EBUSY);
+			if ((!transient && inflight == 0) || ++fails == URING_MAX_FAILS)
+				break;
+		}
+		else
+		{
+			queued -= res;
+			inflight += res;
+			fails = 0;
+		}
+
+		unsigned chead = *ring->cq_head;
+		unsigned ctail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		if (chead != ctail)
+			fails = 0;
+		while (chead != ctail)
+		{
+			struct io_uring_cqe *cqe = &ring->cqes[chead & *ring->cq_mask];
+			struct pa5_io_req *req = &reqs[cqe->user_data];
+
+			req->res = cqe->res;
+			chead++;
+			inflight--;
+
+			if (req->write)
+				finish_write(req);
+			if (req->res > 0)
+				pa5_stats_add(req->write ? PA5_CTR_BACKING_WRITTEN : PA5_CTR_BACKING_READ,
+					      req->res);
+			if (done)
+			{
+				int dres = done(req);
+				if (dres < 0 && err == 0)
+					err = dres;
+			}
+		}
+		__atomic_store_n(ring->cq_head, chead, __ATOMIC_RELEASE);
+	}
+
+	/* The ring failed. Drop it so the stale entries can never be submitted
+	 * later, which also cancels any the kernel still holds, then finish
+	 * every request without a completion synchronously. Only the outcome
+	 * of the requests counts, not that of the failed enters. */
+	if (next < nreqs || queued > 0 || inflight > 0)
+	{
+		int i;
+		pa5_warn("io_uring failed (%s), using synchronous I/O.", strerror(enter_err));
+		thread_ring = NULL;
+		pthread_setspecific(ring_key, NULL);
+		ring_free(ring);
+
+		for (i = 0; i < nreqs; i++)
+		{
+			if (i < next && reqs[i].res != -EINPROGRESS)
+				continue;
+			int res = sync_submit(&reqs[i], 1, done);
+			if (res < 0 && err == 0)
+				err = res;
+		}
+	}
+	return err;
+}
+
+#endif /* HAVE_IO_URING */
+
+int pa5_io_init(unsigned depth, int use_uring)
+{
+	if (depth > 0)
+		io_depth = depth;
+	uring_enabled = 0;
+
+#ifdef HAVE_IO_URING
+	if (use_uring)
+	{
+		/* Probe once here; the real rings are created per thread. */
+		struct pa5_ring *probe = ring_setup(io_depth);
+		if (probe)
+		{
+			ring_free(probe);
+			uring_enabled = 1;
+		}
+	}
+#else
+	(void) use_uring;
+#endif
+
+	return uring_enabled;
+}
+
+int pa5_io_submit(struct pa5_io_req *reqs, int nreqs, pa5_io_done_t done)
+{
+#ifdef HAVE_IO_URING
+	if (uring_enabled && nreqs > 1)
+	{
+		struct pa5_ring *ring = get_ring();
+		if (ring)
+			return uring_submit(ring, reqs, nreqs, done);
+	}
+#endif
+	return sync_submit(reqs, nreqs, done);
+}
+
+const char *pa5_io_backend(void)
+{
+	return uring_enabled ? "io_uring" : "sync";
+}
+
+/* Copies len bytes at off from in to out, in the kernel if it can. */
+static int copy_extent(int in, int out, off_t off, off_t len, char **buf)
+{
+	while (len > 0)
+	{
+		loff_t in_off = off, out_off = off;
+		ssize_t n = copy_file_range(in, &in_off, out, &out_off, len, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+		    errno != EOPNOTSUPP)
+			return -errno;
+		if (n == -1)
+		{
+			/* Not between these files; copy through a buffer. */
+			if (!*buf && !(*buf = malloc(COPY_BUFFER)))
+				return -ENOMEM;
+			n = pread(in, *buf, (len < COPY_BUFFER) ? len : COPY_BUFFER, off);
+			if (n > 0 && pwrite(out, *buf, n, off) != n)
+				return -EIO;
+			if (n == -1)
+				return -errno;
+		}
+		if (n == 0)
+			break;
+		pa5_stats_add(PA5_CTR_BACKING_READ, n);
+		pa5_stats_add(PA5_CTR_BACKING_WRITTEN, n);
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int pa5_io_copy(int in, int out, off_t len)
+{
+	struct stat st;
+	char *buf = NULL;
+	off_t data, hole;
+	int res = 0;
+
+	if (fstat(in, &st) == -1)
+		return -errno;
+	if (ftruncate(out, 0) == -1)
+		return -errno;
+#ifdef FICLONE
+	if (len == st.st_size && ioctl(out, FICLONE, in) == 0)
+		return 0;
+#endif
+
+	/* Only the data extents, so that sparse files stay sparse. */
+	for (data = 0; data < len && res == 0; data = hole)
+	{
+		if ((data = lseek(in, data, SEEK_DATA)) == -1 || data >= len)
+			break;
+		if ((hole = lseek(in, data, SEEK_HOLE)) == -1)
+			hole = len;
+		if (hole > len)
+			hole = len;
+		res = copy_extent(in, out, data, hole - data, &buf);
+	}
+	free(buf);
+	if (res == 0 && ftruncate(out, len) == -1)
+		res = -errno;
+	return res;
+}
@@ -0,0 +1,70 @@
+/* pa5-io.h
+ * Backing-store I/O engine for pa5-encfs.
+ *
+ * Callers describe a batch of chunk reads or writes against backing file
+ * descriptors and hand it to pa5_io_submit(). When the kernel supports
+ * io_uring the whole batch is queued on a per-thread ring and the completion
+ * callback runs as each chunk finishes, so the caller can decrypt one chunk
+ * while the others are still in flight. Without io_uring the same batch is
+ * served with plain pread()/pwrite() calls.
+ *
+ * Whole files are copied with pa5_io_copy(), which never moves the data
+ * through user space when the kernel can copy or share it.
+ */
+
+#ifndef PA5_IO_H
+#define PA5_IO_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define PA5_IO_DEFAULT_DEPTH 64
+
+struct pa5_io_req
+{
+	int fd;
+	int write;     /* 1 = write buf to fd, 0 = read from fd into buf */
+	void *buf;
+	size_t len;
+	off_t off;
+	ssize_t res;   /* Bytes transferred or -errno, set before the callback runs. */
+	void *data;    /* Caller cookie, untouched by the engine. */
+	struct iovec iov;  /* Private to the engine. */
+};
+
+/* Completion callback, called once per request in completion order.
+ * A negative return value is reported back by pa5_io_submit(). */
+typedef int (*pa5_io_done_t)(struct pa5_io_req *req);
+
+/* int pa5_io_init(unsigned depth, int use_uring)
+ * Purpose: Select the I/O backend. Probes io_uring when use_uring is set and
+ *          falls back to synchronous syscalls when it is unavailable.
+ * Args: unsigned depth : Maximum requests in flight per thread
+ *       int use_uring  : 0 forces the synchronous backend
+ * Return: 1 if io_uring will be used, 0 otherwise
+ */
+int pa5_io_init(unsigned depth, int use_uring);
+
+/* int pa5_io_submit(struct pa5_io_req *reqs, int nreqs, pa5_io_done_t done)
+ * Purpose: Run a batch of requests and wait for all of them to complete.
+ * Args: reqs  : Array of requests, res is filled in for every entry
+ *       nreqs : Number of requests
+ *       done  : Optional completion callback
+ * Return: 0 on success, first negative value returned by done otherwise
+ */
+int pa5_io_submit(struct pa5_io_req *reqs, int nreqs, pa5_io_done_t done);
+
+/* int pa5_io_copy(int in, int out, off_t len)
+ * Purpose: Make out a copy of the first len bytes of in, which must be all
+ *          of it or the start of it. The extents are shared (FICLONE) where
+ *          the filesystem can, and otherwise copied in the kernel with
+ *          copy_file_range(), or through a buffer as a last resort. Holes
+ *          in in stay holes in out.
+ * Return: 0 on success, -errno on error
+ */
+int pa5_io_copy(int in, int out, off_t len);
+
+/* Name of the active backend, "io_uring" or "sync". */
+const char *pa5_io_backend(void);
+
+#endif
@@ -0,0 +1,891 @@
+/* pa5-journal.c
+ * Write-ahead journal for chunk files.
+ *
+ * Records are appended under the journal lock, each writer copying its
+ * slots straight from its batch buffers with one pwritev(). Committing is
+ * done by whichever waiting writer finds no fdatasync() running: it syncs
+ * everything appended so far outside the lock and wakes the others, whose
+ * records that covered too. Writers count as active from their append
+ * until their slots are in place, and a checkpoint waits for them to drain
+ * and holds new ones back until the new epoch is on disk.
+ *
+ * The paths named since the last checkpoint are kept in a hash table, so
+ * that renaming a file the journal knows nothing about costs no sync.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-journal.h"
+#include "pa5-stripe.h"
+#include "pa5-stats.h"
+#include "pa5-log.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#define JOURNAL_MAGIC "PA5W"
+#define JOURNAL_HEADER 64
+#define RECORD_MAGIC "PA5R"
+#define RECORD_HEAD 64            /* Fixed part, before the path. */
+#define RECORD_ENTRY 24
+#define RECORD_MAC 32
+#define RECORD_HEADER 0x01        /* First entry is a chunk header. */
+#define CHECKPOINT_INTERVAL 30    /* Seconds records may wait for a checkpoint. */
+#define MIN_TABLE 256
+
+/* A path named by a record of the current epoch. */
+struct named
+{
+	struct named *next;
+	uint64_t created;            /* Replay: last record with a chunk header, plus 1. */
+	size_t len;
+	char path[];
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;         /* Commits and checkpoints finishing. */
+	pthread_cond_t wake;         /* The worker. */
+	pthread_t worker;
+	int running;
+	int ready;
+	int fd;
+	int rootfd;
+	char *rootdir;
+	size_t rootlen;
+	unsigned char key[32];
+	uint64_t limit;
+	uint64_t epoch;
+	off_t tail;                  /* End of the records appended. */
+	off_t durable;               /* End of the records on disk. */
+	int flushing;
+	int checkpointing;
+	unsigned active;
+	time_t first_record;         /* When the epoch got its first record. */
+
+	struct named **names;
+	size_t nnames;
+	size_t names_cap;            /* Power of two. */
+
+	unsigned long long records;
+	unsigned long long bytes;
+	unsigned long long commits;
+	unsigned long long unlogged;
+	unsigned long long full_waits;
+	unsigned long long checkpoints;
+	unsigned long long replayed;
+	unsigned long long skipped;
+} journal = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.fd = -1,
+	.rootfd = -1
+};
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static uint16_t get_le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+	put_le32(p, (uint32_t)v);
+	put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+	return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static void hmac_sha256(const unsigned char *key, const void *data, size_t len,
+			unsigned char out[32])
+{
+	unsigned int outlen = 32;
+	HMAC(EVP_sha256(), key, 32, data, len, out, &outlen);
+}
+
+static uint64_t hash_path(const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+	return h;
+}
+
+/* MAC of a record from the digest of its iov entries. */
+static int record_mac(const struct iovec *iov, int n, unsigned char mac[32])
+{
+	unsigned char digest[32];
+	unsigned int dlen = 32;
+	int ok;
+	int i;
+
+	EVP_MD_CTX *md = EVP_MD_CTX_new();
+	ok = md && EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+	for (i = 0; ok && i < n; i++)
+		ok = EVP_DigestUpdate(md, iov[i].iov_base, iov[i].iov_len);
+	ok = ok && EVP_DigestFinal_ex(md, digest, &dlen);
+	EVP_MD_CTX_free(md);
+	if (!ok)
+		return -ENOMEM;
+	hmac_sha256(journal.key, digest, sizeof(digest), mac);
+	return 0;
+}
+
+/* ---- Names ----
+ * All called with the journal locked. */
+
+static struct named *name_find(const char *path, size_t len)
+{
+	struct named *n;
+
+	if (!journal.names)
+		return NULL;
+	n = journal.names[hash_path(path, len) & (journal.names_cap - 1)];
+	while (n && (n->len != len || memcmp(n->path, path, len) != 0))
+		n = n->next;
+	return n;
+}
+
+/* Doubles the table once it holds as many names as buckets. A table that
+ * cannot grow keeps working with longer chains. */
+static void names_grow(void)
+{
+	size_t cap = journal.names_cap ? journal.names_cap * 2 : MIN_TABLE;
+	struct named **names = calloc(cap, sizeof(*names));
+	size_t i;
+
+	if (!names)
+		return;
+	for (i = 0; i < journal.names_cap; i++)
+	{
+		struct named *n = journal.names[i];
+		while (n)
+		{
+			struct named *next = n->next;
+			size_t b = hash_path(n->path, n->len) & (cap - 1);
+			n->next = names[b];
+			names[b] = n;
+			n = next;
+		}
+	}
+	free(journal.names);
+	journal.names = names;
+	journal.names_cap = cap;
+}
+
+static struct named *name_add(const char *path, size_t len)
+{
+	struct named *n = name_find(path, len);
+
+	if (n)
+		return n;
+	if (journal.nnames >= journal.names_cap)
+		names_grow();
+	if (!journal.names || (n = malloc(sizeof(*n) + len)) == NULL)
+		return NULL;
+	n->created = 0;
+	n->len = len;
+	memcpy(n->path, path, len);
+
+	size_t b = hash_path(path, len) & (journal.names_cap - 1);
+	n->next = journal.names[b];
+	journal.names[b] = n;
+	journal.nnames++;
+	return n;
+}
+
+static void names_clear(void)
+{
+	size_t i;
+
+	for (i = 0; i < journal.names_cap; i++)
+	{
+		while (journal.names[i])
+		{
+			struct named *n = journal.names[i];
+			journal.names[i] = n->next;
+			free(n);
+		}
+	}
+	journal.nnames = 0;
+}
+
+/* Whether a record names path or a file below it. */
+static int names_cover(const char *path)
+{
+	size_t len = strlen(path);
+	size_t i;
+
+	if (name_find(path, len))
+		return 1;
+	for (i = 0; i < journal.names_cap; i++)
+	{
+		struct named *n;
+		for (n = journal.names[i]; n; n = n->next)
+			if (n->len > len && n->path[len] == '/' && memcmp(n->path, path, len) == 0)
+				return 1;
+	}
+	return 0;
+}
+
+/* ---- Checkpoints ---- */
+
+static int header_write(uint64_t epoch)
+{
+	unsigned char hdr[JOURNAL_HEADER];
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, JOURNAL_MAGIC, 4);
+	hdr[4] = PA5_JOURNAL_VERSION;
+	put_le64(hdr + 8, epoch);
+	hmac_sha256(journal.key, hdr, 32, hdr + 32);
+	if (pwrite(journal.fd, hdr, sizeof(hdr), 0) != sizeof(hdr) || fdatasync(journal.fd) == -1)
+		return -EIO;
+	return 0;
+}
+
+/* Syncs what the records were written over and starts a new epoch.
+ * Called with the journal locked. */
+static int checkpoint(void)
+{
+	int res = 0;
+
+	if (journal.checkpointing)
+	{
+		while (journal.checkpointing)
+			pthread_cond_wait(&journal.cond, &journal.lock);
+		return 0;
+	}
+	if (journal.tail == JOURNAL_HEADER)
+		return 0;
+
+	journal.checkpointing = 1;
+	while (journal.active > 0)
+		pthread_cond_wait(&journal.cond, &journal.lock);
+	pthread_mutex_unlock(&journal.lock);
+
+	uint64_t start = pa5_stats_now();
+	if (syncfs(journal.rootfd) == -1)
+		res = -errno;
+	else if ((res = pa5_stripe_syncfs()) == 0)
+		res = header_write(journal.epoch + 1);
+	pa5_stats_time(PA5_TIME_IO, start, res);
+
+	pa5_mutex_lock(&journal.lock, PA5_LOCK_JOURNAL);
+	if (res == 0)
+	{
+		journal.epoch++;
+		journal.tail = journal.durable = JOURNAL_HEADER;
+		journal.checkpoints++;
+		names_clear();
+	}
+	else
+		pa5_error("Could not checkpoint the journal: %d.", res);
+	journal.checkpointing = 0;
+	pthread_cond_broadcast(&journal.cond);
+	return res;
+}
+
+static void *checkpoint_worker(void *arg)
+{
+	(void) arg;
+
+	pa5_mutex_lock(&journal.lock, PA5_LOCK_JOURNAL);
+	while (journal.running)
+	{
+		if (journal.tail > JOURNAL_HEADER &&
+		    ((uint64_t)journal.tail > journal.limit / 2 ||
+		     time(NULL) - journal.first_record >= CHECKPOINT_INTERVAL))
+		{
+			checkpoint();
+			continue;
+		}
+
+		struct timespec until = { time(NULL) + 1, 0 };
+		pthread_cond_timedwait(&journal.wake, &journal.lock, &until);
+	}
+	pthread_mutex_unlock(&journal.lock);
+	return NULL;
+}
+
+/* ---- Commits ---- */
+
+/* Name of cf's backing file below the mirror root, or 0 if it has none. */
+static size_t file_name(const struct pa5_chunk_file *cf, char path[PATH_MAX])
+{
+	char link[64];
+	struct stat st;
+
+	if (fstat(cf->fd, &st) == -1 || st.st_nlink == 0)
+		return 0;
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", cf->fd);
+	ssize_t len = readlink(link, path, PATH_MAX);
+	if (len <= (ssize_t)journal.rootlen || len >= PATH_MAX ||
+	    memcmp(path, journal.rootdir, journal.rootlen) != 0 || path[journal.rootlen] != '/')
+		return 0;
+	memmove(path, path + journal.rootlen, len - journal.rootlen);
+	return len - journal.rootlen;
+}
+
+/* Waits until the journal is on disk up to end. Called with it locked. */
+static int commit_wait(off_t end)
+{
+	while (journal.durable < end)
+	{
+		if (journal.flushing)
+		{
+			pthread_cond_wait(&journal.cond, &journal.lock);
+			continue;
+		}
+
+		off_t target = journal.tail;
+		journal.flushing = 1;
+		pthread_mutex_unlock(&journal.lock);
+		uint64_t start = pa5_stats_now();
+		int res = (fdatasync(journal.fd) == -1) ? -errno : 0;
+		pa5_stats_time(PA5_TIME_IO, start, res);
+		pa5_mutex_lock(&journal.lock, PA5_LOCK_JOURNAL);
+		journal.flushing = 0;
+		journal.commits++;
+		if (res == 0 && target > journal.durable)
+			journal.durable = target;
+		pthread_cond_broadcast(&journal.cond);
+		if (res < 0)
+			return res;
+	}
+	return 0;
+}
+
+int pa5_journal_commit(const struct pa5_chunk_file *cf, const unsigned char *header,
+		       off_t size, const struct pa5_journal_entry *entries, int n)
+{
+	unsigned char head[RECORD_HEAD + PATH_MAX];
+	unsigned char ents[PA5_CHUNK_BATCH + 1][RECORD_ENTRY];
+	unsigned char mac[RECORD_MAC];
+	struct iovec iov[2 * (PA5_CHUNK_BATCH + 1) + 2];
+	int niov = 0;
+	int nents = n + (header != NULL);
+	size_t len = RECORD_HEAD + RECORD_MAC;
+	int i;
+	int res;
+
+	if (n > PA5_CHUNK_BATCH)
+		return -EINVAL;
+	size_t plen = file_name(cf, (char *)head + RECORD_HEAD);
+
+	memset(head, 0, RECORD_HEAD);
+	memcpy(head, RECORD_MAGIC, 4);
+	head[4] = header ? RECORD_HEADER : 0;
+	put_le16(head + 6, plen);
+	put_le32(head + 8, nents);
+	put_le64(head + 32, size);
+	memcpy(head + 40, cf->file_id, 16);
+	iov[niov].iov_base = head;
+	iov[niov++].iov_len = RECORD_HEAD + plen;
+	len += plen;
+
+	for (i = 0; i < nents; i++)
+	{
+		const struct pa5_journal_entry *e = header ? &entries[i - 1] : &entries[i];
+		struct pa5_journal_entry h = { 0, 0, header, PA5_CHUNK_HEADER, PA5_CHUNK_HEADER };
+		if (header && i == 0)
+			e = &h;
+		put_le32(ents[i], e->root);
+		put_le32(ents[i] + 4, e->len);
+		put_le64(ents[i] + 8, e->off);
+		put_le32(ents[i] + 16, e->span);
+		put_le32(ents[i] + 20, 0);
+		iov[niov].iov_base = ents[i];
+		iov[niov++].iov_len = RECORD_ENTRY;
+		iov[niov].iov_base = (void *)e->buf;
+		iov[niov++].iov_len = e->len;
+		len += RECORD_ENTRY + e->len;
+	}
+	iov[niov].iov_base = mac;
+	iov[niov++].iov_len = RECORD_MAC;
+
+	pa5_mutex_lock(&journal.lock, PA5_LOCK_JOURNAL);
+	while (journal.checkpointing)
+		pthread_cond_wait(&journal.cond, &journal.lock);
+
+	/* Unnamed files vanish in a crash anyway, and a record bigger than
+	 * half the journal would leave no room to group commits. */
+	if (plen == 0 || len > journal.limit / 2)
+	{
+		journal.unlogged++;
+		journal.active++;
+		pthread_mutex_unlock(&journal.lock);
+		return 0;
+	}
+
+	while ((uint64_t)journal.tail + len > journal.limit)
+	{
+		journal.full_waits++;
+		if ((res = checkpoint()) < 0)
+		{
+			pthread_mutex_unlock(&journal.lock);
+			return res;
+		}
+	}
+
+	put_le64(head + 16, journal.epoch);
+	put_le32(head + 24, len);
+	if ((res = record_mac(iov, niov - 1, mac)) < 0)
+	{
+		pthread_mutex_unlock(&journal.lock);
+		return res;
+	}
+
+	off_t off = journal.tail;
+	ssize_t written = pwritev(journal.fd, iov, niov, off);
+	if (written != (ssize_t)len)
+	{
+		res = (written == -1) ? -errno : -EIO;
+		pthread_mutex_unlock(&journal.lock);
+		return res;
+	}
+	if (journal.tail == JOURNAL_HEADER)
+		journal.first_record = time(NULL);
+	journal.tail += len;
+	journal.records++;
+	journal.bytes += len;
+	pa5_stats_add(PA5_CTR_BACKING_WRITTEN, len);
+	if (!name_add((char *)head + RECORD_HEAD, plen))
+		pa5_warn("Could not track journaled file %.*s.", (int)plen, (char *)head + RECORD_HEAD);
+	if ((uint64_t)journal.tail > journal.limit / 2)
+		pthread_cond_signal(&journal.wake);
+
+	journal.active++;
+	if ((res = commit_wait(off + len)) < 0)
+	{
+		journal.active--;
+		pthread_cond_broadcast(&journal.cond);
+	}
+	pthread_mutex_unlock(&journal.lock);
+	return res;
+}
+
+void pa5_journal_done(void)
+{
+	pa5_mutex_lock(&journal.lock, PA5_LOCK_JOURNAL);
+	if (--journal.active == 0 && journal.checkpointing)
+		pthread_cond_broadcast(&journal.cond);
+	pthread_mutex_unlock(&journal.lock);
+}
+
+int pa5_journal_moving(const char *path)
+{
+	int res = 0;
+
+	if (!journal.ready)
+		return 0;
+	pa5_mutex_lock(&journal.lock, PA5_LOCK_JOURNAL);
+	if (names_cover(path))
+		res = checkpoint();
+	pthread_mutex_unlock(&journal.lock);
+	return res;
+}
+
+/* ---- Replay ---- */
+
+/* Whether fd lacks a chunk header that verifies, such as one that a
+ * crash cut short. */
+static int header_torn(int fd, const struct pa5_keys *keys)
+{
+	unsigned char hdr[PA5_CHUNK_HEADER];
+	unsigned char mac[32];
+
+	if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return 1;
+	hmac_sha256(keys->header_mac, hdr, 32, mac);
+	return CRYPTO_memcmp(mac, hdr + 32, 32) != 0;
+}
+
+/* Opens the backing file a record names and returns its descriptor, or -1
+ * if it is gone or is another file by now. A record that made the chunk
+ * header writes it again over a torn one, on an encrypted file only. */
+static int replay_open(const char *path, const unsigned char *rec, const unsigned char *header,
+		       const struct pa5_keys *keys, struct pa5_chunk_file *cf)
+{
+	char fpath[PATH_MAX];
+	char value[5] = { 0 };
+
+	snprintf(fpath, sizeof(fpath), "%s%s", journal.rootdir, path);
+	int fd = open(fpath, O_RDWR | O_NOFOLLOW);
+	if (fd == -1)
+		return -1;
+
+	int res = pa5_chunk_open(fd, keys, cf);
+	if (res < 0 && header && header_torn(fd, keys) &&
+	    fgetxattr(fd, "user.encrypted", value, 4) == 4 && strcmp(value, "true") == 0 &&
+	    pwrite(fd, header, PA5_CHUNK_HEADER, 0) == PA5_CHUNK_HEADER)
+		res = pa5_chunk_open(fd, keys, cf);
+	if (res == 0 && memcmp(cf->file_id, rec + 40, 16) == 0 &&
+	    !(cf->flags & PA5_CHUNK_FLAG_DEDUP))
+		return fd;
+	if (res == 0)
+		pa5_chunk_close(cf);
+	close(fd);
+	return -1;
+}
+
+/* Writes the slots of a verified record in place and sets the length. */
+static int replay_apply(const unsigned char *rec, const struct pa5_keys *keys)
+{
+	struct pa5_chunk_file cf;
+	char path[PATH_MAX];
+	struct stat st;
+	size_t plen = get_le16(rec + 6);
+	uint32_t nents = get_le32(rec + 8);
+	off_t size = get_le64(rec + 32);
+	const unsigned char *e = rec + RECORD_HEAD + plen;
+	const unsigned char *header = NULL;
+	uint32_t i;
+	int res = 0;
+
+	memcpy(path, rec + RECORD_HEAD, plen);
+	path[plen] = '\0';
+	if (rec[4] & RECORD_HEADER)
+		header = e + RECORD_ENTRY;
+
+	int fd = replay_open(path, rec, header, keys, &cf);
+	if (fd < 0)
+	{
+		pa5_info("Journal: skipping a record of %s, which is gone or replaced.", path);
+		journal.skipped++;
+		return 0;
+	}
+
+	for (i = 0; i < nents && res == 0; i++)
+	{
+		unsigned root = get_le32(e);
+		size_t len = get_le32(e + 4);
+		off_t off = get_le64(e + 8);
+		off_t span = get_le32(e + 16);
+		int out = (root == 0) ? fd :
+			  (root < cf.stripe_width) ? pa5_stripe_get(&cf, root, 1) : -EIO;
+
+		if (out < 0)
+			res = out;
+		else if (pwrite(out, e + RECORD_ENTRY, len, off) != (ssize_t)len)
+			res = -EIO;
+		else if (root != 0 && (fstat(out, &st) == -1 ||
+				       (st.st_size < off + span && ftruncate(out, off + span) == -1)))
+			res = -errno;
+		if (root != 0 && out >= 0)
+			pa5_stripe_put(out);
+		e += RECORD_ENTRY + len;
+	}
+
+	if (res == 0 && fstat(fd, &st) == -1)
+		res = -errno;
+	if (res == 0 && st.st_size != size)
+	{
+		if (ftruncate(fd, size) == -1)
+			res = -errno;
+		else if (size < st.st_size)
+			res = pa5_stripe_truncate(&cf, size);
+	}
+	if (res == 0)
+		journal.replayed++;
+	else
+		pa5_error("Journal: could not replay a record of %s: %d.", path, res);
+	pa5_chunk_close(&cf);
+	close(fd);
+	return res;
+}
+
+/* Checks that the entries of a record fit it exactly, and that a record
+ * flagged RECORD_HEADER starts with a chunk header. */
+static int record_check(const unsigned char *rec, uint32_t len)
+{
+	size_t plen = get_le16(rec + 6);
+	uint32_t nents = get_le32(rec + 8);
+	size_t pos = RECORD_HEAD + plen;
+	uint32_t i;
+
+	if (plen < 2 || plen >= PATH_MAX || pos > len || rec[RECORD_HEAD] != '/' ||
+	    nents > PA5_CHUNK_BATCH + 1)
+		return -EIO;
+	for (i = 0; i < nents; i++)
+	{
+		if (pos + RECORD_ENTRY > len - RECORD_MAC)
+			return -EIO;
+		uint32_t elen = get_le32(rec + pos + 4);
+		if (get_le32(rec + pos) >= PA5_STRIPE_MAX || elen > len ||
+		    get_le32(rec + pos + 16) < elen ||
+		    (i == 0 && (rec[4] & RECORD_HEADER) &&
+		     (elen != PA5_CHUNK_HEADER || get_le32(rec + pos) != 0 || get_le64(rec + pos + 8) != 0)))
+			return -EIO;
+		pos += RECORD_ENTRY + elen;
+	}
+	if ((rec[4] & RECORD_HEADER) && nents == 0)
+		return -EIO;
+	return (pos == len - RECORD_MAC) ? 0 : -EIO;
+}
+
+/* Reads the record at off into *buf if it is a whole record of the
+ * current epoch, returning its length, or 0 where the records end. */
+static uint32_t record_read(off_t off, off_t end, unsigned char **buf)
+{
+	unsigned char head[RECORD_HEAD];
+	unsigned char mac[RECORD_MAC];
+
+	if (off + RECORD_HEAD + RECORD_MAC > end ||
+	    pread(journal.fd, head, sizeof(head), off) != sizeof(head) ||
+	    memcmp(head, RECORD_MAGIC, 4) != 0 || get_le64(head + 16) != journal.epoch)
+		return 0;
+	uint32_t len = get_le32(head + 24);
+	if (len < RECORD_HEAD + RECORD_MAC || off + len > end)
+		return 0;
+
+	unsigned char *rec = realloc(*buf, len);
+	if (!rec)
+		return 0;
+	*buf = rec;
+	struct iovec iov = { rec, len - RECORD_MAC };
+	if (pread(journal.fd, rec, len, off) != (ssize_t)len || record_check(rec, len) < 0 ||
+	    record_mac(&iov, 1, mac) < 0 ||
+	    CRYPTO_memcmp(mac, rec + len - RECORD_MAC, RECORD_MAC) != 0)
+		return 0;
+	return len;
+}
+
+/* Replays the records of the current epoch, in two passes: the first
+ * finds where they end and the last record that gave each path a new
+ * chunk header, so that the records of a file replaced since are skipped
+ * rather than written over its successor. */
+static int replay(const struct pa5_keys *keys)
+{
+	unsigned char *rec = NULL;
+	struct named *n;
+	struct stat st;
+	uint64_t count = 0;
+	uint64_t i;
+	uint32_t len;
+	off_t end;
+	off_t off;
+	int res = 0;
+
+	if (fstat(journal.fd, &st) == -1)
+		return -errno;
+	for (off = JOURNAL_HEADER; (len = record_read(off, st.st_size, &rec)) > 0; off += len)
+	{
+		if ((n = name_add((char *)rec + RECORD_HEAD, get_le16(rec + 6))) == NULL)
+		{
+			res = -ENOMEM;
+			goto out;
+		}
+		if (rec[4] & RECORD_HEADER)
+			n->created = count + 1;
+		count++;
+	}
+	end = off;
+
+	for (off = JOURNAL_HEADER, i = 0; off < end; off += len, i++)
+	{
+		if ((len = record_read(off, end, &rec)) == 0)
+		{
+			res = -EIO;
+			goto out;
+		}
+		n = name_find((char *)rec + RECORD_HEAD, get_le16(rec + 6));
+		if (n && i + 1 < n->created)
+		{
+			journal.skipped++;
+			continue;
+		}
+		if ((res = replay_apply(rec, keys)) < 0)
+			goto out;
+	}
+	if (count > 0)
+		pa5_info("Journal: replayed %llu records, skipped %llu.", journal.replayed,
+			 journal.skipped);
+
+out:
+	free(rec);
+	names_clear();
+	return (res < 0) ? res : (count > 0);
+}
+
+/* ---- Public interface ---- */
+
+int pa5_journal_open(const char *rootdir, const struct pa5_keys *keys, uint64_t size)
+{
+	unsigned char hdr[JOURNAL_HEADER];
+	unsigned char mac[32];
+	char path[PATH_MAX];
+	int res;
+
+	snprintf(path, sizeof(path), "%s/%s", rootdir, PA5_JOURNAL_FILE);
+	if ((journal.fd = open(path, O_RDWR | (size ? O_CREAT : 0), 0600)) == -1)
+		return -errno;
+	if ((journal.rootfd = open(rootdir, O_RDONLY | O_DIRECTORY)) == -1 ||
+	    (journal.rootdir = strdup(rootdir)) == NULL)
+	{
+		res = (journal.rootfd == -1) ? -errno : -ENOMEM;
+		goto fail;
+	}
+	journal.rootlen = strlen(rootdir);
+	hmac_sha256(keys->header_mac, "pa5 journal", 11, journal.key);
+	journal.limit = (size && size < PA5_JOURNAL_MIN_SIZE) ? PA5_JOURNAL_MIN_SIZE : size;
+
+	/* A missing or torn header means no record was ever committed under
+	 * it: the header is synced before the first one is appended. */
+	memset(hdr, 0, sizeof(hdr));
+	ssize_t got = pread(journal.fd, hdr, sizeof(hdr), 0);
+	hmac_sha256(journal.key, hdr, 32, mac);
+	if (got == sizeof(hdr) && memcmp(hdr, JOURNAL_MAGIC, 4) == 0 &&
+	    hdr[4] == PA5_JOURNAL_VERSION && CRYPTO_memcmp(mac, hdr + 32, 32) == 0)
+	{
+		journal.epoch = get_le64(hdr + 8);
+		if ((res = replay(keys)) < 0)
+			goto fail;
+		if (res > 0 && (syncfs(journal.rootfd) == -1 || pa5_stripe_syncfs() < 0))
+		{
+			res = -EIO;
+			goto fail;
+		}
+	}
+	else if (got != 0)
+	{
+		/* Records left behind may carry any epoch, so start empty. */
+		if (got > 0)
+			pa5_warn("Journal header is not valid, starting a new journal.");
+		if (ftruncate(journal.fd, 0) == -1)
+		{
+			res = -errno;
+			goto fail;
+		}
+	}
+
+	/* A new epoch even without records, so that none of the old one can
+	 * pass for a record of this mount. */
+	if ((res = header_write(++journal.epoch)) < 0)
+		goto fail;
+	journal.tail = journal.durable = JOURNAL_HEADER;
+
+	if (!size)
+	{
+		unlink(path);
+		pa5_journal_close();
+		return 0;
+	}
+	journal.ready = 1;
+	return 0;
+
+fail:
+	pa5_journal_close();
+	return res;
+}
+
+int pa5_journal_start(void)
+{
+	int res;
+
+	if (!journal.ready)
+		return 0;
+	journal.running = 1;
+	if ((res = pthread_create(&journal.worker, NULL, checkpoint_worker, NULL)) != 0)
+	{
+		journal.running = 0;
+		return -res;
+	}
+	return 0;
+}
+
+void pa5_journal_close(void)
+{
+	pa5_mutex_lock(&journal.lock, PA5_LOCK_JOURNAL);
+	if (journal.running)
+	{
+		journal.running = 0;
+		pthread_cond_signal(&journal.wake);
+		pthread_mutex_unlock(&journal.lock);
+		pthread_join(journal.worker, NULL);
+		pa5_mutex_lock(&journal.lock, PA5_LOCK_JOURNAL);
+	}
+	if (journal.ready)
+		checkpoint();
+	journal.ready = 0;
+	names_clear();
+	free(journal.names);
+	journal.names = NULL;
+	journal.names_cap = 0;
+	pthread_mutex_unlock(&journal.lock);
+
+	if (journal.fd != -1)
+		close(journal.fd);
+	if (journal.rootfd != -1)
+		close(journal.rootfd);
+	free(journal.rootdir);
+	journal.fd = journal.rootfd = -1;
+	journal.rootdir = NULL;
+}
+
+int pa5_journal_ready(void)
+{
+	return journal.ready;
+}
+
+void pa5_journal_stats(FILE *out)
+{
+	pa5_mutex_lock(&journal.lock, PA5_LOCK_JOURNAL);
+	fprintf(out, "enabled %d\n", journal.ready);
+	if (journal.ready)
+	{
+		fprintf(out, "limit_bytes %llu\n", (unsigned long long)journal.limit);
+		fprintf(out, "used_bytes %llu\n", (unsigned long long)(journal.tail - JOURNAL_HEADER));
+		fprintf(out, "epoch %llu\n", (unsigned long long)journal.epoch);
+		fprintf(out, "records %llu\n", journal.records);
+		fprintf(out, "record_bytes %llu\n", journal.bytes);
+		fprintf(out, "commits %llu\n", journal.commits);
+		fprintf(out, "records_per_commit %.2f\n",
+			journal.commits ? (double)journal.records / journal.commits : 0.0);
+		fprintf(out, "unlogged %llu\n", journal.unlogged);
+		fprintf(out, "checkpoints %llu\n", journal.checkpoints);
+		fprintf(out, "full_waits %llu\n", journal.full_waits);
+	}
+	fprintf(out, "replayed %llu\n", journal.replayed);
+	fprintf(out, "replay_skipped %llu\n", journal.skipped);
+	pthread_mutex_unlock(&journal.lock);
+}
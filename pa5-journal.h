@@ -0,0 +1,110 @@
+/* pa5-journal.h
+ * Write-ahead journal for chunk files.
+ *
+ * A chunk write seals its chunks and then overwrites their slots in place,
+ * so a crash in the middle can leave a slot half old and half new, which
+ * then fails verification, or a backing length that no longer matches the
+ * slots. With the journal on, every batch of sealed slots is first
+ * appended to PA5_JOURNAL_FILE in the mirror together with the backing
+ * length it leaves the file at, and only written in place once the record
+ * is on disk. Writes that arrive while a commit is running are committed
+ * together by the next one, so concurrent writers share one fdatasync()
+ * and the only synchronous I/O is sequential.
+ *
+ * The file starts with a 64-byte header holding an epoch and its MAC.
+ * Records follow it back to back:
+ *
+ *   0   magic "PA5R"
+ *   4   flags, RECORD_HEADER if the record holds a new chunk header
+ *   6   path length, little endian like every field below
+ *   8   entry count
+ *   16  epoch
+ *   24  record length
+ *   32  backing length of the file after the record
+ *   40  file id
+ *   64  path of the backing file below the mirror root
+ *       entries: root, length, offset and span (the bytes the slot takes),
+ *       then the sealed slot as it is to be written
+ *       HMAC-SHA256 under a key derived from the volume header key of a
+ *       SHA-256 digest of everything before it
+ *
+ * A checkpoint syncs the mirror roots, so that everything written in place
+ * is on disk, and starts a new epoch at the start of the file. It runs in
+ * the background once the journal is half full or has held records for a
+ * while, in the foreground when it is full, and at unmount. At mount the
+ * records of the current epoch are written in place again, up to the first
+ * torn one, and a checkpoint follows.
+ *
+ * Records name files by path, so a rename of a file that has records in
+ * the journal checkpoints it first; a file replay finds with another file
+ * id is left alone. Only slots in the mirror roots are journaled: mounts
+ * with a cache tier cannot use the journal, and deduplicated files keep
+ * their own write ordering. Copies made by pa5_chunk_clone() are synced
+ * instead. Run the offline tools only after a mount has replayed the
+ * journal.
+ *
+ * All functions return 0 on success and -errno on error.
+ */
+
+#ifndef PA5_JOURNAL_H
+#define PA5_JOURNAL_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "pa5-chunk.h"
+
+#define PA5_JOURNAL_FILE ".pa5-journal"
+#define PA5_JOURNAL_VERSION 1
+#define PA5_JOURNAL_DEFAULT_SIZE (64ULL << 20)
+#define PA5_JOURNAL_MIN_SIZE (4ULL << 20)   /* Room for several full batches. */
+#define PA5_JOURNAL_MAX_SIZE (1ULL << 40)   /* Keeps journal offsets well inside off_t. */
+
+/* One slot of a record, to be written at off in the file of root. */
+struct pa5_journal_entry
+{
+	unsigned root;      /* 0 for the primary file, else a stripe root. */
+	off_t off;
+	const void *buf;
+	size_t len;
+	size_t span;        /* Length the slot takes, at least len. */
+};
+
+/* int pa5_journal_open(const char *rootdir, const struct pa5_keys *keys, uint64_t size)
+ * Purpose: Replay the journal of the mirror at rootdir, if it has one, and
+ *          with size set journal chunk writes from now on, checkpointing
+ *          before the journal grows past size bytes. Without size the
+ *          journal is removed once replayed. Needs the stripe roots open.
+ * Return: 0 on success, -ENOENT if there is no journal and size is 0
+ */
+int pa5_journal_open(const char *rootdir, const struct pa5_keys *keys, uint64_t size);
+
+/* Starts the checkpoint worker. Called once the daemon has forked. */
+int pa5_journal_start(void);
+
+/* Stops the worker and checkpoints the journal. */
+void pa5_journal_close(void);
+
+int pa5_journal_ready(void);
+
+/* int pa5_journal_commit(const struct pa5_chunk_file *cf, const unsigned char *header,
+ *                        off_t size, const struct pa5_journal_entry *entries, int n)
+ * Purpose: Log n slots of cf, and its new chunk header if header is set,
+ *          leaving its backing file size bytes long, and wait until the
+ *          record is on disk. Files without a name in the mirror are not
+ *          logged. On success the caller writes the record in place and
+ *          then calls pa5_journal_done(), and no checkpoint runs meanwhile.
+ */
+int pa5_journal_commit(const struct pa5_chunk_file *cf, const unsigned char *header,
+		       off_t size, const struct pa5_journal_entry *entries, int n);
+void pa5_journal_done(void);
+
+/* Called before path (below the mount) is renamed away, or unlinked while
+ * it has other links: checkpoints the journal if it has records of a file
+ * at or below path. */
+int pa5_journal_moving(const char *path);
+
+/* Stats section with the records, commits and checkpoints. */
+void pa5_journal_stats(FILE *out);
+
+#endif
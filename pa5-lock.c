@@ -0,0 +1,169 @@
+/* pa5-lock.c
+ * Lock contention and queue depth profiling.
+ *
+ * Each class keeps its counters on a cache line of its own, so that two
+ * hot classes do not contend on the counters where their locks do not.
+ */
+
+#include "pa5-lock.h"
+#include "pa5-stats.h"
+
+#include <stdio.h>
+
+#ifdef PA5_LOCK_PROFILE
+
+static const char *class_names[PA5_LOCK_CLASSES] = {
+	"inode", "inode_table", "small_handle", "cache", "cache_resize", "cache_file",
+	"pool", "pool_list", "sched", "dedup", "small", "stripe", "tier", "tier_file",
+	"journal", "migrate", "log", "trace", "stats", "control", "mem", "warm"
+};
+
+static const char *queue_names[PA5_QUEUES] = { "sched", "migrate", "tier" };
+
+struct lock_class
+{
+	uint64_t acquires;
+	uint64_t contended;
+	uint64_t wait_ns;
+	uint64_t max_wait_ns;
+	uint64_t buckets[PA5_LOCK_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct queue
+{
+	uint64_t samples;
+	uint64_t sum;
+	uint64_t depth;
+	uint64_t max;
+} __attribute__((aligned(64)));
+
+static struct lock_class classes[PA5_LOCK_CLASSES];
+static struct queue queues[PA5_QUEUES];
+
+static void count(enum pa5_lock_class cls)
+{
+	__atomic_fetch_add(&classes[cls].acquires, 1, __ATOMIC_RELAXED);
+}
+
+static void count_wait(enum pa5_lock_class cls, uint64_t start)
+{
+	struct lock_class *c = &classes[cls];
+	uint64_t ns = pa5_stats_now() - start;
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+
+	while (bucket < PA5_LOCK_BUCKETS - 1 && us >= 1ULL << (2 * bucket))
+		bucket++;
+	__atomic_fetch_add(&c->acquires, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->contended, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->wait_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->buckets[bucket], 1, __ATOMIC_RELAXED);
+	if (ns > __atomic_load_n(&c->max_wait_ns, __ATOMIC_RELAXED))
+		__atomic_store_n(&c->max_wait_ns, ns, __ATOMIC_RELAXED);
+}
+
+int pa5_lock_profile_mutex(pthread_mutex_t *mutex, enum pa5_lock_class cls)
+{
+	if (pthread_mutex_trylock(mutex) == 0)
+	{
+		count(cls);
+		return 0;
+	}
+
+	uint64_t start = pa5_stats_now();
+	int res = pthread_mutex_lock(mutex);
+	count_wait(cls, start);
+	return res;
+}
+
+int pa5_lock_profile_rwlock(pthread_rwlock_t *rwlock, int write, enum pa5_lock_class cls)
+{
+	if ((write ? pthread_rwlock_trywrlock(rwlock) : pthread_rwlock_tryrdlock(rwlock)) == 0)
+	{
+		count(cls);
+		return 0;
+	}
+
+	uint64_t start = pa5_stats_now();
+	int res = write ? pthread_rwlock_wrlock(rwlock) : pthread_rwlock_rdlock(rwlock);
+	count_wait(cls, start);
+	return res;
+}
+
+void pa5_lock_profile_queue(enum pa5_queue queue, uint64_t depth)
+{
+	struct queue *q = &queues[queue];
+
+	__atomic_fetch_add(&q->samples, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&q->sum, depth, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->depth, depth, __ATOMIC_RELAXED);
+	if (depth > __atomic_load_n(&q->max, __ATOMIC_RELAXED))
+		__atomic_store_n(&q->max, depth, __ATOMIC_RELAXED);
+}
+
+void pa5_lock_stats(FILE *out)
+{
+	int cls, i;
+
+	fprintf(out, "enabled 1\n");
+	fprintf(out, "%-13s %12s %10s %7s %12s %12s\n", "class", "acquires", "contended",
+		"pct", "mean_wait_us", "max_wait_us");
+	for (cls = 0; cls < PA5_LOCK_CLASSES; cls++)
+	{
+		struct lock_class *c = &classes[cls];
+		uint64_t acquires = __atomic_load_n(&c->acquires, __ATOMIC_RELAXED);
+		uint64_t contended = __atomic_load_n(&c->contended, __ATOMIC_RELAXED);
+		uint64_t wait_ns = __atomic_load_n(&c->wait_ns, __ATOMIC_RELAXED);
+
+		if (acquires == 0)
+			continue;
+		fprintf(out, "%-13s %12llu %10llu %6.2f%% %12.1f %12.1f\n", class_names[cls],
+			(unsigned long long)acquires, (unsigned long long)contended,
+			100.0 * contended / acquires,
+			contended ? wait_ns / 1000.0 / contended : 0.0,
+			__atomic_load_n(&c->max_wait_ns, __ATOMIC_RELAXED) / 1000.0);
+	}
+
+	/* Waits of the contended acquisitions, by the time they took. */
+	fprintf(out, "%-13s", "wait_us");
+	for (i = 0; i < PA5_LOCK_BUCKETS; i++)
+	{
+		char label[24];
+		snprintf(label, sizeof(label), "%s%llu", (i < PA5_LOCK_BUCKETS - 1) ? "<" : ">=",
+			 1ULL << (2 * ((i < PA5_LOCK_BUCKETS - 1) ? i : i - 1)));
+		fprintf(out, " %9s", label);
+	}
+	fprintf(out, "\n");
+	for (cls = 0; cls < PA5_LOCK_CLASSES; cls++)
+	{
+		if (__atomic_load_n(&classes[cls].contended, __ATOMIC_RELAXED) == 0)
+			continue;
+		fprintf(out, "%-13s", class_names[cls]);
+		for (i = 0; i < PA5_LOCK_BUCKETS; i++)
+			fprintf(out, " %9llu", (unsigned long long)
+				__atomic_load_n(&classes[cls].buckets[i], __ATOMIC_RELAXED));
+		fprintf(out, "\n");
+	}
+
+	fprintf(out, "%-13s %12s %10s %10s %10s\n", "queue", "changes", "depth", "mean", "max");
+	for (i = 0; i < PA5_QUEUES; i++)
+	{
+		struct queue *q = &queues[i];
+		uint64_t samples = __atomic_load_n(&q->samples, __ATOMIC_RELAXED);
+
+		fprintf(out, "%-13s %12llu %10llu %10.1f %10llu\n", queue_names[i],
+			(unsigned long long)samples,
+			(unsigned long long)__atomic_load_n(&q->depth, __ATOMIC_RELAXED),
+			samples ? (double)__atomic_load_n(&q->sum, __ATOMIC_RELAXED) / samples : 0.0,
+			(unsigned long long)__atomic_load_n(&q->max, __ATOMIC_RELAXED));
+	}
+}
+
+#else
+
+void pa5_lock_stats(FILE *out)
+{
+	fprintf(out, "enabled 0\n");
+}
+
+#endif
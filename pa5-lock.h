@@ -0,0 +1,112 @@
+/* pa5-lock.h
+ * Lock contention and queue depth profiling.
+ *
+ * Every internal mutex and rwlock is taken through pa5_mutex_lock(),
+ * pa5_rwlock_rdlock() or pa5_rwlock_wrlock(), naming the class of lock it
+ * is: all the inode lock stripes are one class, all the cache shards
+ * another. The queues in front of the workers report their depth with
+ * pa5_queue_depth() whenever it changes.
+ *
+ * In a build with PA5_LOCK_PROFILE defined (make LOCK_PROFILE=1) each
+ * acquisition first tries the lock, and only one that has to wait is
+ * timed. Every class counts its acquisitions, the contended ones and their
+ * waits in a histogram, and every queue its depth, all in the "locks"
+ * stats section. The counters are shared between threads, which costs a
+ * little on the hottest locks. Without PA5_LOCK_PROFILE the functions here
+ * are the plain pthread calls and the section only says it is off.
+ */
+
+#ifndef PA5_LOCK_H
+#define PA5_LOCK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+enum pa5_lock_class
+{
+	PA5_LOCK_INODE,        /* Inode lock stripes. */
+	PA5_LOCK_INODE_TABLE,  /* Open handle counts and known sizes. */
+	PA5_LOCK_SMALL_HANDLE, /* Moving small file handles on promotion. */
+	PA5_LOCK_CACHE,        /* Cache shards. */
+	PA5_LOCK_CACHE_RESIZE,
+	PA5_LOCK_CACHE_FILE,   /* Lists of each file's cache entries. */
+	PA5_LOCK_POOL,         /* Depot of each pa5-pool. */
+	PA5_LOCK_POOL_LIST,
+	PA5_LOCK_SCHED,
+	PA5_LOCK_DEDUP,
+	PA5_LOCK_SMALL,
+	PA5_LOCK_STRIPE,
+	PA5_LOCK_TIER,
+	PA5_LOCK_TIER_FILE,    /* Per-file state of the cache tier. */
+	PA5_LOCK_JOURNAL,
+	PA5_LOCK_MIGRATE,
+	PA5_LOCK_LOG,
+	PA5_LOCK_TRACE,
+	PA5_LOCK_STATS,
+	PA5_LOCK_CONTROL,
+	PA5_LOCK_MEM,
+	PA5_LOCK_WARM,
+	PA5_LOCK_CLASSES
+};
+
+enum pa5_queue
+{
+	PA5_QUEUE_SCHED,       /* Callers waiting for a pa5-sched slot. */
+	PA5_QUEUE_MIGRATE,     /* Files waiting for conversion. */
+	PA5_QUEUE_TIER,        /* Dirty chunks waiting for writeback. */
+	PA5_QUEUES
+};
+
+#define PA5_LOCK_BUCKETS 12    /* Bucket i holds waits below 4^i us, the last the rest. */
+
+#ifdef PA5_LOCK_PROFILE
+int pa5_lock_profile_mutex(pthread_mutex_t *mutex, enum pa5_lock_class cls);
+int pa5_lock_profile_rwlock(pthread_rwlock_t *rwlock, int write, enum pa5_lock_class cls);
+void pa5_lock_profile_queue(enum pa5_queue queue, uint64_t depth);
+#endif
+
+static inline int pa5_mutex_lock(pthread_mutex_t *mutex, enum pa5_lock_class cls)
+{
+#ifdef PA5_LOCK_PROFILE
+	return pa5_lock_profile_mutex(mutex, cls);
+#else
+	(void) cls;
+	return pthread_mutex_lock(mutex);
+#endif
+}
+
+static inline int pa5_rwlock_rdlock(pthread_rwlock_t *rwlock, enum pa5_lock_class cls)
+{
+#ifdef PA5_LOCK_PROFILE
+	return pa5_lock_profile_rwlock(rwlock, 0, cls);
+#else
+	(void) cls;
+	return pthread_rwlock_rdlock(rwlock);
+#endif
+}
+
+static inline int pa5_rwlock_wrlock(pthread_rwlock_t *rwlock, enum pa5_lock_class cls)
+{
+#ifdef PA5_LOCK_PROFILE
+	return pa5_lock_profile_rwlock(rwlock, 1, cls);
+#else
+	(void) cls;
+	return pthread_rwlock_wrlock(rwlock);
+#endif
+}
+
+static inline void pa5_queue_depth(enum pa5_queue queue, uint64_t depth)
+{
+#ifdef PA5_LOCK_PROFILE
+	pa5_lock_profile_queue(queue, depth);
+#else
+	(void) queue;
+	(void) depth;
+#endif
+}
+
+/* Stats section with every lock class and queue. */
+void pa5_lock_stats(FILE *out);
+
+#endif
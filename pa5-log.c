@@ -0,0 +1,230 @@
+/* pa5-log.c
+ * Leveled, asynchronous logging for pa5-encfs.
+ *
+ * Each ring has exactly one producer (its thread) and one consumer (the
+ * drain thread), so head and tail with acquire/release ordering are all the
+ * synchronisation it needs. A ring outlives its thread until the drain
+ * thread has written out everything in it.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-log.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define RING_SLOTS 256          /* Power of two. */
+#define RECORD_MAX 240
+#define DRAIN_INTERVAL_MS 50
+
+struct log_record
+{
+	struct timespec when;
+	int level;
+	char msg[RECORD_MAX];
+};
+
+struct log_ring
+{
+	struct log_record records[RING_SLOTS];
+	unsigned head;          /* Next slot to write, owned by the producer. */
+	unsigned tail;          /* Next slot to drain, owned by the consumer. */
+	int retired;            /* Producer thread has exited. */
+	pid_t tid;
+	struct log_ring *next;
+};
+
+int pa5_log_threshold = PA5_LOG_ERROR;
+
+static const char *level_names[] = { "off", "error", "warn", "info", "debug" };
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *rings = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static __thread struct log_ring *thread_ring = NULL;
+
+static pthread_t drainer;
+static int draining = 0;
+static FILE *log_out = NULL;
+static unsigned long long dropped = 0;
+
+static void ring_retire(void *ptr)
+{
+	struct log_ring *ring = ptr;
+	__atomic_store_n(&ring->retired, 1, __ATOMIC_RELEASE);
+}
+
+static void ring_key_create(void)
+{
+	pthread_key_create(&ring_key, ring_retire);
+}
+
+static struct log_ring *get_ring(void)
+{
+	if (thread_ring)
+		return thread_ring;
+
+	pthread_once(&ring_once, ring_key_create);
+	struct log_ring *ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+	ring->tid = syscall(SYS_gettid);
+
+	pa5_mutex_lock(&rings_lock, PA5_LOCK_LOG);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+
+	pthread_setspecific(ring_key, ring);
+	thread_ring = ring;
+	return ring;
+}
+
+void pa5_log_write(enum pa5_log_level level, const char *fmt, ...)
+{
+	va_list ap;
+	struct log_ring *ring = get_ring();
+	if (!ring)
+	{
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	unsigned head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= RING_SLOTS)
+	{
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct log_record *rec = &ring->records[head & (RING_SLOTS - 1)];
+	clock_gettime(CLOCK_REALTIME, &rec->when);
+	rec->level = level;
+	va_start(ap, fmt);
+	vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+	va_end(ap);
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int pa5_log_parse_level(const char *name)
+{
+	unsigned i;
+	for (i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++)
+	{
+		if (strcmp(name, level_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *pa5_log_level_name(int level)
+{
+	if (level < PA5_LOG_OFF || level > PA5_LOG_DEBUG)
+		return "unknown";
+	return level_names[level];
+}
+
+void pa5_log_set_level(int level)
+{
+	if (level < PA5_LOG_OFF)
+		level = PA5_LOG_OFF;
+	if (level > PA5_LOG_DEBUG)
+		level = PA5_LOG_DEBUG;
+	__atomic_store_n(&pa5_log_threshold, level, __ATOMIC_RELAXED);
+}
+
+unsigned long long pa5_log_dropped(void)
+{
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+/* Writes out everything queued so far and frees the rings of threads that
+ * have exited. Returns the number of records written. */
+static int drain_rings(void)
+{
+	struct log_ring **link;
+	int written = 0;
+
+	pa5_mutex_lock(&rings_lock, PA5_LOCK_LOG);
+	link = &rings;
+	while (*link)
+	{
+		struct log_ring *ring = *link;
+		int retired = __atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE);
+		unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		unsigned tail = ring->tail;
+
+		for (; tail != head; tail++)
+		{
+			struct log_record *rec = &ring->records[tail & (RING_SLOTS - 1)];
+			struct tm tm;
+			char stamp[32];
+
+			localtime_r(&rec->when.tv_sec, &tm);
+			strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+			fprintf(log_out, "%s.%03ld [%d] %s: %s\n", stamp, rec->when.tv_nsec / 1000000,
+				(int)ring->tid, level_names[rec->level], rec->msg);
+			written++;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		if (retired)
+		{
+			*link = ring->next;
+			free(ring);
+		}
+		else
+			link = &ring->next;
+	}
+	pthread_mutex_unlock(&rings_lock);
+
+	if (written)
+		fflush(log_out);
+	return written;
+}
+
+static void *drain_worker(void *arg)
+{
+	struct timespec pause = { 0, DRAIN_INTERVAL_MS * 1000000L };
+
+	(void) arg;
+
+	while (__atomic_load_n(&draining, __ATOMIC_ACQUIRE))
+	{
+		if (drain_rings() == 0)
+			nanosleep(&pause, NULL);
+	}
+	drain_rings();
+
+	return NULL;
+}
+
+int pa5_log_start(FILE *out)
+{
+	log_out = out;
+	__atomic_store_n(&draining, 1, __ATOMIC_RELEASE);
+	int res = pthread_create(&drainer, NULL, drain_worker, NULL);
+	if (res != 0)
+	{
+		draining = 0;
+		return -res;
+	}
+	return 0;
+}
+
+void pa5_log_stop(void)
+{
+	if (!__atomic_exchange_n(&draining, 0, __ATOMIC_ACQ_REL))
+		return;
+
+	pthread_join(drainer, NULL);
+}
@@ -0,0 +1,59 @@
+/* pa5-log.h
+ * Leveled, asynchronous logging for pa5-encfs.
+ *
+ * A record is formatted on the calling thread into that thread's own ring
+ * buffer, and a background thread drains the rings to the log stream. The
+ * only thing a request thread ever waits on is its own vsnprintf(); if its
+ * ring is full the record is dropped and counted instead. A message below
+ * the current level costs one relaxed load and a compare, and its arguments
+ * are never evaluated.
+ */
+
+#ifndef PA5_LOG_H
+#define PA5_LOG_H
+
+#include <stdio.h>
+
+enum pa5_log_level
+{
+	PA5_LOG_OFF,
+	PA5_LOG_ERROR,
+	PA5_LOG_WARN,
+	PA5_LOG_INFO,
+	PA5_LOG_DEBUG
+};
+
+extern int pa5_log_threshold;
+
+#define pa5_log(level, ...) \
+	do { \
+		if ((int)(level) <= __atomic_load_n(&pa5_log_threshold, __ATOMIC_RELAXED)) \
+			pa5_log_write((level), __VA_ARGS__); \
+	} while (0)
+
+#define pa5_error(...) pa5_log(PA5_LOG_ERROR, __VA_ARGS__)
+#define pa5_warn(...)  pa5_log(PA5_LOG_WARN, __VA_ARGS__)
+#define pa5_info(...)  pa5_log(PA5_LOG_INFO, __VA_ARGS__)
+#define pa5_debug(...) pa5_log(PA5_LOG_DEBUG, __VA_ARGS__)
+
+/* Queues one record. Use the macros above so disabled levels stay free. */
+void pa5_log_write(enum pa5_log_level level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/* Parses "off", "error", "warn", "info" or "debug". Returns -1 if unknown. */
+int pa5_log_parse_level(const char *name);
+const char *pa5_log_level_name(int level);
+
+/* Changes the level; safe to call from a signal handler. */
+void pa5_log_set_level(int level);
+
+/* Starts the drain thread writing to out. Records queued before this are
+ * kept and written once it runs. pa5_log_stop() drains everything but leaves
+ * out open. */
+int pa5_log_start(FILE *out);
+void pa5_log_stop(void);
+
+/* Number of records dropped because a ring was full. */
+unsigned long long pa5_log_dropped(void);
+
+#endif
@@ -0,0 +1,552 @@
+/* pa5-macro.c
+ * End-to-end job runner for the mounted file system.
+ *
+ *   pa5-macro [-s MB] [-n ops] [-f files] <bare dir> <encfs dir>
+ *
+ * Runs every job first in the bare directory and then in the pa5-encfs
+ * mount, and prints one JSON document with both timings and the overhead
+ * ratio (encfs seconds / bare seconds) of each job. The bare directory
+ * should live on the same file system as the mirror behind the mount.
+ * pa5-macrobench.sh sets both up; see that script for the usual entry point.
+ *
+ * Jobs:
+ *   seq_write_<bs>, seq_read_<bs>  Sequential I/O at 4k, 128k and 1m blocks
+ *   rand_write_qd<n>, rand_read_qd<n>  Random 4 KiB I/O with n threads in
+ *                                      flight, n = 1, 4, 16
+ *   small_files     Create, write and fsync-free close of 4 KiB files, then
+ *                   unlink them all
+ *   tar_extract     Extract a generated source-like tree with tar(1)
+ *   stat_storm      lstat() every entry of the extracted tree, five passes,
+ *                   as `git status` does
+ *
+ * Page cache is dropped for the file with posix_fadvise() before each read
+ * job so reads reach the file system. tar is looked up in PATH and its two
+ * jobs are skipped if it is missing; nothing else outside this program is
+ * used.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+
+#define RAND_BLOCK 4096
+#define STAT_PASSES 5
+
+struct job_result
+{
+	double seconds;
+	uint64_t ops;
+	uint64_t bytes;
+	int error;         /* errno of the first failure, 0 if none. */
+};
+
+struct macro_config
+{
+	off_t size;
+	uint64_t nops;
+	unsigned nfiles;
+	char tarball[PATH_MAX];  /* Empty when tar is unavailable. */
+};
+
+struct rand_worker
+{
+	const char *path;
+	int write;
+	off_t blocks;
+	uint64_t ops;
+	uint64_t seed;
+	int error;
+};
+
+static struct macro_config cfg;
+static uint64_t stat_entries;
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Paths that would not fit come out empty, so the job fails with ENOENT. */
+static void join(char *out, const char *dir, const char *name)
+{
+	if (snprintf(out, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX)
+		out[0] = '\0';
+}
+
+static int remove_entry(const char *fpath, const struct stat *st, int type, struct FTW *ftw)
+{
+	(void) st;
+	(void) type;
+	(void) ftw;
+
+	remove(fpath);
+	return 0;
+}
+
+static void remove_tree(const char *path)
+{
+	nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int write_file(const char *path, size_t bs, off_t size, struct job_result *r)
+{
+	char *buf = malloc(bs);
+	off_t pos;
+	int res = 0;
+
+	if (!buf)
+		return ENOMEM;
+	memset(buf, 0xa5, bs);
+
+	int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd == -1)
+	{
+		free(buf);
+		return errno;
+	}
+	for (pos = 0; pos < size; pos += bs)
+	{
+		if (write(fd, buf, bs) != (ssize_t)bs)
+		{
+			res = errno ? errno : EIO;
+			break;
+		}
+		if (r)
+		{
+			r->ops++;
+			r->bytes += bs;
+		}
+	}
+	if (res == 0 && fsync(fd) == -1)
+		res = errno;
+	close(fd);
+	free(buf);
+	return res;
+}
+
+static void drop_cache(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd != -1)
+	{
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+static int job_seq_write(const char *dir, size_t bs, struct job_result *r)
+{
+	char path[PATH_MAX];
+	join(path, dir, "seq.dat");
+	return write_file(path, bs, cfg.size, r);
+}
+
+static int job_seq_read(const char *dir, size_t bs, struct job_result *r)
+{
+	char path[PATH_MAX];
+	char *buf = malloc(bs);
+	ssize_t n;
+
+	if (!buf)
+		return ENOMEM;
+	join(path, dir, "seq.dat");
+	drop_cache(path);
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		free(buf);
+		return errno;
+	}
+	while ((n = read(fd, buf, bs)) > 0)
+	{
+		r->ops++;
+		r->bytes += n;
+	}
+	int res = (n < 0) ? errno : 0;
+	close(fd);
+	free(buf);
+	return res;
+}
+
+static void *rand_thread(void *arg)
+{
+	struct rand_worker *w = arg;
+	char buf[RAND_BLOCK];
+	uint64_t x = w->seed;
+	uint64_t i;
+
+	memset(buf, 0x5a, sizeof(buf));
+	int fd = open(w->path, w->write ? O_WRONLY : O_RDONLY);
+	if (fd == -1)
+	{
+		w->error = errno;
+		return NULL;
+	}
+	for (i = 0; i < w->ops; i++)
+	{
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		off_t off = (off_t)((x * 0x2545f4914f6cdd1dULL) % w->blocks) * RAND_BLOCK;
+		ssize_t n = w->write ? pwrite(fd, buf, RAND_BLOCK, off) : pread(fd, buf, RAND_BLOCK, off);
+		if (n != RAND_BLOCK)
+		{
+			w->error = (n < 0) ? errno : EIO;
+			break;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static int job_random(const char *dir, int write, int qd, struct job_result *r)
+{
+	char path[PATH_MAX];
+	pthread_t threads[16];
+	struct rand_worker workers[16];
+	int res = 0;
+	int i;
+
+	join(path, dir, "seq.dat");
+	if (!write)
+		drop_cache(path);
+
+	for (i = 0; i < qd; i++)
+	{
+		workers[i].path = path;
+		workers[i].write = write;
+		workers[i].blocks = cfg.size / RAND_BLOCK;
+		workers[i].ops = cfg.nops / qd;
+		workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		workers[i].error = 0;
+		pthread_create(&threads[i], NULL, rand_thread, &workers[i]);
+	}
+	for (i = 0; i < qd; i++)
+	{
+		pthread_join(threads[i], NULL);
+		if (workers[i].error && !res)
+			res = workers[i].error;
+		r->ops += workers[i].ops;
+		r->bytes += workers[i].ops * RAND_BLOCK;
+	}
+	return res;
+}
+
+static int job_small_files(const char *dir, struct job_result *r)
+{
+	char sub[PATH_MAX];
+	char path[PATH_MAX];
+	char name[32];
+	unsigned i;
+	int res = 0;
+
+	join(sub, dir, "small");
+	if (mkdir(sub, 0755) == -1 && errno != EEXIST)
+		return errno;
+
+	for (i = 0; i < cfg.nfiles && !res; i++)
+	{
+		snprintf(name, sizeof(name), "f%u", i);
+		join(path, sub, name);
+		char buf[RAND_BLOCK];
+		memset(buf, 0x11, sizeof(buf));
+		int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if (fd == -1 || write(fd, buf, sizeof(buf)) != sizeof(buf))
+			res = errno ? errno : EIO;
+		if (fd != -1)
+			close(fd);
+		r->ops++;
+		r->bytes += sizeof(buf);
+	}
+	for (i = 0; i < cfg.nfiles && !res; i++)
+	{
+		snprintf(name, sizeof(name), "f%u", i);
+		join(path, sub, name);
+		if (unlink(path) == -1)
+			res = errno;
+		r->ops++;
+	}
+	rmdir(sub);
+	return res;
+}
+
+static int run_tar(const char *archive, const char *dir, int create)
+{
+	pid_t pid = fork();
+	if (pid == -1)
+		return errno;
+	if (pid == 0)
+	{
+		int null = open("/dev/null", O_WRONLY);
+		if (null != -1)
+			dup2(null, STDERR_FILENO);
+		if (create)
+			execlp("tar", "tar", "-C", dir, "-cf", archive, ".", (char *)NULL);
+		else
+			execlp("tar", "tar", "-C", dir, "-xf", archive, (char *)NULL);
+		_exit(127);
+	}
+
+	int status;
+	if (waitpid(pid, &status, 0) == -1)
+		return errno;
+	return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : EIO;
+}
+
+static int job_tar_extract(const char *dir, struct job_result *r)
+{
+	char sub[PATH_MAX];
+	struct stat st;
+
+	join(sub, dir, "tree");
+	if (mkdir(sub, 0755) == -1 && errno != EEXIST)
+		return errno;
+	int res = run_tar(cfg.tarball, sub, 0);
+	if (res == 0 && stat(cfg.tarball, &st) == 0)
+	{
+		r->ops = 1;
+		r->bytes = st.st_size;
+	}
+	return res;
+}
+
+static int count_stat(const char *fpath, const struct stat *st, int type, struct FTW *ftw)
+{
+	(void) fpath;
+	(void) st;
+	(void) type;
+	(void) ftw;
+
+	stat_entries++;
+	return 0;
+}
+
+static int job_stat_storm(const char *dir, struct job_result *r)
+{
+	char sub[PATH_MAX];
+	int i;
+
+	join(sub, dir, "tree");
+	for (i = 0; i < STAT_PASSES; i++)
+	{
+		stat_entries = 0;
+		if (nftw(sub, count_stat, 64, FTW_PHYS) == -1)
+			return errno;
+		r->ops += stat_entries;
+	}
+	remove_tree(sub);
+	return 0;
+}
+
+/* Builds a tree shaped like a source checkout and tars it up once, outside
+ * both directories under test. */
+static void make_tarball(const char *bare)
+{
+	char src[PATH_MAX];
+	char path[PATH_MAX];
+	char name[64];
+	unsigned d;
+	unsigned f;
+
+	snprintf(src, sizeof(src), "%s.tarsrc", bare);
+	snprintf(cfg.tarball, sizeof(cfg.tarball), "%s.tar", bare);
+	mkdir(src, 0755);
+	for (d = 0; d < 40; d++)
+	{
+		snprintf(name, sizeof(name), "dir%u", d);
+		join(path, src, name);
+		mkdir(path, 0755);
+		for (f = 0; f < 50; f++)
+		{
+			char file[PATH_MAX];
+			snprintf(name, sizeof(name), "file%u.c", f);
+			join(file, path, name);
+			write_file(file, 512, 512 * (1 + (d * 50 + f) % 32), NULL);
+		}
+	}
+	if (run_tar(cfg.tarball, src, 1) != 0)
+		cfg.tarball[0] = '\0';
+	remove_tree(src);
+}
+
+static const char *fs_name(const char *dir)
+{
+	struct statfs sfs;
+	if (statfs(dir, &sfs) == -1)
+		return "unknown";
+	switch ((unsigned long)sfs.f_type)
+	{
+	case 0x01021994UL:
+		return "tmpfs";
+	case 0xEF53UL:
+		return "ext4";
+	case 0x58465342UL:
+		return "xfs";
+	case 0x9123683EUL:
+		return "btrfs";
+	case 0x65735546UL:
+		return "fuse";
+	case 0x794c7630UL:
+		return "overlay";
+	default:
+		return "other";
+	}
+}
+
+static void print_result(const struct job_result *r)
+{
+	printf("{\"seconds\": %.6f, \"ops\": %llu, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f",
+	       r->seconds, (unsigned long long)r->ops, r->seconds > 0 ? r->ops / r->seconds : 0,
+	       r->seconds > 0 ? r->bytes / 1e6 / r->seconds : 0);
+	if (r->error)
+		printf(", \"error\": \"%s\"", strerror(r->error));
+	printf("}");
+}
+
+enum job_kind { SEQ_WRITE, SEQ_READ, RAND_WRITE, RAND_READ, SMALL_FILES, TAR, STAT_STORM };
+
+static int run_job(enum job_kind kind, int arg, const char *dir, struct job_result *r)
+{
+	switch (kind)
+	{
+	case SEQ_WRITE:
+		return job_seq_write(dir, arg, r);
+	case SEQ_READ:
+		return job_seq_read(dir, arg, r);
+	case RAND_WRITE:
+		return job_random(dir, 1, arg, r);
+	case RAND_READ:
+		return job_random(dir, 0, arg, r);
+	case SMALL_FILES:
+		return job_small_files(dir, r);
+	case TAR:
+		return job_tar_extract(dir, r);
+	case STAT_STORM:
+		return job_stat_storm(dir, r);
+	}
+	return EINVAL;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct
+	{
+		const char *name;
+		enum job_kind kind;
+		int arg;
+	} jobs[] = {
+		{ "seq_write_4k", SEQ_WRITE, 4096 },
+		{ "seq_read_4k", SEQ_READ, 4096 },
+		{ "seq_write_128k", SEQ_WRITE, 131072 },
+		{ "seq_read_128k", SEQ_READ, 131072 },
+		{ "seq_write_1m", SEQ_WRITE, 1048576 },
+		{ "seq_read_1m", SEQ_READ, 1048576 },
+		{ "rand_write_qd1", RAND_WRITE, 1 },
+		{ "rand_read_qd1", RAND_READ, 1 },
+		{ "rand_write_qd4", RAND_WRITE, 4 },
+		{ "rand_read_qd4", RAND_READ, 4 },
+		{ "rand_write_qd16", RAND_WRITE, 16 },
+		{ "rand_read_qd16", RAND_READ, 16 },
+		{ "small_files", SMALL_FILES, 0 },
+		{ "tar_extract", TAR, 0 },
+		{ "stat_storm", STAT_STORM, 0 },
+	};
+	const char *dirs[2];
+	int failed = 0;
+	int opt;
+	unsigned j;
+	int d;
+
+	cfg.size = 128 * 1024 * 1024;
+	cfg.nops = 20000;
+	cfg.nfiles = 5000;
+	while ((opt = getopt(argc, argv, "s:n:f:")) != -1)
+	{
+		switch (opt)
+		{
+		case 's':
+			cfg.size = (off_t)strtoul(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'n':
+			cfg.nops = strtoull(optarg, NULL, 10);
+			break;
+		case 'f':
+			cfg.nfiles = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (argc - optind != 2 || cfg.size < RAND_BLOCK)
+		goto usage;
+	dirs[0] = argv[optind];
+	dirs[1] = argv[optind + 1];
+
+	make_tarball(dirs[0]);
+
+	printf("{\n  \"bare_fs\": \"%s\",\n  \"encfs_fs\": \"%s\",\n", fs_name(dirs[0]),
+	       fs_name(dirs[1]));
+	printf("  \"size_mb\": %llu,\n  \"rand_ops\": %llu,\n  \"small_files\": %u,\n",
+	       (unsigned long long)(cfg.size >> 20), (unsigned long long)cfg.nops, cfg.nfiles);
+	printf("  \"jobs\": [");
+
+	for (j = 0; j < sizeof(jobs) / sizeof(jobs[0]); j++)
+	{
+		struct job_result r[2];
+
+		if ((jobs[j].kind == TAR || jobs[j].kind == STAT_STORM) && !cfg.tarball[0])
+			continue;
+
+		for (d = 0; d < 2; d++)
+		{
+			memset(&r[d], 0, sizeof(r[d]));
+			double start = now_seconds();
+			r[d].error = run_job(jobs[j].kind, jobs[j].arg, dirs[d], &r[d]);
+			r[d].seconds = now_seconds() - start;
+			if (r[d].error)
+			{
+				fprintf(stderr, "%s on %s: %s\n", jobs[j].name, dirs[d],
+					strerror(r[d].error));
+				failed = 1;
+			}
+		}
+
+		printf("%s\n    {\"name\": \"%s\", \"bare\": ", j ? "," : "", jobs[j].name);
+		print_result(&r[0]);
+		printf(", \"encfs\": ");
+		print_result(&r[1]);
+		printf(", \"overhead\": %.3f}", r[0].seconds > 0 ? r[1].seconds / r[0].seconds : 0);
+		fflush(stdout);
+	}
+	printf("\n  ]\n}\n");
+
+	for (d = 0; d < 2; d++)
+	{
+		char path[PATH_MAX];
+		join(path, dirs[d], "seq.dat");
+		unlink(path);
+	}
+	if (cfg.tarball[0])
+		unlink(cfg.tarball);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "usage: %s [-s MB] [-n ops] [-f files] <bare dir> <encfs dir>\n", argv[0]);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+# pa5-macrobench.sh
+# End-to-end benchmark of a mounted pa5-encfs against its bare backing store.
+#
+#   ./pa5-macrobench.sh [pa5-macro options]
+#
+# Sets up a scratch file system, mounts pa5-encfs on it and runs pa5-macro
+# against the bare directory and the mount. The JSON result goes to stdout.
+#
+# PA5_BENCH_FS picks the backing store:
+#   tmpfs    A fresh tmpfs (needs root)
+#   ext4     A fresh ext4 image on a loop device (needs root and mkfs.ext4)
+#   dir      A directory under $TMPDIR (default when not root)
+# Root defaults to tmpfs. Needs /dev/fuse and fusermount; no network.
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+PASSWORD=macrobench
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/pa5-macro.XXXXXX")
+FS=${PA5_BENCH_FS:-$( [ "$(id -u)" = 0 ] && echo tmpfs || echo dir )}
+SCRATCH=$WORK/scratch
+MNT=$WORK/mnt
+MOUNTED=
+
+cleanup()
+{
+	[ -n "$MOUNTED" ] && fusermount -u "$MNT" 2>/dev/null || true
+	if [ "$FS" != dir ]; then
+		umount "$SCRATCH" 2>/dev/null || true
+	fi
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$SCRATCH" "$MNT"
+case "$FS" in
+tmpfs)
+	mount -t tmpfs -o size=${PA5_BENCH_FS_SIZE:-2g} pa5-bench "$SCRATCH"
+	;;
+ext4)
+	truncate -s ${PA5_BENCH_FS_SIZE:-2g} "$WORK/ext4.img"
+	mkfs.ext4 -q -F "$WORK/ext4.img"
+	mount -o loop "$WORK/ext4.img" "$SCRATCH"
+	;;
+dir)
+	;;
+*)
+	echo "Unknown PA5_BENCH_FS $FS" >&2
+	exit 1
+	;;
+esac
+
+# user.* xattrs mark encrypted files, so the backing store must take them.
+mkdir -p "$SCRATCH/bare" "$SCRATCH/mirror"
+
+# pa5-encfs takes the mount point before the backing directory.
+"$HERE/pa5-encfs" "$PASSWORD" "$MNT" "$SCRATCH/mirror"
+MOUNTED=1
+
+"$HERE/pa5-macro" "$@" "$SCRATCH/bare" "$MNT"
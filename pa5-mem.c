@@ -0,0 +1,400 @@
+/* pa5-mem.c
+ * Memory accounting for the daemon's caches.
+ *
+ * The worker sleeps in poll() on the PSI trigger and a pipe that wakes it
+ * to stop, with a one second timeout for the regular check. Shrinking one
+ * subsystem can move memory into another rather than free it, as cache
+ * entries go back to the pools they came from, so a check over the limit
+ * takes a few passes, measuring afresh each time.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-mem.h"
+#include "pa5-log.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define MAX_SUBSYSTEMS 16
+#define CHECK_MS 1000
+#define OVER_PASSES 4
+#define PSI_TRIGGER "some 150000 1000000"   /* 150ms stalled in any second. */
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+enum pressure_source
+{
+	SOURCE_NONE,
+	SOURCE_PSI_CGROUP,
+	SOURCE_PSI,
+	SOURCE_CGROUP
+};
+
+static const char *source_names[] = { "none", "psi-cgroup", "psi", "cgroup" };
+
+struct subsystem
+{
+	const char *name;
+	pa5_mem_usage_t usage;
+	pa5_mem_shrink_t shrink;
+	size_t bytes;                /* As of the last check. */
+	int capped;
+	unsigned long long released; /* Bytes given up when shrunk. */
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	struct subsystem subsystems[MAX_SUBSYSTEMS];
+	unsigned n;
+	uint64_t limit;
+	size_t total;
+	time_t last_pressure;
+	int capped;
+
+	pthread_t worker;
+	int running;
+	int wake[2];
+	int psi_fd;
+	enum pressure_source source;
+	char cgroup[512];            /* Directory of our cgroup, if on cgroup v2. */
+
+	unsigned long long pressure_events;
+	unsigned long long over_limit;
+} mem = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = { -1, -1 }, .psi_fd = -1 };
+
+void pa5_mem_register(const char *name, pa5_mem_usage_t usage, pa5_mem_shrink_t shrink)
+{
+	pa5_mutex_lock(&mem.lock, PA5_LOCK_MEM);
+	if (mem.n < MAX_SUBSYSTEMS)
+	{
+		memset(&mem.subsystems[mem.n], 0, sizeof(mem.subsystems[0]));
+		mem.subsystems[mem.n].name = name;
+		mem.subsystems[mem.n].usage = usage;
+		mem.subsystems[mem.n].shrink = shrink;
+		mem.n++;
+	}
+	pthread_mutex_unlock(&mem.lock);
+}
+
+void pa5_mem_set_limit(uint64_t limit)
+{
+	__atomic_store_n(&mem.limit, limit, __ATOMIC_RELAXED);
+	pa5_mutex_lock(&mem.lock, PA5_LOCK_MEM);
+	if (mem.running)
+		(void) !write(mem.wake[1], "", 1);
+	pthread_mutex_unlock(&mem.lock);
+}
+
+uint64_t pa5_mem_limit(void)
+{
+	return __atomic_load_n(&mem.limit, __ATOMIC_RELAXED);
+}
+
+/* Reads a small file into buf as a string. Return: its length or -errno */
+static ssize_t read_file(const char *path, char *buf, size_t size)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	ssize_t n;
+
+	if (fd < 0)
+		return -errno;
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if (n < 0)
+		return -errno;
+	buf[n] = '\0';
+	return n;
+}
+
+/* Finds the directory of our cgroup on a unified hierarchy. */
+static void find_cgroup(void)
+{
+	char buf[1024];
+	char *p;
+
+	mem.cgroup[0] = '\0';
+	if (read_file("/proc/self/cgroup", buf, sizeof(buf)) <= 0)
+		return;
+	for (p = buf; p; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : NULL)
+	{
+		if (strncmp(p, "0::", 3) == 0)
+		{
+			size_t len = strcspn(p + 3, "\n");
+			snprintf(mem.cgroup, sizeof(mem.cgroup), CGROUP_ROOT "%.*s", (int)len, p + 3);
+			return;
+		}
+	}
+}
+
+/* Sets up a PSI trigger, on our cgroup if it has one and on the whole
+ * system otherwise. */
+static void open_psi(void)
+{
+	char path[600];
+	int fd;
+
+	mem.source = SOURCE_NONE;
+	if (mem.cgroup[0])
+	{
+		snprintf(path, sizeof(path), "%s/memory.pressure", mem.cgroup);
+		if ((fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) >= 0)
+		{
+			if (write(fd, PSI_TRIGGER, strlen(PSI_TRIGGER) + 1) > 0)
+			{
+				mem.psi_fd = fd;
+				mem.source = SOURCE_PSI_CGROUP;
+				return;
+			}
+			close(fd);
+		}
+	}
+	if ((fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC)) >= 0)
+	{
+		if (write(fd, PSI_TRIGGER, strlen(PSI_TRIGGER) + 1) > 0)
+		{
+			mem.psi_fd = fd;
+			mem.source = SOURCE_PSI;
+			return;
+		}
+		close(fd);
+	}
+	if (mem.cgroup[0])
+	{
+		snprintf(path, sizeof(path), "%s/memory.max", mem.cgroup);
+		if (access(path, R_OK) == 0)
+			mem.source = SOURCE_CGROUP;
+	}
+}
+
+/* Whether our cgroup is within a tenth of its memory.max. */
+static int cgroup_near_max(void)
+{
+	char path[600];
+	char buf[64];
+	unsigned long long current, max;
+
+	snprintf(path, sizeof(path), "%s/memory.max", mem.cgroup);
+	if (read_file(path, buf, sizeof(buf)) <= 0 || strncmp(buf, "max", 3) == 0)
+		return 0;
+	max = strtoull(buf, NULL, 10);
+	snprintf(path, sizeof(path), "%s/memory.current", mem.cgroup);
+	if (read_file(path, buf, sizeof(buf)) <= 0)
+		return 0;
+	current = strtoull(buf, NULL, 10);
+	return max > 0 && current > max - max / 10;
+}
+
+/* Measures every subsystem. Called locked. */
+static size_t measure(void)
+{
+	unsigned i;
+
+	mem.total = 0;
+	for (i = 0; i < mem.n; i++)
+	{
+		mem.subsystems[i].bytes = mem.subsystems[i].usage();
+		mem.total += mem.subsystems[i].bytes;
+	}
+	return mem.total;
+}
+
+/* Shrinks s to target and counts what it gave up. Called locked. */
+static void shrink_to(struct subsystem *s, size_t target)
+{
+	s->shrink(target);
+	size_t after = s->usage();
+	if (after < s->bytes)
+		s->released += s->bytes - after;
+	s->bytes = after;
+	s->capped = 1;
+	mem.capped = 1;
+}
+
+/* One check, with pressure set if the trigger fired. Called locked. */
+static void check(int pressure)
+{
+	time_t now = time(NULL);
+	uint64_t limit = pa5_mem_limit();
+	unsigned pass;
+	unsigned i;
+
+	measure();
+	if (pressure)
+	{
+		mem.pressure_events++;
+		mem.last_pressure = now;
+		for (i = 0; i < mem.n; i++)
+			if (mem.subsystems[i].shrink)
+				shrink_to(&mem.subsystems[i],
+					  mem.subsystems[i].bytes - mem.subsystems[i].bytes / 4);
+		pa5_info("Memory pressure, caches shrunk to %zu bytes.", measure());
+		return;
+	}
+
+	if (limit && mem.total > limit)
+	{
+		mem.over_limit++;
+		mem.last_pressure = now;
+		for (pass = 0; pass < OVER_PASSES && mem.total > limit; pass++)
+		{
+			size_t excess = mem.total - limit;
+			size_t shrinkable = 0;
+
+			for (i = 0; i < mem.n; i++)
+				if (mem.subsystems[i].shrink)
+					shrinkable += mem.subsystems[i].bytes;
+			if (shrinkable == 0)
+				break;
+			for (i = 0; i < mem.n; i++)
+			{
+				struct subsystem *s = &mem.subsystems[i];
+				if (!s->shrink || s->bytes == 0)
+					continue;
+				size_t share = (size_t)((double)excess * s->bytes / shrinkable) + 1;
+				shrink_to(s, (s->bytes > share) ? s->bytes - share : 0);
+			}
+			measure();
+		}
+		return;
+	}
+
+	if (mem.capped && now - mem.last_pressure >= PA5_MEM_RELAX)
+	{
+		for (i = 0; i < mem.n; i++)
+		{
+			if (mem.subsystems[i].capped)
+			{
+				mem.subsystems[i].shrink(SIZE_MAX);
+				mem.subsystems[i].capped = 0;
+			}
+		}
+		mem.capped = 0;
+	}
+}
+
+static void *mem_worker(void *arg)
+{
+	(void) arg;
+
+	for (;;)
+	{
+		struct pollfd fds[2] = {
+			{ .fd = mem.wake[0], .events = POLLIN },
+			{ .fd = mem.psi_fd, .events = POLLPRI }
+		};
+		int pressure = 0;
+
+		if (poll(fds, (mem.psi_fd >= 0) ? 2 : 1, CHECK_MS) < 0 && errno != EINTR)
+			break;
+		if (fds[0].revents & POLLIN)
+		{
+			char drain[16];
+			(void) !read(mem.wake[0], drain, sizeof(drain));
+		}
+		if (mem.psi_fd >= 0 && (fds[1].revents & POLLERR))
+		{
+			pa5_warn("Memory pressure trigger failed, checking the limit only.");
+			close(mem.psi_fd);
+			mem.psi_fd = -1;
+			mem.source = SOURCE_NONE;
+		}
+		pressure = (mem.psi_fd >= 0 && (fds[1].revents & POLLPRI)) ||
+			   (mem.source == SOURCE_CGROUP && cgroup_near_max());
+
+		pa5_mutex_lock(&mem.lock, PA5_LOCK_MEM);
+		if (!mem.running)
+		{
+			pthread_mutex_unlock(&mem.lock);
+			break;
+		}
+		check(pressure);
+		pthread_mutex_unlock(&mem.lock);
+	}
+	return NULL;
+}
+
+int pa5_mem_start(int oom_adj)
+{
+	char value[16];
+	int res;
+	int fd;
+
+	snprintf(value, sizeof(value), "%d", oom_adj);
+	if ((fd = open("/proc/self/oom_score_adj", O_WRONLY | O_CLOEXEC)) < 0 ||
+	    write(fd, value, strlen(value)) < 0)
+		pa5_warn("Could not set oom_score_adj to %d: %d.", oom_adj, -errno);
+	if (fd >= 0)
+		close(fd);
+
+	find_cgroup();
+	open_psi();
+	if (pipe2(mem.wake, O_CLOEXEC | O_NONBLOCK) == -1)
+		return -errno;
+
+	mem.running = 1;
+	if ((res = pthread_create(&mem.worker, NULL, mem_worker, NULL)) != 0)
+	{
+		mem.running = 0;
+		return -res;
+	}
+	return 0;
+}
+
+void pa5_mem_stop(void)
+{
+	pa5_mutex_lock(&mem.lock, PA5_LOCK_MEM);
+	if (!mem.running)
+	{
+		pthread_mutex_unlock(&mem.lock);
+		return;
+	}
+	mem.running = 0;
+	(void) !write(mem.wake[1], "", 1);
+	pthread_mutex_unlock(&mem.lock);
+
+	pthread_join(mem.worker, NULL);
+	close(mem.wake[0]);
+	close(mem.wake[1]);
+	mem.wake[0] = mem.wake[1] = -1;
+	if (mem.psi_fd >= 0)
+		close(mem.psi_fd);
+	mem.psi_fd = -1;
+}
+
+void pa5_mem_stats(FILE *out)
+{
+	char buf[64];
+	unsigned long long rss = 0;
+	unsigned i;
+
+	if (read_file("/proc/self/statm", buf, sizeof(buf)) > 0)
+	{
+		char *p = strchr(buf, ' ');
+		rss = p ? strtoull(p + 1, NULL, 10) * sysconf(_SC_PAGESIZE) : 0;
+	}
+
+	pa5_mutex_lock(&mem.lock, PA5_LOCK_MEM);
+	measure();
+	fprintf(out, "limit %llu\n", (unsigned long long)pa5_mem_limit());
+	fprintf(out, "total %zu\n", mem.total);
+	fprintf(out, "rss %llu\n", rss);
+	fprintf(out, "pressure_source %s\n", source_names[mem.source]);
+	fprintf(out, "pressure_events %llu\n", mem.pressure_events);
+	fprintf(out, "over_limit %llu\n", mem.over_limit);
+	if (read_file("/proc/self/oom_score_adj", buf, sizeof(buf)) > 0)
+		fprintf(out, "oom_score_adj %d\n", atoi(buf));
+	fprintf(out, "%-10s %14s %7s %14s\n", "subsystem", "bytes", "capped", "released");
+	for (i = 0; i < mem.n; i++)
+		fprintf(out, "%-10s %14zu %7d %14llu\n", mem.subsystems[i].name,
+			mem.subsystems[i].bytes, mem.subsystems[i].capped,
+			mem.subsystems[i].released);
+	pthread_mutex_unlock(&mem.lock);
+}
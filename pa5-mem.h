@@ -0,0 +1,53 @@
+/* pa5-mem.h
+ * Memory accounting for the daemon's caches.
+ *
+ * Every subsystem holding memory it could do without registers a function
+ * that reports its bytes and, if it can give some up, one that shrinks it.
+ * A worker adds them up once a second, and when the total is over the
+ * limit it shrinks each subsystem by its share of the excess, so the
+ * biggest gives up the most. Memory pressure does the same at once,
+ * taking a quarter off each. Pressure is a PSI trigger on the daemon's
+ * cgroup, or failing that on the whole system, or without PSI the cgroup
+ * nearing its memory.max. A subsystem that was shrunk is held there until
+ * the pressure has been gone for PA5_MEM_RELAX seconds.
+ *
+ * When the worker starts, it also lowers the daemon's oom_score_adj, so
+ * that the OOM killer takes some other process when the host runs out.
+ */
+
+#ifndef PA5_MEM_H
+#define PA5_MEM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PA5_MEM_RELAX 10              /* Seconds. */
+#define PA5_MEM_DEFAULT_OOM_ADJ (-1000)
+
+/* Bytes a subsystem holds. */
+typedef size_t (*pa5_mem_usage_t)(void);
+
+/* Brings a subsystem down to at most target bytes. It may keep itself
+ * there until it is called again with SIZE_MAX. */
+typedef void (*pa5_mem_shrink_t)(size_t target);
+
+/* Registers a subsystem. shrink may be NULL for one that is only reported. */
+void pa5_mem_register(const char *name, pa5_mem_usage_t usage, pa5_mem_shrink_t shrink);
+
+/* Sets the limit on the registered total in bytes, 0 for none. */
+void pa5_mem_set_limit(uint64_t limit);
+uint64_t pa5_mem_limit(void);
+
+/* int pa5_mem_start(int oom_adj)
+ * Purpose: Set the daemon's oom_score_adj to oom_adj and start the worker.
+ *          Called once the daemon has forked.
+ * Return: 0 on success, -errno if the worker could not be started
+ */
+int pa5_mem_start(int oom_adj);
+void pa5_mem_stop(void);
+
+/* Stats section with the total, the pressure seen and every subsystem. */
+void pa5_mem_stats(FILE *out);
+
+#endif
@@ -0,0 +1,441 @@
+/* pa5-migrate.c
+ * Online conversion of whole-file CBC files to the chunk format.
+ *
+ * One worker thread serves both the queue and the idle scan, so any
+ * temporary file the scan comes across is known to be stale.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-migrate.h"
+#include "pa5-inode.h"
+#include "pa5-sched.h"
+#include "pa5-log.h"
+#include "pa5-lock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#define MIGRATE_WINDOW (1024 * 1024)
+#define MIGRATE_QUEUE_MAX 1024
+
+struct migrate_item
+{
+	char *fpath;
+	struct migrate_item *next;
+};
+
+static struct pa5_migrate_config config;
+static pthread_t worker;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct migrate_item *queue_head = NULL;
+static struct migrate_item *queue_tail = NULL;
+static int queue_len = 0;
+static int running = 0;
+static time_t last_activity = 0;
+
+/* Returns 1 for an encrypted file that still has no chunk header. */
+static int is_legacy(int fd, const struct stat *st)
+{
+	char value[5] = { 0 };
+
+	if (!S_ISREG(st->st_mode) || st->st_size == 0)
+		return 0;
+	fgetxattr(fd, "user.encrypted", value, 5);
+	return (strcmp(value, "true") == 0 && pa5_chunk_probe(fd) == 0);
+}
+
+static int copy_xattrs(int src, int dst)
+{
+	char names[4096];
+	char value[4096];
+	ssize_t len = flistxattr(src, names, sizeof(names));
+	char *name;
+
+	if (len < 0)
+		return (errno == ENOTSUP) ? 0 : -errno;
+
+	for (name = names; name < names + len; name += strlen(name) + 1)
+	{
+		ssize_t vlen = fgetxattr(src, name, value, sizeof(value));
+		if (vlen < 0 || fsetxattr(dst, name, value, vlen, 0) == -1)
+			return -errno;
+	}
+	return 0;
+}
+
+static void sync_parent(const char *fpath)
+{
+	char dir[PATH_MAX];
+	char *slash;
+
+	strncpy(dir, fpath, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = '\0';
+	if ((slash = strrchr(dir, '/')) == NULL)
+		return;
+	*(slash == dir ? slash + 1 : slash) = '\0';
+
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd != -1)
+	{
+		fsync(fd);
+		close(fd);
+	}
+}
+
+/* Copies the plaintext of src into the chunk file, a window at a time so
+ * writers of the original are only held off for one window. */
+static int copy_plaintext(int src, pthread_rwlock_t *lock, const struct pa5_cbc_key *cbc_key,
+			  const struct pa5_chunk_file *cf)
+{
+	char *buf = malloc(MIGRATE_WINDOW);
+	off_t pos = 0;
+	int res = 0;
+
+	if (!buf)
+		return -ENOMEM;
+
+	for (;;)
+	{
+		pa5_sched_enter();
+		pa5_rwlock_rdlock(lock, PA5_LOCK_INODE);
+		res = pa5_cbc_read(src, cbc_key, buf, MIGRATE_WINDOW, pos);
+		pthread_rwlock_unlock(lock);
+		pa5_sched_leave();
+		if (res <= 0)
+			break;
+
+		int n = res;
+		if ((res = pa5_chunk_write(cf, buf, n, pos)) < 0)
+			break;
+		pos += n;
+	}
+
+	free(buf);
+	return res;
+}
+
+int pa5_migrate_file(const char *fpath, const struct pa5_cbc_key *cbc_key,
+		     const struct pa5_keys *keys)
+{
+	struct stat st;
+	struct stat now;
+	struct pa5_chunk_file cf;
+	char tmppath[PATH_MAX];
+	int created = 0;
+	int dst = -1;
+	int res = 0;
+
+	int src = open(fpath, O_RDONLY | O_NOFOLLOW);
+	if (src == -1)
+		return -errno;
+
+	/* Hard linked files would be split in two by the rename. */
+	if (fstat(src, &st) == -1 || st.st_nlink != 1 || !is_legacy(src, &st) ||
+	    pa5_inode_busy(st.st_dev, st.st_ino))
+		goto out;
+
+	const char *slash = strrchr(fpath, '/');
+	int dirlen = slash ? (int)(slash - fpath) : 0;
+	if (snprintf(tmppath, sizeof(tmppath), "%.*s/%s%lu.tmp", dirlen, fpath,
+		     PA5_MIGRATE_PREFIX, (unsigned long)st.st_ino) >= (int)sizeof(tmppath))
+	{
+		res = -ENAMETOOLONG;
+		goto out;
+	}
+
+	unlink(tmppath);
+	dst = open(tmppath, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (dst == -1)
+	{
+		res = -errno;
+		goto out;
+	}
+
+	pthread_rwlock_t *lock = pa5_inode_lock(st.st_dev, st.st_ino);
+	if ((res = copy_xattrs(src, dst)) < 0 ||
+	    (res = pa5_chunk_create(dst, keys, PA5_CHUNK_CODEC_MOUNT, &cf)) < 0)
+		goto out;
+	created = 1;
+	if ((res = copy_plaintext(src, lock, cbc_key, &cf)) < 0)
+		goto out;
+
+	if (fchown(dst, st.st_uid, st.st_gid) == -1)
+	{
+		/* Only possible as root, and harmless otherwise. */
+	}
+	if (fchmod(dst, st.st_mode & 07777) == -1)
+	{
+		res = -errno;
+		goto out;
+	}
+	if ((res = pa5_chunk_sync(&cf, 0)) < 0)
+		goto out;
+
+	/* Swap the files in only if nobody touched or opened the original. */
+	pa5_rwlock_wrlock(lock, PA5_LOCK_INODE);
+	if (fstat(src, &now) == 0 && now.st_nlink == 1 && now.st_size == st.st_size &&
+	    now.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+	    now.st_mtim.tv_nsec == st.st_mtim.tv_nsec &&
+	    !pa5_inode_busy(st.st_dev, st.st_ino))
+	{
+		struct timespec times[2] = { st.st_atim, st.st_mtim };
+		futimens(dst, times);
+		res = (rename(tmppath, fpath) == 0) ? 1 : -errno;
+	}
+	pthread_rwlock_unlock(lock);
+
+	if (res == 1)
+		sync_parent(fpath);
+
+out:
+	if (dst != -1)
+	{
+		/* A deduplicated, striped or tiered copy gives its chunks back. */
+		if (res != 1 && created)
+			pa5_chunk_truncate(&cf, 0);
+		if (created)
+			pa5_chunk_close(&cf);
+		close(dst);
+		if (res != 1)
+			unlink(tmppath);
+	}
+	close(src);
+	return res;
+}
+
+static int queue_pop(char **fpath)
+{
+	struct migrate_item *item = queue_head;
+	if (!item)
+		return 0;
+
+	queue_head = item->next;
+	if (!queue_head)
+		queue_tail = NULL;
+	queue_len--;
+	pa5_queue_depth(PA5_QUEUE_MIGRATE, queue_len);
+
+	*fpath = item->fpath;
+	free(item);
+	return 1;
+}
+
+/* Converts everything queued so far. Called with queue_lock held. */
+static void drain_queue(void)
+{
+	char *fpath;
+
+	while (running && queue_pop(&fpath))
+	{
+		pthread_mutex_unlock(&queue_lock);
+		int res = pa5_migrate_file(fpath, config.cbc_key, config.keys);
+		if (res < 0)
+			pa5_error("Could not migrate %s to the chunk format: %d.", fpath, res);
+		else if (res == 1)
+			pa5_info("Migrated %s to the chunk format.", fpath);
+		free(fpath);
+		pa5_mutex_lock(&queue_lock, PA5_LOCK_MIGRATE);
+	}
+}
+
+static int is_idle(void)
+{
+	time_t last = __atomic_load_n(&last_activity, __ATOMIC_RELAXED);
+	return (time(NULL) - last >= PA5_MIGRATE_IDLE);
+}
+
+/* Whether fpath is a temporary file pa5_migrate_file() left behind: named
+ * PA5_MIGRATE_PREFIX, an inode number and ".tmp", and either still empty
+ * and the daemon's, or holding a chunk header made under the volume keys. */
+static int is_leftover(const char *fpath, const char *name, const struct stat *st)
+{
+	struct pa5_chunk_file cf;
+	const char *p = name + strlen(PA5_MIGRATE_PREFIX);
+	int res = 0;
+
+	if (strncmp(name, PA5_MIGRATE_PREFIX, strlen(PA5_MIGRATE_PREFIX)) != 0 || !isdigit((unsigned char)*p))
+		return 0;
+	while (isdigit((unsigned char)*p))
+		p++;
+	if (strcmp(p, ".tmp") != 0)
+		return 0;
+	if (st->st_size == 0)
+		return (st->st_uid == geteuid());
+
+	int fd = open(fpath, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1)
+		return 0;
+	if (pa5_chunk_probe(fd) == PA5_CHUNK_VERSION && pa5_chunk_open(fd, config.keys, &cf) == 0)
+	{
+		pa5_chunk_close(&cf);
+		res = 1;
+	}
+	close(fd);
+	return res;
+}
+
+static int scan_visit(const char *fpath, const struct stat *st, int type, struct FTW *ftw)
+{
+	pa5_mutex_lock(&queue_lock, PA5_LOCK_MIGRATE);
+	drain_queue();
+	int stop = !running;
+	pthread_mutex_unlock(&queue_lock);
+	if (stop)
+		return 1;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	if (is_leftover(fpath, fpath + ftw->base, st))
+	{
+		unlink(fpath);
+		return 0;
+	}
+
+	/* Yield to foreground traffic before converting anything. */
+	while (!is_idle())
+	{
+		sleep(1);
+		if (!__atomic_load_n(&running, __ATOMIC_RELAXED))
+			return 1;
+	}
+
+	int res = pa5_migrate_file(fpath, config.cbc_key, config.keys);
+	if (res < 0)
+		pa5_error("Could not migrate %s to the chunk format: %d.", fpath, res);
+	else if (res == 1)
+		pa5_info("Migrated %s to the chunk format.", fpath);
+	return 0;
+}
+
+static void *migrate_worker(void *arg)
+{
+	time_t next_scan = time(NULL) + config.scan_interval;
+
+	(void) arg;
+
+	pa5_sched_set_class(PA5_SCHED_MAINT);
+	pa5_mutex_lock(&queue_lock, PA5_LOCK_MIGRATE);
+	while (running)
+	{
+		drain_queue();
+		if (!running)
+			break;
+
+		if (config.scan_interval == 0)
+		{
+			pthread_cond_wait(&queue_cond, &queue_lock);
+			continue;
+		}
+
+		if (time(NULL) >= next_scan && is_idle())
+		{
+			pthread_mutex_unlock(&queue_lock);
+			nftw(config.rootdir, scan_visit, 16, FTW_PHYS | FTW_MOUNT);
+			pa5_mutex_lock(&queue_lock, PA5_LOCK_MIGRATE);
+			next_scan = time(NULL) + config.scan_interval;
+			continue;
+		}
+
+		struct timespec until = { time(NULL) + 1, 0 };
+		pthread_cond_timedwait(&queue_cond, &queue_lock, &until);
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	return NULL;
+}
+
+int pa5_migrate_start(const struct pa5_migrate_config *cfg)
+{
+	config = *cfg;
+	pa5_migrate_activity();
+
+	pa5_mutex_lock(&queue_lock, PA5_LOCK_MIGRATE);
+	running = 1;
+	pthread_mutex_unlock(&queue_lock);
+
+	int res = pthread_create(&worker, NULL, migrate_worker, NULL);
+	if (res != 0)
+	{
+		running = 0;
+		return -res;
+	}
+	return 0;
+}
+
+void pa5_migrate_stop(void)
+{
+	char *fpath;
+
+	pa5_mutex_lock(&queue_lock, PA5_LOCK_MIGRATE);
+	if (!running)
+	{
+		pthread_mutex_unlock(&queue_lock);
+		return;
+	}
+	running = 0;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	pthread_join(worker, NULL);
+
+	while (queue_pop(&fpath))
+		free(fpath);
+}
+
+void pa5_migrate_queue(const char *fpath)
+{
+	struct migrate_item *item;
+
+	pa5_mutex_lock(&queue_lock, PA5_LOCK_MIGRATE);
+	if (!running || queue_len >= MIGRATE_QUEUE_MAX)
+	{
+		/* A full queue only delays things; the idle scan finds it later. */
+		pthread_mutex_unlock(&queue_lock);
+		return;
+	}
+
+	for (item = queue_head; item; item = item->next)
+	{
+		if (strcmp(item->fpath, fpath) == 0)
+		{
+			pthread_mutex_unlock(&queue_lock);
+			return;
+		}
+	}
+
+	item = malloc(sizeof(*item));
+	if (item && (item->fpath = strdup(fpath)) != NULL)
+	{
+		item->next = NULL;
+		if (queue_tail)
+			queue_tail->next = item;
+		else
+			queue_head = item;
+		queue_tail = item;
+		queue_len++;
+		pa5_queue_depth(PA5_QUEUE_MIGRATE, queue_len);
+		pthread_cond_signal(&queue_cond);
+	}
+	else
+		free(item);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+void pa5_migrate_activity(void)
+{
+	__atomic_store_n(&last_activity, time(NULL), __ATOMIC_RELAXED);
+}
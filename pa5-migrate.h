@@ -0,0 +1,50 @@
+/* pa5-migrate.h
+ * Online conversion of whole-file CBC files to the chunk format.
+ *
+ * A legacy file is queued for conversion when the last handle on it is
+ * released, and an optional idle scan walks the mirror for legacy files that
+ * are never opened. The new image is built in a temporary file next to the
+ * original and moved over it with rename(), so a crash leaves either the old
+ * file or the new one, never a mix. Temporary files left behind by a crash
+ * are removed by the next scan; it only takes names of the exact form
+ * PA5_MIGRATE_PREFIX "<inode>.tmp" that are empty and the daemon's or hold
+ * a chunk header made under the volume keys.
+ */
+
+#ifndef PA5_MIGRATE_H
+#define PA5_MIGRATE_H
+
+#include "pa5-cbc.h"
+#include "pa5-chunk.h"
+
+#define PA5_MIGRATE_PREFIX ".pa5-migrate."
+#define PA5_MIGRATE_IDLE 5   /* Seconds without foreground I/O before a scan step. */
+
+struct pa5_migrate_config
+{
+	const char *rootdir;
+	const struct pa5_cbc_key *cbc_key;
+	const struct pa5_keys *keys;
+	unsigned scan_interval;   /* Seconds between idle scans, 0 disables them. */
+};
+
+/* int pa5_migrate_file(const char *fpath, ...)
+ * Purpose: Convert one legacy CBC backing file in place.
+ * Return: 1 if the file was converted, 0 if it was skipped because it is not
+ *         a legacy file, is open, has hard links or changed during the copy,
+ *         -errno on error
+ */
+int pa5_migrate_file(const char *fpath, const struct pa5_cbc_key *cbc_key,
+		     const struct pa5_keys *keys);
+
+/* Starts and stops the background worker. */
+int pa5_migrate_start(const struct pa5_migrate_config *config);
+void pa5_migrate_stop(void);
+
+/* Queues a backing file for conversion by the worker. */
+void pa5_migrate_queue(const char *fpath);
+
+/* Notes foreground activity, which holds back the idle scan. */
+void pa5_migrate_activity(void);
+
+#endif
@@ -0,0 +1,407 @@
+/* pa5-policy.c
+ * Encryption policy for new files.
+ *
+ * The rules are parsed once at mount into an array that never changes
+ * afterwards, so deciding takes no lock; only the counters are shared.
+ * Each rule keeps its extensions sorted for a binary search, and a glob
+ * that is a literal, or a literal with a single leading or trailing '*',
+ * is reduced to a compare so that fnmatch() is left to real patterns.
+ */
+
+#include "pa5-policy.h"
+#include "pa5-chunk.h"
+#include "pa5-compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <fnmatch.h>
+
+#define MAX_EXT 16    /* Longer extensions never match. */
+
+enum glob_kind
+{
+	GLOB_NONE,
+	GLOB_EXACT,
+	GLOB_PREFIX,    /* "lit*" */
+	GLOB_SUFFIX,    /* "*lit" */
+	GLOB_FNMATCH
+};
+
+struct rule
+{
+	enum pa5_policy_action action;
+	unsigned line;
+	enum glob_kind glob_kind;
+	int glob_base;        /* Match the last path component only. */
+	char *glob;           /* The literal part unless GLOB_FNMATCH. */
+	size_t glob_len;
+	char **exts;          /* Lower case, sorted. */
+	unsigned nexts;
+	int has_uid;
+	uid_t uid_min;
+	uid_t uid_max;
+	uint64_t size_min;
+	uint64_t size_max;    /* Exclusive. */
+	uint64_t hits;
+};
+
+static struct
+{
+	int ready;
+	struct rule *rules;
+	unsigned nrules;
+	enum pa5_policy_action fallback;
+	uint64_t decisions[PA5_POLICY_PLAIN + 1];
+} policy;
+
+static const char *const action_names[] = { "mount", "encrypt", "compress", "plain" };
+
+static int parse_action(const char *name)
+{
+	int i;
+	for (i = PA5_POLICY_ENCRYPT; i <= PA5_POLICY_PLAIN; i++)
+		if (strcmp(name, action_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+static int parse_size(const char *s, uint64_t *out)
+{
+	char *end;
+
+	if (!isdigit((unsigned char)*s))
+		return -EINVAL;
+	unsigned long long v = strtoull(s, &end, 10);
+	switch (toupper((unsigned char)*end))
+	{
+	case 'G':
+		v <<= 10;
+		/* fall through */
+	case 'M':
+		v <<= 10;
+		/* fall through */
+	case 'K':
+		v <<= 10;
+		end++;
+		break;
+	}
+	if (*end != '\0')
+		return -EINVAL;
+	*out = v;
+	return 0;
+}
+
+static int compare_ext(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int parse_exts(struct rule *r, const char *list)
+{
+	char *copy = strdup(list);
+	char *save, *tok;
+	char *p;
+
+	if (!copy)
+		return -ENOMEM;
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+	{
+		if (tok[0] == '.')
+			tok++;
+		if (tok[0] == '\0' || strlen(tok) > MAX_EXT)
+			continue;
+		char **exts = realloc(r->exts, (r->nexts + 1) * sizeof(*exts));
+		if (!exts || !(exts[r->nexts] = strdup(tok)))
+		{
+			if (exts)
+				r->exts = exts;
+			free(copy);
+			return -ENOMEM;
+		}
+		for (p = exts[r->nexts]; *p; p++)
+			*p = tolower((unsigned char)*p);
+		r->exts = exts;
+		r->nexts++;
+	}
+	free(copy);
+	if (r->nexts == 0)
+		return -EINVAL;
+	qsort(r->exts, r->nexts, sizeof(*r->exts), compare_ext);
+	return 0;
+}
+
+/* Reduces a glob to a compare where it can. */
+static int parse_glob(struct rule *r, const char *pattern)
+{
+	size_t len = strlen(pattern);
+	size_t metas = strcspn(pattern, "*?[\\");
+
+	if (len == 0)
+		return -EINVAL;
+	r->glob_base = (strchr(pattern, '/') == NULL);
+	if (metas == len)
+		r->glob_kind = GLOB_EXACT;
+	else if (metas == len - 1 && pattern[len - 1] == '*')
+		r->glob_kind = GLOB_PREFIX;
+	else if (metas == 0 && pattern[0] == '*' && strcspn(pattern + 1, "*?[\\") == len - 1)
+		r->glob_kind = GLOB_SUFFIX;
+	else
+		r->glob_kind = GLOB_FNMATCH;
+
+	if (r->glob_kind == GLOB_PREFIX)
+		r->glob = strndup(pattern, len - 1);
+	else if (r->glob_kind == GLOB_SUFFIX)
+		r->glob = strdup(pattern + 1);
+	else
+		r->glob = strdup(pattern);
+	if (!r->glob)
+		return -ENOMEM;
+	r->glob_len = strlen(r->glob);
+	return 0;
+}
+
+static int parse_condition(struct rule *r, const char *cond)
+{
+	char *end;
+
+	if (strncmp(cond, "path=", 5) == 0 && r->glob_kind == GLOB_NONE)
+		return parse_glob(r, cond + 5);
+	if (strncmp(cond, "ext=", 4) == 0 && r->nexts == 0)
+		return parse_exts(r, cond + 4);
+	if (strncmp(cond, "uid=", 4) == 0 && isdigit((unsigned char)cond[4]))
+	{
+		r->has_uid = 1;
+		r->uid_min = r->uid_max = strtoul(cond + 4, &end, 10);
+		if (*end == '-' && isdigit((unsigned char)end[1]))
+			r->uid_max = strtoul(end + 1, &end, 10);
+		return (*end == '\0' && r->uid_min <= r->uid_max) ? 0 : -EINVAL;
+	}
+	if (strncmp(cond, "size<", 5) == 0)
+		return parse_size(cond + 5, &r->size_max);
+	if (strncmp(cond, "size>", 5) == 0 && parse_size(cond + 5, &r->size_min) == 0)
+		return (r->size_min++ < UINT64_MAX) ? 0 : -EINVAL;
+	return -EINVAL;
+}
+
+static void free_rule(struct rule *r)
+{
+	unsigned i;
+
+	for (i = 0; i < r->nexts; i++)
+		free(r->exts[i]);
+	free(r->exts);
+	free(r->glob);
+}
+
+/* Parses one line into r. Returns 1 for a rule, 0 for a blank line, 2 for
+ * a default line, or -errno. */
+static int parse_line(char *text, unsigned line, struct rule *r)
+{
+	char *save, *tok;
+	int action;
+
+	text[strcspn(text, "#\n")] = '\0';
+	if (!(tok = strtok_r(text, " \t\r", &save)))
+		return 0;
+
+	memset(r, 0, sizeof(*r));
+	r->line = line;
+	r->size_max = UINT64_MAX;
+	if (strcmp(tok, "default") == 0)
+	{
+		if (!(tok = strtok_r(NULL, " \t\r", &save)) || (action = parse_action(tok)) < 0 ||
+		    strtok_r(NULL, " \t\r", &save))
+			return -EINVAL;
+		r->action = action;
+		return 2;
+	}
+	if ((action = parse_action(tok)) < 0)
+		return -EINVAL;
+	r->action = action;
+
+	while ((tok = strtok_r(NULL, " \t\r", &save)))
+	{
+		int err = parse_condition(r, tok);
+		if (err < 0)
+		{
+			free_rule(r);
+			return err;
+		}
+	}
+	if (r->size_min >= r->size_max)
+	{
+		free_rule(r);
+		return -EINVAL;
+	}
+	return 1;
+}
+
+int pa5_policy_load(const char *file, unsigned *line)
+{
+	FILE *in;
+	char *text = NULL;
+	size_t cap = 0;
+	struct rule r;
+	int res = 0;
+
+	*line = 0;
+	if (!(in = fopen(file, "r")))
+		return -errno;
+
+	while (getline(&text, &cap, in) != -1)
+	{
+		(*line)++;
+		int kind = parse_line(text, *line, &r);
+		if (kind == 2)
+			policy.fallback = r.action;
+		else if (kind == 1 && policy.nrules == PA5_POLICY_MAX_RULES)
+		{
+			free_rule(&r);
+			kind = -EINVAL;
+		}
+		else if (kind == 1)
+		{
+			struct rule *rules = realloc(policy.rules, (policy.nrules + 1) * sizeof(*rules));
+			if (!rules)
+			{
+				free_rule(&r);
+				kind = -ENOMEM;
+			}
+			else
+			{
+				policy.rules = rules;
+				policy.rules[policy.nrules++] = r;
+			}
+		}
+		if (kind < 0)
+		{
+			res = kind;
+			break;
+		}
+	}
+	if (res == 0 && ferror(in))
+		res = -EIO;
+	free(text);
+	fclose(in);
+
+	if (res == 0)
+	{
+		*line = 0;
+		policy.ready = 1;
+	}
+	return res;
+}
+
+int pa5_policy_ready(void)
+{
+	return policy.ready;
+}
+
+/* Lower-cased extension of a file name into ext. Returns 0 if it has none
+ * that a rule could match. */
+static int file_ext(const char *base, char ext[MAX_EXT + 1])
+{
+	const char *dot = strrchr(base, '.');
+	size_t i;
+
+	if (!dot || dot == base || strlen(dot + 1) > MAX_EXT || dot[1] == '\0')
+		return 0;
+	for (i = 0; dot[1 + i]; i++)
+		ext[i] = tolower((unsigned char)dot[1 + i]);
+	ext[i] = '\0';
+	return 1;
+}
+
+static int glob_match(const struct rule *r, const char *path, size_t len)
+{
+	switch (r->glob_kind)
+	{
+	case GLOB_NONE:
+		return 1;
+	case GLOB_EXACT:
+		return len == r->glob_len && memcmp(path, r->glob, len) == 0;
+	case GLOB_PREFIX:
+		return len >= r->glob_len && memcmp(path, r->glob, r->glob_len) == 0;
+	case GLOB_SUFFIX:
+		return len >= r->glob_len && memcmp(path + len - r->glob_len, r->glob, r->glob_len) == 0;
+	default:
+		return fnmatch(r->glob, path, 0) == 0;
+	}
+}
+
+enum pa5_policy_action pa5_policy_decide(const char *path, uid_t uid, off_t size)
+{
+	char ext[MAX_EXT + 1];
+	char *key = ext;
+	unsigned i;
+
+	if (!policy.ready)
+		return PA5_POLICY_DEFAULT;
+
+	const char *base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	size_t path_len = strlen(path);
+	size_t base_len = strlen(base);
+	int has_ext = file_ext(base, ext);
+	enum pa5_policy_action action = policy.fallback;
+
+	for (i = 0; i < policy.nrules; i++)
+	{
+		struct rule *r = &policy.rules[i];
+		if ((uint64_t)size < r->size_min || (uint64_t)size >= r->size_max)
+			continue;
+		if (r->has_uid && (uid < r->uid_min || uid > r->uid_max))
+			continue;
+		if (r->nexts > 0 &&
+		    (!has_ext || !bsearch(&key, r->exts, r->nexts, sizeof(*r->exts), compare_ext)))
+			continue;
+		if (r->glob_base ? !glob_match(r, base, base_len) : !glob_match(r, path, path_len))
+			continue;
+		__atomic_fetch_add(&r->hits, 1, __ATOMIC_RELAXED);
+		action = r->action;
+		break;
+	}
+	__atomic_fetch_add(&policy.decisions[action], 1, __ATOMIC_RELAXED);
+	return action;
+}
+
+int pa5_policy_codec(enum pa5_policy_action action)
+{
+	static const char *const best[] = { "zstd", "lz4", "zlib" };
+	unsigned i;
+	int codec;
+
+	if (action == PA5_POLICY_ENCRYPT)
+		return PA5_CODEC_NONE;
+	if (action != PA5_POLICY_COMPRESS)
+		return PA5_CHUNK_CODEC_MOUNT;
+
+	/* Pinned to the file, so it stays compressed on a mount without
+	 * PA5_COMPRESS. */
+	if ((codec = pa5_chunk_codec()) != PA5_CODEC_NONE)
+		return codec;
+	for (i = 0; i < sizeof(best) / sizeof(best[0]); i++)
+		if ((codec = pa5_compress_parse(best[i])) >= 0)
+			return codec;
+	return PA5_CODEC_NONE;
+}
+
+void pa5_policy_stats(FILE *out)
+{
+	unsigned i;
+
+	fprintf(out, "rules %u\n", policy.nrules);
+	if (!policy.ready)
+		return;
+	fprintf(out, "default %s\n", action_names[policy.fallback]);
+	for (i = 0; i <= PA5_POLICY_PLAIN; i++)
+		fprintf(out, "decisions_%s %llu\n", action_names[i],
+			(unsigned long long)__atomic_load_n(&policy.decisions[i], __ATOMIC_RELAXED));
+	for (i = 0; i < policy.nrules; i++)
+		fprintf(out, "line%u_%s_hits %llu\n", policy.rules[i].line,
+			action_names[policy.rules[i].action],
+			(unsigned long long)__atomic_load_n(&policy.rules[i].hits, __ATOMIC_RELAXED));
+}
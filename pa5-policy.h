@@ -0,0 +1,80 @@
+/* pa5-policy.h
+ * Encryption policy for new files.
+ *
+ * A mount can be given a policy file that decides, for each file created
+ * through it, whether its backing file is encrypted, left as plaintext, or
+ * compressed and then encrypted. Already compressed or public data can so
+ * skip the cipher and the compressor instead of paying for both on every
+ * access.
+ *
+ * The file holds one rule per line, an action followed by any number of
+ * conditions that must all hold. The first rule that matches decides; a
+ * "default" line decides for files no rule matches. '#' starts a comment.
+ *
+ *   # action   conditions
+ *   plain      ext=jpg,jpeg,png,mp4,zip,gz
+ *   plain      path=/public*
+ *   compress   path=*.log size<64M
+ *   encrypt    uid=1000-1999
+ *   default    compress
+ *
+ *   encrypt    chunked and encrypted, never compressed
+ *   compress   compressed with the mount's codec (PA5_COMPRESS, or the best
+ *              one built in when that is off), then encrypted
+ *   plain      a plaintext backing file, passed through as is
+ *
+ *   path=<glob>       fnmatch() on the path below the mount, '*' matching
+ *                     '/' too; a pattern without '/' is matched against
+ *                     the last component only
+ *   ext=<a>,<b>,...   file name extension, ignoring case
+ *   uid=<n>[-<m>]     uid of the calling process
+ *   size<N, size>N    file size when the decision is made, with an
+ *                     optional K, M or G suffix
+ *
+ * Decisions are made when a backing file is created: in create() and
+ * mknod(), where a file is empty, and when a file leaves the small-file
+ * store (pa5-small.h), which it does with its contents. Files no rule
+ * decides are encrypted as they would be without a policy. Rules are
+ * compiled when the file is loaded, so a decision costs a few compares
+ * per rule and one fnmatch() only for globs that are not a plain prefix
+ * or suffix. Deduplicated files always use the mount's codec, as their
+ * chunks are shared.
+ */
+
+#ifndef PA5_POLICY_H
+#define PA5_POLICY_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define PA5_POLICY_MAX_RULES 1024
+
+enum pa5_policy_action
+{
+	PA5_POLICY_DEFAULT = 0,   /* No rule matched: encrypt as without a policy. */
+	PA5_POLICY_ENCRYPT = 1,
+	PA5_POLICY_COMPRESS = 2,
+	PA5_POLICY_PLAIN = 3
+};
+
+/* int pa5_policy_load(const char *file, unsigned *line)
+ * Purpose: Compile the rules in file into the mount's policy.
+ * Return: 0 on success, -EINVAL with the offending line number in *line if
+ *         a rule does not parse
+ */
+int pa5_policy_load(const char *file, unsigned *line);
+
+int pa5_policy_ready(void);
+
+/* Action for a new file at path (below the mount) of size bytes, created
+ * by uid. Counted in the stats. */
+enum pa5_policy_action pa5_policy_decide(const char *path, uid_t uid, off_t size);
+
+/* Codec a chunk file created under action is to use, or
+ * PA5_CHUNK_CODEC_MOUNT when the mount's codec applies. */
+int pa5_policy_codec(enum pa5_policy_action action);
+
+/* Stats section with the decisions made and the hits of each rule. */
+void pa5_policy_stats(FILE *out);
+
+#endif
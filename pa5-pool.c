@@ -0,0 +1,464 @@
+/* pa5-pool.c
+ * Per-thread object pools for the request path.
+ *
+ * This is the magazine layer described by Bonwick and Adams. A thread's
+ * loaded magazine serves every get and put it can; the previous magazine
+ * lets a thread that alternates between get and put at a magazine boundary
+ * swap the two instead of going to the depot each time. A thread's
+ * magazines go back to the depot when it exits.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-pool.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct pa5_pool_mag
+{
+	unsigned count;
+	int trimmed;                   /* Its objects' pages were given back. */
+	size_t released;               /* How many bytes of them that was. */
+	struct pa5_pool_mag *next;
+	void *objs[PA5_POOL_MAG_MAX];
+};
+
+struct pool_slot
+{
+	struct pa5_pool_mag *loaded;
+	struct pa5_pool_mag *prev;
+	unsigned long long gets;
+	unsigned long long puts;
+};
+
+struct thread_cache
+{
+	struct pool_slot slots[PA5_POOL_MAX];
+	struct thread_cache *next;
+};
+
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pa5_pool *pools[PA5_POOL_MAX];
+static int npools = 0;
+static struct thread_cache *caches = NULL;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static __thread struct thread_cache *thread_cache = NULL;
+
+static void mag_push(struct pa5_pool_mag **list, struct pa5_pool_mag *mag)
+{
+	mag->next = *list;
+	*list = mag;
+}
+
+static struct pa5_pool_mag *mag_pop(struct pa5_pool_mag **list)
+{
+	struct pa5_pool_mag *mag = *list;
+	if (mag)
+		*list = mag->next;
+	return mag;
+}
+
+/* Hands a magazine back to the depot. Called with the pool locked. */
+static void depot_return(struct pa5_pool *pool, struct pa5_pool_mag *mag)
+{
+	if (!mag)
+		return;
+	if (mag->count == 0)
+		mag_push(&pool->empty, mag);
+	else
+	{
+		mag_push(&pool->full, mag);
+		pool->flushes++;
+	}
+}
+
+static void cache_release(void *ptr)
+{
+	struct thread_cache *cache = ptr;
+	struct thread_cache **link;
+	int i;
+
+	pa5_mutex_lock(&pools_lock, PA5_LOCK_POOL_LIST);
+	for (link = &caches; *link; link = &(*link)->next)
+	{
+		if (*link == cache)
+		{
+			*link = cache->next;
+			break;
+		}
+	}
+	for (i = 0; i < npools; i++)
+	{
+		struct pa5_pool *pool = pools[i];
+		struct pool_slot *slot = &cache->slots[i];
+
+		pa5_mutex_lock(&pool->lock, PA5_LOCK_POOL);
+		depot_return(pool, slot->loaded);
+		depot_return(pool, slot->prev);
+		pool->gets += slot->gets;
+		pool->puts += slot->puts;
+		pthread_mutex_unlock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pools_lock);
+	free(cache);
+}
+
+static void cache_key_create(void)
+{
+	pthread_key_create(&cache_key, cache_release);
+}
+
+static struct thread_cache *get_cache(void)
+{
+	if (thread_cache)
+		return thread_cache;
+
+	pthread_once(&cache_once, cache_key_create);
+	struct thread_cache *cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	pa5_mutex_lock(&pools_lock, PA5_LOCK_POOL_LIST);
+	cache->next = caches;
+	caches = cache;
+	pthread_mutex_unlock(&pools_lock);
+
+	pthread_setspecific(cache_key, cache);
+	thread_cache = cache;
+	return cache;
+}
+
+/* Gives a pool its slot in the thread caches. Returns 0 or -1 if there
+ * are already PA5_POOL_MAX pools. */
+static int pool_register(struct pa5_pool *pool)
+{
+	int res = 0;
+
+	pa5_mutex_lock(&pools_lock, PA5_LOCK_POOL_LIST);
+	if (pool->id < 0)
+	{
+		if (npools == PA5_POOL_MAX)
+			res = -1;
+		else
+		{
+			size_t align = pool->align < sizeof(void *) ? sizeof(void *) : pool->align;
+			pool->align = align;
+			pool->stride = (pool->size + align - 1) & ~(align - 1);
+			if (pool->mag_size == 0 || pool->mag_size > PA5_POOL_MAG_MAX)
+				pool->mag_size = PA5_POOL_MAG_MAX;
+			pools[npools] = pool;
+			__atomic_store_n(&pool->id, npools, __ATOMIC_RELEASE);
+			npools++;
+		}
+	}
+	pthread_mutex_unlock(&pools_lock);
+	return res;
+}
+
+static struct pool_slot *get_slot(struct pa5_pool *pool)
+{
+	struct thread_cache *cache = get_cache();
+	int id = __atomic_load_n(&pool->id, __ATOMIC_ACQUIRE);
+
+	if (!cache)
+		return NULL;
+	if (id < 0)
+	{
+		if (pool_register(pool) < 0)
+			return NULL;
+		id = pool->id;
+	}
+	return &cache->slots[id];
+}
+
+/* Carves a new slab into a full magazine. Called with the pool locked. */
+static struct pa5_pool_mag *pool_grow(struct pa5_pool *pool)
+{
+	struct pa5_pool_mag *mag = mag_pop(&pool->empty);
+	unsigned char *slab;
+	unsigned i;
+
+	if (!mag && (mag = malloc(sizeof(*mag))) == NULL)
+		return NULL;
+	mag->trimmed = 0;
+	if (posix_memalign((void **)&slab, pool->align, pool->stride * pool->mag_size) != 0)
+	{
+		mag_push(&pool->empty, mag);
+		return NULL;
+	}
+
+	for (i = 0; i < pool->mag_size; i++)
+		mag->objs[i] = slab + i * pool->stride;
+	mag->count = pool->mag_size;
+	pool->slabs++;
+	return mag;
+}
+
+/* Both magazines are empty: trade one for a full one from the depot, or
+ * build one from loose objects or a new slab. */
+static void *get_slow(struct pa5_pool *pool, struct pool_slot *slot)
+{
+	struct pa5_pool_mag *fresh;
+	void *obj = NULL;
+
+	pa5_mutex_lock(&pool->lock, PA5_LOCK_POOL);
+	if (pool->loose)
+	{
+		obj = pool->loose;
+		pool->loose = *(void **)obj;
+	}
+	else
+	{
+		if ((fresh = mag_pop(&pool->full)) != NULL)
+		{
+			pool->refills++;
+			if (fresh->trimmed)
+			{
+				pool->trimmed -= fresh->released;
+				fresh->trimmed = 0;
+			}
+		}
+		else if ((fresh = pool_grow(pool)) == NULL)
+			goto out;
+		depot_return(pool, slot->prev);
+		slot->prev = slot->loaded;
+		slot->loaded = fresh;
+		obj = fresh->objs[--fresh->count];
+	}
+out:
+	pthread_mutex_unlock(&pool->lock);
+	return obj;
+}
+
+/* Both magazines are full: trade one for an empty one from the depot. */
+static void put_slow(struct pa5_pool *pool, struct pool_slot *slot, void *obj)
+{
+	pa5_mutex_lock(&pool->lock, PA5_LOCK_POOL);
+	struct pa5_pool_mag *fresh = mag_pop(&pool->empty);
+	if (!fresh && (fresh = malloc(sizeof(*fresh))) != NULL)
+	{
+		fresh->count = 0;
+		fresh->trimmed = 0;
+	}
+
+	if (fresh)
+	{
+		depot_return(pool, slot->prev);
+		slot->prev = slot->loaded;
+		slot->loaded = fresh;
+		fresh->objs[fresh->count++] = obj;
+	}
+	else
+	{
+		*(void **)obj = pool->loose;
+		pool->loose = obj;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void *pa5_pool_get(struct pa5_pool *pool)
+{
+	struct pool_slot *slot = get_slot(pool);
+	struct pa5_pool_mag *mag;
+	void *obj;
+
+	if (!slot)
+		return NULL;
+
+	if ((mag = slot->loaded) == NULL || mag->count == 0)
+	{
+		if (slot->prev && slot->prev->count > 0)
+		{
+			slot->loaded = slot->prev;
+			slot->prev = mag;
+			mag = slot->loaded;
+		}
+		else
+		{
+			if ((obj = get_slow(pool, slot)) == NULL)
+				return NULL;
+			__atomic_store_n(&slot->gets, slot->gets + 1, __ATOMIC_RELAXED);
+			return obj;
+		}
+	}
+
+	__atomic_store_n(&slot->gets, slot->gets + 1, __ATOMIC_RELAXED);
+	return mag->objs[--mag->count];
+}
+
+void pa5_pool_put(struct pa5_pool *pool, void *obj)
+{
+	struct pool_slot *slot;
+	struct pa5_pool_mag *mag;
+
+	if (!obj)
+		return;
+	if ((slot = get_slot(pool)) == NULL)
+	{
+		/* No thread cache: park it on the loose list. */
+		pa5_mutex_lock(&pool->lock, PA5_LOCK_POOL);
+		*(void **)obj = pool->loose;
+		pool->loose = obj;
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+
+	__atomic_store_n(&slot->puts, slot->puts + 1, __ATOMIC_RELAXED);
+	if ((mag = slot->loaded) == NULL || mag->count == pool->mag_size)
+	{
+		if (slot->prev && slot->prev->count < pool->mag_size)
+		{
+			slot->loaded = slot->prev;
+			slot->prev = mag;
+			mag = slot->loaded;
+		}
+		else
+		{
+			put_slow(pool, slot, obj);
+			return;
+		}
+	}
+	mag->objs[mag->count++] = obj;
+}
+
+/* Objects of pool handed out and not yet returned. Called with pools_lock
+ * held. */
+static unsigned long long pool_in_use(struct pa5_pool *pool, int id)
+{
+	struct thread_cache *cache;
+	unsigned long long gets = pool->gets;
+	unsigned long long puts = pool->puts;
+
+	for (cache = caches; cache; cache = cache->next)
+	{
+		gets += __atomic_load_n(&cache->slots[id].gets, __ATOMIC_RELAXED);
+		puts += __atomic_load_n(&cache->slots[id].puts, __ATOMIC_RELAXED);
+	}
+	return (gets > puts) ? gets - puts : 0;
+}
+
+/* Idle bytes of pool still backed by memory. Called with pools_lock and the
+ * pool locked. */
+static size_t pool_resident(struct pa5_pool *pool, int id)
+{
+	unsigned long long objs = pool->slabs * pool->mag_size;
+	unsigned long long in_use = pool_in_use(pool, id);
+	unsigned long long idle = (objs > in_use) ? (objs - in_use) * pool->stride : 0;
+
+	return (idle > pool->trimmed) ? idle - pool->trimmed : 0;
+}
+
+size_t pa5_pool_memory(void)
+{
+	size_t total = 0;
+	int i;
+
+	pa5_mutex_lock(&pools_lock, PA5_LOCK_POOL_LIST);
+	for (i = 0; i < npools; i++)
+	{
+		pa5_mutex_lock(&pools[i]->lock, PA5_LOCK_POOL);
+		total += pool_resident(pools[i], i);
+		pthread_mutex_unlock(&pools[i]->lock);
+	}
+	pthread_mutex_unlock(&pools_lock);
+	return total;
+}
+
+/* Gives back the whole pages inside the objects of depot magazines until
+ * want bytes are released. Pages shared with a neighbouring object are
+ * kept, as it may be in use. Called with the pool locked.
+ * Return: the bytes released */
+static size_t pool_trim(struct pa5_pool *pool, size_t want)
+{
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	struct pa5_pool_mag *mag;
+	size_t released = 0;
+	unsigned i;
+
+	for (mag = pool->full; mag && released < want; mag = mag->next)
+	{
+		if (mag->trimmed)
+			continue;
+		mag->released = 0;
+		for (i = 0; i < mag->count; i++)
+		{
+			uintptr_t start = ((uintptr_t)mag->objs[i] + page - 1) & ~(page - 1);
+			uintptr_t end = ((uintptr_t)mag->objs[i] + pool->size) & ~(page - 1);
+			if (end > start && madvise((void *)start, end - start, MADV_DONTNEED) == 0)
+				mag->released += end - start;
+		}
+		mag->trimmed = 1;
+		pool->trimmed += mag->released;
+		released += mag->released;
+	}
+	return released;
+}
+
+/* The caller has usually just evicted what it wants trimmed, so its own
+ * magazines go to the depot first, where they can be trimmed too. */
+void pa5_pool_trim(size_t target)
+{
+	size_t resident = pa5_pool_memory();
+	size_t want = (resident > target) ? resident - target : 0;
+	int i;
+
+	pa5_mutex_lock(&pools_lock, PA5_LOCK_POOL_LIST);
+	for (i = 0; i < npools && want > 0; i++)
+	{
+		pa5_mutex_lock(&pools[i]->lock, PA5_LOCK_POOL);
+		if (thread_cache)
+		{
+			struct pool_slot *slot = &thread_cache->slots[i];
+			depot_return(pools[i], slot->loaded);
+			depot_return(pools[i], slot->prev);
+			slot->loaded = slot->prev = NULL;
+		}
+		size_t released = pool_trim(pools[i], want);
+		want -= (released < want) ? released : want;
+		pthread_mutex_unlock(&pools[i]->lock);
+	}
+	pthread_mutex_unlock(&pools_lock);
+}
+
+void pa5_pool_stats(FILE *out)
+{
+	struct thread_cache *cache;
+	int i;
+
+	fprintf(out, "%-10s %8s %12s %12s %8s %8s %12s %12s %10s %10s\n", "pool", "size", "gets",
+		"puts", "in_use", "slabs", "bytes", "trimmed", "refills", "flushes");
+
+	pa5_mutex_lock(&pools_lock, PA5_LOCK_POOL_LIST);
+	for (i = 0; i < npools; i++)
+	{
+		struct pa5_pool *pool = pools[i];
+		unsigned long long gets, puts, slabs, trimmed, refills, flushes;
+
+		pa5_mutex_lock(&pool->lock, PA5_LOCK_POOL);
+		gets = pool->gets;
+		puts = pool->puts;
+		slabs = pool->slabs;
+		trimmed = pool->trimmed;
+		refills = pool->refills;
+		flushes = pool->flushes;
+		pthread_mutex_unlock(&pool->lock);
+
+		for (cache = caches; cache; cache = cache->next)
+		{
+			gets += __atomic_load_n(&cache->slots[i].gets, __ATOMIC_RELAXED);
+			puts += __atomic_load_n(&cache->slots[i].puts, __ATOMIC_RELAXED);
+		}
+
+		fprintf(out, "%-10s %8zu %12llu %12llu %8lld %8llu %12llu %12llu %10llu %10llu\n",
+			pool->name, pool->size, gets, puts, (long long)(gets - puts), slabs,
+			slabs * pool->mag_size * (unsigned long long)pool->stride, trimmed, refills,
+			flushes);
+	}
+	pthread_mutex_unlock(&pools_lock);
+}
@@ -0,0 +1,74 @@
+/* pa5-pool.h
+ * Per-thread object pools for the request path.
+ *
+ * A pool hands out objects of one size and alignment. Each thread keeps two
+ * magazines of free objects per pool and allocates and frees from them with
+ * no lock at all. Only when both are empty (or both full) does it trade one
+ * with the pool's depot, under the pool lock, for a full (or empty) one.
+ * New objects are carved a magazine at a time out of aligned slabs, which
+ * are never given back, so once a workload has reached its peak the request
+ * path neither calls malloc() nor takes a contended lock.
+ *
+ * Objects may be freed by a different thread from the one that allocated
+ * them. Pools are defined statically with PA5_POOL_INIT.
+ *
+ * Under memory pressure the pages inside idle objects in the depot can be
+ * given back to the kernel with pa5_pool_trim(). The objects stay where
+ * they are and fault fresh zeroed pages in when next used.
+ */
+
+#ifndef PA5_POOL_H
+#define PA5_POOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define PA5_POOL_MAX 16       /* Pools per process. */
+#define PA5_POOL_MAG_MAX 32   /* Objects per magazine, at most. */
+
+struct pa5_pool_mag;
+
+struct pa5_pool
+{
+	const char *name;
+	size_t size;
+	size_t align;             /* Power of two. */
+	unsigned mag_size;        /* Objects per magazine. */
+
+	/* Set up on first use. */
+	int id;
+	size_t stride;
+	pthread_mutex_t lock;
+	struct pa5_pool_mag *full;     /* Depot. */
+	struct pa5_pool_mag *empty;
+	void *loose;                   /* Freed while no magazine could be had. */
+	unsigned long long slabs;
+	unsigned long long refills;    /* Full magazines taken from the depot. */
+	unsigned long long flushes;    /* Full magazines given back to it. */
+	unsigned long long gets;       /* From threads that have exited. */
+	unsigned long long puts;
+	unsigned long long trimmed;    /* Bytes of depot objects given back. */
+};
+
+#define PA5_POOL_INIT(name, size, align, mag_size) \
+	{ (name), (size), (align), (mag_size), -1, 0, PTHREAD_MUTEX_INITIALIZER, \
+	  NULL, NULL, NULL, 0, 0, 0, 0, 0, 0 }
+
+/* Returns an object of pool->size bytes, or NULL when out of memory. */
+void *pa5_pool_get(struct pa5_pool *pool);
+
+/* Returns obj, which must have come from pool. */
+void pa5_pool_put(struct pa5_pool *pool, void *obj);
+
+/* Bytes of idle objects of every pool that are still backed by memory. */
+size_t pa5_pool_memory(void);
+
+/* Gives the pages of idle objects in the depots back to the kernel until
+ * pa5_pool_memory() is at most target. */
+void pa5_pool_trim(size_t target);
+
+/* Stats section listing every pool in use. */
+void pa5_pool_stats(FILE *out);
+
+#endif
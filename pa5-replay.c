@@ -0,0 +1,943 @@
+/* pa5-replay.c
+ * Replays a pa5-encfs callback trace.
+ *
+ *   pa5-replay [-f] [-p password] <trace> <dir>
+ *
+ * Without -p, dir is a mounted file system and every record is re-issued as
+ * the matching system call. With -p, dir is a mirror directory and the
+ * records go straight to the pa5-encfs callbacks through pa5-harness, with
+ * no kernel or FUSE in the way.
+ *
+ * A trace holds hashes, not names, so the tree is rebuilt with one made-up
+ * name per hash under the same parents. Anything the trace uses without
+ * creating it first is made before the clock starts: directories, symlinks,
+ * and files as long as the furthest byte ever read from them. Data written
+ * is zeros.
+ *
+ * Each thread of the traced daemon gets a thread here, which issues that
+ * thread's records in order. A record never starts before every record that
+ * had finished when it started in the trace, so the order the daemon saw is
+ * kept. By default each record also waits for its original start time; -f
+ * drops that and replays as fast as the ordering allows.
+ *
+ * Options:
+ *   -f             Maximum speed instead of the original timing
+ *   -p <password>  Replay in process against the mirror dir
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include "pa5-harness.h"
+#include "pa5-stats.h"
+#include "pa5-trace.h"
+
+#define XATTR_NAME "user.pa5-replay"
+#define LINK_TARGET "pa5-replay"
+#define FILL_BLOCK (128 * 1024)
+
+enum node_kind
+{
+	NODE_FILE,
+	NODE_DIR,
+	NODE_LINK
+};
+
+/* A path hash seen in the trace. */
+struct node
+{
+	uint64_t hash;
+	uint64_t parent;
+	enum node_kind kind;
+	int seen;           /* Some record has used it. */
+	int premade;        /* Must exist before the replay starts. */
+	uint64_t extent;    /* Furthest byte read, for premade files. */
+	char *path;         /* Made-up path, relative to the root. */
+};
+
+/* An open file, keyed by the traced fi->fh. */
+struct handle
+{
+	uint64_t traced;
+	int fd;
+	struct fuse_file_info fi;
+	struct handle *next;
+};
+
+struct op_result
+{
+	uint64_t count;
+	uint64_t errors;
+	uint64_t mismatched;   /* Failed here but not in the trace, or the other way round. */
+	uint64_t traced_ns;
+	uint64_t replay_ns;
+};
+
+struct worker
+{
+	pthread_t thread;
+	size_t *recs;
+	size_t nrecs;
+	size_t cap;
+	char *buf;
+	size_t buf_len;
+	struct op_result results[PA5_OP_COUNT];
+};
+
+struct replay
+{
+	const char *trace;
+	const char *dir;          /* Mount point, or NULL in process. */
+	const struct fuse_operations *op;
+	int fast;
+
+	uint64_t root;
+	struct pa5_trace_record *recs;    /* Sorted by start. */
+	size_t nrecs;
+	size_t *needed;                   /* Records that must be done before each one starts. */
+	size_t *end_rank;                 /* Position of each record in end order. */
+
+	struct node *nodes;               /* Open addressing on hash. */
+	size_t node_cap;
+
+	struct worker *workers;
+	unsigned nworkers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t progress;
+	char *done;                       /* By end rank. */
+	size_t done_prefix;
+	struct handle *handles;
+	uint64_t base;
+};
+
+static struct replay rp;
+
+static uint64_t record_end(const struct pa5_trace_record *rec)
+{
+	return rec->start + rec->latency;
+}
+
+static int compare_start(const void *a, const void *b)
+{
+	const struct pa5_trace_record *x = a;
+	const struct pa5_trace_record *y = b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+static int compare_end(const void *a, const void *b)
+{
+	uint64_t x = record_end(&rp.recs[*(const size_t *)a]);
+	uint64_t y = record_end(&rp.recs[*(const size_t *)b]);
+	return (x > y) - (x < y);
+}
+
+static int load_trace(const char *name)
+{
+	unsigned char hdr[PA5_TRACE_HEADER_SIZE];
+	unsigned char buf[PA5_TRACE_RECORD_SIZE];
+	size_t cap = 0;
+	FILE *in = fopen(name, "rb");
+
+	if (!in)
+		return -errno;
+	if (fread(hdr, 1, sizeof(hdr), in) != sizeof(hdr) ||
+	    pa5_trace_parse_header(hdr, &rp.root) < 0)
+	{
+		fclose(in);
+		return -EINVAL;
+	}
+
+	while (fread(buf, 1, sizeof(buf), in) == sizeof(buf))
+	{
+		if (rp.nrecs == cap)
+		{
+			size_t ncap = cap ? cap * 2 : 4096;
+			struct pa5_trace_record *recs = realloc(rp.recs, ncap * sizeof(*recs));
+			if (!recs)
+			{
+				fclose(in);
+				return -ENOMEM;
+			}
+			rp.recs = recs;
+			cap = ncap;
+		}
+		pa5_trace_decode(buf, &rp.recs[rp.nrecs]);
+		if (rp.recs[rp.nrecs].op < PA5_OP_COUNT)
+			rp.nrecs++;
+	}
+	fclose(in);
+
+	qsort(rp.recs, rp.nrecs, sizeof(*rp.recs), compare_start);
+	return 0;
+}
+
+/* Works out what each record waits for: everything that had ended by the
+ * time it started. */
+static int order_records(void)
+{
+	size_t *by_end = malloc(rp.nrecs * sizeof(size_t));
+	size_t i, e = 0;
+
+	rp.needed = malloc(rp.nrecs * sizeof(size_t));
+	rp.end_rank = malloc(rp.nrecs * sizeof(size_t));
+	rp.done = calloc(rp.nrecs + 1, 1);
+	if (!by_end || !rp.needed || !rp.end_rank || !rp.done)
+	{
+		free(by_end);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < rp.nrecs; i++)
+		by_end[i] = i;
+	qsort(by_end, rp.nrecs, sizeof(size_t), compare_end);
+	for (i = 0; i < rp.nrecs; i++)
+		rp.end_rank[by_end[i]] = i;
+
+	for (i = 0; i < rp.nrecs; i++)
+	{
+		while (e < rp.nrecs && record_end(&rp.recs[by_end[e]]) < rp.recs[i].start)
+			e++;
+		rp.needed[i] = e;
+	}
+	free(by_end);
+	return 0;
+}
+
+static struct node *find_node(uint64_t hash)
+{
+	size_t mask = rp.node_cap - 1;
+	size_t i = hash & mask;
+
+	while (rp.nodes[i].hash && rp.nodes[i].hash != hash)
+		i = (i + 1) & mask;
+	return &rp.nodes[i];
+}
+
+/* Adds hash under parent, which may be 0 if the trace never said. */
+static struct node *add_node(uint64_t hash, uint64_t parent)
+{
+	struct node *n = find_node(hash);
+
+	if (!n->hash)
+	{
+		n->hash = hash;
+		n->kind = NODE_FILE;
+	}
+	if (parent && !n->parent)
+		n->parent = parent;
+	if (parent && parent != rp.root)
+		find_node(parent)->hash = parent;
+	return n;
+}
+
+/* Does rec make the node at path (or at path2 when second is set)? */
+static int creates(const struct pa5_trace_record *rec, int second)
+{
+	if (second)
+		return rec->op == PA5_OP_RENAME || rec->op == PA5_OP_LINK;
+	return rec->op == PA5_OP_MKNOD || rec->op == PA5_OP_MKDIR || rec->op == PA5_OP_CREATE ||
+		rec->op == PA5_OP_SYMLINK;
+}
+
+/* A node is premade if the first record to use it expected it to exist,
+ * unless that record failed because it did not. */
+static void first_use(struct node *n, const struct pa5_trace_record *rec, int second)
+{
+	if (n->seen)
+		return;
+	n->seen = 1;
+	if (rec->res == -ENOENT)
+		return;
+	if (creates(rec, second) && rec->res >= 0)
+		return;
+	n->premade = 1;
+}
+
+static const char *node_path(struct node *n, int depth)
+{
+	char buf[PATH_MAX];
+	const char *parent = "";
+
+	if (n->path)
+		return n->path;
+	if (n->hash == rp.root)
+		return "";
+
+	if (n->parent && n->parent != rp.root && depth < 64)
+		parent = node_path(find_node(n->parent), depth + 1);
+	snprintf(buf, sizeof(buf), "%s/n%016llx", parent, (unsigned long long)n->hash);
+	n->path = strdup(buf);
+	return n->path ? n->path : "";
+}
+
+static int build_tree(void)
+{
+	size_t i, want = 64;
+
+	while (want < rp.nrecs * 8)
+		want *= 2;
+	rp.node_cap = want;
+	rp.nodes = calloc(rp.node_cap, sizeof(struct node));
+	if (!rp.nodes)
+		return -ENOMEM;
+
+	for (i = 0; i < rp.nrecs; i++)
+	{
+		const struct pa5_trace_record *rec = &rp.recs[i];
+		struct node *n = add_node(rec->path, rec->parent);
+
+		first_use(n, rec, 0);
+		if (rec->op == PA5_OP_MKDIR || rec->op == PA5_OP_RMDIR || rec->op == PA5_OP_READDIR)
+			n->kind = NODE_DIR;
+		else if (rec->op == PA5_OP_SYMLINK || rec->op == PA5_OP_READLINK)
+			n->kind = NODE_LINK;
+		if (rec->op == PA5_OP_READ && rec->res > 0 && rec->offset + rec->res > n->extent)
+			n->extent = rec->offset + rec->res;
+
+		if (rec->path2)
+		{
+			n = add_node(rec->path2, rec->parent2);
+			first_use(n, rec, 1);
+		}
+	}
+
+	/* Anything with children is a directory, and one nobody made must
+	 * already have been there. */
+	for (i = 0; i < rp.node_cap; i++)
+	{
+		struct node *n = &rp.nodes[i];
+		if (n->hash && n->parent && n->parent != rp.root)
+		{
+			struct node *p = find_node(n->parent);
+			p->kind = NODE_DIR;
+			if (!p->seen)
+				p->premade = 1;
+		}
+	}
+	return 0;
+}
+
+/* The root is "" under a mount point and "/" for the callbacks. */
+static void full_path(char *out, const struct node *n)
+{
+	const char *rel = n->path ? n->path : "";
+
+	if (rp.dir)
+		snprintf(out, PATH_MAX, "%s%s", rp.dir, rel);
+	else
+		snprintf(out, PATH_MAX, "%s", *rel ? rel : "/");
+}
+
+static int fill_mount(const char *path, uint64_t size, const char *zeros)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	uint64_t off;
+	int res = 0;
+
+	if (fd < 0)
+		return -errno;
+	for (off = 0; off < size && res == 0; off += FILL_BLOCK)
+	{
+		size_t len = size - off < FILL_BLOCK ? size - off : FILL_BLOCK;
+		if (pwrite(fd, zeros, len, off) != (ssize_t)len)
+			res = -errno;
+	}
+	close(fd);
+	return res;
+}
+
+static int fill_callbacks(const char *path, uint64_t size, const char *zeros)
+{
+	struct fuse_file_info fi;
+	uint64_t off;
+	int res;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY | O_CREAT | O_TRUNC;
+	if ((res = rp.op->create(path, 0644, &fi)) < 0)
+		return res;
+	for (off = 0; off < size; off += FILL_BLOCK)
+	{
+		size_t len = size - off < FILL_BLOCK ? size - off : FILL_BLOCK;
+		if ((res = rp.op->write(path, zeros, len, off, &fi)) < 0)
+			break;
+		res = 0;
+	}
+	rp.op->release(path, &fi);
+	return res;
+}
+
+/* Makes a premade node and, first, its parents. */
+static int premake(struct node *n, const char *zeros, int depth)
+{
+	char path[PATH_MAX];
+	int res;
+
+	if (!n->hash || n->hash == rp.root || n->premade == 2 || depth > 64)
+		return 0;
+	if (n->parent && n->parent != rp.root &&
+	    (res = premake(find_node(n->parent), zeros, depth + 1)) < 0)
+		return res;
+	n->premade = 2;
+
+	full_path(path, n);
+	if (n->kind == NODE_DIR)
+		res = rp.op ? rp.op->mkdir(path, 0755) : (mkdir(path, 0755) ? -errno : 0);
+	else if (n->kind == NODE_LINK)
+		res = rp.op ? rp.op->symlink(LINK_TARGET, path) :
+			(symlink(LINK_TARGET, path) ? -errno : 0);
+	else
+		res = rp.op ? fill_callbacks(path, n->extent, zeros) :
+			fill_mount(path, n->extent, zeros);
+	return res == -EEXIST ? 0 : res;
+}
+
+static int premake_all(void)
+{
+	char *zeros = calloc(1, FILL_BLOCK);
+	size_t i;
+	int res = 0;
+
+	if (!zeros)
+		return -ENOMEM;
+	for (i = 0; i < rp.node_cap && res == 0; i++)
+	{
+		if (rp.nodes[i].hash)
+			node_path(&rp.nodes[i], 0);
+	}
+	for (i = 0; i < rp.node_cap && res == 0; i++)
+	{
+		if (rp.nodes[i].premade == 1)
+			res = premake(&rp.nodes[i], zeros, 0);
+	}
+	free(zeros);
+	return res;
+}
+
+/* Finds the open file for a traced handle, opening path if the file was
+ * already open when the trace started. */
+static struct handle *get_handle(uint64_t traced, const char *path)
+{
+	struct handle *h;
+
+	pthread_mutex_lock(&rp.lock);
+	for (h = rp.handles; h; h = h->next)
+	{
+		if (h->traced == traced)
+			break;
+	}
+	pthread_mutex_unlock(&rp.lock);
+	if (h)
+		return h;
+
+	if ((h = calloc(1, sizeof(*h))) == NULL)
+		return NULL;
+	h->traced = traced;
+	h->fd = -1;
+	h->fi.flags = O_RDWR;
+	if (rp.op)
+	{
+		if (rp.op->open(path, &h->fi) < 0)
+		{
+			h->fi.flags = O_RDONLY;
+			if (rp.op->open(path, &h->fi) < 0)
+			{
+				free(h);
+				return NULL;
+			}
+		}
+	}
+	else if ((h->fd = open(path, O_RDWR)) < 0 && (h->fd = open(path, O_RDONLY)) < 0)
+	{
+		free(h);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&rp.lock);
+	h->next = rp.handles;
+	rp.handles = h;
+	pthread_mutex_unlock(&rp.lock);
+	return h;
+}
+
+static void put_handle(uint64_t traced, struct handle *h)
+{
+	h->traced = traced;
+	pthread_mutex_lock(&rp.lock);
+	h->next = rp.handles;
+	rp.handles = h;
+	pthread_mutex_unlock(&rp.lock);
+}
+
+static struct handle *take_handle(uint64_t traced)
+{
+	struct handle **link;
+	struct handle *h = NULL;
+
+	pthread_mutex_lock(&rp.lock);
+	for (link = &rp.handles; *link; link = &(*link)->next)
+	{
+		if ((*link)->traced == traced)
+		{
+			h = *link;
+			*link = h->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rp.lock);
+	return h;
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(void) buf;
+	(void) name;
+	(void) st;
+	(void) off;
+	return 0;
+}
+
+/* Issues rec against the mount. Returns the result the callback would have. */
+static int issue_mount(const struct pa5_trace_record *rec, const char *path, const char *path2,
+		       struct worker *w)
+{
+	struct handle *h;
+	struct stat st;
+	struct statvfs sv;
+	DIR *dir;
+	ssize_t res = 0;
+
+	switch (rec->op)
+	{
+	case PA5_OP_GETATTR:
+		res = lstat(path, &st);
+		break;
+	case PA5_OP_ACCESS:
+		res = access(path, rec->flags);
+		break;
+	case PA5_OP_READLINK:
+		res = readlink(path, w->buf, rec->size ? rec->size - 1 : 0);
+		return res < 0 ? -errno : 0;
+	case PA5_OP_READDIR:
+		if ((dir = opendir(path)) == NULL)
+			return -errno;
+		while (readdir(dir))
+			;
+		closedir(dir);
+		return 0;
+	case PA5_OP_MKNOD:
+		res = mknod(path, rec->mode, rec->offset);
+		break;
+	case PA5_OP_MKDIR:
+		res = mkdir(path, rec->mode);
+		break;
+	case PA5_OP_SYMLINK:
+		res = symlink(LINK_TARGET, path);
+		break;
+	case PA5_OP_UNLINK:
+		res = unlink(path);
+		break;
+	case PA5_OP_RMDIR:
+		res = rmdir(path);
+		break;
+	case PA5_OP_RENAME:
+		res = rename(path, path2);
+		break;
+	case PA5_OP_LINK:
+		res = link(path, path2);
+		break;
+	case PA5_OP_CHMOD:
+		res = chmod(path, rec->mode);
+		break;
+	case PA5_OP_CHOWN:
+		res = lchown(path, -1, -1);
+		break;
+	case PA5_OP_TRUNCATE:
+		res = truncate(path, rec->offset);
+		break;
+	case PA5_OP_UTIMENS:
+		res = utimensat(AT_FDCWD, path, NULL, AT_SYMLINK_NOFOLLOW);
+		break;
+	case PA5_OP_STATFS:
+		res = statvfs(path, &sv);
+		break;
+	case PA5_OP_OPEN:
+	case PA5_OP_CREATE:
+		if ((h = calloc(1, sizeof(*h))) == NULL)
+			return -ENOMEM;
+		if (rec->op == PA5_OP_CREATE)
+			h->fd = open(path, rec->flags | O_CREAT, rec->mode & 07777);
+		else
+			h->fd = open(path, rec->flags & ~(O_CREAT | O_EXCL | O_TRUNC | O_NOCTTY));
+		if (h->fd < 0)
+		{
+			res = -errno;
+			free(h);
+			return res;
+		}
+		put_handle(rec->handle, h);
+		return 0;
+	case PA5_OP_RELEASE:
+		if ((h = take_handle(rec->handle)) == NULL)
+			return 0;
+		close(h->fd);
+		free(h);
+		return 0;
+	case PA5_OP_READ:
+	case PA5_OP_WRITE:
+	case PA5_OP_FTRUNCATE:
+	case PA5_OP_FSYNC:
+		if ((h = get_handle(rec->handle, path)) == NULL)
+			return -EBADF;
+		if (rec->op == PA5_OP_READ)
+			res = pread(h->fd, w->buf, rec->size, rec->offset);
+		else if (rec->op == PA5_OP_WRITE)
+			res = pwrite(h->fd, w->buf, rec->size, rec->offset);
+		else if (rec->op == PA5_OP_FTRUNCATE)
+			res = ftruncate(h->fd, rec->offset);
+		else
+			res = rec->flags ? fdatasync(h->fd) : fsync(h->fd);
+		return res < 0 ? -errno : (int)res;
+	case PA5_OP_SETXATTR:
+		res = lsetxattr(path, XATTR_NAME, w->buf, rec->size, 0);
+		break;
+	case PA5_OP_GETXATTR:
+		res = lgetxattr(path, XATTR_NAME, w->buf, rec->size);
+		return res < 0 ? -errno : (int)res;
+	case PA5_OP_LISTXATTR:
+		res = llistxattr(path, w->buf, rec->size);
+		return res < 0 ? -errno : (int)res;
+	case PA5_OP_REMOVEXATTR:
+		res = lremovexattr(path, XATTR_NAME);
+		break;
+	}
+	return res < 0 ? -errno : 0;
+}
+
+/* Issues rec straight to the callbacks. */
+static int issue_callbacks(const struct pa5_trace_record *rec, const char *path,
+			   const char *path2, struct worker *w)
+{
+	const struct fuse_operations *op = rp.op;
+	struct handle *h;
+	struct fuse_file_info fi;
+	struct stat st;
+	struct statvfs sv;
+	struct timespec ts[2];
+	int res;
+
+	memset(&fi, 0, sizeof(fi));
+	switch (rec->op)
+	{
+	case PA5_OP_GETATTR:
+		return op->getattr(path, &st);
+	case PA5_OP_ACCESS:
+		return op->access(path, rec->flags);
+	case PA5_OP_READLINK:
+		return op->readlink(path, w->buf, rec->size);
+	case PA5_OP_READDIR:
+		return op->readdir(path, NULL, count_entry, 0, &fi);
+	case PA5_OP_MKNOD:
+		return op->mknod(path, rec->mode, rec->offset);
+	case PA5_OP_MKDIR:
+		return op->mkdir(path, rec->mode);
+	case PA5_OP_SYMLINK:
+		return op->symlink(LINK_TARGET, path);
+	case PA5_OP_UNLINK:
+		return op->unlink(path);
+	case PA5_OP_RMDIR:
+		return op->rmdir(path);
+	case PA5_OP_RENAME:
+		return op->rename(path, path2);
+	case PA5_OP_LINK:
+		return op->link(path, path2);
+	case PA5_OP_CHMOD:
+		return op->chmod(path, rec->mode);
+	case PA5_OP_CHOWN:
+		return op->chown(path, -1, -1);
+	case PA5_OP_TRUNCATE:
+		return op->truncate(path, rec->offset);
+	case PA5_OP_UTIMENS:
+		clock_gettime(CLOCK_REALTIME, &ts[0]);
+		ts[1] = ts[0];
+		return op->utimens(path, ts);
+	case PA5_OP_STATFS:
+		return op->statfs(path, &sv);
+	case PA5_OP_OPEN:
+	case PA5_OP_CREATE:
+		if ((h = calloc(1, sizeof(*h))) == NULL)
+			return -ENOMEM;
+		h->fd = -1;
+		h->fi.flags = rec->flags;
+		if (rec->op == PA5_OP_CREATE)
+			res = op->create(path, rec->mode, &h->fi);
+		else
+			res = op->open(path, &h->fi);
+		if (res < 0)
+			free(h);
+		else
+			put_handle(rec->handle, h);
+		return res;
+	case PA5_OP_RELEASE:
+		if ((h = take_handle(rec->handle)) == NULL)
+			return 0;
+		res = op->release(path, &h->fi);
+		free(h);
+		return res;
+	case PA5_OP_READ:
+	case PA5_OP_WRITE:
+	case PA5_OP_FTRUNCATE:
+	case PA5_OP_FSYNC:
+		if ((h = get_handle(rec->handle, path)) == NULL)
+			return -EBADF;
+		if (rec->op == PA5_OP_READ)
+			return op->read(path, w->buf, rec->size, rec->offset, &h->fi);
+		if (rec->op == PA5_OP_WRITE)
+			return op->write(path, w->buf, rec->size, rec->offset, &h->fi);
+		if (rec->op == PA5_OP_FTRUNCATE)
+			return op->ftruncate(path, rec->offset, &h->fi);
+		return op->fsync(path, rec->flags, &h->fi);
+	case PA5_OP_SETXATTR:
+		return op->setxattr(path, XATTR_NAME, w->buf, rec->size, 0);
+	case PA5_OP_GETXATTR:
+		return op->getxattr(path, XATTR_NAME, w->buf, rec->size);
+	case PA5_OP_LISTXATTR:
+		return op->listxattr(path, w->buf, rec->size);
+	case PA5_OP_REMOVEXATTR:
+		return op->removexattr(path, XATTR_NAME);
+	}
+	return -ENOSYS;
+}
+
+static void wait_for(size_t i)
+{
+	if (!rp.fast)
+	{
+		uint64_t at = rp.base + rp.recs[i].start;
+		struct timespec ts = { at / 1000000000ULL, at % 1000000000ULL };
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+	}
+
+	pthread_mutex_lock(&rp.lock);
+	while (rp.done_prefix < rp.needed[i])
+		pthread_cond_wait(&rp.progress, &rp.lock);
+	pthread_mutex_unlock(&rp.lock);
+}
+
+static void mark_done(size_t i)
+{
+	pthread_mutex_lock(&rp.lock);
+	rp.done[rp.end_rank[i]] = 1;
+	while (rp.done_prefix < rp.nrecs && rp.done[rp.done_prefix])
+		rp.done_prefix++;
+	pthread_cond_broadcast(&rp.progress);
+	pthread_mutex_unlock(&rp.lock);
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	size_t k;
+
+	for (k = 0; k < w->nrecs; k++)
+	{
+		size_t i = w->recs[k];
+		const struct pa5_trace_record *rec = &rp.recs[i];
+		struct op_result *r = &w->results[rec->op];
+		char path[PATH_MAX], path2[PATH_MAX];
+
+		full_path(path, find_node(rec->path));
+		path2[0] = '\0';
+		if (rec->path2)
+			full_path(path2, find_node(rec->path2));
+
+		wait_for(i);
+		uint64_t start = pa5_stats_now();
+		int res = rp.op ? issue_callbacks(rec, path, path2, w) :
+			issue_mount(rec, path, path2, w);
+		r->replay_ns += pa5_stats_now() - start;
+		mark_done(i);
+
+		r->count++;
+		r->traced_ns += rec->latency;
+		if (res < 0)
+			r->errors++;
+		if ((res < 0) != (rec->res < 0))
+			r->mismatched++;
+	}
+	return NULL;
+}
+
+/* One worker per traced thread, each with its records in start order and a
+ * buffer big enough for its largest request. */
+static int make_workers(void)
+{
+	size_t i;
+
+	for (i = 0; i < rp.nrecs; i++)
+	{
+		if (rp.recs[i].thread >= rp.nworkers)
+			rp.nworkers = rp.recs[i].thread + 1;
+	}
+	rp.workers = calloc(rp.nworkers ? rp.nworkers : 1, sizeof(struct worker));
+	if (!rp.workers)
+		return -ENOMEM;
+
+	for (i = 0; i < rp.nrecs; i++)
+	{
+		struct worker *w = &rp.workers[rp.recs[i].thread];
+		if (w->nrecs == w->cap)
+		{
+			size_t ncap = w->cap ? w->cap * 2 : 256;
+			size_t *recs = realloc(w->recs, ncap * sizeof(size_t));
+			if (!recs)
+				return -ENOMEM;
+			w->recs = recs;
+			w->cap = ncap;
+		}
+		w->recs[w->nrecs++] = i;
+		if (rp.recs[i].size + 1 > w->buf_len)
+			w->buf_len = rp.recs[i].size + 1;
+	}
+	for (i = 0; i < rp.nworkers; i++)
+	{
+		if ((rp.workers[i].buf = calloc(1, rp.workers[i].buf_len)) == NULL)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+static void report(uint64_t elapsed)
+{
+	uint64_t span = rp.nrecs ? record_end(&rp.recs[rp.nrecs - 1]) : 0;
+	unsigned t;
+	int op;
+	size_t i;
+
+	for (i = 0; i < rp.nrecs; i++)
+	{
+		if (record_end(&rp.recs[i]) > span)
+			span = record_end(&rp.recs[i]);
+	}
+
+	printf("%-12s %9s %9s %11s %12s %12s\n", "op", "count", "errors", "mismatched",
+	       "traced_us", "replay_us");
+	for (op = 0; op < PA5_OP_COUNT; op++)
+	{
+		struct op_result sum;
+		memset(&sum, 0, sizeof(sum));
+		for (t = 0; t < rp.nworkers; t++)
+		{
+			struct op_result *r = &rp.workers[t].results[op];
+			sum.count += r->count;
+			sum.errors += r->errors;
+			sum.mismatched += r->mismatched;
+			sum.traced_ns += r->traced_ns;
+			sum.replay_ns += r->replay_ns;
+		}
+		if (sum.count == 0)
+			continue;
+		printf("%-12s %9llu %9llu %11llu %12.1f %12.1f\n",
+		       pa5_stats_timer_name(op), (unsigned long long)sum.count,
+		       (unsigned long long)sum.errors, (unsigned long long)sum.mismatched,
+		       sum.traced_ns / 1000.0 / sum.count, sum.replay_ns / 1000.0 / sum.count);
+	}
+	printf("%zu records on %u threads in %.3f s (traced: %.3f s)\n", rp.nrecs, rp.nworkers,
+	       elapsed / 1e9, span / 1e9);
+}
+
+static int replay_body(const struct fuse_operations *op, void *arg)
+{
+	unsigned t;
+	int res;
+
+	(void) arg;
+
+	rp.op = op;
+	if ((res = premake_all()) < 0)
+	{
+		fprintf(stderr, "Error: Could not set up the tree: %s\n", strerror(-res));
+		return EXIT_FAILURE;
+	}
+
+	rp.base = pa5_stats_now();
+	for (t = 0; t < rp.nworkers; t++)
+	{
+		if (pthread_create(&rp.workers[t].thread, NULL, worker_main, &rp.workers[t]) != 0)
+		{
+			fprintf(stderr, "Error: Could not start a replay thread.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (t = 0; t < rp.nworkers; t++)
+		pthread_join(rp.workers[t].thread, NULL);
+	report(pa5_stats_now() - rp.base);
+	return EXIT_SUCCESS;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-f] [-p password] <trace> <dir>\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *password = NULL;
+	int opt;
+	int res;
+
+	while ((opt = getopt(argc, argv, "fp:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'f':
+			rp.fast = 1;
+			break;
+		case 'p':
+			password = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+	rp.trace = argv[optind];
+	pthread_mutex_init(&rp.lock, NULL);
+	pthread_cond_init(&rp.progress, NULL);
+
+	if ((res = load_trace(rp.trace)) < 0)
+	{
+		fprintf(stderr, "Error: %s: %s\n", rp.trace,
+			res == -EINVAL ? "not a pa5-encfs trace" : strerror(-res));
+		return EXIT_FAILURE;
+	}
+	if (order_records() < 0 || build_tree() < 0 || make_workers() < 0)
+	{
+		fprintf(stderr, "Error: Out of memory.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (password)
+		return pa5_harness_run(password, argv[optind + 1], replay_body, NULL);
+
+	rp.dir = argv[optind + 1];
+	return replay_body(NULL, NULL);
+}
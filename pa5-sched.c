@@ -0,0 +1,650 @@
+/* pa5-sched.c
+ * Priority scheduler for chunk crypto and backing I/O.
+ *
+ * Waiting callers sit in one FIFO per class, each on a condition variable of
+ * its own, so a freed slot wakes exactly the caller it is handed to. A
+ * caller that finds nobody queued and room in its class takes a slot
+ * straight away; otherwise it queues behind the others and the dispatcher
+ * decides, which keeps a stream of foreground arrivals from overtaking an
+ * aged background waiter.
+ *
+ * A slot is charged to its tenant twice: the tenant's recent hold time up
+ * front, so that a tenant with many requests in flight falls behind at
+ * once, and the difference to the actual hold time when it is given back.
+ * Tenants live in a fixed table and are never freed, so a thread keeps a
+ * pointer to its own without the lock.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-sched.h"
+#include "pa5-stats.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define AGING_NS ((int64_t)PA5_SCHED_AGING_MS * 1000000)
+#define MIN_SLOTS 4
+#define LABEL_MAX 64
+#define LATENCY_BUCKETS 40   /* Bucket i holds latencies below 2^i ns. */
+#define OTHER_KEY UINT64_MAX
+
+enum fair_key
+{
+	FAIR_OFF,
+	FAIR_UID,
+	FAIR_GID,
+	FAIR_PID,
+	FAIR_CGROUP
+};
+
+struct tenant
+{
+	uint64_t key;
+	char label[LABEL_MAX];
+	unsigned weight;
+	unsigned active;          /* Slots held and callers queued. */
+	uint64_t vtime;           /* Hold time so far over weight, in ns. */
+	uint64_t hold_ns;         /* Recent time a slot is held. */
+	uint64_t first_ns;
+	unsigned long long waited;
+	uint64_t wait_ns;
+	uint64_t busy_ns;
+
+	/* Reads and writes, updated without the lock. */
+	unsigned long long ops;
+	unsigned long long errors;
+	unsigned long long bytes;
+	uint64_t lat_ns;
+	uint64_t max_lat_ns;
+	unsigned long long buckets[LATENCY_BUCKETS];
+};
+
+struct weight
+{
+	char label[LABEL_MAX];
+	unsigned weight;
+};
+
+struct waiter
+{
+	struct waiter *next;
+	struct tenant *tenant;
+	pthread_cond_t cond;
+	uint64_t since;
+	uint64_t charge;
+	int granted;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	unsigned slots;                        /* 0 while the gate is off. */
+	unsigned limit[PA5_SCHED_CLASSES];
+	unsigned asked[PA5_SCHED_CLASSES];     /* Limits as given, 0 for the default. */
+	unsigned background_limit;
+	unsigned running[PA5_SCHED_CLASSES];
+	unsigned total;
+	unsigned background;
+	struct waiter *head[PA5_SCHED_CLASSES];
+	struct waiter *tail[PA5_SCHED_CLASSES];
+	unsigned queued[PA5_SCHED_CLASSES];
+	unsigned nqueued;
+
+	unsigned long long admitted[PA5_SCHED_CLASSES];
+	unsigned long long waited[PA5_SCHED_CLASSES];
+	unsigned long long aged[PA5_SCHED_CLASSES];   /* Admitted ahead of a better class. */
+	uint64_t wait_ns[PA5_SCHED_CLASSES];
+	uint64_t max_wait_ns[PA5_SCHED_CLASSES];
+
+	enum fair_key fair;
+	struct tenant tenants[PA5_SCHED_TENANTS];   /* The last one is "other". */
+	unsigned ntenants;
+	uint64_t vclock;          /* Virtual time of the latest tenant served. */
+	struct weight weights[PA5_SCHED_TENANTS];
+	unsigned nweights;
+} sched = { .lock = PTHREAD_MUTEX_INITIALIZER, .fair = FAIR_UID };
+
+static __thread int thread_class = PA5_SCHED_READ;
+static __thread int thread_held = -1;
+static __thread unsigned thread_depth = 0;
+static __thread struct tenant *thread_tenant = NULL;
+static __thread uint64_t thread_key = 0;
+static __thread pid_t thread_cgroup_pid = 0;
+static __thread struct tenant *thread_held_tenant = NULL;
+static __thread uint64_t thread_start = 0;
+static __thread uint64_t thread_charge = 0;
+
+static const char *class_names[PA5_SCHED_CLASSES] = {
+	"read", "write", "prefetch", "writeback", "maint"
+};
+
+static const char *fair_names[] = { "off", "uid", "gid", "pid", "cgroup" };
+
+static int is_background(int cls)
+{
+	return cls >= PA5_SCHED_PREFETCH;
+}
+
+/* Whether a caller of class cls may take a slot now. Called locked. */
+static int eligible(int cls)
+{
+	return sched.total < sched.slots && sched.running[cls] < sched.limit[cls] &&
+	       (!is_background(cls) || sched.background < sched.background_limit);
+}
+
+/* Takes a slot for cls and charges it to t up front. Called locked.
+ * Return: the charge */
+static uint64_t take(int cls, struct tenant *t)
+{
+	uint64_t charge = 0;
+
+	sched.running[cls]++;
+	sched.total++;
+	if (is_background(cls))
+		sched.background++;
+	sched.admitted[cls]++;
+	if (t)
+	{
+		if (t->vtime > sched.vclock)
+			sched.vclock = t->vtime;
+		charge = t->hold_ns / t->weight;
+		t->vtime += charge;
+	}
+	return charge;
+}
+
+static uint64_t vtime_of(const struct tenant *t)
+{
+	return t ? t->vtime : sched.vclock;
+}
+
+/* Unlinks and returns the waiter of cls whose tenant is furthest behind,
+ * the longest waiting of them on a tie. Called locked. */
+static struct waiter *pick(int cls)
+{
+	struct waiter *best = sched.head[cls];
+	struct waiter *best_prev = NULL;
+	struct waiter *prev = best;
+	struct waiter *w;
+
+	for (w = best->next; w; prev = w, w = w->next)
+	{
+		if (vtime_of(w->tenant) < vtime_of(best->tenant))
+		{
+			best = w;
+			best_prev = prev;
+		}
+	}
+	if (best_prev)
+		best_prev->next = best->next;
+	else
+		sched.head[cls] = best->next;
+	if (sched.tail[cls] == best)
+		sched.tail[cls] = best_prev;
+	return best;
+}
+
+/* Hands free slots to the best waiters. Called locked. */
+static void dispatch(void)
+{
+	while (sched.nqueued > 0 && sched.total < sched.slots)
+	{
+		uint64_t now = pa5_stats_now();
+		int64_t best_score = 0;
+		int best = -1;
+		int cls;
+
+		for (cls = 0; cls < PA5_SCHED_CLASSES; cls++)
+		{
+			struct waiter *w = sched.head[cls];
+			if (!w || !eligible(cls))
+				continue;
+			int64_t score = cls * AGING_NS - (int64_t)(now - w->since);
+			if (best < 0 || score < best_score ||
+			    (score == best_score && w->since < sched.head[best]->since))
+			{
+				best = cls;
+				best_score = score;
+			}
+		}
+		if (best < 0)
+			return;
+
+		for (cls = 0; cls < best; cls++)
+		{
+			if (sched.head[cls] && eligible(cls))
+			{
+				sched.aged[best]++;
+				break;
+			}
+		}
+
+		struct waiter *w = pick(best);
+		sched.queued[best]--;
+		sched.nqueued--;
+		pa5_queue_depth(PA5_QUEUE_SCHED, sched.nqueued);
+		w->charge = take(best, w->tenant);
+		w->granted = 1;
+		pthread_cond_signal(&w->cond);
+	}
+}
+
+int pa5_sched_init(unsigned slots, const unsigned *limits)
+{
+	unsigned defaults[PA5_SCHED_CLASSES];
+	int cls;
+
+	if (slots == 0)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		slots = (cpus > 0) ? 2 * (unsigned)cpus : MIN_SLOTS;
+		if (slots < MIN_SLOTS)
+			slots = MIN_SLOTS;
+	}
+	defaults[PA5_SCHED_READ] = slots;
+	defaults[PA5_SCHED_WRITE] = slots;
+	defaults[PA5_SCHED_PREFETCH] = slots / 2;
+	defaults[PA5_SCHED_WRITEBACK] = slots / 2;
+	defaults[PA5_SCHED_MAINT] = slots / 4;
+
+	pa5_mutex_lock(&sched.lock, PA5_LOCK_SCHED);
+	if (limits)
+		memcpy(sched.asked, limits, sizeof(sched.asked));
+	for (cls = 0; cls < PA5_SCHED_CLASSES; cls++)
+	{
+		unsigned limit = sched.asked[cls] ? sched.asked[cls] : defaults[cls];
+		sched.limit[cls] = (limit == 0) ? 1 : (limit > slots) ? slots : limit;
+	}
+	sched.background_limit = slots - slots / 4;
+	if (sched.background_limit == 0)
+		sched.background_limit = 1;
+	__atomic_store_n(&sched.slots, slots, __ATOMIC_RELAXED);
+	dispatch();
+	pthread_mutex_unlock(&sched.lock);
+	return 0;
+}
+
+unsigned pa5_sched_slots(void)
+{
+	return __atomic_load_n(&sched.slots, __ATOMIC_RELAXED);
+}
+
+void pa5_sched_limits(unsigned limits[PA5_SCHED_CLASSES])
+{
+	pa5_mutex_lock(&sched.lock, PA5_LOCK_SCHED);
+	memcpy(limits, sched.limit, sizeof(sched.limit));
+	pthread_mutex_unlock(&sched.lock);
+}
+
+int pa5_sched_parse_limits(const char *text, unsigned limits[PA5_SCHED_CLASSES])
+{
+	const char *p = text;
+	char *end;
+	int cls;
+
+	for (cls = 0; cls < PA5_SCHED_CLASSES; cls++)
+	{
+		unsigned long v = strtoul(p, &end, 10);
+		if (end == p || v > 1u << 16 || *end != ((cls == PA5_SCHED_CLASSES - 1) ? '\0' : ','))
+			return -EINVAL;
+		limits[cls] = v;
+		p = end + 1;
+	}
+	return 0;
+}
+
+int pa5_sched_set_class(int cls)
+{
+	int old = thread_class;
+
+	if (cls >= 0 && cls < PA5_SCHED_CLASSES)
+		thread_class = cls;
+	return old;
+}
+
+/* Weight of the tenant named label. Called locked. */
+static unsigned weight_of(const char *label)
+{
+	unsigned i;
+
+	for (i = 0; i < sched.nweights; i++)
+		if (strcmp(sched.weights[i].label, label) == 0)
+			return sched.weights[i].weight;
+	return 1;
+}
+
+int pa5_sched_set_fairness(const char *key, const char *weights)
+{
+	struct weight parsed[PA5_SCHED_TENANTS];
+	const char *p = weights;
+	unsigned n = 0;
+	unsigned i;
+
+	for (i = 0; i < sizeof(fair_names) / sizeof(fair_names[0]); i++)
+		if (key && strcmp(key, fair_names[i]) == 0)
+			break;
+	if (key && i == sizeof(fair_names) / sizeof(fair_names[0]))
+		return -EINVAL;
+
+	while (p && *p)
+	{
+		const char *end = strchr(p, ',');
+		size_t len = end ? (size_t)(end - p) : strlen(p);
+		const char *colon = memrchr(p, ':', len);
+		char *num_end;
+		unsigned long weight = colon ? strtoul(colon + 1, &num_end, 10) : 0;
+
+		if (!colon || colon == p || (size_t)(colon - p) >= LABEL_MAX ||
+		    num_end != p + len || weight == 0 || weight > 1000 || n == PA5_SCHED_TENANTS)
+			return -EINVAL;
+		memcpy(parsed[n].label, p, colon - p);
+		parsed[n].label[colon - p] = '\0';
+		parsed[n].weight = weight;
+		n++;
+		p = end ? end + 1 : NULL;
+	}
+
+	pa5_mutex_lock(&sched.lock, PA5_LOCK_SCHED);
+	if (key)
+		sched.fair = (enum fair_key) i;
+	memcpy(sched.weights, parsed, n * sizeof(parsed[0]));
+	sched.nweights = n;
+	for (i = 0; i < PA5_SCHED_TENANTS; i++)
+		if (sched.tenants[i].weight)
+			sched.tenants[i].weight = weight_of(sched.tenants[i].label);
+	pthread_mutex_unlock(&sched.lock);
+	return 0;
+}
+
+void pa5_sched_print_weights(FILE *out)
+{
+	unsigned i;
+
+	pa5_mutex_lock(&sched.lock, PA5_LOCK_SCHED);
+	for (i = 0; i < sched.nweights; i++)
+		fprintf(out, "%s%s:%u", i ? "," : "", sched.weights[i].label, sched.weights[i].weight);
+	pthread_mutex_unlock(&sched.lock);
+}
+
+/* The tenant with key, added as label if it is new. Called locked. */
+static struct tenant *tenant_find(uint64_t key, const char *label)
+{
+	struct tenant *t;
+	unsigned i;
+
+	for (i = 0; i < sched.ntenants; i++)
+		if (sched.tenants[i].key == key)
+			return &sched.tenants[i];
+
+	if (sched.ntenants < PA5_SCHED_TENANTS - 1)
+	{
+		t = &sched.tenants[sched.ntenants++];
+		t->key = key;
+	}
+	else
+	{
+		t = &sched.tenants[PA5_SCHED_TENANTS - 1];
+		if (t->weight)
+			return t;
+		t->key = OTHER_KEY;
+		label = "other";
+	}
+	snprintf(t->label, sizeof(t->label), "%s", label);
+	t->weight = weight_of(label);
+	t->vtime = sched.vclock;
+	t->first_ns = pa5_stats_now();
+	return t;
+}
+
+/* Reads the cgroup of pid, the path of the last hierarchy listed, which on
+ * a unified hierarchy is the only one.
+ * Return: 0 on success, -errno on error */
+static int cgroup_of(pid_t pid, char *path, size_t size)
+{
+	char name[64];
+	char buf[1024];
+	ssize_t n;
+	int fd;
+
+	snprintf(name, sizeof(name), "/proc/%d/cgroup", (int) pid);
+	if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0)
+		return -errno;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return n < 0 ? -errno : -ENOENT;
+	while (n > 0 && buf[n - 1] == '\n')
+		n--;
+	buf[n] = '\0';
+
+	char *line = strrchr(buf, '\n');
+	line = line ? line + 1 : buf;
+	char *p = strchr(line, ':');
+	if (!p || !(p = strchr(p + 1, ':')))
+		return -EINVAL;
+	snprintf(path, size, "%s", p + 1);
+	return 0;
+}
+
+void pa5_sched_set_tenant(uid_t uid, gid_t gid, pid_t pid)
+{
+	char label[LABEL_MAX];
+	uint64_t key;
+	const char *c;
+
+	switch (sched.fair)
+	{
+	case FAIR_UID:
+		key = uid;
+		break;
+	case FAIR_GID:
+		key = gid;
+		break;
+	case FAIR_PID:
+		key = pid;
+		break;
+	case FAIR_CGROUP:
+		if (thread_tenant && pid == thread_cgroup_pid)
+			return;
+		if (cgroup_of(pid, label, sizeof(label)) < 0)
+			snprintf(label, sizeof(label), "?");
+		/* FNV-1a of the path. */
+		key = 14695981039346656037ULL;
+		for (c = label; *c; c++)
+			key = (key ^ (unsigned char) *c) * 1099511628211ULL;
+		break;
+	default:
+		thread_tenant = NULL;
+		return;
+	}
+	if (thread_tenant && thread_key == key)
+		return;
+
+	if (sched.fair != FAIR_CGROUP)
+		snprintf(label, sizeof(label), "%llu", (unsigned long long) key);
+	pa5_mutex_lock(&sched.lock, PA5_LOCK_SCHED);
+	thread_tenant = tenant_find(key, label);
+	pthread_mutex_unlock(&sched.lock);
+	thread_key = key;
+	thread_cgroup_pid = pid;
+}
+
+void pa5_sched_account(uint64_t start, int res)
+{
+	struct tenant *t = thread_tenant;
+
+	if (!t)
+		return;
+	uint64_t ns = pa5_stats_now() - start;
+	unsigned bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (bucket >= LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS - 1;
+
+	__atomic_add_fetch(&t->ops, 1, __ATOMIC_RELAXED);
+	if (res < 0)
+		__atomic_add_fetch(&t->errors, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&t->bytes, res, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&t->lat_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&t->buckets[bucket], 1, __ATOMIC_RELAXED);
+	if (ns > __atomic_load_n(&t->max_lat_ns, __ATOMIC_RELAXED))
+		__atomic_store_n(&t->max_lat_ns, ns, __ATOMIC_RELAXED);
+}
+
+void pa5_sched_enter(void)
+{
+	struct waiter w;
+	struct tenant *t = is_background(thread_class) ? NULL : thread_tenant;
+	int cls = thread_class;
+
+	if (thread_depth++ > 0)
+		return;
+	thread_held = -1;
+	if (!__atomic_load_n(&sched.slots, __ATOMIC_RELAXED))
+		return;
+
+	pa5_mutex_lock(&sched.lock, PA5_LOCK_SCHED);
+	thread_held = cls;
+	thread_held_tenant = t;
+	if (t && t->active++ == 0 && t->vtime < sched.vclock)
+		t->vtime = sched.vclock;
+	if (sched.nqueued == 0 && eligible(cls))
+	{
+		thread_charge = take(cls, t);
+		pthread_mutex_unlock(&sched.lock);
+		thread_start = pa5_stats_now();
+		return;
+	}
+
+	w.next = NULL;
+	w.tenant = t;
+	w.granted = 0;
+	w.since = pa5_stats_now();
+	pthread_cond_init(&w.cond, NULL);
+	if (sched.tail[cls])
+		sched.tail[cls]->next = &w;
+	else
+		sched.head[cls] = &w;
+	sched.tail[cls] = &w;
+	sched.queued[cls]++;
+	sched.nqueued++;
+	pa5_queue_depth(PA5_QUEUE_SCHED, sched.nqueued);
+
+	dispatch();
+	while (!w.granted)
+		pthread_cond_wait(&w.cond, &sched.lock);
+
+	uint64_t waited = pa5_stats_now() - w.since;
+	sched.waited[cls]++;
+	sched.wait_ns[cls] += waited;
+	if (waited > sched.max_wait_ns[cls])
+		sched.max_wait_ns[cls] = waited;
+	if (t)
+	{
+		t->waited++;
+		t->wait_ns += waited;
+	}
+	pthread_mutex_unlock(&sched.lock);
+	pthread_cond_destroy(&w.cond);
+	pa5_stats_time(PA5_TIME_QUEUE, w.since, 0);
+	thread_charge = w.charge;
+	thread_start = pa5_stats_now();
+}
+
+void pa5_sched_leave(void)
+{
+	int cls = thread_held;
+
+	struct tenant *t = thread_held_tenant;
+
+	if (thread_depth == 0 || --thread_depth > 0 || cls < 0)
+		return;
+	thread_held = -1;
+	uint64_t held = pa5_stats_now() - thread_start;
+
+	pa5_mutex_lock(&sched.lock, PA5_LOCK_SCHED);
+	sched.running[cls]--;
+	sched.total--;
+	if (is_background(cls))
+		sched.background--;
+	if (t)
+	{
+		t->active--;
+		t->vtime += held / t->weight - thread_charge;
+		t->hold_ns = t->hold_ns ? t->hold_ns - t->hold_ns / 8 + held / 8 : held;
+		t->busy_ns += held;
+	}
+	dispatch();
+	pthread_mutex_unlock(&sched.lock);
+}
+
+/* Upper bound of the latency bucket holding quantile q of t's count reads
+ * and writes, in microseconds, clamped to the largest seen. */
+static double quantile_us(const struct tenant *t, double q, unsigned long long count,
+			  uint64_t max_ns)
+{
+	unsigned long long want = (unsigned long long)(q * count);
+	unsigned long long seen = 0;
+	unsigned i;
+
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++)
+	{
+		seen += __atomic_load_n(&t->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= want)
+			break;
+	}
+	uint64_t bound = 1ULL << i;
+	return (bound < max_ns ? bound : max_ns) / 1000.0;
+}
+
+void pa5_sched_stats(FILE *out)
+{
+	int cls;
+
+	pa5_mutex_lock(&sched.lock, PA5_LOCK_SCHED);
+	fprintf(out, "slots %u\n", sched.slots);
+	fprintf(out, "in_use %u\n", sched.total);
+	fprintf(out, "background_limit %u\n", sched.background_limit);
+	fprintf(out, "%-10s %6s %7s %7s %12s %10s %8s %12s %12s\n", "class", "limit", "running",
+		"queued", "admitted", "waited", "aged", "mean_wait_us", "max_wait_us");
+	for (cls = 0; cls < PA5_SCHED_CLASSES; cls++)
+		fprintf(out, "%-10s %6u %7u %7u %12llu %10llu %8llu %12.1f %12.1f\n",
+			class_names[cls], sched.limit[cls], sched.running[cls], sched.queued[cls],
+			sched.admitted[cls], sched.waited[cls], sched.aged[cls],
+			sched.waited[cls] ? sched.wait_ns[cls] / 1000.0 / sched.waited[cls] : 0.0,
+			sched.max_wait_ns[cls] / 1000.0);
+
+	unsigned i;
+	uint64_t now = pa5_stats_now();
+
+	fprintf(out, "fair_by %s\n", fair_names[sched.fair]);
+	fprintf(out, "%-16s %6s %6s %10s %8s %14s %8s %10s %10s %10s %10s %12s %10s\n", "tenant",
+		"weight", "active", "ops", "errors", "bytes", "mib_s", "mean_us", "p99_us",
+		"max_us", "waited", "mean_wait_us", "busy_ms");
+	for (i = 0; i < PA5_SCHED_TENANTS; i++)
+	{
+		const struct tenant *t = &sched.tenants[i];
+		unsigned long long ops = __atomic_load_n(&t->ops, __ATOMIC_RELAXED);
+		unsigned long long bytes = __atomic_load_n(&t->bytes, __ATOMIC_RELAXED);
+		uint64_t max_ns = __atomic_load_n(&t->max_lat_ns, __ATOMIC_RELAXED);
+		if (t->weight == 0)
+			continue;
+		fprintf(out, "%-16s %6u %6u %10llu %8llu %14llu %8.1f %10.1f %10.1f %10.1f %10llu %12.1f %10.1f\n",
+			t->label, t->weight, t->active, ops,
+			__atomic_load_n(&t->errors, __ATOMIC_RELAXED), bytes,
+			now > t->first_ns ? bytes / 1048576.0 / ((now - t->first_ns) / 1e9) : 0.0,
+			ops ? __atomic_load_n(&t->lat_ns, __ATOMIC_RELAXED) / 1000.0 / ops : 0.0,
+			quantile_us(t, 0.99, ops, max_ns), max_ns / 1000.0, t->waited,
+			t->waited ? t->wait_ns / 1000.0 / t->waited : 0.0, t->busy_ns / 1e6);
+	}
+	pthread_mutex_unlock(&sched.lock);
+}
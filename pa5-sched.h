@@ -0,0 +1,102 @@
+/* pa5-sched.h
+ * Priority scheduler for chunk crypto and backing I/O.
+ *
+ * Chunks are sealed, opened and read or written on the thread that asks for
+ * them, so the scheduler is a gate in front of that work rather than a
+ * queue of jobs: each chunk operation holds one of a fixed number of slots
+ * while it runs. A thread names the class of its work with
+ * pa5_sched_set_class(). FUSE callbacks are foreground reads or writes, and
+ * each background worker sets its class once when it starts.
+ *
+ * A caller queues when every slot is taken or its class is at its own
+ * limit. A freed slot goes to the waiting caller of the best class, every
+ * PA5_SCHED_AGING_MS it has waited counting as one class better, so that
+ * background work is held back behind a busy foreground but never starved.
+ * The background classes together never take the last quarter of the slots,
+ * which are kept for foreground requests arriving while they are busy.
+ *
+ * A thread that already holds a slot enters again without waiting, so a
+ * gated operation may call another.
+ *
+ * Within a class, slots are shared fairly between tenants: the users,
+ * groups, processes or cgroups the FUSE requests come from. Each tenant
+ * has a virtual time that grows by the time its slots are held, divided by
+ * its weight, and a freed slot goes to the waiter of the class whose tenant
+ * is furthest behind. A tenant that was idle starts level with the others
+ * rather than with the credit of its idle time, so one bulk job takes its
+ * share and no more while anybody else is waiting. Background work belongs
+ * to the daemon and is not a tenant.
+ */
+
+#ifndef PA5_SCHED_H
+#define PA5_SCHED_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Classes, best first. */
+enum pa5_sched_class
+{
+	PA5_SCHED_READ,        /* Foreground reads. */
+	PA5_SCHED_WRITE,       /* Other foreground requests. */
+	PA5_SCHED_PREFETCH,    /* Reads ahead of demand. */
+	PA5_SCHED_WRITEBACK,   /* Moving written data to where it belongs. */
+	PA5_SCHED_MAINT,       /* Conversion, compaction and the like. */
+	PA5_SCHED_CLASSES
+};
+
+#define PA5_SCHED_AGING_MS 50
+#define PA5_SCHED_TENANTS 64   /* Tenants tracked; later ones share "other". */
+
+/* int pa5_sched_init(unsigned slots, const unsigned *limits)
+ * Purpose: Gate chunk work through slots slots, 0 for twice the online CPUs,
+ *          with limits[c] of them at most for class c. A 0 in limits picks
+ *          the default limit of that class, which follows the slots. A NULL
+ *          limits keeps those given before, or the defaults if none were.
+ *          Called again, it changes both for callers from then on.
+ * Return: 0 on success
+ */
+int pa5_sched_init(unsigned slots, const unsigned *limits);
+
+/* Parses "read,write,prefetch,writeback,maint" limits into limits.
+ * Return: 0 on success, -EINVAL if text is not five numbers */
+int pa5_sched_parse_limits(const char *text, unsigned limits[PA5_SCHED_CLASSES]);
+
+/* Sets the class of the calling thread's work and returns the old one.
+ * Threads start as PA5_SCHED_READ. */
+int pa5_sched_set_class(int cls);
+
+/* Current slots, 0 if the gate is off, and class limits. */
+unsigned pa5_sched_slots(void);
+void pa5_sched_limits(unsigned limits[PA5_SCHED_CLASSES]);
+
+/* int pa5_sched_set_fairness(const char *key, const char *weights)
+ * Purpose: Pick what a tenant is: "uid" (the default), "gid", "pid",
+ *          "cgroup" or "off", and give tenants weights from a list of
+ *          <tenant>:<weight> pairs split by commas, tenants named by number
+ *          or cgroup path. Unlisted tenants weigh 1. weights may be NULL,
+ *          and key NULL to change only the weights.
+ * Return: 0 on success, -EINVAL if either is malformed
+ */
+int pa5_sched_set_fairness(const char *key, const char *weights);
+
+/* Prints the weights as pa5_sched_set_fairness() takes them. */
+void pa5_sched_print_weights(FILE *out);
+
+/* Sets the tenant of the calling thread's work from the FUSE request. */
+void pa5_sched_set_tenant(uid_t uid, gid_t gid, pid_t pid);
+
+/* Records a read or write of the current tenant that started at start and
+ * returned res, for its throughput and latency stats. */
+void pa5_sched_account(uint64_t start, int res);
+
+/* Bracket one chunk operation. pa5_sched_enter() waits for a slot. */
+void pa5_sched_enter(void);
+void pa5_sched_leave(void);
+
+/* Stats section with the slots, per class the queue and its waits, and per
+ * tenant its share and the latency of its reads and writes. */
+void pa5_sched_stats(FILE *out);
+
+#endif
@@ -0,0 +1,1942 @@
+/* pa5-small.c
+ * Packed store for small files.
+ *
+ * The whole store is kept in memory as two hash tables, one of files by
+ * path and one of the directories that hold them, and every change is
+ * appended to the log under one store lock. Handles share one in-memory
+ * copy of a file's contents, so writes only touch memory and the file is
+ * sealed and appended once, when its last handle is put or it is synced.
+ * A create, write and close therefore costs one record and no syscall on
+ * the mirror's namespace at all.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-small.h"
+#include "pa5-stats.h"
+#include "pa5-sched.h"
+#include "pa5-log.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#define NONCE_LEN 12
+#define TAG_LEN 16
+#define RECORD_MAGIC "PA5S"
+#define RECORD_HEADER 96
+#define RECORD_AAD 64            /* Header bytes covered by the tag. */
+#define INDEX_MAGIC "PA5J"
+#define INDEX_HEADER 64
+#define INDEX_ENTRY 64           /* Before the path. */
+#define INDEX_MAC 32
+#define READ_WINDOW (1 << 20)
+#define MIN_TABLE 1024
+#define COMPACT_INTERVAL 30      /* Seconds between checks when not woken. */
+#define INO_BASE (1ULL << 62)    /* Far above what the mirror hands out. */
+
+enum record_type
+{
+	REC_PUT = 1,
+	REC_ATTR = 2,
+	REC_DELETE = 3
+};
+
+struct small_dir
+{
+	char *path;
+	size_t len;
+	struct small_dir *hash_next;
+	struct pa5_small *files;
+	size_t count;
+};
+
+struct pa5_small
+{
+	char *path;
+	const char *name;            /* Last component of path. */
+	struct pa5_small *hash_next;
+	struct pa5_small *dir_next;
+	struct pa5_small **dir_prev;
+	struct small_dir *dir;
+	ino_t ino;
+	mode_t mode;                 /* Permission bits only. */
+	uid_t uid;
+	gid_t gid;
+	uint64_t atime;              /* Nanoseconds since the epoch. */
+	uint64_t mtime;
+	uint64_t ctime;
+	size_t size;
+	unsigned seg;                /* Latest put record, if rec_len != 0. */
+	off_t off;
+	uint32_t rec_len;
+	unsigned opens;
+	int dirty;                   /* Contents newer than the latest put. */
+	int linked;                  /* In the tables; 0 once unlinked or promoted. */
+	int promoted;
+	char *data;                  /* Contents, while open. */
+	size_t cap;
+};
+
+struct segment
+{
+	int fd;                      /* -1 once compacted away. */
+	off_t size;
+	uint64_t live;               /* Bytes of records still in use. */
+};
+
+struct store
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t worker;
+	int running;
+	int ready;
+	int dirfd;
+	size_t max;
+	unsigned char seal_key[32];
+	unsigned char index_key[32];
+
+	struct pa5_small **files;
+	size_t nfiles;
+	size_t files_cap;            /* Power of two. */
+	struct small_dir **dirs;
+	size_t ndirs;
+	size_t dirs_cap;
+
+	struct segment *segs;        /* Indexed by segment number. */
+	unsigned nsegs;              /* The head is nsegs - 1. */
+	unsigned first;              /* Oldest segment left. */
+	unsigned segs_cap;
+	uint64_t total;
+	uint64_t live;
+	int compact_failed;
+	uint64_t next_ino;
+
+	unsigned long long creates;
+	unsigned long long promotions;
+	unsigned long long compactions;
+	unsigned long long copied;
+};
+
+static struct store store = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.dirfd = -1
+};
+
+struct cipher_ctxs
+{
+	EVP_CIPHER_CTX *enc;
+	EVP_CIPHER_CTX *dec;
+};
+
+static pthread_key_t ctx_key;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+static __thread struct cipher_ctxs *thread_ctxs = NULL;
+
+/* Sequential reads of a segment for replay and compaction. */
+struct reader
+{
+	int fd;
+	off_t size;
+	unsigned char *buf;
+	size_t cap;
+	off_t base;
+	size_t len;
+};
+
+/* A record header, decoded. */
+struct record
+{
+	int type;
+	size_t plen;
+	size_t dlen;
+	uint32_t len;
+	const unsigned char *hdr;
+	const char *path;            /* Not terminated. */
+};
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static uint16_t get_le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+	put_le32(p, (uint32_t)v);
+	put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+	return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static void hmac_sha256(const unsigned char *key, const void *data, size_t len,
+			unsigned char out[32])
+{
+	unsigned int outlen = 32;
+	HMAC(EVP_sha256(), key, 32, data, len, out, &outlen);
+}
+
+static void ctxs_free(void *ptr)
+{
+	struct cipher_ctxs *ctxs = ptr;
+	EVP_CIPHER_CTX_free(ctxs->enc);
+	EVP_CIPHER_CTX_free(ctxs->dec);
+	free(ctxs);
+}
+
+static void ctx_key_create(void)
+{
+	pthread_key_create(&ctx_key, ctxs_free);
+}
+
+static struct cipher_ctxs *get_ctxs(void)
+{
+	struct cipher_ctxs *ctxs;
+
+	if (thread_ctxs)
+		return thread_ctxs;
+
+	pthread_once(&ctx_once, ctx_key_create);
+	if ((ctxs = calloc(1, sizeof(*ctxs))) == NULL)
+		return NULL;
+	ctxs->enc = EVP_CIPHER_CTX_new();
+	ctxs->dec = EVP_CIPHER_CTX_new();
+	if (!ctxs->enc || !ctxs->dec ||
+	    !EVP_EncryptInit_ex(ctxs->enc, EVP_aes_256_gcm(), NULL, NULL, NULL) ||
+	    !EVP_CIPHER_CTX_ctrl(ctxs->enc, EVP_CTRL_GCM_SET_IVLEN, NONCE_LEN, NULL) ||
+	    !EVP_DecryptInit_ex(ctxs->dec, EVP_aes_256_gcm(), NULL, NULL, NULL) ||
+	    !EVP_CIPHER_CTX_ctrl(ctxs->dec, EVP_CTRL_GCM_SET_IVLEN, NONCE_LEN, NULL))
+	{
+		ctxs_free(ctxs);
+		return NULL;
+	}
+
+	pthread_setspecific(ctx_key, ctxs);
+	thread_ctxs = ctxs;
+	return ctxs;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t hash_path(const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+	return h;
+}
+
+/* Length of the directory part of path: 1 for "/name", 2 for "/a/name". */
+static size_t dir_len(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return (slash == path) ? 1 : (size_t)(slash - path);
+}
+
+/* ---- Tables ----
+ * All called with the store locked. */
+
+static struct pa5_small *file_find(const char *path)
+{
+	struct pa5_small *f;
+
+	if (!store.files)
+		return NULL;
+	f = store.files[hash_path(path, strlen(path)) & (store.files_cap - 1)];
+	while (f && strcmp(f->path, path) != 0)
+		f = f->hash_next;
+	return f;
+}
+
+static struct small_dir *dir_find(const char *path, size_t len)
+{
+	struct small_dir *d;
+
+	if (!store.dirs)
+		return NULL;
+	d = store.dirs[hash_path(path, len) & (store.dirs_cap - 1)];
+	while (d && (d->len != len || memcmp(d->path, path, len) != 0))
+		d = d->hash_next;
+	return d;
+}
+
+/* Doubles a table once it holds as many entries as buckets. A table that
+ * cannot grow keeps working with longer chains. */
+static void files_grow(void)
+{
+	size_t cap = store.files_cap ? store.files_cap * 2 : MIN_TABLE;
+	struct pa5_small **files = calloc(cap, sizeof(*files));
+	size_t i;
+
+	if (!files)
+		return;
+	for (i = 0; i < store.files_cap; i++)
+	{
+		struct pa5_small *f = store.files[i];
+		while (f)
+		{
+			struct pa5_small *next = f->hash_next;
+			size_t b = hash_path(f->path, strlen(f->path)) & (cap - 1);
+			f->hash_next = files[b];
+			files[b] = f;
+			f = next;
+		}
+	}
+	free(store.files);
+	store.files = files;
+	store.files_cap = cap;
+}
+
+static void dirs_grow(void)
+{
+	size_t cap = store.dirs_cap ? store.dirs_cap * 2 : MIN_TABLE;
+	struct small_dir **dirs = calloc(cap, sizeof(*dirs));
+	size_t i;
+
+	if (!dirs)
+		return;
+	for (i = 0; i < store.dirs_cap; i++)
+	{
+		struct small_dir *d = store.dirs[i];
+		while (d)
+		{
+			struct small_dir *next = d->hash_next;
+			size_t b = hash_path(d->path, d->len) & (cap - 1);
+			d->hash_next = dirs[b];
+			dirs[b] = d;
+			d = next;
+		}
+	}
+	free(store.dirs);
+	store.dirs = dirs;
+	store.dirs_cap = cap;
+}
+
+/* Returns the directory entry for the directory part of path, adding it
+ * if needed. */
+static struct small_dir *dir_get(const char *path)
+{
+	size_t len = dir_len(path);
+	struct small_dir *d = dir_find(path, len);
+
+	if (d)
+		return d;
+	if (store.ndirs >= store.dirs_cap)
+		dirs_grow();
+	if (!store.dirs || (d = calloc(1, sizeof(*d))) == NULL)
+		return NULL;
+	if ((d->path = strndup(path, len)) == NULL)
+	{
+		free(d);
+		return NULL;
+	}
+	d->len = len;
+
+	size_t b = hash_path(path, len) & (store.dirs_cap - 1);
+	d->hash_next = store.dirs[b];
+	store.dirs[b] = d;
+	store.ndirs++;
+	return d;
+}
+
+static void dir_drop(struct small_dir *d)
+{
+	struct small_dir **link = &store.dirs[hash_path(d->path, d->len) & (store.dirs_cap - 1)];
+
+	while (*link != d)
+		link = &(*link)->hash_next;
+	*link = d->hash_next;
+	store.ndirs--;
+	free(d->path);
+	free(d);
+}
+
+/* Enters f under its path in d, which dir_get() returned for it. */
+static void file_link(struct pa5_small *f, struct small_dir *d)
+{
+	if (store.nfiles >= store.files_cap)
+		files_grow();
+
+	size_t b = hash_path(f->path, strlen(f->path)) & (store.files_cap - 1);
+	f->hash_next = store.files[b];
+	store.files[b] = f;
+	store.nfiles++;
+
+	f->dir = d;
+	f->name = f->path + (d->len == 1 ? 1 : d->len + 1);
+	f->dir_next = d->files;
+	if (d->files)
+		d->files->dir_prev = &f->dir_next;
+	f->dir_prev = &d->files;
+	d->files = f;
+	d->count++;
+	f->linked = 1;
+}
+
+static void file_unlink(struct pa5_small *f)
+{
+	struct pa5_small **link = &store.files[hash_path(f->path, strlen(f->path)) &
+					       (store.files_cap - 1)];
+
+	while (*link != f)
+		link = &(*link)->hash_next;
+	*link = f->hash_next;
+	store.nfiles--;
+
+	*f->dir_prev = f->dir_next;
+	if (f->dir_next)
+		f->dir_next->dir_prev = f->dir_prev;
+	if (--f->dir->count == 0)
+		dir_drop(f->dir);
+	f->dir = NULL;
+	f->linked = 0;
+}
+
+/* Re-enters f under path in d. d is held across the unlink so that a move
+ * within one directory does not drop it. */
+static void file_move(struct pa5_small *f, char *path, struct small_dir *d)
+{
+	d->count++;
+	file_unlink(f);
+	f->path = path;
+	file_link(f, d);
+	d->count--;
+}
+
+/* Adds a file at path to the tables. */
+static struct pa5_small *file_new(const char *path)
+{
+	struct pa5_small *f = calloc(1, sizeof(*f));
+	struct small_dir *d;
+
+	if (!f || (f->path = strdup(path)) == NULL || (d = dir_get(path)) == NULL)
+	{
+		if (f)
+			free(f->path);
+		free(f);
+		return NULL;
+	}
+	f->ino = INO_BASE + ++store.next_ino;
+	file_link(f, d);
+	return f;
+}
+
+static void file_free(struct pa5_small *f)
+{
+	free(f->path);
+	free(f->data);
+	free(f);
+}
+
+static void fill_stat(const struct pa5_small *f, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = f->ino;
+	st->st_mode = S_IFREG | f->mode;
+	st->st_nlink = 1;
+	st->st_uid = f->uid;
+	st->st_gid = f->gid;
+	st->st_size = f->size;
+	st->st_blksize = 4096;
+	st->st_blocks = (f->size + 511) / 512;
+	st->st_atim.tv_sec = f->atime / 1000000000ULL;
+	st->st_atim.tv_nsec = f->atime % 1000000000ULL;
+	st->st_mtim.tv_sec = f->mtime / 1000000000ULL;
+	st->st_mtim.tv_nsec = f->mtime % 1000000000ULL;
+	st->st_ctim.tv_sec = f->ctime / 1000000000ULL;
+	st->st_ctim.tv_nsec = f->ctime % 1000000000ULL;
+}
+
+/* ---- Records ---- */
+
+static void record_header(unsigned char *hdr, int type, const struct pa5_small *f, size_t plen)
+{
+	memset(hdr, 0, RECORD_HEADER);
+	memcpy(hdr, RECORD_MAGIC, 4);
+	hdr[4] = type;
+	put_le16(hdr + 6, plen);
+	if (!f)
+		return;
+	put_le32(hdr + 16, type == REC_PUT ? f->size : 0);
+	put_le32(hdr + 20, f->mode);
+	put_le32(hdr + 24, f->uid);
+	put_le32(hdr + 28, f->gid);
+	put_le64(hdr + 32, f->atime);
+	put_le64(hdr + 40, f->mtime);
+	put_le64(hdr + 48, f->ctime);
+}
+
+/* Seals the dlen bytes of data into rec, whose header and path are filled
+ * in. */
+static int record_seal(unsigned char *rec, size_t plen, const char *data, size_t dlen)
+{
+	unsigned char *nonce = rec + RECORD_AAD;
+	int outlen;
+	int ok;
+
+	if (RAND_bytes(nonce, NONCE_LEN) != 1)
+		return -EIO;
+
+	uint64_t start = pa5_stats_now();
+	struct cipher_ctxs *ctxs = get_ctxs();
+	if (!ctxs)
+		return -ENOMEM;
+	EVP_CIPHER_CTX *ctx = ctxs->enc;
+	unsigned char *ct = rec + RECORD_HEADER + plen;
+
+	ok = EVP_EncryptInit_ex(ctx, NULL, NULL, store.seal_key, nonce) &&
+	     EVP_EncryptUpdate(ctx, NULL, &outlen, rec, RECORD_AAD) &&
+	     EVP_EncryptUpdate(ctx, NULL, &outlen, rec + RECORD_HEADER, plen) &&
+	     (dlen == 0 || EVP_EncryptUpdate(ctx, ct, &outlen, (const unsigned char *)data, dlen)) &&
+	     EVP_EncryptFinal_ex(ctx, ct + dlen, &outlen) &&
+	     EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_LEN, rec + RECORD_AAD + NONCE_LEN);
+
+	pa5_stats_time(PA5_TIME_CRYPTO, start, ok ? 0 : -EIO);
+	return ok ? 0 : -EIO;
+}
+
+/* Verifies a whole record and decrypts its contents into out, if any. */
+static int record_unseal(const unsigned char *rec, size_t plen, size_t dlen, char *out)
+{
+	unsigned char tag[TAG_LEN];
+	int outlen;
+	int ok;
+
+	memcpy(tag, rec + RECORD_AAD + NONCE_LEN, TAG_LEN);
+
+	uint64_t start = pa5_stats_now();
+	struct cipher_ctxs *ctxs = get_ctxs();
+	if (!ctxs)
+		return -ENOMEM;
+	EVP_CIPHER_CTX *ctx = ctxs->dec;
+
+	ok = EVP_DecryptInit_ex(ctx, NULL, NULL, store.seal_key, rec + RECORD_AAD) &&
+	     EVP_DecryptUpdate(ctx, NULL, &outlen, rec, RECORD_AAD) &&
+	     EVP_DecryptUpdate(ctx, NULL, &outlen, rec + RECORD_HEADER, plen) &&
+	     (dlen == 0 || EVP_DecryptUpdate(ctx, (unsigned char *)out, &outlen,
+					     rec + RECORD_HEADER + plen, dlen)) &&
+	     EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag) &&
+	     EVP_DecryptFinal_ex(ctx, (unsigned char *)out + dlen, &outlen);
+
+	pa5_stats_time(PA5_TIME_CRYPTO, start, ok ? 0 : -EIO);
+	return ok ? 0 : -EIO;
+}
+
+/* Decodes the record header at hdr, with avail bytes of the record at
+ * hand. Returns 0, or -EIO if this is not the start of a record. */
+static int record_parse(const unsigned char *hdr, size_t avail, struct record *r)
+{
+	if (avail < RECORD_HEADER || memcmp(hdr, RECORD_MAGIC, 4) != 0)
+		return -EIO;
+	r->type = hdr[4];
+	r->plen = get_le16(hdr + 6);
+	r->dlen = get_le32(hdr + 16);
+	if (r->type < REC_PUT || r->type > REC_DELETE || r->plen < 2 || r->plen >= PATH_MAX ||
+	    r->dlen > PA5_SMALL_MAX_LIMIT || (r->type != REC_PUT && r->dlen != 0))
+		return -EIO;
+	r->len = RECORD_HEADER + r->plen + r->dlen;
+	r->hdr = hdr;
+	r->path = (const char *)hdr + RECORD_HEADER;
+	return 0;
+}
+
+/* ---- Segments ---- */
+
+static void segment_name(char name[32], unsigned seg)
+{
+	snprintf(name, 32, "seg.%05u", seg);
+}
+
+/* Makes room for segment seg in the table. Called with the store locked. */
+static int segs_reserve(unsigned seg)
+{
+	unsigned cap = store.segs_cap ? store.segs_cap : 16;
+	unsigned i;
+
+	if (seg < store.segs_cap)
+		return 0;
+	while (cap <= seg)
+		cap *= 2;
+	struct segment *segs = realloc(store.segs, cap * sizeof(*segs));
+	if (!segs)
+		return -ENOMEM;
+	for (i = store.segs_cap; i < cap; i++)
+	{
+		segs[i].fd = -1;
+		segs[i].size = 0;
+		segs[i].live = 0;
+	}
+	store.segs = segs;
+	store.segs_cap = cap;
+	return 0;
+}
+
+/* Starts a new head segment. Called with the store locked. */
+static int segment_new(void)
+{
+	char name[32];
+	unsigned seg = store.nsegs;
+	int res;
+
+	if ((res = segs_reserve(seg)) < 0)
+		return res;
+	segment_name(name, seg);
+	if ((store.segs[seg].fd = openat(store.dirfd, name, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1)
+		return -errno;
+	store.segs[seg].size = 0;
+	store.segs[seg].live = 0;
+	store.nsegs++;
+	return 0;
+}
+
+/* Appends a record at the head of the log. Called with the store locked. */
+static int log_append(const unsigned char *rec, uint32_t len, unsigned *segp, off_t *offp)
+{
+	struct segment *s = &store.segs[store.nsegs - 1];
+	int res;
+
+	if (s->size > 0 && s->size + len > PA5_SMALL_SEG_MAX)
+	{
+		if ((res = segment_new()) < 0)
+			return res;
+		s = &store.segs[store.nsegs - 1];
+	}
+
+	ssize_t n = pwrite(s->fd, rec, len, s->size);
+	if (n != (ssize_t)len)
+		return (n == -1) ? -errno : -EIO;
+	pa5_stats_add(PA5_CTR_BACKING_WRITTEN, len);
+
+	*segp = store.nsegs - 1;
+	*offp = s->size;
+	s->size += len;
+	store.total += len;
+	return 0;
+}
+
+static int compact_due(void)
+{
+	return store.first < store.nsegs - 1 && !store.compact_failed &&
+	       store.total - store.live > store.total / 2;
+}
+
+/* Forgets f's put record. Called with the store locked. */
+static void drop_live(struct pa5_small *f)
+{
+	if (f->rec_len == 0)
+		return;
+	store.segs[f->seg].live -= f->rec_len;
+	store.live -= f->rec_len;
+	f->rec_len = 0;
+	if (compact_due())
+		pthread_cond_signal(&store.wake);
+}
+
+/* Appends a put or attribute record for f. Called with the store locked;
+ * a put needs the contents loaded. */
+static int file_store(struct pa5_small *f, int type)
+{
+	size_t plen = strlen(f->path);
+	size_t dlen = (type == REC_PUT) ? f->size : 0;
+	uint32_t len = RECORD_HEADER + plen + dlen;
+	unsigned char *rec = malloc(len);
+	unsigned seg;
+	off_t off;
+	int res;
+
+	if (!rec)
+		return -ENOMEM;
+	record_header(rec, type, f, plen);
+	memcpy(rec + RECORD_HEADER, f->path, plen);
+	if ((res = record_seal(rec, plen, f->data, dlen)) == 0)
+		res = log_append(rec, len, &seg, &off);
+	free(rec);
+	if (res < 0)
+		return res;
+
+	if (type == REC_PUT)
+	{
+		drop_live(f);
+		f->seg = seg;
+		f->off = off;
+		f->rec_len = len;
+		f->dirty = 0;
+		store.segs[seg].live += len;
+		store.live += len;
+	}
+	return 0;
+}
+
+static int write_delete(const char *path)
+{
+	size_t plen = strlen(path);
+	unsigned char rec[RECORD_HEADER + PATH_MAX];
+	unsigned seg;
+	off_t off;
+	int res;
+
+	record_header(rec, REC_DELETE, NULL, plen);
+	memcpy(rec + RECORD_HEADER, path, plen);
+	if ((res = record_seal(rec, plen, NULL, 0)) < 0)
+		return res;
+	return log_append(rec, RECORD_HEADER + plen, &seg, &off);
+}
+
+/* Reads and verifies f's put record into out, which has room for
+ * f->size bytes. Called with the store locked. */
+static int file_fetch(const struct pa5_small *f, char *out)
+{
+	struct record r;
+	unsigned char *rec = malloc(f->rec_len);
+	size_t plen = strlen(f->path);
+	int res = -EIO;
+
+	if (!rec)
+		return -ENOMEM;
+	if (pread(store.segs[f->seg].fd, rec, f->rec_len, f->off) == (ssize_t)f->rec_len &&
+	    record_parse(rec, f->rec_len, &r) == 0 && r.type == REC_PUT && r.len == f->rec_len &&
+	    r.plen == plen && memcmp(r.path, f->path, plen) == 0 && r.dlen == f->size)
+		res = record_unseal(rec, plen, r.dlen, out);
+	if (res == 0)
+		pa5_stats_add(PA5_CTR_BACKING_READ, f->rec_len);
+	else
+		pa5_error("Small file %s failed verification.", f->path);
+	free(rec);
+	return res;
+}
+
+/* Brings f's contents into memory. Called with the store locked. */
+static int file_load(struct pa5_small *f)
+{
+	size_t cap = f->size ? f->size : 1;
+	int res;
+
+	if (f->data)
+		return 0;
+	if ((f->data = malloc(cap)) == NULL)
+		return -ENOMEM;
+	f->cap = cap;
+	if (f->rec_len == 0)
+		return 0;
+	if ((res = file_fetch(f, f->data)) < 0)
+	{
+		free(f->data);
+		f->data = NULL;
+	}
+	return res;
+}
+
+/* Lets go of the contents of a file no handle has open. */
+static void file_unload(struct pa5_small *f)
+{
+	if (f->opens == 0 && !f->dirty)
+	{
+		free(f->data);
+		f->data = NULL;
+		f->cap = 0;
+	}
+}
+
+/* Removes f from the store. Called with the store locked. */
+static int file_delete(struct pa5_small *f)
+{
+	int res;
+
+	if (f->rec_len && (res = write_delete(f->path)) < 0)
+		return res;
+	drop_live(f);
+	file_unlink(f);
+	f->dirty = 0;
+	if (f->opens == 0)
+		file_free(f);
+	return 0;
+}
+
+/* Moves f to path to, replacing any file there. Called with the store
+ * locked. */
+static int file_rename(struct pa5_small *f, const char *to)
+{
+	struct pa5_small *t = file_find(to);
+	struct small_dir *d;
+	char *old = f->path;
+	char *path;
+	int res;
+
+	if (t == f)
+		return 0;
+	if (f->rec_len && (res = file_load(f)) < 0)
+		return res;
+	if (t && (res = file_delete(t)) < 0)
+		return res;
+	if ((path = strdup(to)) == NULL || (d = dir_get(to)) == NULL)
+	{
+		free(path);
+		return -ENOMEM;
+	}
+
+	/* The path is sealed into the record, so a stored file is put again
+	 * under its new name. */
+	int stored = (f->rec_len != 0);
+	file_move(f, path, d);
+	f->ctime = now_ns();
+	if (stored && (res = file_store(f, REC_PUT)) < 0)
+	{
+		if ((d = dir_get(old)) != NULL)
+		{
+			file_move(f, old, d);
+			free(path);
+			return res;
+		}
+		f->dirty = 1;
+	}
+	else if (stored && (res = write_delete(old)) < 0)
+		pa5_warn("Could not log the removal of small file %s: %d.", old, res);
+	free(old);
+	file_unload(f);
+	return 0;
+}
+
+/* Writes back f's attributes. Called with the store locked. */
+static int file_store_attr(struct pa5_small *f)
+{
+	f->ctime = now_ns();
+	if (f->dirty)
+		return 0;   /* They go out with the contents. */
+	return file_store(f, REC_ATTR);
+}
+
+/* ---- Replay ---- */
+
+/* Returns a pointer to len bytes of the segment at off, or NULL past its
+ * end. */
+static const unsigned char *reader_get(struct reader *rd, off_t off, size_t len)
+{
+	if (off + (off_t)len > rd->size)
+		return NULL;
+	if (off < rd->base || off + (off_t)len > rd->base + (off_t)rd->len)
+	{
+		size_t want = len > READ_WINDOW ? len : READ_WINDOW;
+		if ((off_t)want > rd->size - off)
+			want = rd->size - off;
+		if (want > rd->cap)
+		{
+			unsigned char *buf = realloc(rd->buf, want);
+			if (!buf)
+				return NULL;
+			rd->buf = buf;
+			rd->cap = want;
+		}
+		ssize_t n = pread(rd->fd, rd->buf, want, off);
+		if (n < (ssize_t)len)
+			return NULL;
+		rd->base = off;
+		rd->len = n;
+	}
+	return rd->buf + (off - rd->base);
+}
+
+/* Reads the record at off, with its path and, for puts with want_data, its
+ * contents. */
+static int reader_record(struct reader *rd, off_t off, int want_data, struct record *r)
+{
+	const unsigned char *p = reader_get(rd, off, RECORD_HEADER);
+	if (!p || record_parse(p, RECORD_HEADER, r) < 0)
+		return -EIO;
+	if (off + (off_t)r->len > rd->size)
+		return -EIO;
+	size_t len = RECORD_HEADER + r->plen + (want_data ? r->dlen : 0);
+	if ((p = reader_get(rd, off, len)) == NULL)
+		return -EIO;
+	r->hdr = p;
+	r->path = (const char *)p + RECORD_HEADER;
+	return 0;
+}
+
+static void record_attrs(const struct record *r, struct pa5_small *f)
+{
+	f->mode = get_le32(r->hdr + 20) & 07777;
+	f->uid = get_le32(r->hdr + 24);
+	f->gid = get_le32(r->hdr + 28);
+	f->atime = get_le64(r->hdr + 32);
+	f->mtime = get_le64(r->hdr + 40);
+	f->ctime = get_le64(r->hdr + 48);
+}
+
+/* Applies one record found at seg/off to the tables. */
+static int replay_apply(const struct record *r, unsigned seg, off_t off)
+{
+	char path[PATH_MAX];
+	struct pa5_small *f;
+
+	memcpy(path, r->path, r->plen);
+	path[r->plen] = '\0';
+	if (path[0] != '/')
+		return -EIO;
+	f = file_find(path);
+
+	switch (r->type)
+	{
+	case REC_PUT:
+		if (!f && (f = file_new(path)) == NULL)
+			return -ENOMEM;
+		drop_live(f);
+		record_attrs(r, f);
+		f->size = r->dlen;
+		f->seg = seg;
+		f->off = off;
+		f->rec_len = r->len;
+		store.segs[seg].live += r->len;
+		store.live += r->len;
+		break;
+	case REC_ATTR:
+		if (f)
+			record_attrs(r, f);
+		break;
+	case REC_DELETE:
+		if (f)
+		{
+			drop_live(f);
+			file_unlink(f);
+			file_free(f);
+		}
+		break;
+	}
+	return 0;
+}
+
+/* Replays segment seg from start. A torn record at the end of the head is
+ * cut off; anywhere else the rest of the segment is skipped. */
+static int replay_segment(unsigned seg, off_t start)
+{
+	struct reader rd = { .fd = store.segs[seg].fd, .size = store.segs[seg].size };
+	struct record r;
+	off_t off = start;
+	int res = 0;
+
+	while (off < rd.size)
+	{
+		/* Records that only change the namespace are checked here; the
+		 * contents of puts are checked when they are read. */
+		if (reader_record(&rd, off, 0, &r) < 0 ||
+		    (r.type != REC_PUT && record_unseal(r.hdr, r.plen, 0, NULL) < 0))
+			break;
+		if ((res = replay_apply(&r, seg, off)) < 0)
+			break;
+		off += r.len;
+	}
+	free(rd.buf);
+	if (res < 0)
+		return res;
+
+	if (off < rd.size)
+	{
+		pa5_warn("Small file segment %u: dropping %lld bytes after offset %lld.", seg,
+			 (long long)(rd.size - off), (long long)off);
+		if (seg == store.nsegs - 1)
+		{
+			if (ftruncate(rd.fd, off) == -1)
+				return -errno;
+			store.segs[seg].size = off;
+		}
+	}
+	return 0;
+}
+
+/* ---- Index ---- */
+
+static void index_mac(const unsigned char *digest, unsigned char mac[32])
+{
+	hmac_sha256(store.index_key, digest, 32, mac);
+}
+
+/* Loads the index and returns where replay has to carry on from, or
+ * -errno if there is no usable index. */
+static int index_load(unsigned *segp, off_t *offp)
+{
+	unsigned char digest[32];
+	unsigned char mac[32];
+	unsigned int dlen = 32;
+	struct stat st;
+	unsigned char *map;
+	size_t pos;
+	uint64_t i;
+	int res = -EIO;
+
+	int fd = openat(store.dirfd, "index", O_RDONLY);
+	if (fd == -1)
+		return -errno;
+	if (fstat(fd, &st) == -1 || st.st_size < INDEX_HEADER + INDEX_MAC ||
+	    (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return -EIO;
+	}
+	close(fd);
+
+	size_t len = st.st_size - INDEX_MAC;
+	if (!EVP_Digest(map, len, digest, &dlen, EVP_sha256(), NULL))
+		goto out;
+	index_mac(digest, mac);
+	if (CRYPTO_memcmp(mac, map + len, INDEX_MAC) != 0 || memcmp(map, INDEX_MAGIC, 4) != 0 ||
+	    map[4] != PA5_SMALL_VERSION)
+		goto out;
+
+	uint64_t count = get_le64(map + 8);
+	*segp = get_le32(map + 16);
+	*offp = get_le64(map + 24);
+	if (*segp < store.first || *segp >= store.nsegs || *offp > store.segs[*segp].size)
+		goto out;
+
+	for (i = 0, pos = INDEX_HEADER; i < count; i++)
+	{
+		const unsigned char *e = map + pos;
+		char path[PATH_MAX];
+		struct pa5_small *f;
+
+		if (pos + INDEX_ENTRY > len)
+			goto out;
+		size_t plen = get_le16(e);
+		unsigned seg = get_le32(e + 4);
+		off_t off = get_le64(e + 8);
+		uint32_t rec_len = get_le32(e + 16);
+		if (plen < 2 || plen >= PATH_MAX || pos + INDEX_ENTRY + plen > len ||
+		    seg < store.first || seg >= store.nsegs || store.segs[seg].fd == -1 || rec_len == 0 ||
+		    off + rec_len > store.segs[seg].size)
+			goto out;
+		memcpy(path, e + INDEX_ENTRY, plen);
+		path[plen] = '\0';
+		if (path[0] != '/' || file_find(path) || (f = file_new(path)) == NULL)
+			goto out;
+
+		f->size = get_le32(e + 20);
+		f->mode = get_le32(e + 24) & 07777;
+		f->uid = get_le32(e + 28);
+		f->gid = get_le32(e + 32);
+		f->atime = get_le64(e + 40);
+		f->mtime = get_le64(e + 48);
+		f->ctime = get_le64(e + 56);
+		f->seg = seg;
+		f->off = off;
+		f->rec_len = rec_len;
+		store.segs[seg].live += rec_len;
+		store.live += rec_len;
+		pos += INDEX_ENTRY + plen;
+	}
+	res = (pos == len) ? 0 : -EIO;
+
+out:
+	munmap(map, st.st_size);
+	return res;
+}
+
+/* Writes every stored file to a new index. Called with the store locked
+ * and every file written back. */
+static int index_write(void)
+{
+	unsigned char hdr[INDEX_HEADER];
+	unsigned char e[INDEX_ENTRY];
+	unsigned char digest[32];
+	unsigned char mac[32];
+	unsigned int dlen = 32;
+	uint64_t count = 0;
+	size_t i;
+	int res = 0;
+
+	int fd = openat(store.dirfd, "index.new", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		return -errno;
+	FILE *out = fdopen(fd, "w");
+	EVP_MD_CTX *md = EVP_MD_CTX_new();
+	if (!out || !md || !EVP_DigestInit_ex(md, EVP_sha256(), NULL))
+	{
+		res = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < store.files_cap; i++)
+	{
+		struct pa5_small *f;
+		for (f = store.files[i]; f; f = f->hash_next)
+			if (f->rec_len)
+				count++;
+	}
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, INDEX_MAGIC, 4);
+	hdr[4] = PA5_SMALL_VERSION;
+	put_le64(hdr + 8, count);
+	put_le32(hdr + 16, store.nsegs - 1);
+	put_le64(hdr + 24, store.segs[store.nsegs - 1].size);
+	fwrite(hdr, 1, sizeof(hdr), out);
+	EVP_DigestUpdate(md, hdr, sizeof(hdr));
+
+	for (i = 0; i < store.files_cap; i++)
+	{
+		struct pa5_small *f;
+		for (f = store.files[i]; f; f = f->hash_next)
+		{
+			size_t plen = strlen(f->path);
+			if (!f->rec_len)
+				continue;
+			memset(e, 0, sizeof(e));
+			put_le16(e, plen);
+			put_le32(e + 4, f->seg);
+			put_le64(e + 8, f->off);
+			put_le32(e + 16, f->rec_len);
+			put_le32(e + 20, f->size);
+			put_le32(e + 24, f->mode);
+			put_le32(e + 28, f->uid);
+			put_le32(e + 32, f->gid);
+			put_le64(e + 40, f->atime);
+			put_le64(e + 48, f->mtime);
+			put_le64(e + 56, f->ctime);
+			fwrite(e, 1, sizeof(e), out);
+			fwrite(f->path, 1, plen, out);
+			EVP_DigestUpdate(md, e, sizeof(e));
+			EVP_DigestUpdate(md, f->path, plen);
+		}
+	}
+
+	EVP_DigestFinal_ex(md, digest, &dlen);
+	index_mac(digest, mac);
+	fwrite(mac, 1, sizeof(mac), out);
+	if (fflush(out) != 0 || ferror(out) || fsync(fd) == -1 ||
+	    renameat(store.dirfd, "index.new", store.dirfd, "index") == -1)
+		res = errno ? -errno : -EIO;
+
+fail:
+	EVP_MD_CTX_free(md);
+	if (out)
+		fclose(out);
+	else
+		close(fd);
+	if (res < 0)
+		unlinkat(store.dirfd, "index.new", 0);
+	return res;
+}
+
+/* Opens every segment in the store directory and starts a head segment
+ * if there is none. */
+static int segments_open(void)
+{
+	char name[32];
+	struct dirent *de;
+	unsigned lo = UINT_MAX;
+	unsigned hi = 0;
+	unsigned i;
+	int res = 0;
+
+	int fd = dup(store.dirfd);
+	DIR *dp = (fd == -1) ? NULL : fdopendir(fd);
+	if (!dp)
+	{
+		if (fd != -1)
+			close(fd);
+		return -errno;
+	}
+	while ((de = readdir(dp)) != NULL)
+	{
+		char *end;
+		if (strncmp(de->d_name, "seg.", 4) != 0)
+			continue;
+		unsigned long n = strtoul(de->d_name + 4, &end, 10);
+		if (*end != '\0' || n >= UINT_MAX)
+			continue;
+		if (n < lo)
+			lo = n;
+		if (n > hi)
+			hi = n;
+	}
+	closedir(dp);
+
+	if (lo == UINT_MAX)
+		return segment_new();
+
+	if ((res = segs_reserve(hi)) < 0)
+		return res;
+	store.first = lo;
+	store.nsegs = hi + 1;
+	for (i = lo; i <= hi; i++)
+	{
+		struct stat st;
+		segment_name(name, i);
+		store.segs[i].fd = openat(store.dirfd, name, O_RDWR);
+		if (store.segs[i].fd == -1)
+		{
+			/* A gap from a compaction cut short: the segment was
+			 * emptied before it went. */
+			if (errno != ENOENT)
+				return -errno;
+			continue;
+		}
+		if (fstat(store.segs[i].fd, &st) == -1)
+			return -errno;
+		store.segs[i].size = st.st_size;
+		store.total += st.st_size;
+	}
+	return 0;
+}
+
+/* Rebuilds the tables from the index and the records after it, or from
+ * every record if there is no usable index. */
+static int store_load(void)
+{
+	unsigned seg = 0;
+	off_t off = 0;
+	unsigned i;
+	int res;
+
+	if (index_load(&seg, &off) < 0)
+	{
+		size_t j;
+		for (j = 0; j < store.files_cap; j++)
+		{
+			while (store.files[j])
+			{
+				struct pa5_small *f = store.files[j];
+				drop_live(f);
+				file_unlink(f);
+				file_free(f);
+			}
+		}
+		seg = store.first;
+		off = 0;
+		if (store.total > 0)
+			pa5_info("Small file store has no usable index, replaying the log.");
+	}
+
+	/* The index describes the store as of one clean unmount only. Once
+	 * records have been compacted away it could bring back files deleted
+	 * since, so it goes until the next unmount writes it again. */
+	unlinkat(store.dirfd, "index", 0);
+
+	for (i = seg; i < store.nsegs; i++)
+	{
+		if (store.segs[i].fd == -1)
+			continue;
+		if ((res = replay_segment(i, i == seg ? off : 0)) < 0)
+			return res;
+	}
+	return 0;
+}
+
+/* ---- Compaction ---- */
+
+/* Copies the live puts of segment seg to the head and removes it. */
+static int compact_segment(unsigned seg)
+{
+	struct reader rd;
+	struct record r;
+	char path[PATH_MAX];
+	off_t off = 0;
+	unsigned head;
+	unsigned i;
+	int res = 0;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	rd.fd = store.segs[seg].fd;
+	rd.size = store.segs[seg].size;
+	pthread_mutex_unlock(&store.lock);
+	rd.buf = NULL;
+	rd.cap = 0;
+	rd.base = 0;
+	rd.len = 0;
+
+	/* Only the worker removes segments, so seg stays open meanwhile, and
+	 * nothing is appended to it as it is not the head. */
+	while (off < rd.size && reader_record(&rd, off, 0, &r) == 0)
+	{
+		if (r.type == REC_PUT)
+		{
+			memcpy(path, r.path, r.plen);
+			path[r.plen] = '\0';
+
+			pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+			struct pa5_small *f = file_find(path);
+			if (f && f->rec_len && f->seg == seg && f->off == off)
+			{
+				uint32_t len = f->rec_len;
+				if ((res = file_load(f)) == 0 && (res = file_store(f, REC_PUT)) == 0)
+					store.copied += len;
+				file_unload(f);
+			}
+			pthread_mutex_unlock(&store.lock);
+			if (res < 0)
+				break;
+		}
+		off += r.len;
+	}
+	free(rd.buf);
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	head = store.nsegs - 1;
+	if (res == 0 && store.segs[seg].live != 0)
+		res = -EIO;
+	pthread_mutex_unlock(&store.lock);
+	if (res < 0)
+		return res;
+
+	/* The copies have to be on disk before the originals go. */
+	for (i = seg + 1; i <= head; i++)
+	{
+		int fd;
+		pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+		fd = store.segs[i].fd;
+		pthread_mutex_unlock(&store.lock);
+		if (fd != -1 && fdatasync(fd) == -1)
+			return -errno;
+	}
+
+	char name[32];
+	segment_name(name, seg);
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if (unlinkat(store.dirfd, name, 0) == -1)
+		res = -errno;
+	else
+	{
+		close(store.segs[seg].fd);
+		store.segs[seg].fd = -1;
+		store.total -= store.segs[seg].size;
+		store.segs[seg].size = 0;
+		while (store.first < store.nsegs - 1 && store.segs[store.first].fd == -1)
+			store.first++;
+		store.compactions++;
+	}
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+static void *compact_worker(void *arg)
+{
+	(void) arg;
+
+	pa5_sched_set_class(PA5_SCHED_MAINT);
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	while (store.running)
+	{
+		if (compact_due())
+		{
+			unsigned seg = store.first;
+			pthread_mutex_unlock(&store.lock);
+			pa5_sched_enter();
+			int res = compact_segment(seg);
+			pa5_sched_leave();
+			pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+			if (res < 0)
+			{
+				pa5_error("Could not compact small file segment %u: %d.", seg, res);
+				store.compact_failed = 1;
+			}
+			continue;
+		}
+
+		struct timespec until = { time(NULL) + COMPACT_INTERVAL, 0 };
+		pthread_cond_timedwait(&store.wake, &store.lock, &until);
+	}
+	pthread_mutex_unlock(&store.lock);
+	return NULL;
+}
+
+/* ---- Public interface ---- */
+
+int pa5_small_open(const char *rootdir, const struct pa5_keys *keys, size_t max)
+{
+	char path[PATH_MAX];
+	int res;
+
+	snprintf(path, sizeof(path), "%s/%s", rootdir, PA5_SMALL_DIR);
+	if (max && mkdir(path, 0700) == -1 && errno != EEXIST)
+		return -errno;
+	if ((store.dirfd = open(path, O_RDONLY | O_DIRECTORY)) == -1)
+		return -errno;
+
+	memcpy(store.seal_key, keys->small_store, 32);
+	hmac_sha256(keys->small_store, "pa5 small index", 15, store.index_key);
+	store.max = (max > PA5_SMALL_MAX_LIMIT) ? PA5_SMALL_MAX_LIMIT : max;
+	dirs_grow();
+	files_grow();
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if ((res = segments_open()) == 0)
+		res = store_load();
+	pthread_mutex_unlock(&store.lock);
+	if (res < 0)
+	{
+		pa5_small_close();
+		return res;
+	}
+
+	store.ready = 1;
+	return 0;
+}
+
+int pa5_small_start(void)
+{
+	int res;
+
+	if (!store.ready)
+		return 0;
+	store.running = 1;
+	if ((res = pthread_create(&store.worker, NULL, compact_worker, NULL)) != 0)
+	{
+		store.running = 0;
+		return -res;
+	}
+	return 0;
+}
+
+void pa5_small_close(void)
+{
+	unsigned i;
+	size_t j;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if (store.running)
+	{
+		store.running = 0;
+		pthread_cond_signal(&store.wake);
+		pthread_mutex_unlock(&store.lock);
+		pthread_join(store.worker, NULL);
+		pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	}
+
+	if (store.ready)
+	{
+		int res = 0;
+		for (j = 0; j < store.files_cap; j++)
+		{
+			struct pa5_small *f;
+			for (f = store.files[j]; f; f = f->hash_next)
+				if (f->dirty && (res = file_store(f, REC_PUT)) < 0)
+					pa5_error("Could not write back small file %s: %d.", f->path, res);
+		}
+		if (fdatasync(store.segs[store.nsegs - 1].fd) == -1 || (res = index_write()) < 0)
+			pa5_error("Could not write the small file index: %d.", res);
+	}
+
+	for (j = 0; j < store.files_cap; j++)
+	{
+		while (store.files[j])
+		{
+			struct pa5_small *f = store.files[j];
+			file_unlink(f);
+			if (f->opens == 0)
+				file_free(f);
+		}
+	}
+	free(store.files);
+	free(store.dirs);
+	store.files = NULL;
+	store.dirs = NULL;
+	store.files_cap = store.dirs_cap = 0;
+	store.nfiles = store.ndirs = 0;
+
+	for (i = 0; i < store.segs_cap; i++)
+		if (store.segs[i].fd != -1)
+			close(store.segs[i].fd);
+	free(store.segs);
+	store.segs = NULL;
+	store.segs_cap = store.nsegs = store.first = 0;
+	store.total = store.live = 0;
+	if (store.dirfd != -1)
+		close(store.dirfd);
+	store.dirfd = -1;
+	store.ready = 0;
+	store.max = 0;
+	pthread_mutex_unlock(&store.lock);
+}
+
+int pa5_small_ready(void)
+{
+	return store.ready;
+}
+
+size_t pa5_small_max(void)
+{
+	return store.ready ? store.max : 0;
+}
+
+int pa5_small_stat(const char *path, struct stat *st)
+{
+	struct pa5_small *f;
+	int res = -ENOENT;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if ((f = file_find(path)) != NULL)
+	{
+		fill_stat(f, st);
+		res = 0;
+	}
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_small_create(const char *path, mode_t mode, uid_t uid, gid_t gid, int excl,
+		     struct pa5_small **fp)
+{
+	struct pa5_small *f;
+	int res = 0;
+
+	if (strlen(path) >= PATH_MAX)
+		return -ENAMETOOLONG;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if ((f = file_find(path)) != NULL)
+	{
+		if (excl)
+			res = -EEXIST;
+		else if ((res = file_load(f)) == 0)
+			f->opens++;
+	}
+	else if ((f = file_new(path)) == NULL)
+		res = -ENOMEM;
+	else
+	{
+		f->mode = mode & 07777;
+		f->uid = uid;
+		f->gid = gid;
+		f->atime = f->mtime = f->ctime = now_ns();
+		f->dirty = 1;
+		f->opens = 1;
+		if ((res = file_load(f)) < 0)
+		{
+			file_unlink(f);
+			file_free(f);
+		}
+		else
+			store.creates++;
+	}
+	pthread_mutex_unlock(&store.lock);
+
+	if (res == 0)
+		*fp = f;
+	return res;
+}
+
+int pa5_small_get(const char *path, struct pa5_small **fp)
+{
+	struct pa5_small *f;
+	int res;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if ((f = file_find(path)) == NULL)
+		res = -ENOENT;
+	else if ((res = file_load(f)) == 0)
+	{
+		f->opens++;
+		*fp = f;
+	}
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_small_put(struct pa5_small *f)
+{
+	int res = 0;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if (f->dirty && f->linked && f->opens == 1 && (res = file_store(f, REC_PUT)) < 0)
+		pa5_error("Could not write back small file %s: %d.", f->path, res);
+	if (--f->opens == 0)
+	{
+		if (!f->linked)
+			file_free(f);
+		else
+			file_unload(f);
+	}
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_small_read(struct pa5_small *f, char *buf, size_t size, off_t offset)
+{
+	int res = 0;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if (f->promoted)
+		res = -ESTALE;
+	else if ((size_t)offset < f->size)
+	{
+		if (size > f->size - offset)
+			size = f->size - offset;
+		memcpy(buf, f->data + offset, size);
+		res = size;
+	}
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+/* Makes room for size bytes of contents. Called with the store locked. */
+static int file_resize(struct pa5_small *f, size_t size)
+{
+	size_t limit = store.max ? store.max : f->size;
+
+	if (size > limit)
+		return -EFBIG;
+	if (size > f->cap)
+	{
+		size_t cap = f->cap * 2;
+		if (cap < size)
+			cap = size;
+		if (cap > limit)
+			cap = limit;
+		char *data = realloc(f->data, cap);
+		if (!data)
+			return -ENOMEM;
+		f->data = data;
+		f->cap = cap;
+	}
+	if (size > f->size)
+		memset(f->data + f->size, 0, size - f->size);
+	return 0;
+}
+
+int pa5_small_write(struct pa5_small *f, const char *buf, size_t size, off_t offset)
+{
+	size_t end = offset + size;
+	int res;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if (f->promoted)
+		res = -ESTALE;
+	else if ((res = file_resize(f, end > f->size ? end : f->size)) == 0)
+	{
+		memcpy(f->data + offset, buf, size);
+		if (end > f->size)
+			f->size = end;
+		f->mtime = f->ctime = now_ns();
+		f->dirty = 1;
+		res = size;
+	}
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_small_truncate(struct pa5_small *f, off_t size)
+{
+	int res;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if (f->promoted)
+		res = -ESTALE;
+	else if ((res = file_resize(f, size)) == 0)
+	{
+		f->size = size;
+		f->mtime = f->ctime = now_ns();
+		f->dirty = 1;
+	}
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_small_sync(struct pa5_small *f)
+{
+	int res = 0;
+	int fd = -1;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if (f->promoted)
+		res = -ESTALE;
+	else if (f->linked)
+	{
+		if (f->dirty)
+			res = file_store(f, REC_PUT);
+		if (res == 0 && f->rec_len)
+			fd = store.segs[f->seg].fd;
+	}
+	if (fd != -1 && fdatasync(fd) == -1)
+		res = -errno;
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_small_promote(struct pa5_small *f, pa5_small_export_t fn, void *arg)
+{
+	struct stat st;
+	int res;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if (f->promoted)
+		res = 0;
+	else if (!f->linked)
+		res = -EFBIG;   /* Unlinked while open: nowhere to put it. */
+	else
+	{
+		fill_stat(f, &st);
+		if ((res = fn(arg, f->data, &st)) == 0 && (res = file_delete(f)) == 0)
+		{
+			f->promoted = 1;
+			store.promotions++;
+		}
+	}
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_small_promoted(struct pa5_small *f)
+{
+	int res;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	res = f->promoted;
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_small_unlink(const char *path)
+{
+	struct pa5_small *f;
+	int res;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	res = (f = file_find(path)) ? file_delete(f) : -ENOENT;
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_small_rename(const char *from, const char *to)
+{
+	struct pa5_small *f;
+	int res;
+
+	if (strlen(to) >= PATH_MAX)
+		return -ENAMETOOLONG;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	res = (f = file_find(from)) ? file_rename(f, to) : -ENOENT;
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_small_rename_dir(const char *from, const char *to)
+{
+	size_t from_len = strlen(from);
+	struct pa5_small **moves = NULL;
+	size_t n = 0;
+	size_t cap = 0;
+	size_t i;
+	int res = 0;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	for (i = 0; i < store.dirs_cap; i++)
+	{
+		struct small_dir *d;
+		for (d = store.dirs[i]; d; d = d->hash_next)
+		{
+			struct pa5_small *f;
+			if (d->len < from_len || memcmp(d->path, from, from_len) != 0 ||
+			    (d->len > from_len && d->path[from_len] != '/'))
+				continue;
+			for (f = d->files; f; f = f->dir_next)
+			{
+				if (n == cap)
+				{
+					cap = cap ? cap * 2 : 64;
+					struct pa5_small **m = realloc(moves, cap * sizeof(*m));
+					if (!m)
+					{
+						res = -ENOMEM;
+						goto out;
+					}
+					moves = m;
+				}
+				moves[n++] = f;
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		char path[PATH_MAX];
+		struct pa5_small *f = moves[i];
+		if (snprintf(path, sizeof(path), "%s%s", to, f->path + from_len) >= PATH_MAX)
+			res = -ENAMETOOLONG;
+		else if ((res = file_rename(f, path)) < 0)
+			pa5_error("Could not move small file %s: %d.", f->path, res);
+	}
+
+out:
+	pthread_mutex_unlock(&store.lock);
+	free(moves);
+	return res;
+}
+
+int pa5_small_chmod(const char *path, mode_t mode)
+{
+	struct pa5_small *f;
+	int res = -ENOENT;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if ((f = file_find(path)) != NULL)
+	{
+		f->mode = mode & 07777;
+		res = file_store_attr(f);
+	}
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_small_chown(const char *path, uid_t uid, gid_t gid)
+{
+	struct pa5_small *f;
+	int res = -ENOENT;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if ((f = file_find(path)) != NULL)
+	{
+		if (uid != (uid_t)-1)
+			f->uid = uid;
+		if (gid != (gid_t)-1)
+			f->gid = gid;
+		res = file_store_attr(f);
+	}
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+static uint64_t time_ns(const struct timespec *ts, uint64_t now, uint64_t old)
+{
+	if (ts->tv_nsec == UTIME_NOW)
+		return now;
+	if (ts->tv_nsec == UTIME_OMIT)
+		return old;
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+int pa5_small_utimens(const char *path, const struct timespec ts[2])
+{
+	struct pa5_small *f;
+	int res = -ENOENT;
+	uint64_t now = now_ns();
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if ((f = file_find(path)) != NULL)
+	{
+		f->atime = time_ns(&ts[0], now, f->atime);
+		f->mtime = time_ns(&ts[1], now, f->mtime);
+		res = file_store_attr(f);
+	}
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_small_has_files(const char *path)
+{
+	int res;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	res = dir_find(path, strlen(path)) != NULL;
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+int pa5_small_list(const char *path, pa5_small_fill_t fn, void *arg)
+{
+	struct small_dir *d;
+	struct pa5_small *f;
+	struct stat st;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	if ((d = dir_find(path, strlen(path))) != NULL)
+	{
+		for (f = d->files; f; f = f->dir_next)
+		{
+			fill_stat(f, &st);
+			if (fn(arg, f->name, &st))
+				break;
+		}
+	}
+	pthread_mutex_unlock(&store.lock);
+	return 0;
+}
+
+int pa5_small_each(pa5_small_each_t fn, void *arg)
+{
+	struct pa5_small *f;
+	struct stat st;
+	size_t i;
+	int res = 0;
+
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	for (i = 0; i < store.files_cap && res == 0; i++)
+	{
+		for (f = store.files[i]; f && res == 0; f = f->hash_next)
+		{
+			char *data = malloc(f->size ? f->size : 1);
+			int ok = data ? 0 : -ENOMEM;
+
+			if (ok == 0 && f->data)
+				memcpy(data, f->data, f->size);
+			else if (ok == 0 && f->rec_len)
+				ok = file_fetch(f, data);
+			fill_stat(f, &st);
+			res = fn(arg, f->path, ok == 0 ? data : NULL, &st, ok);
+			free(data);
+		}
+	}
+	pthread_mutex_unlock(&store.lock);
+	return res;
+}
+
+void pa5_small_stats(FILE *out)
+{
+	pa5_mutex_lock(&store.lock, PA5_LOCK_SMALL);
+	fprintf(out, "enabled %d\n", store.max > 0);
+	if (store.ready)
+	{
+		fprintf(out, "max_size %zu\n", store.max);
+		fprintf(out, "files %zu\n", store.nfiles);
+		fprintf(out, "dirs %zu\n", store.ndirs);
+		fprintf(out, "segments %u\n", store.nsegs - store.first);
+		fprintf(out, "bytes %llu\n", (unsigned long long)store.total);
+		fprintf(out, "live_bytes %llu\n", (unsigned long long)store.live);
+		fprintf(out, "creates %llu\n", store.creates);
+		fprintf(out, "promotions %llu\n", store.promotions);
+		fprintf(out, "compactions %llu\n", store.compactions);
+		fprintf(out, "copied_bytes %llu\n", store.copied);
+	}
+	pthread_mutex_unlock(&store.lock);
+}
@@ -0,0 +1,155 @@
+/* pa5-small.h
+ * Packed store for small files.
+ *
+ * Files created while the store is enabled start out in it instead of as
+ * backing files of their own: they have no inode, no xattr and no chunk
+ * header in the mirror, only a record in an append-only segment file under
+ * PA5_SMALL_DIR. A file stays in the store while it is at most
+ * pa5_small_max() bytes long. Growing past that, or being hard linked or
+ * given extended attributes, promotes it to an ordinary encrypted backing
+ * file at its path.
+ *
+ * Files are named by their path below the mount. Directories are always
+ * real directories in the mirror; the store only holds the files in them.
+ *
+ *   seg.NNNNN   records, appended in order, up to PA5_SMALL_SEG_MAX bytes
+ *   index       every live file as of the last clean unmount
+ *
+ * A record is a 96-byte header, the path, and for puts the file contents:
+ *
+ *   0   magic "PA5S"
+ *   4   type: 1 put (contents and attributes), 2 attributes only, 3 delete
+ *   6   path length, little endian like every field below
+ *   16  file size
+ *   20  mode, uid, gid
+ *   32  atime, mtime and ctime in nanoseconds
+ *   64  GCM nonce, then the tag
+ *
+ * The contents are sealed with AES-256-GCM under the volume small-file key,
+ * with a random nonce and the first 64 header bytes and the path as
+ * additional data, so a record cannot be moved to another path. At mount
+ * the index is loaded and the records written after it are replayed; with
+ * no valid index every segment is replayed.
+ *
+ * Space of overwritten and deleted files is reclaimed by a background
+ * worker that copies the live records of the oldest segment to the head of
+ * the log and then removes it. Only ever removing the oldest segment keeps
+ * a full replay correct: a record can only be superseded by a later one.
+ *
+ * All functions return 0 (or a byte count) on success and -errno on error.
+ */
+
+#ifndef PA5_SMALL_H
+#define PA5_SMALL_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "pa5-chunk.h"
+
+#define PA5_SMALL_DIR ".pa5-small"
+#define PA5_SMALL_VERSION 1
+#define PA5_SMALL_SEG_MAX (64LL << 20)
+#define PA5_SMALL_DEFAULT_MAX 65536
+#define PA5_SMALL_MAX_LIMIT (1 << 20)
+
+/* A small file held open. Handles keep the contents in memory and write
+ * them back to the store when the last one is put. */
+struct pa5_small;
+
+/* Called by pa5_small_promote() with the contents and attributes of the
+ * file to create it outside the store. */
+typedef int (*pa5_small_export_t)(void *arg, const char *data, const struct stat *st);
+
+/* Called by pa5_small_each() for every file; res < 0 and data NULL if the
+ * file failed verification. */
+typedef int (*pa5_small_each_t)(void *arg, const char *path, const char *data,
+				const struct stat *st, int res);
+
+/* Called by pa5_small_list() for every file in a directory. */
+typedef int (*pa5_small_fill_t)(void *arg, const char *name, const struct stat *st);
+
+/* int pa5_small_open(const char *rootdir, const struct pa5_keys *keys, size_t max)
+ * Purpose: Open the small-file store of the mirror at rootdir. With max
+ *          set the store is created if needed and new files up to max bytes
+ *          are placed in it.
+ * Return: 0 on success, -ENOENT if there is no store and max is 0
+ */
+int pa5_small_open(const char *rootdir, const struct pa5_keys *keys, size_t max);
+
+/* Starts the compaction worker; called once the daemon has forked. */
+int pa5_small_start(void);
+
+/* Stops the worker, writes the index and closes the store. */
+void pa5_small_close(void);
+
+/* Returns 1 once the store is open, and the size limit for new files (0 if
+ * new files are not placed in the store). */
+int pa5_small_ready(void);
+size_t pa5_small_max(void);
+
+/* Attributes of the small file at path, -ENOENT if there is none. */
+int pa5_small_stat(const char *path, struct stat *st);
+
+/* int pa5_small_create(const char *path, mode_t mode, uid_t uid, gid_t gid, int excl,
+ *                      struct pa5_small **fp)
+ * Purpose: Create an empty small file at path and open it, or open the
+ *          existing one unless excl is set. The caller checks that nothing
+ *          else in the mirror has the name.
+ * Return: 0 on success, -EEXIST if excl is set and the file exists
+ */
+int pa5_small_create(const char *path, mode_t mode, uid_t uid, gid_t gid, int excl,
+		     struct pa5_small **fp);
+
+/* Opens the small file at path, -ENOENT if there is none. */
+int pa5_small_get(const char *path, struct pa5_small **fp);
+
+/* Closes a handle, writing the file back if it changed and this was the
+ * last handle on it. */
+int pa5_small_put(struct pa5_small *f);
+
+/* Contents of an open file. Writes and truncates that would take the file
+ * past pa5_small_max() fail with -EFBIG and change nothing; the caller then
+ * promotes the file. */
+int pa5_small_read(struct pa5_small *f, char *buf, size_t size, off_t offset);
+int pa5_small_write(struct pa5_small *f, const char *buf, size_t size, off_t offset);
+int pa5_small_truncate(struct pa5_small *f, off_t size);
+
+/* Writes the file back and flushes its segment to disk. */
+int pa5_small_sync(struct pa5_small *f);
+
+/* int pa5_small_promote(struct pa5_small *f, pa5_small_export_t fn, void *arg)
+ * Purpose: Hand the file to fn to be created outside the store and, if fn
+ *          succeeds, drop it from the store. Other handles on the file see
+ *          pa5_small_promoted() and move to the new file.
+ * Return: 0 on success, fn's error otherwise
+ */
+int pa5_small_promote(struct pa5_small *f, pa5_small_export_t fn, void *arg);
+int pa5_small_promoted(struct pa5_small *f);
+
+/* Namespace operations on files in the store. pa5_small_rename() replaces
+ * a small file at to; pa5_small_rename_dir() moves every file below a
+ * directory the mirror has just renamed. */
+int pa5_small_unlink(const char *path);
+int pa5_small_rename(const char *from, const char *to);
+int pa5_small_rename_dir(const char *from, const char *to);
+int pa5_small_chmod(const char *path, mode_t mode);
+int pa5_small_chown(const char *path, uid_t uid, gid_t gid);
+int pa5_small_utimens(const char *path, const struct timespec ts[2]);
+
+/* Returns 1 if the directory at path holds small files. */
+int pa5_small_has_files(const char *path);
+
+/* Calls fn for each small file in the directory at path until it returns
+ * nonzero. */
+int pa5_small_list(const char *path, pa5_small_fill_t fn, void *arg);
+
+/* Reads and verifies every file in the store, for pa5-bulk. */
+int pa5_small_each(pa5_small_each_t fn, void *arg);
+
+/* Stats section with the file count and space use of the store. */
+void pa5_small_stats(FILE *out);
+
+#endif
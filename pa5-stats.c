@@ -0,0 +1,258 @@
+/* pa5-stats.c
+ * Per-thread counters and latency histograms for pa5-encfs.
+ *
+ * Slots are never freed. When a thread exits its slot is handed to the next
+ * new thread, which keeps adding to the same totals, so the number of slots
+ * stays bounded by the peak number of threads.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-stats.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define MAX_SECTIONS 32
+
+struct stats_hist
+{
+	uint64_t count;
+	uint64_t errors;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[PA5_STATS_BUCKETS];
+};
+
+struct stats_slot
+{
+	struct stats_hist timers[PA5_TIMER_COUNT];
+	uint64_t counters[PA5_CTR_COUNT];
+	int in_use;
+	struct stats_slot *next;
+};
+
+struct stats_section
+{
+	const char *name;
+	pa5_stats_section_t fn;
+};
+
+static const char *timer_names[PA5_TIMER_COUNT] = {
+	"getattr", "access", "readlink", "readdir", "mknod", "mkdir", "symlink",
+	"unlink", "rmdir", "rename", "link", "chmod", "chown", "truncate",
+	"ftruncate", "utimens", "open", "read", "write", "statfs", "create",
+	"release", "fsync", "setxattr", "getxattr", "listxattr", "removexattr",
+	"crypto", "backing_io", "compress", "sched_wait"
+};
+
+static const char *counter_names[PA5_CTR_COUNT] = {
+	"cache_hits", "cache_misses", "bytes_in", "bytes_out",
+	"backing_read", "backing_written", "compress_in", "compress_out"
+};
+
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_slot *slots = NULL;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_slot *thread_slot = NULL;
+
+static struct stats_section sections[MAX_SECTIONS];
+static int nsections = 0;
+
+static void slot_release(void *ptr)
+{
+	struct stats_slot *slot = ptr;
+
+	pa5_mutex_lock(&slots_lock, PA5_LOCK_STATS);
+	slot->in_use = 0;
+	pthread_mutex_unlock(&slots_lock);
+}
+
+static void slot_key_create(void)
+{
+	pthread_key_create(&slot_key, slot_release);
+}
+
+static struct stats_slot *get_slot(void)
+{
+	struct stats_slot *slot;
+
+	if (thread_slot)
+		return thread_slot;
+
+	pthread_once(&slot_once, slot_key_create);
+	pa5_mutex_lock(&slots_lock, PA5_LOCK_STATS);
+	for (slot = slots; slot; slot = slot->next)
+	{
+		if (!slot->in_use)
+			break;
+	}
+	if (!slot && (slot = calloc(1, sizeof(*slot))) != NULL)
+	{
+		slot->next = slots;
+		slots = slot;
+	}
+	if (slot)
+		slot->in_use = 1;
+	pthread_mutex_unlock(&slots_lock);
+
+	if (slot)
+		pthread_setspecific(slot_key, slot);
+	thread_slot = slot;
+	return slot;
+}
+
+/* Only the owning thread writes a slot, so a load and a store will do. */
+static inline void bump(uint64_t *v, uint64_t n)
+{
+	__atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t peek(const uint64_t *v)
+{
+	return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
+
+uint64_t pa5_stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void pa5_stats_time(enum pa5_timer timer, uint64_t start, int res)
+{
+	struct stats_slot *slot = get_slot();
+	if (!slot)
+		return;
+
+	uint64_t ns = pa5_stats_now() - start;
+	unsigned bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (bucket >= PA5_STATS_BUCKETS)
+		bucket = PA5_STATS_BUCKETS - 1;
+
+	struct stats_hist *h = &slot->timers[timer];
+	bump(&h->count, 1);
+	bump(&h->sum_ns, ns);
+	bump(&h->buckets[bucket], 1);
+	if (res < 0)
+		bump(&h->errors, 1);
+	if (ns > peek(&h->max_ns))
+		__atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+void pa5_stats_add(enum pa5_counter counter, uint64_t n)
+{
+	struct stats_slot *slot = get_slot();
+	if (slot)
+		bump(&slot->counters[counter], n);
+}
+
+const char *pa5_stats_timer_name(enum pa5_timer timer)
+{
+	if ((unsigned)timer >= PA5_TIMER_COUNT)
+		return "unknown";
+	return timer_names[timer];
+}
+
+void pa5_stats_register(const char *name, pa5_stats_section_t section)
+{
+	pa5_mutex_lock(&slots_lock, PA5_LOCK_STATS);
+	if (nsections < MAX_SECTIONS)
+	{
+		sections[nsections].name = name;
+		sections[nsections].fn = section;
+		nsections++;
+	}
+	pthread_mutex_unlock(&slots_lock);
+}
+
+/* Upper bound of the bucket holding quantile q, in microseconds, clamped
+ * to the largest value seen. */
+static double quantile_us(const struct stats_hist *h, double q)
+{
+	uint64_t want = (uint64_t)(q * h->count);
+	uint64_t seen = 0;
+	unsigned i;
+
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < PA5_STATS_BUCKETS - 1; i++)
+	{
+		seen += h->buckets[i];
+		if (seen >= want)
+			break;
+	}
+	uint64_t bound = 1ULL << i;
+	return (bound < h->max_ns ? bound : h->max_ns) / 1000.0;
+}
+
+int pa5_stats_format(char **text, size_t *len)
+{
+	struct stats_hist total[PA5_TIMER_COUNT];
+	uint64_t counters[PA5_CTR_COUNT];
+	struct stats_slot *slot;
+	unsigned t;
+	unsigned i;
+	int s;
+
+	memset(total, 0, sizeof(total));
+	memset(counters, 0, sizeof(counters));
+
+	pa5_mutex_lock(&slots_lock, PA5_LOCK_STATS);
+	for (slot = slots; slot; slot = slot->next)
+	{
+		for (t = 0; t < PA5_TIMER_COUNT; t++)
+		{
+			const struct stats_hist *h = &slot->timers[t];
+			total[t].count += peek(&h->count);
+			total[t].errors += peek(&h->errors);
+			total[t].sum_ns += peek(&h->sum_ns);
+			if (peek(&h->max_ns) > total[t].max_ns)
+				total[t].max_ns = peek(&h->max_ns);
+			for (i = 0; i < PA5_STATS_BUCKETS; i++)
+				total[t].buckets[i] += peek(&h->buckets[i]);
+		}
+		for (i = 0; i < PA5_CTR_COUNT; i++)
+			counters[i] += peek(&slot->counters[i]);
+	}
+	int n = nsections;
+	pthread_mutex_unlock(&slots_lock);
+
+	FILE *out = open_memstream(text, len);
+	if (!out)
+		return -errno;
+
+	fprintf(out, "%-12s %10s %8s %10s %10s %10s %10s %10s\n", "op", "count", "errors",
+		"mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+	for (t = 0; t < PA5_TIMER_COUNT; t++)
+	{
+		const struct stats_hist *h = &total[t];
+		if (h->count == 0)
+			continue;
+		fprintf(out, "%-12s %10llu %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			timer_names[t], (unsigned long long)h->count,
+			(unsigned long long)h->errors, h->sum_ns / 1000.0 / h->count,
+			quantile_us(h, 0.50), quantile_us(h, 0.90), quantile_us(h, 0.99),
+			h->max_ns / 1000.0);
+	}
+
+	fprintf(out, "\n");
+	for (i = 0; i < PA5_CTR_COUNT; i++)
+		fprintf(out, "%-16s %llu\n", counter_names[i], (unsigned long long)counters[i]);
+
+	for (s = 0; s < n; s++)
+	{
+		fprintf(out, "\n[%s]\n", sections[s].name);
+		sections[s].fn(out);
+	}
+
+	if (fclose(out) != 0)
+		return -errno;
+	return 0;
+}
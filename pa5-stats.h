@@ -0,0 +1,100 @@
+/* pa5-stats.h
+ * Per-thread counters and latency histograms for pa5-encfs.
+ *
+ * Every thread that records anything gets its own slot, so updates are plain
+ * relaxed stores to memory no other thread writes: no locks and no atomic
+ * read-modify-write on the hot path. A snapshot sums all slots. Latencies go
+ * into histograms with power-of-two nanosecond buckets, which is enough to
+ * tell a 100us p99 from a 10ms one.
+ *
+ * The snapshot is rendered as text for the synthetic PA5_STATS_FILE in the
+ * mount root. Other modules can append their own sections to it.
+ */
+
+#ifndef PA5_STATS_H
+#define PA5_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define PA5_STATS_FILE "/.encfs-stats"
+#define PA5_STATS_BUCKETS 40   /* Bucket i holds latencies below 2^i ns. */
+
+/* Timed events: one per FUSE callback, then the internal phases. */
+enum pa5_timer
+{
+	PA5_OP_GETATTR,
+	PA5_OP_ACCESS,
+	PA5_OP_READLINK,
+	PA5_OP_READDIR,
+	PA5_OP_MKNOD,
+	PA5_OP_MKDIR,
+	PA5_OP_SYMLINK,
+	PA5_OP_UNLINK,
+	PA5_OP_RMDIR,
+	PA5_OP_RENAME,
+	PA5_OP_LINK,
+	PA5_OP_CHMOD,
+	PA5_OP_CHOWN,
+	PA5_OP_TRUNCATE,
+	PA5_OP_FTRUNCATE,
+	PA5_OP_UTIMENS,
+	PA5_OP_OPEN,
+	PA5_OP_READ,
+	PA5_OP_WRITE,
+	PA5_OP_STATFS,
+	PA5_OP_CREATE,
+	PA5_OP_RELEASE,
+	PA5_OP_FSYNC,
+	PA5_OP_SETXATTR,
+	PA5_OP_GETXATTR,
+	PA5_OP_LISTXATTR,
+	PA5_OP_REMOVEXATTR,
+	PA5_OP_COUNT,
+
+	PA5_TIME_CRYPTO = PA5_OP_COUNT,  /* Cipher work, per call. */
+	PA5_TIME_IO,                     /* Waiting on the backing store. */
+	PA5_TIME_COMPRESS,               /* Chunk (de)compression, per chunk. */
+	PA5_TIME_QUEUE,                  /* Queued for a pa5-sched slot. */
+	PA5_TIMER_COUNT
+};
+
+enum pa5_counter
+{
+	PA5_CTR_CACHE_HIT,
+	PA5_CTR_CACHE_MISS,
+	PA5_CTR_BYTES_IN,          /* Plaintext written by clients. */
+	PA5_CTR_BYTES_OUT,         /* Plaintext read by clients. */
+	PA5_CTR_BACKING_READ,      /* Bytes read from backing files. */
+	PA5_CTR_BACKING_WRITTEN,   /* Bytes written to backing files. */
+	PA5_CTR_COMPRESS_IN,       /* Plaintext offered to the compressor. */
+	PA5_CTR_COMPRESS_OUT,      /* What of it was stored, compressed or raw. */
+	PA5_CTR_COUNT
+};
+
+/* Appends a section to the stats text. */
+typedef void (*pa5_stats_section_t)(FILE *out);
+
+/* Monotonic clock in nanoseconds, the start value for pa5_stats_time(). */
+uint64_t pa5_stats_now(void);
+
+/* Records the time since start against timer. A negative res counts as an
+ * error for the callback timers. */
+void pa5_stats_time(enum pa5_timer timer, uint64_t start, int res);
+
+void pa5_stats_add(enum pa5_counter counter, uint64_t n);
+
+/* Name of a timer as printed in the stats file. */
+const char *pa5_stats_timer_name(enum pa5_timer timer);
+
+/* Registers a section printed after the built-in ones. */
+void pa5_stats_register(const char *name, pa5_stats_section_t section);
+
+/* int pa5_stats_format(char **text, size_t *len)
+ * Purpose: Render a snapshot of all statistics.
+ * Return: 0 with a malloc()ed buffer in text, -errno on error
+ */
+int pa5_stats_format(char **text, size_t *len);
+
+#endif
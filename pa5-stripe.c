@@ -0,0 +1,524 @@
+/* pa5-stripe.c
+ * Striping of chunk files across several mirror roots.
+ *
+ * The roots are opened once at mount and stripe files are opened relative
+ * to them. Descriptors of stripe files are cached with a reference count,
+ * looked up by file id and root, so consecutive batches of a file, and
+ * other handles on it, reuse one descriptor per root. Idle descriptors are
+ * closed least recently used first once MAX_CACHED are open.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-stripe.h"
+#include "pa5-log.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#define MARKER_NAME "root"
+#define MAX_CACHED 256
+#define NAME_LEN 35           /* "xx/" and 32 hex digits. */
+
+struct stripe_root
+{
+	char *path;
+	int dirfd;
+};
+
+/* A cached stripe file descriptor. A dead entry belongs to a stripe file
+ * that has been removed and is closed when its last reference goes. */
+struct stripe_fd
+{
+	unsigned char file_id[16];
+	unsigned root;
+	int fd;
+	unsigned refs;
+	int dead;
+	uint64_t used;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	struct stripe_root roots[PA5_STRIPE_MAX];
+	unsigned nroots;
+	int policy;
+	unsigned unit;        /* Chunks per stripe unit. */
+	struct stripe_fd *fds;
+	size_t nfds;
+	size_t fds_cap;
+	uint64_t tick;
+	uint64_t opens;
+	uint64_t creates;
+	uint64_t removes;
+} stripe = { .lock = PTHREAD_MUTEX_INITIALIZER, .nroots = 1 };
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Name of the stripe file of cf below its root's PA5_STRIPE_DIR. */
+static void stripe_name(const struct pa5_chunk_file *cf, char name[NAME_LEN + 1])
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	name[0] = hex[cf->file_id[0] >> 4];
+	name[1] = hex[cf->file_id[0] & 15];
+	name[2] = '/';
+	for (i = 0; i < 16; i++)
+	{
+		name[3 + 2 * i] = hex[cf->file_id[i] >> 4];
+		name[4 + 2 * i] = hex[cf->file_id[i] & 15];
+	}
+	name[NAME_LEN] = '\0';
+}
+
+/* Checks the marker of extra root index, writing it if the root is new. */
+static int root_mark(int dirfd, unsigned index, const struct pa5_keys *keys)
+{
+	unsigned char msg[16] = "pa5 stripe root";
+	unsigned char mark[32];
+	unsigned char found[32];
+	unsigned int len = 32;
+	int res = 0;
+
+	msg[15] = index;
+	HMAC(EVP_sha256(), keys->header_mac, 32, msg, sizeof(msg), mark, &len);
+
+	int fd = openat(dirfd, MARKER_NAME, O_RDONLY);
+	if (fd != -1)
+	{
+		if (pread(fd, found, sizeof(found), 0) != sizeof(found) ||
+		    CRYPTO_memcmp(found, mark, sizeof(mark)) != 0)
+			res = -EINVAL;
+		close(fd);
+		return res;
+	}
+	if (errno != ENOENT)
+		return -errno;
+
+	if ((fd = openat(dirfd, MARKER_NAME, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1)
+		return -errno;
+	if (pwrite(fd, mark, sizeof(mark), 0) != sizeof(mark) || fsync(fd) == -1)
+		res = -EIO;
+	close(fd);
+	if (res < 0)
+		unlinkat(dirfd, MARKER_NAME, 0);
+	return res;
+}
+
+int pa5_stripe_parse_policy(const char *name)
+{
+	if (strcmp(name, "all") == 0)
+		return PA5_STRIPE_ALL;
+	if (strcmp(name, "data") == 0)
+		return PA5_STRIPE_DATA;
+	return -EINVAL;
+}
+
+int pa5_stripe_open(const char *rootdir, const char *roots, const struct pa5_keys *keys,
+		    int policy, size_t unit)
+{
+	char *list = strdup(roots);
+	char *save = NULL;
+	char *root;
+	int res = 0;
+
+	if (!list)
+		return -ENOMEM;
+	if (policy != PA5_STRIPE_ALL && policy != PA5_STRIPE_DATA)
+		policy = PA5_STRIPE_ALL;
+
+	stripe.roots[0].path = strdup(rootdir);
+	stripe.roots[0].dirfd = -1;
+	stripe.nroots = 1;
+	for (root = strtok_r(list, ":", &save); root; root = strtok_r(NULL, ":", &save))
+	{
+		struct stripe_root *r = &stripe.roots[stripe.nroots];
+		char path[PATH_MAX];
+
+		if (stripe.nroots == PA5_STRIPE_MAX)
+		{
+			res = -E2BIG;
+			break;
+		}
+		if ((r->path = realpath(root, NULL)) == NULL)
+		{
+			res = -errno;
+			pa5_error("Stripe root %s: %s.", root, strerror(-res));
+			break;
+		}
+		snprintf(path, sizeof(path), "%s/%s", r->path, PA5_STRIPE_DIR);
+		if ((mkdir(path, 0700) == -1 && errno != EEXIST) ||
+		    (r->dirfd = open(path, O_RDONLY | O_DIRECTORY)) == -1)
+		{
+			res = -errno;
+			pa5_error("Stripe root %s: %s.", r->path, strerror(-res));
+			free(r->path);
+			break;
+		}
+		stripe.nroots++;
+		if ((res = root_mark(r->dirfd, stripe.nroots - 1, keys)) < 0)
+		{
+			pa5_error("Stripe root %s is not root %u of this volume.", r->path,
+				  stripe.nroots - 1);
+			break;
+		}
+	}
+	free(list);
+
+	if (res < 0)
+	{
+		pa5_stripe_close();
+		return res;
+	}
+
+	stripe.policy = (stripe.nroots > 2) ? policy : PA5_STRIPE_ALL;
+	stripe.unit = (unit + PA5_CHUNK_SIZE - 1) / PA5_CHUNK_SIZE;
+	if (stripe.unit == 0)
+		stripe.unit = 1;
+	return 0;
+}
+
+void pa5_stripe_close(void)
+{
+	unsigned i;
+	size_t j;
+
+	pa5_mutex_lock(&stripe.lock, PA5_LOCK_STRIPE);
+	for (j = 0; j < stripe.nfds; j++)
+		close(stripe.fds[j].fd);
+	free(stripe.fds);
+	stripe.fds = NULL;
+	stripe.nfds = stripe.fds_cap = 0;
+	for (i = 0; i < stripe.nroots; i++)
+	{
+		if (stripe.roots[i].dirfd != -1)
+			close(stripe.roots[i].dirfd);
+		free(stripe.roots[i].path);
+		stripe.roots[i].path = NULL;
+	}
+	stripe.nroots = 1;
+	pthread_mutex_unlock(&stripe.lock);
+}
+
+unsigned pa5_stripe_roots(void)
+{
+	return stripe.nroots;
+}
+
+int pa5_stripe_enabled(void)
+{
+	return stripe.nroots > 1;
+}
+
+void pa5_stripe_header(unsigned char hdr[PA5_CHUNK_HEADER])
+{
+	hdr[6] = stripe.nroots;
+	hdr[7] = stripe.policy;
+	put_le32(hdr + 12, stripe.unit);
+}
+
+int pa5_stripe_check(const unsigned char hdr[PA5_CHUNK_HEADER], struct pa5_chunk_file *cf)
+{
+	cf->stripe_width = hdr[6];
+	cf->stripe_policy = hdr[7];
+	cf->stripe_unit = get_le32(hdr + 12);
+
+	if (cf->stripe_width < 2 || cf->stripe_width > PA5_STRIPE_MAX || cf->stripe_unit == 0 ||
+	    (cf->stripe_policy != PA5_STRIPE_ALL && cf->stripe_policy != PA5_STRIPE_DATA) ||
+	    (cf->stripe_policy == PA5_STRIPE_DATA && cf->stripe_width < 3))
+		return -EIO;
+	if (cf->stripe_width > stripe.nroots)
+		return -ENOTSUP;
+	return 0;
+}
+
+unsigned pa5_stripe_root(const struct pa5_chunk_file *cf, uint64_t index)
+{
+	uint64_t u;
+
+	if (!(cf->flags & PA5_CHUNK_FLAG_STRIPE))
+		return 0;
+	u = index / cf->stripe_unit;
+	if (cf->stripe_policy == PA5_STRIPE_DATA)
+		return (u == 0) ? 0 : 1 + (u - 1) % (cf->stripe_width - 1);
+	return u % cf->stripe_width;
+}
+
+/* Cached entry for the stripe file of cf on root. Called with the lock
+ * held. */
+static struct stripe_fd *fd_find(const struct pa5_chunk_file *cf, unsigned root)
+{
+	size_t i;
+
+	for (i = 0; i < stripe.nfds; i++)
+	{
+		struct stripe_fd *e = &stripe.fds[i];
+		if (!e->dead && e->root == root && memcmp(e->file_id, cf->file_id, 16) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/* Closes and drops entry i. Called with the lock held. */
+static void fd_drop(size_t i)
+{
+	close(stripe.fds[i].fd);
+	stripe.fds[i] = stripe.fds[--stripe.nfds];
+}
+
+/* Makes room for one more entry, closing the least recently used idle one
+ * if the cache is full. Called with the lock held. */
+static struct stripe_fd *fd_slot(void)
+{
+	size_t i;
+
+	if (stripe.nfds >= MAX_CACHED)
+	{
+		size_t lru = stripe.nfds;
+		for (i = 0; i < stripe.nfds; i++)
+			if (stripe.fds[i].refs == 0 &&
+			    (lru == stripe.nfds || stripe.fds[i].used < stripe.fds[lru].used))
+				lru = i;
+		if (lru < stripe.nfds)
+			fd_drop(lru);
+	}
+	if (stripe.nfds == stripe.fds_cap)
+	{
+		size_t cap = stripe.fds_cap ? stripe.fds_cap * 2 : 16;
+		struct stripe_fd *fds = realloc(stripe.fds, cap * sizeof(*fds));
+		if (!fds)
+			return NULL;
+		stripe.fds = fds;
+		stripe.fds_cap = cap;
+	}
+	return &stripe.fds[stripe.nfds];
+}
+
+int pa5_stripe_get(const struct pa5_chunk_file *cf, unsigned root, int create)
+{
+	char name[NAME_LEN + 1];
+	struct stripe_fd *e;
+	int fd;
+
+	if (root == 0 || root >= stripe.nroots)
+		return -EINVAL;
+
+	pa5_mutex_lock(&stripe.lock, PA5_LOCK_STRIPE);
+	if ((e = fd_find(cf, root)) != NULL)
+	{
+		e->refs++;
+		e->used = ++stripe.tick;
+		pthread_mutex_unlock(&stripe.lock);
+		return e->fd;
+	}
+
+	stripe_name(cf, name);
+	int dirfd = stripe.roots[root].dirfd;
+	fd = openat(dirfd, name, O_RDWR);
+	if (fd == -1 && errno == ENOENT && create)
+	{
+		name[2] = '\0';
+		if (mkdirat(dirfd, name, 0700) == -1 && errno != EEXIST)
+		{
+			int res = -errno;
+			pthread_mutex_unlock(&stripe.lock);
+			return res;
+		}
+		name[2] = '/';
+		fd = openat(dirfd, name, O_RDWR | O_CREAT, 0600);
+		if (fd != -1)
+			stripe.creates++;
+	}
+	if (fd == -1)
+	{
+		int res = -errno;
+		pthread_mutex_unlock(&stripe.lock);
+		return res;
+	}
+	stripe.opens++;
+
+	if ((e = fd_slot()) == NULL)
+	{
+		close(fd);
+		pthread_mutex_unlock(&stripe.lock);
+		return -ENOMEM;
+	}
+	memcpy(e->file_id, cf->file_id, 16);
+	e->root = root;
+	e->fd = fd;
+	e->refs = 1;
+	e->dead = 0;
+	e->used = ++stripe.tick;
+	stripe.nfds++;
+	pthread_mutex_unlock(&stripe.lock);
+	return fd;
+}
+
+void pa5_stripe_put(int fd)
+{
+	size_t i;
+
+	pa5_mutex_lock(&stripe.lock, PA5_LOCK_STRIPE);
+	for (i = 0; i < stripe.nfds; i++)
+	{
+		if (stripe.fds[i].fd == fd)
+		{
+			if (--stripe.fds[i].refs == 0 && stripe.fds[i].dead)
+				fd_drop(i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stripe.lock);
+}
+
+int pa5_stripe_truncate(const struct pa5_chunk_file *cf, off_t backing_len)
+{
+	char name[NAME_LEN + 1];
+	unsigned r;
+	int res = 0;
+
+	if (!(cf->flags & PA5_CHUNK_FLAG_STRIPE))
+		return 0;
+
+	stripe_name(cf, name);
+	pa5_mutex_lock(&stripe.lock, PA5_LOCK_STRIPE);
+	for (r = 1; r < cf->stripe_width; r++)
+	{
+		int dirfd = stripe.roots[r].dirfd;
+		struct stat st;
+
+		if (backing_len <= PA5_CHUNK_HEADER)
+		{
+			struct stripe_fd *e = fd_find(cf, r);
+			if (e && e->refs == 0)
+				fd_drop(e - stripe.fds);
+			else if (e)
+				e->dead = 1;
+			if (unlinkat(dirfd, name, 0) == 0)
+				stripe.removes++;
+			else if (errno != ENOENT)
+				res = -errno;
+			continue;
+		}
+
+		int fd = openat(dirfd, name, O_RDWR);
+		if (fd == -1)
+		{
+			if (errno != ENOENT)
+				res = -errno;
+			continue;
+		}
+		if (fstat(fd, &st) == -1 ||
+		    (st.st_size > backing_len && ftruncate(fd, backing_len) == -1))
+			res = -errno;
+		close(fd);
+	}
+	pthread_mutex_unlock(&stripe.lock);
+	return res;
+}
+
+void pa5_stripe_statfs(struct statvfs *st)
+{
+	unsigned long fsids[PA5_STRIPE_MAX];
+	unsigned nfs = 1;
+	unsigned i, j;
+
+	/* Roots on a filesystem already counted add nothing. */
+	fsids[0] = st->f_fsid;
+	for (i = 1; i < stripe.nroots; i++)
+	{
+		struct statvfs sv;
+		if (statvfs(stripe.roots[i].path, &sv) == -1 || st->f_frsize == 0)
+			continue;
+		for (j = 0; j < nfs && fsids[j] != sv.f_fsid; j++)
+			;
+		if (j < nfs)
+			continue;
+		fsids[nfs++] = sv.f_fsid;
+		st->f_blocks += (unsigned long long)sv.f_blocks * sv.f_frsize / st->f_frsize;
+		st->f_bfree += (unsigned long long)sv.f_bfree * sv.f_frsize / st->f_frsize;
+		st->f_bavail += (unsigned long long)sv.f_bavail * sv.f_frsize / st->f_frsize;
+	}
+}
+
+int pa5_stripe_sync(const struct pa5_chunk_file *cf)
+{
+	unsigned r;
+	int res = 0;
+
+	if (!(cf->flags & PA5_CHUNK_FLAG_STRIPE))
+		return 0;
+
+	for (r = 1; r < cf->stripe_width; r++)
+	{
+		int fd = pa5_stripe_get(cf, r, 0);
+		if (fd == -ENOENT)
+			continue;
+		if (fd < 0)
+			return fd;
+		if (fdatasync(fd) == -1)
+			res = -errno;
+		pa5_stripe_put(fd);
+	}
+	return res;
+}
+
+int pa5_stripe_syncfs(void)
+{
+	unsigned i;
+	int res = 0;
+
+	for (i = 1; i < stripe.nroots; i++)
+		if (syncfs(stripe.roots[i].dirfd) == -1)
+			res = -errno;
+	return res;
+}
+
+void pa5_stripe_stats(FILE *out)
+{
+	unsigned i;
+
+	pa5_mutex_lock(&stripe.lock, PA5_LOCK_STRIPE);
+	fprintf(out, "roots %u\n", stripe.nroots);
+	if (stripe.nroots > 1)
+	{
+		fprintf(out, "policy %s\n", stripe.policy == PA5_STRIPE_DATA ? "data" : "all");
+		fprintf(out, "unit_bytes %llu\n", (unsigned long long)stripe.unit * PA5_CHUNK_SIZE);
+		fprintf(out, "open_files %zu\n", stripe.nfds);
+		fprintf(out, "opens %llu\n", (unsigned long long)stripe.opens);
+		fprintf(out, "creates %llu\n", (unsigned long long)stripe.creates);
+		fprintf(out, "removes %llu\n", (unsigned long long)stripe.removes);
+		for (i = 0; i < stripe.nroots; i++)
+		{
+			struct statvfs sv;
+			if (statvfs(stripe.roots[i].path, &sv) == 0)
+				fprintf(out, "root%u_free_bytes %llu\n", i,
+					(unsigned long long)sv.f_bavail * sv.f_frsize);
+		}
+	}
+	pthread_mutex_unlock(&stripe.lock);
+}
@@ -0,0 +1,111 @@
+/* pa5-stripe.h
+ * Striping of chunk files across several mirror roots.
+ *
+ * A mount can be given extra mirror roots, usually on other disks, next to
+ * its primary mirror directory. A chunk file (see pa5-chunk.h) created
+ * while striping is enabled has PA5_CHUNK_FLAG_STRIPE set and its stripe
+ * layout recorded in the authenticated part of its header:
+ *
+ *   6   stripe width, the number of roots the file is spread over
+ *   7   policy, PA5_STRIPE_ALL or PA5_STRIPE_DATA
+ *   12  stripe unit in chunks, little endian
+ *
+ * Chunk i belongs to stripe unit u = i / unit. Under PA5_STRIPE_ALL unit u
+ * goes to root u % width; under PA5_STRIPE_DATA the first unit stays on the
+ * primary root and the others rotate over the extra roots only, leaving the
+ * primary disk to metadata and small files. Either way a file no larger
+ * than one unit never leaves the primary root.
+ *
+ * The file in the primary mirror keeps its header, the chunks of root 0 and
+ * the full backing length, so sizes are still read off the primary file
+ * alone. Root r > 0 holds the file's other chunks in a sparse stripe file at
+ * PA5_STRIPE_DIR/xx/<file id in hex> with every slot at the same offset as
+ * in the primary file. Stripe files are named by the file id, so renames
+ * and hard links never touch them; they are removed with the last link.
+ *
+ * Each extra root carries a marker tying it to the volume and to its place
+ * in the root list, so roots given in another order, or the roots of
+ * another volume, are refused at mount instead of serving wrong chunks.
+ *
+ * All functions return 0 (or a file descriptor) on success and -errno on
+ * error.
+ */
+
+#ifndef PA5_STRIPE_H
+#define PA5_STRIPE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/statvfs.h>
+
+#include "pa5-chunk.h"
+
+#define PA5_STRIPE_DIR ".pa5-stripe"
+#define PA5_STRIPE_MAX 16                    /* Roots, the primary included. */
+#define PA5_STRIPE_DEFAULT_UNIT (1 << 20)    /* Bytes of plaintext. */
+#define PA5_STRIPE_MAX_UNIT (1ULL << 40)     /* Keeps the unit in chunks within 32 bits. */
+
+enum pa5_stripe_policy
+{
+	PA5_STRIPE_ALL = 1,   /* Round robin over every root. */
+	PA5_STRIPE_DATA = 2   /* First unit on the primary, the rest on the others. */
+};
+
+/* Returns the policy named all or data, or -EINVAL. */
+int pa5_stripe_parse_policy(const char *name);
+
+/* int pa5_stripe_open(const char *rootdir, const char *roots, const struct pa5_keys *keys,
+ *                     int policy, size_t unit)
+ * Purpose: Use the colon separated directories in roots as extra mirror
+ *          roots after rootdir, marking them for the volume on first use.
+ *          New chunk files are striped over all of them with the given
+ *          policy, unit bytes (rounded to whole chunks) at a time.
+ * Return: 0 on success, -EINVAL if a root belongs elsewhere
+ */
+int pa5_stripe_open(const char *rootdir, const char *roots, const struct pa5_keys *keys,
+		    int policy, size_t unit);
+
+/* Closes every stripe file and forgets the roots. */
+void pa5_stripe_close(void);
+
+/* Number of roots the mount has, 1 without striping, and whether new
+ * chunk files are striped. */
+unsigned pa5_stripe_roots(void);
+int pa5_stripe_enabled(void);
+
+/* Fills in the stripe fields of a new chunk header. */
+void pa5_stripe_header(unsigned char hdr[PA5_CHUNK_HEADER]);
+
+/* Checks the stripe fields of a header and copies them to cf. Returns
+ * -ENOTSUP if the mount lacks roots the file is spread over. */
+int pa5_stripe_check(const unsigned char hdr[PA5_CHUNK_HEADER], struct pa5_chunk_file *cf);
+
+/* Root that holds chunk index of cf. */
+unsigned pa5_stripe_root(const struct pa5_chunk_file *cf, uint64_t index);
+
+/* int pa5_stripe_get(const struct pa5_chunk_file *cf, unsigned root, int create)
+ * Purpose: Take a reference on the stripe file of cf on root (> 0), opening
+ *          it, or with create set creating it, if needed. Descriptors stay
+ *          cached after pa5_stripe_put() for the next batch of the file.
+ * Return: the descriptor, -ENOENT if the file is missing and create is 0
+ */
+int pa5_stripe_get(const struct pa5_chunk_file *cf, unsigned root, int create);
+void pa5_stripe_put(int fd);
+
+/* Cuts the stripe files of cf to backing_len bytes, removing them when no
+ * chunk is left in them. */
+int pa5_stripe_truncate(const struct pa5_chunk_file *cf, off_t backing_len);
+
+/* Adds the space of the extra roots to the primary root's statfs. */
+void pa5_stripe_statfs(struct statvfs *st);
+
+/* Flushes the stripe files of cf to disk. */
+int pa5_stripe_sync(const struct pa5_chunk_file *cf);
+
+/* Flushes the filesystems of the extra roots to disk. */
+int pa5_stripe_syncfs(void);
+
+/* Stats section with the roots, their free space and the stripe files. */
+void pa5_stripe_stats(FILE *out);
+
+#endif
@@ -0,0 +1,1132 @@
+/* pa5-tier.c
+ * Fast cache tier for the chunks of chunk files.
+ *
+ * The placement index and the table of open tiered files share one lock,
+ * held only for lookups and updates. Tier and mirror I/O happens outside
+ * it. Each open file has a reader-writer lock: batches hold it shared
+ * while they use the tier file, and the worker and truncation hold it
+ * exclusively while they move or drop chunks of the file. Chunks of files
+ * that are not open are never in use, so the worker drops those under the
+ * index lock alone.
+ *
+ * A slot is written to the tier file before its entry goes in, and written
+ * back and synced to the mirror before its entry turns clean, so the index
+ * only ever names slots that are in place.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-tier.h"
+#include "pa5-stripe.h"
+#include "pa5-sched.h"
+#include "pa5-log.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#define INDEX_MAGIC "PA5T"
+#define INDEX_HEADER 4096
+#define INDEX_MIN_BUCKETS (1 << 12)
+#define NAME_LEN 35             /* "xx/" and 32 hex digits. */
+#define FILE_BUCKETS 256
+#define SKETCH_ROWS 4
+#define SKETCH_WIDTH (1 << 16)
+#define SKETCH_AGE (SKETCH_WIDTH * 4)   /* Misses between halvings. */
+#define SWEEP_STEP 4096         /* Buckets the hand passes per idle round. */
+#define VICTIMS 64
+#define MAX_REF 3
+#define WORKER_INTERVAL 1       /* Seconds between idle rounds. */
+#define FLUSH_BATCH 64
+
+enum { STATE_EMPTY, STATE_CLEAN, STATE_DIRTY };
+
+/* One index bucket. state == STATE_EMPTY marks it empty. */
+struct bucket
+{
+	unsigned char file_id[16];
+	uint64_t index;
+	uint32_t chunk_size;
+	unsigned char state;
+	unsigned char ref;           /* Clock counter, bumped on use. */
+	unsigned char reserved[2];
+};
+
+/* An open tiered file, shared by every handle on it. */
+struct pa5_tier_file
+{
+	struct pa5_tier_file *next;
+	struct pa5_chunk_file cf;    /* With a descriptor of our own. */
+	int tier_fd;                 /* -1 until first used. */
+	unsigned refs;
+	uint64_t dirty;              /* Dirty chunks written since it was opened. */
+	pthread_rwlock_t lock;
+};
+
+struct victim
+{
+	unsigned char file_id[16];
+	uint64_t index;
+	uint32_t chunk_size;
+	unsigned char state;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t worker;
+	int ready;
+	int running;
+	int dirfd;
+	unsigned char mark[32];
+
+	int index_fd;
+	unsigned char *map;          /* Header, then the buckets. */
+	size_t map_len;
+	struct bucket *buckets;
+	uint64_t nbuckets;           /* Power of two. */
+	uint64_t count;
+	uint64_t ndirty;
+	uint64_t capacity;           /* Entries, in default sized slots. */
+	uint64_t hand;
+
+	struct pa5_tier_file *files[FILE_BUCKETS];
+	size_t nfiles;
+
+	unsigned char sketch[SKETCH_ROWS][SKETCH_WIDTH];
+	uint64_t sketch_adds;
+
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long promotions;
+	unsigned long long writes;
+	unsigned long long demotions;
+	unsigned long long evictions;
+} tier = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+	   .dirfd = -1, .index_fd = -1 };
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+	int i;
+	for (i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+	for (i = 7; i >= 0; i--)
+		v = v << 8 | p[i];
+	return v;
+}
+
+static off_t slot_offset(uint32_t chunk_size, uint64_t index)
+{
+	return PA5_CHUNK_HEADER + (off_t)index * (PA5_CHUNK_SLOT_HEADER + chunk_size);
+}
+
+/* File ids are random, so their first bytes mixed with the index do. */
+static uint64_t key_hash(const unsigned char *file_id, uint64_t index)
+{
+	uint64_t h = get_le64(file_id) ^ index * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 31;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 29;
+	return h;
+}
+
+/* Name of the tier file of a file id below PA5_TIER_DIR. */
+static void tier_name(const unsigned char *file_id, char name[NAME_LEN + 1])
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	name[0] = hex[file_id[0] >> 4];
+	name[1] = hex[file_id[0] & 15];
+	name[2] = '/';
+	for (i = 0; i < 16; i++)
+	{
+		name[3 + 2 * i] = hex[file_id[i] >> 4];
+		name[4 + 2 * i] = hex[file_id[i] & 15];
+	}
+	name[NAME_LEN] = '\0';
+}
+
+static int tier_file_open(const unsigned char *file_id, int create)
+{
+	char name[NAME_LEN + 1];
+	int fd;
+
+	tier_name(file_id, name);
+	fd = openat(tier.dirfd, name, O_RDWR | O_CLOEXEC);
+	if (fd == -1 && errno == ENOENT && create)
+	{
+		name[2] = '\0';
+		if (mkdirat(tier.dirfd, name, 0700) == -1 && errno != EEXIST)
+			return -errno;
+		name[2] = '/';
+		fd = openat(tier.dirfd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	}
+	return (fd == -1) ? -errno : fd;
+}
+
+/* Gives a slot's space in a tier file back to the filesystem. */
+static void punch_slot(int fd, uint32_t chunk_size, uint64_t index)
+{
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      slot_offset(chunk_size, index), PA5_CHUNK_SLOT_HEADER + chunk_size) == -1)
+	{
+		/* Not every filesystem can; the slot is dead either way. */
+	}
+}
+
+/* ---- Frequency sketch ---- */
+
+/* Counts one miss of the chunk hashed to h and returns the estimated
+ * number of misses within the aging window, this one included. Called
+ * with the lock held. */
+static unsigned sketch_add(uint64_t h)
+{
+	unsigned est = 255;
+	int r;
+
+	for (r = 0; r < SKETCH_ROWS; r++)
+	{
+		unsigned char *c = &tier.sketch[r][(h >> (16 * r)) & (SKETCH_WIDTH - 1)];
+		if (*c < 255)
+			(*c)++;
+		if (*c < est)
+			est = *c;
+	}
+
+	if (++tier.sketch_adds >= SKETCH_AGE)
+	{
+		int i;
+		for (r = 0; r < SKETCH_ROWS; r++)
+			for (i = 0; i < SKETCH_WIDTH; i++)
+				tier.sketch[r][i] >>= 1;
+		tier.sketch_adds = 0;
+	}
+	return est;
+}
+
+/* ---- Index ---- */
+
+/* Returns the bucket of a chunk, or NULL. Called with the lock held. */
+static struct bucket *index_find(const unsigned char *file_id, uint64_t index)
+{
+	uint64_t mask = tier.nbuckets - 1;
+	uint64_t i = key_hash(file_id, index) & mask;
+
+	for (;; i = (i + 1) & mask)
+	{
+		struct bucket *b = &tier.buckets[i];
+		if (b->state == STATE_EMPTY)
+			return NULL;
+		if (b->index == index && memcmp(b->file_id, file_id, 16) == 0)
+			return b;
+	}
+}
+
+static struct bucket *index_place(struct bucket *buckets, uint64_t nbuckets,
+				  const struct bucket *b)
+{
+	uint64_t i = key_hash(b->file_id, b->index) & (nbuckets - 1);
+
+	while (buckets[i].state != STATE_EMPTY)
+		i = (i + 1) & (nbuckets - 1);
+	buckets[i] = *b;
+	return &buckets[i];
+}
+
+/* Empties a bucket, shifting later members of its probe run back so that
+ * lookups need no tombstones. Called with the lock held. */
+static void index_remove(struct bucket *b)
+{
+	uint64_t mask = tier.nbuckets - 1;
+	uint64_t hole = b - tier.buckets;
+	uint64_t i = hole;
+
+	if (b->state == STATE_DIRTY)
+	{
+		tier.ndirty--;
+		pa5_queue_depth(PA5_QUEUE_TIER, tier.ndirty);
+	}
+	tier.count--;
+	for (;;)
+	{
+		i = (i + 1) & mask;
+		struct bucket *next = &tier.buckets[i];
+		if (next->state == STATE_EMPTY)
+			break;
+		uint64_t home = key_hash(next->file_id, next->index) & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask))
+		{
+			tier.buckets[hole] = *next;
+			hole = i;
+		}
+	}
+	memset(&tier.buckets[hole], 0, sizeof(struct bucket));
+}
+
+/* Creates an empty index of nbuckets at name and maps it. */
+static int index_create(const char *name, uint64_t nbuckets, int *fdp, unsigned char **mapp,
+			size_t *lenp)
+{
+	size_t len = INDEX_HEADER + nbuckets * sizeof(struct bucket);
+	unsigned char *map;
+	int fd = openat(tier.dirfd, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return -errno;
+	if (ftruncate(fd, len) == -1 ||
+	    (map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		int res = -errno;
+		close(fd);
+		return res;
+	}
+
+	memcpy(map, INDEX_MAGIC, 4);
+	map[4] = PA5_TIER_VERSION;
+	put_le64(map + 8, nbuckets);
+	memcpy(map + 32, tier.mark, 32);
+	*fdp = fd;
+	*mapp = map;
+	*lenp = len;
+	return 0;
+}
+
+/* Rehashes the index into a new file of nbuckets and renames it over the
+ * old one. Called with the lock held. */
+static int index_resize(uint64_t nbuckets)
+{
+	unsigned char *map = NULL;
+	size_t len = 0;
+	uint64_t i;
+	int fd = -1;
+	int res;
+
+	if ((res = index_create("index.new", nbuckets, &fd, &map, &len)) < 0)
+		return res;
+
+	struct bucket *buckets = (struct bucket *)(map + INDEX_HEADER);
+	for (i = 0; i < tier.nbuckets; i++)
+		if (tier.buckets[i].state != STATE_EMPTY)
+			index_place(buckets, nbuckets, &tier.buckets[i]);
+
+	if (msync(map, len, MS_SYNC) == -1 ||
+	    renameat(tier.dirfd, "index.new", tier.dirfd, "index") == -1)
+	{
+		res = -errno;
+		munmap(map, len);
+		close(fd);
+		unlinkat(tier.dirfd, "index.new", 0);
+		return res;
+	}
+
+	if (tier.map)
+	{
+		munmap(tier.map, tier.map_len);
+		close(tier.index_fd);
+	}
+	tier.index_fd = fd;
+	tier.map = map;
+	tier.map_len = len;
+	tier.buckets = buckets;
+	tier.nbuckets = nbuckets;
+	return 0;
+}
+
+/* Adds a chunk, growing the index when it gets three quarters full.
+ * Called with the lock held. */
+static struct bucket *index_insert(const struct pa5_chunk_file *cf, uint64_t index, int state)
+{
+	struct bucket b;
+
+	if ((tier.count + 1) * 4 > tier.nbuckets * 3 && index_resize(tier.nbuckets * 2) < 0)
+		return NULL;
+
+	memset(&b, 0, sizeof(b));
+	memcpy(b.file_id, cf->file_id, 16);
+	b.index = index;
+	b.chunk_size = cf->chunk_size;
+	b.state = state;
+	b.ref = 1;
+	tier.count++;
+	if (state == STATE_DIRTY)
+	{
+		tier.ndirty++;
+		pa5_queue_depth(PA5_QUEUE_TIER, tier.ndirty);
+	}
+	return index_place(tier.buckets, tier.nbuckets, &b);
+}
+
+static int index_open(uint64_t want)
+{
+	struct stat st;
+	unsigned char *map;
+	uint64_t i;
+	int fd = openat(tier.dirfd, "index", O_RDWR | O_CLOEXEC);
+
+	if (fd == -1 && errno == ENOENT)
+		return index_resize(want);
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &st) == -1 || st.st_size < INDEX_HEADER ||
+	    (map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return -EIO;
+	}
+
+	uint64_t nbuckets = get_le64(map + 8);
+	if (memcmp(map, INDEX_MAGIC, 4) != 0 || map[4] != PA5_TIER_VERSION ||
+	    nbuckets == 0 || (nbuckets & (nbuckets - 1)) != 0 ||
+	    (uint64_t)st.st_size != INDEX_HEADER + nbuckets * sizeof(struct bucket))
+	{
+		munmap(map, st.st_size);
+		close(fd);
+		return -EIO;
+	}
+	if (CRYPTO_memcmp(map + 32, tier.mark, 32) != 0)
+	{
+		munmap(map, st.st_size);
+		close(fd);
+		return -EINVAL;
+	}
+
+	tier.index_fd = fd;
+	tier.map = map;
+	tier.map_len = st.st_size;
+	tier.buckets = (struct bucket *)(map + INDEX_HEADER);
+	tier.nbuckets = nbuckets;
+
+	/* Counts are not kept on disk, so a crash cannot leave them wrong. */
+	for (i = 0; i < nbuckets; i++)
+	{
+		if (tier.buckets[i].state == STATE_DIRTY)
+			tier.ndirty++;
+		if (tier.buckets[i].state != STATE_EMPTY)
+			tier.count++;
+	}
+	if (nbuckets < want && tier.count * 4 < want * 3)
+		return index_resize(want);
+	return 0;
+}
+
+/* ---- Open files ---- */
+
+static struct pa5_tier_file **file_slot(const unsigned char *file_id)
+{
+	return &tier.files[file_id[0] ^ file_id[1]];
+}
+
+/* Called with the lock held. */
+static struct pa5_tier_file *file_find(const unsigned char *file_id)
+{
+	struct pa5_tier_file *tf;
+
+	for (tf = *file_slot(file_id); tf; tf = tf->next)
+		if (memcmp(tf->cf.file_id, file_id, 16) == 0)
+			return tf;
+	return NULL;
+}
+
+static int writable(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	return flags != -1 && (flags & O_ACCMODE) != O_RDONLY;
+}
+
+/* Tier file of tf, opened on first use. Called with the lock held. */
+static int file_tier_fd(struct pa5_tier_file *tf, int create)
+{
+	if (tf->tier_fd < 0)
+	{
+		int fd = tier_file_open(tf->cf.file_id, create);
+		if (fd < 0)
+			return fd;
+		tf->tier_fd = fd;
+	}
+	return tf->tier_fd;
+}
+
+/* Writes the dirty chunks indexes[0..n) of tf back to the mirror and marks
+ * them clean. Called with tf locked exclusively and the index lock free. */
+static int flush_chunks(struct pa5_tier_file *tf, const uint64_t *indexes, int n)
+{
+	const struct pa5_chunk_file *cf = &tf->cf;
+	int fds[PA5_STRIPE_MAX];
+	int done[FLUSH_BATCH];
+	uint64_t cs = cf->chunk_size;
+	unsigned char *buf;
+	off_t plain;
+	int tfd;
+	int res;
+	int i;
+
+	if ((res = pa5_chunk_size(cf, &plain)) < 0)
+		return res;
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	tfd = file_tier_fd(tf, 0);
+	pthread_mutex_unlock(&tier.lock);
+	if (tfd < 0)
+		return (tfd == -ENOENT) ? -EIO : tfd;
+	if ((buf = malloc(PA5_CHUNK_SLOT_HEADER + cs)) == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < PA5_STRIPE_MAX; i++)
+		fds[i] = -1;
+	fds[0] = cf->fd;
+	for (i = 0; i < n; i++)
+	{
+		uint64_t index = indexes[i];
+		off_t off = slot_offset(cs, index);
+		unsigned root = pa5_stripe_root(cf, index);
+
+		/* Chunks past the end go with the next truncation. */
+		done[i] = 0;
+		if ((off_t)(index * cs) >= plain)
+			continue;
+		size_t len = PA5_CHUNK_SLOT_HEADER +
+			     ((plain - (off_t)(index * cs) < (off_t)cs) ? plain - index * cs : cs);
+
+		if (fds[root] < 0 && (fds[root] = pa5_stripe_get(cf, root, 1)) < 0)
+		{
+			res = fds[root];
+			break;
+		}
+		if (pread(tfd, buf, len, off) != (ssize_t)len ||
+		    pwrite(fds[root], buf, len, off) != (ssize_t)len)
+		{
+			res = -EIO;
+			break;
+		}
+		done[i] = 1;
+	}
+	for (i = 0; i < PA5_STRIPE_MAX; i++)
+	{
+		if (fds[i] >= 0 && fdatasync(fds[i]) == -1 && res == 0)
+			res = -errno;
+		if (i > 0 && fds[i] >= 0)
+			pa5_stripe_put(fds[i]);
+	}
+	free(buf);
+	if (res < 0)
+		return res;
+
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	for (i = 0; i < n; i++)
+	{
+		struct bucket *b;
+		if (done[i] && (b = index_find(cf->file_id, indexes[i])) && b->state == STATE_DIRTY)
+		{
+			b->state = STATE_CLEAN;
+			tier.ndirty--;
+			pa5_queue_depth(PA5_QUEUE_TIER, tier.ndirty);
+			tier.demotions++;
+			if (tf->dirty > 0)
+				tf->dirty--;
+		}
+	}
+	pthread_mutex_unlock(&tier.lock);
+	return 0;
+}
+
+/* Writes back every dirty chunk of tf. Called like flush_chunks(). */
+static int flush_file(struct pa5_tier_file *tf)
+{
+	uint64_t indexes[FLUSH_BATCH];
+	uint64_t cs = tf->cf.chunk_size;
+	uint64_t index, nchunks;
+	off_t plain;
+	int res;
+
+	if ((res = pa5_chunk_size(&tf->cf, &plain)) < 0)
+		return res;
+	nchunks = (plain + cs - 1) / cs;
+
+	for (index = 0; index < nchunks;)
+	{
+		int n = 0;
+		pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+		for (; index < nchunks && n < FLUSH_BATCH; index++)
+		{
+			struct bucket *b = index_find(tf->cf.file_id, index);
+			if (b && b->state == STATE_DIRTY)
+				indexes[n++] = index;
+		}
+		pthread_mutex_unlock(&tier.lock);
+		if (n > 0 && (res = flush_chunks(tf, indexes, n)) < 0)
+			return res;
+	}
+	return 0;
+}
+
+/* Drops a reference on tf, writing its dirty chunks back first if it is
+ * the last one. */
+static void file_put(struct pa5_tier_file *tf)
+{
+	int res;
+
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	if (tf->refs == 1 && tf->dirty > 0 && tier.ready)
+	{
+		pthread_mutex_unlock(&tier.lock);
+		pa5_sched_enter();
+		pa5_rwlock_wrlock(&tf->lock, PA5_LOCK_TIER_FILE);
+		if ((res = flush_file(tf)) < 0)
+			pa5_error("Could not write back tiered chunks: %d.", res);
+		pthread_rwlock_unlock(&tf->lock);
+		pa5_sched_leave();
+		pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	}
+	if (--tf->refs == 0)
+	{
+		struct pa5_tier_file **p = file_slot(tf->cf.file_id);
+		while (*p != tf)
+			p = &(*p)->next;
+		*p = tf->next;
+		tier.nfiles--;
+		close(tf->cf.fd);
+		if (tf->tier_fd >= 0)
+			close(tf->tier_fd);
+		pthread_rwlock_destroy(&tf->lock);
+		free(tf);
+	}
+	pthread_mutex_unlock(&tier.lock);
+}
+
+/* ---- Worker ---- */
+
+static uint64_t high_mark(void)
+{
+	return tier.capacity - tier.capacity / 16;
+}
+
+static uint64_t low_mark(void)
+{
+	return tier.capacity - tier.capacity / 8;
+}
+
+/* Writes back or drops one cold chunk, returning 1 if it did either.
+ * Called with the lock held, which it lets go of meanwhile. */
+static int demote(const struct victim *v, int evict)
+{
+	struct pa5_tier_file *tf = file_find(v->file_id);
+	struct bucket *b;
+	int moved = 0;
+	int res;
+
+	if (!tf)
+	{
+		/* Nothing can be using it; dirty ones wait for the file to open. */
+		if (!evict || (b = index_find(v->file_id, v->index)) == NULL ||
+		    b->state != STATE_CLEAN || b->ref)
+			return 0;
+		index_remove(b);
+		tier.evictions++;
+		int fd = tier_file_open(v->file_id, 0);
+		if (fd >= 0)
+		{
+			punch_slot(fd, v->chunk_size, v->index);
+			close(fd);
+		}
+		return 1;
+	}
+
+	/* The slot is taken before any lock, since slot holders take them. */
+	tf->refs++;
+	pthread_mutex_unlock(&tier.lock);
+	pa5_sched_enter();
+	pa5_rwlock_wrlock(&tf->lock, PA5_LOCK_TIER_FILE);
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+
+	b = index_find(v->file_id, v->index);
+	if (b && !b->ref && b->state == STATE_DIRTY)
+	{
+		pthread_mutex_unlock(&tier.lock);
+		if ((res = flush_chunks(tf, &v->index, 1)) < 0)
+			pa5_error("Could not write back a tiered chunk: %d.", res);
+		moved = (res == 0);
+		pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+		b = index_find(v->file_id, v->index);
+	}
+	if (b && !b->ref && b->state == STATE_CLEAN && evict && tier.count > low_mark())
+	{
+		index_remove(b);
+		tier.evictions++;
+		if (file_tier_fd(tf, 0) >= 0)
+			punch_slot(tf->tier_fd, v->chunk_size, v->index);
+		moved = 1;
+	}
+
+	pthread_mutex_unlock(&tier.lock);
+	pthread_rwlock_unlock(&tf->lock);
+	file_put(tf);
+	pa5_sched_leave();
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	return moved;
+}
+
+/* Moves the clock hand on, aging the chunks it passes. Cold dirty chunks
+ * are written back; cold clean ones are dropped while the tier is over its
+ * high mark. Returns the number of chunks moved. Called with the lock
+ * held. */
+static int sweep(void)
+{
+	struct victim victims[VICTIMS];
+	int evict = tier.count > high_mark();
+	uint64_t limit = evict ? tier.nbuckets : SWEEP_STEP;
+	uint64_t scanned;
+	int moved = 0;
+	int n = 0;
+	int i;
+
+	for (scanned = 0; scanned < limit && n < VICTIMS; scanned++)
+	{
+		struct bucket *b = &tier.buckets[tier.hand];
+		tier.hand = (tier.hand + 1) & (tier.nbuckets - 1);
+		if (b->state == STATE_EMPTY)
+			continue;
+		if (b->ref)
+		{
+			b->ref--;
+			continue;
+		}
+		if (b->state == STATE_CLEAN && !evict)
+			continue;
+		memcpy(victims[n].file_id, b->file_id, 16);
+		victims[n].index = b->index;
+		victims[n].chunk_size = b->chunk_size;
+		victims[n].state = b->state;
+		n++;
+	}
+
+	for (i = 0; i < n && tier.running; i++)
+		moved += demote(&victims[i], evict && tier.count > low_mark());
+	return moved;
+}
+
+static void *tier_worker(void *arg)
+{
+	(void) arg;
+
+	pa5_sched_set_class(PA5_SCHED_WRITEBACK);
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	while (tier.running)
+	{
+		/* Keep going while over the mark, unless nothing can move. */
+		if (sweep() > 0 && tier.count > high_mark())
+			continue;
+
+		struct timespec until = { time(NULL) + WORKER_INTERVAL, 0 };
+		pthread_cond_timedwait(&tier.wake, &tier.lock, &until);
+	}
+	pthread_mutex_unlock(&tier.lock);
+	return NULL;
+}
+
+/* ---- Public interface ---- */
+
+int pa5_tier_open(const char *dir, const struct pa5_keys *keys, uint64_t size)
+{
+	char path[PATH_MAX];
+	unsigned int len = 32;
+	uint64_t want = INDEX_MIN_BUCKETS;
+	int res;
+
+	tier.capacity = size / (PA5_CHUNK_SLOT_HEADER + PA5_CHUNK_SIZE);
+	if (tier.capacity == 0)
+		return -EINVAL;
+	while (want < tier.capacity * 2)
+		want *= 2;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, PA5_TIER_DIR);
+	if ((mkdir(path, 0700) == -1 && errno != EEXIST) ||
+	    (tier.dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return -errno;
+	HMAC(EVP_sha256(), keys->header_mac, 32, (const unsigned char *)"pa5 tier index", 14,
+	     tier.mark, &len);
+
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	res = index_open(want);
+	pthread_mutex_unlock(&tier.lock);
+	if (res < 0)
+	{
+		pa5_tier_close();
+		return res;
+	}
+
+	if (tier.ndirty > 0)
+		pa5_info("Cache tier holds %llu chunks not yet written back.",
+			 (unsigned long long)tier.ndirty);
+	tier.ready = 1;
+	return 0;
+}
+
+int pa5_tier_start(void)
+{
+	int res;
+
+	if (!tier.ready)
+		return 0;
+	tier.running = 1;
+	if ((res = pthread_create(&tier.worker, NULL, tier_worker, NULL)) != 0)
+	{
+		tier.running = 0;
+		return -res;
+	}
+	return 0;
+}
+
+void pa5_tier_close(void)
+{
+	int i;
+	int res;
+
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	if (tier.running)
+	{
+		tier.running = 0;
+		pthread_cond_signal(&tier.wake);
+		pthread_mutex_unlock(&tier.lock);
+		pthread_join(tier.worker, NULL);
+		pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	}
+
+	/* Files still open at unmount keep their entries, which the next
+	 * mount serves from. */
+	if (tier.ready)
+	{
+		for (i = 0; i < FILE_BUCKETS; i++)
+		{
+			struct pa5_tier_file *tf;
+			for (tf = tier.files[i]; tf; tf = tf->next)
+			{
+				if (tf->dirty == 0)
+					continue;
+				pthread_mutex_unlock(&tier.lock);
+				pa5_rwlock_wrlock(&tf->lock, PA5_LOCK_TIER_FILE);
+				if ((res = flush_file(tf)) < 0)
+					pa5_error("Could not write back tiered chunks: %d.", res);
+				pthread_rwlock_unlock(&tf->lock);
+				pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+			}
+		}
+		tier.ready = 0;
+	}
+
+	if (tier.map)
+	{
+		msync(tier.map, tier.map_len, MS_SYNC);
+		munmap(tier.map, tier.map_len);
+		close(tier.index_fd);
+	}
+	tier.map = NULL;
+	tier.buckets = NULL;
+	tier.index_fd = -1;
+	tier.nbuckets = tier.count = tier.ndirty = 0;
+	if (tier.dirfd != -1)
+		close(tier.dirfd);
+	tier.dirfd = -1;
+	pthread_mutex_unlock(&tier.lock);
+}
+
+int pa5_tier_ready(void)
+{
+	return tier.ready;
+}
+
+void pa5_tier_attach(struct pa5_chunk_file *cf)
+{
+	struct pa5_tier_file *tf;
+
+	cf->tier = NULL;
+	if (!tier.ready || (cf->flags & PA5_CHUNK_FLAG_DEDUP))
+		return;
+
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	if ((tf = file_find(cf->file_id)) == NULL)
+	{
+		if ((tf = calloc(1, sizeof(*tf))) == NULL)
+			goto out;
+		tf->cf = *cf;
+		tf->cf.tier = tf;
+		if ((tf->cf.fd = fcntl(cf->fd, F_DUPFD_CLOEXEC, 0)) == -1)
+		{
+			free(tf);
+			goto out;
+		}
+		tf->tier_fd = -1;
+		pthread_rwlock_init(&tf->lock, NULL);
+		tf->next = *file_slot(cf->file_id);
+		*file_slot(cf->file_id) = tf;
+		tier.nfiles++;
+	}
+	else if (!writable(tf->cf.fd) && writable(cf->fd))
+	{
+		/* Write-back needs a descriptor that can write. */
+		int fd = fcntl(cf->fd, F_DUPFD_CLOEXEC, 0);
+		if (fd != -1)
+		{
+			close(tf->cf.fd);
+			tf->cf.fd = fd;
+		}
+	}
+	tf->refs++;
+	cf->tier = tf;
+out:
+	pthread_mutex_unlock(&tier.lock);
+}
+
+void pa5_tier_detach(struct pa5_chunk_file *cf)
+{
+	struct pa5_tier_file *tf = cf->tier;
+
+	if (!tf)
+		return;
+	cf->tier = NULL;
+	file_put(tf);
+}
+
+void pa5_tier_begin(const struct pa5_chunk_file *cf)
+{
+	if (cf->tier)
+		pa5_rwlock_rdlock(&cf->tier->lock, PA5_LOCK_TIER_FILE);
+}
+
+void pa5_tier_end(const struct pa5_chunk_file *cf)
+{
+	if (cf->tier)
+		pthread_rwlock_unlock(&cf->tier->lock);
+}
+
+void pa5_tier_lookup(const struct pa5_chunk_file *cf, uint64_t first, int n,
+		     const unsigned char *cached, unsigned char *where)
+{
+	int i;
+
+	memset(where, PA5_TIER_MISS, n);
+	if (!cf->tier)
+		return;
+
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	for (i = 0; i < n; i++)
+	{
+		if (cached && cached[i])
+			continue;
+		struct bucket *b = index_find(cf->file_id, first + i);
+		if (b)
+		{
+			where[i] = PA5_TIER_HIT;
+			if (b->ref < MAX_REF)
+				b->ref++;
+			if (cached)
+				tier.hits++;
+		}
+		else if (cached)
+		{
+			tier.misses++;
+			if (sketch_add(key_hash(cf->file_id, first + i)) >= PA5_TIER_PROMOTE &&
+			    tier.count < tier.capacity)
+				where[i] = PA5_TIER_HOT;
+		}
+	}
+	pthread_mutex_unlock(&tier.lock);
+}
+
+void pa5_tier_place(const struct pa5_chunk_file *cf, uint64_t first, int n,
+		    unsigned char *where)
+{
+	uint64_t room;
+	int i;
+
+	memset(where, PA5_TIER_MISS, n);
+	if (!cf->tier)
+		return;
+
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	room = (tier.count < tier.capacity) ? tier.capacity - tier.count : 0;
+	for (i = 0; i < n; i++)
+	{
+		/* A chunk already in the tier must be rewritten there. */
+		if (index_find(cf->file_id, first + i))
+			where[i] = PA5_TIER_HIT;
+		else if (room > 0)
+		{
+			where[i] = PA5_TIER_HIT;
+			room--;
+		}
+	}
+	if (room == 0)
+		pthread_cond_signal(&tier.wake);
+	pthread_mutex_unlock(&tier.lock);
+}
+
+void pa5_tier_written(const struct pa5_chunk_file *cf, uint64_t first, int n,
+		      const unsigned char *where)
+{
+	int i;
+
+	if (!cf->tier)
+		return;
+
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	for (i = 0; i < n; i++)
+	{
+		if (where[i] != PA5_TIER_HIT)
+			continue;
+		struct bucket *b = index_find(cf->file_id, first + i);
+		if (!b)
+			b = index_insert(cf, first + i, STATE_DIRTY);
+		else if (b->state != STATE_DIRTY)
+		{
+			b->state = STATE_DIRTY;
+			tier.ndirty++;
+			pa5_queue_depth(PA5_QUEUE_TIER, tier.ndirty);
+		}
+		else
+			continue;
+		if (!b)
+		{
+			pa5_error("Could not index a tiered chunk.");
+			continue;
+		}
+		cf->tier->dirty++;
+		tier.writes++;
+	}
+	pthread_mutex_unlock(&tier.lock);
+}
+
+void pa5_tier_promoted(const struct pa5_chunk_file *cf, uint64_t index)
+{
+	if (!cf->tier)
+		return;
+
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	if (!index_find(cf->file_id, index) && index_insert(cf, index, STATE_CLEAN))
+		tier.promotions++;
+	pthread_mutex_unlock(&tier.lock);
+}
+
+int pa5_tier_fd(const struct pa5_chunk_file *cf, int create)
+{
+	int fd;
+
+	if (!cf->tier)
+		return -ENOENT;
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	fd = file_tier_fd(cf->tier, create);
+	pthread_mutex_unlock(&tier.lock);
+	return fd;
+}
+
+int pa5_tier_truncate(const struct pa5_chunk_file *cf, off_t old_size, off_t new_size,
+		      off_t backing_len)
+{
+	struct pa5_tier_file *tf = cf->tier;
+	uint64_t cs = cf->chunk_size;
+	uint64_t index;
+	struct stat st;
+	int res = 0;
+
+	if (!tf)
+		return 0;
+
+	pa5_rwlock_wrlock(&tf->lock, PA5_LOCK_TIER_FILE);
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	for (index = (new_size + cs - 1) / cs; index < (old_size + cs - 1) / cs; index++)
+	{
+		struct bucket *b = index_find(cf->file_id, index);
+		if (!b)
+			continue;
+		if (b->state == STATE_DIRTY && tf->dirty > 0)
+			tf->dirty--;
+		index_remove(b);
+	}
+
+	if (backing_len <= PA5_CHUNK_HEADER)
+	{
+		char name[NAME_LEN + 1];
+		if (tf->tier_fd >= 0)
+			close(tf->tier_fd);
+		tf->tier_fd = -1;
+		tier_name(cf->file_id, name);
+		if (unlinkat(tier.dirfd, name, 0) == -1 && errno != ENOENT)
+			res = -errno;
+	}
+	else if (file_tier_fd(tf, 0) >= 0 && fstat(tf->tier_fd, &st) == 0 &&
+		 st.st_size > backing_len && ftruncate(tf->tier_fd, backing_len) == -1)
+		res = -errno;
+	pthread_mutex_unlock(&tier.lock);
+	pthread_rwlock_unlock(&tf->lock);
+	return res;
+}
+
+int pa5_tier_writeback(const struct pa5_chunk_file *cf)
+{
+	int res;
+
+	if (!cf->tier)
+		return 0;
+
+	pa5_rwlock_wrlock(&cf->tier->lock, PA5_LOCK_TIER_FILE);
+	res = flush_file(cf->tier);
+	pthread_rwlock_unlock(&cf->tier->lock);
+	return res;
+}
+
+int pa5_tier_sync(const struct pa5_chunk_file *cf)
+{
+	int res = 0;
+
+	if (!cf->tier)
+		return 0;
+
+	pa5_rwlock_rdlock(&cf->tier->lock, PA5_LOCK_TIER_FILE);
+	if (cf->tier->tier_fd >= 0 && fdatasync(cf->tier->tier_fd) == -1)
+		res = -errno;
+	pthread_rwlock_unlock(&cf->tier->lock);
+
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	if (res == 0 && msync(tier.map, tier.map_len, MS_SYNC) == -1)
+		res = -errno;
+	pthread_mutex_unlock(&tier.lock);
+	return res;
+}
+
+void pa5_tier_stats(FILE *out)
+{
+	pa5_mutex_lock(&tier.lock, PA5_LOCK_TIER);
+	fprintf(out, "ready %d\n", tier.ready);
+	if (tier.ready)
+	{
+		fprintf(out, "capacity %llu\n", (unsigned long long)tier.capacity);
+		fprintf(out, "chunks %llu\n", (unsigned long long)tier.count);
+		fprintf(out, "dirty %llu\n", (unsigned long long)tier.ndirty);
+		fprintf(out, "open_files %zu\n", tier.nfiles);
+		fprintf(out, "hits %llu\n", tier.hits);
+		fprintf(out, "misses %llu\n", tier.misses);
+		fprintf(out, "promotions %llu\n", tier.promotions);
+		fprintf(out, "writes %llu\n", tier.writes);
+		fprintf(out, "demotions %llu\n", tier.demotions);
+		fprintf(out, "evictions %llu\n", tier.evictions);
+	}
+	pthread_mutex_unlock(&tier.lock);
+}
@@ -0,0 +1,131 @@
+/* pa5-tier.h
+ * Fast cache tier for the chunks of chunk files.
+ *
+ * A mount can be given a small fast directory, on NVMe or tmpfs, in front of
+ * its mirror roots. Sealed chunk slots are kept there byte for byte as they
+ * are on the mirror: a slot authenticates its file id and index rather than
+ * where it is stored, so chunks move between tiers without being opened.
+ *
+ * Root PA5_TIER_DIR holds one sparse tier file per chunk file, named by its
+ * file id like the stripe files of pa5-stripe.h and with every slot at the
+ * same offset as in the primary file, and the placement index. The index is
+ * a mapped hash table of (file id, chunk index) entries, each clean (a copy
+ * of the slot on the mirror) or dirty (newer than the mirror), so placement
+ * survives a restart.
+ *
+ *   - Writes land in the tier while it has room and leave the chunk dirty.
+ *   - A read that misses the tier goes to the mirror; a chunk that misses
+ *     PA5_TIER_PROMOTE times within the aging window of a frequency sketch
+ *     is copied up, so a single scan of a large file does not flush the
+ *     working set out.
+ *   - A background worker sweeps the index with a clock hand. Dirty chunks
+ *     that go cold are written back to the mirror, and the coldest clean
+ *     ones are dropped once the tier is nearly full.
+ *   - The chunks a file dirtied are written back when its last handle
+ *     closes, so after a clean unmount the mirror alone is complete.
+ *
+ * Chunks can only be written back while the daemon has their chunk file
+ * open, since the tier names files by id and not by path. After a crash
+ * the mirror may lack dirty chunks until the file is opened on a mount
+ * with the same tier, so keep the tier on storage that survives a reboot
+ * and run the offline tools only after such a mount. Deduplicated files
+ * bypass the tier.
+ *
+ * All functions return 0 (or a file descriptor) on success and -errno on
+ * error.
+ */
+
+#ifndef PA5_TIER_H
+#define PA5_TIER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pa5-chunk.h"
+
+#define PA5_TIER_DIR ".pa5-tier"
+#define PA5_TIER_VERSION 1
+#define PA5_TIER_DEFAULT_SIZE (1ULL << 30)   /* Bytes of slots in the tier. */
+#define PA5_TIER_MAX_SIZE (1ULL << 50)       /* Bounds the size of the placement index. */
+#define PA5_TIER_PROMOTE 2                   /* Misses before a chunk is copied up. */
+
+/* Where a chunk of a batch is served from. */
+enum pa5_tier_where
+{
+	PA5_TIER_MISS = 0,   /* On the mirror. */
+	PA5_TIER_HIT = 1,    /* In the tier. */
+	PA5_TIER_HOT = 2     /* On the mirror, to be copied up once read. */
+};
+
+/* int pa5_tier_open(const char *dir, const struct pa5_keys *keys, uint64_t size)
+ * Purpose: Use dir as the cache tier, keeping up to size bytes of chunk
+ *          slots there, and load or create its placement index.
+ * Return: 0 on success, -EINVAL if dir is the tier of another volume
+ */
+int pa5_tier_open(const char *dir, const struct pa5_keys *keys, uint64_t size);
+
+/* Starts the background worker. Called once the daemon has forked. */
+int pa5_tier_start(void);
+
+/* Stops the worker, writes back what open files still have dirty and
+ * syncs the index. */
+void pa5_tier_close(void);
+
+int pa5_tier_ready(void);
+
+/* Sets cf->tier for a file whose chunks may be tiered, and
+ * pa5_tier_detach() releases it again, writing the file's dirty chunks
+ * back when its last user goes. Called by pa5_chunk_open(),
+ * pa5_chunk_create() and pa5_chunk_close(). */
+void pa5_tier_attach(struct pa5_chunk_file *cf);
+void pa5_tier_detach(struct pa5_chunk_file *cf);
+
+/* Bracket every batch on a tiered file, so that the worker never moves a
+ * chunk of it while a batch is using the tier. */
+void pa5_tier_begin(const struct pa5_chunk_file *cf);
+void pa5_tier_end(const struct pa5_chunk_file *cf);
+
+/* void pa5_tier_lookup(const struct pa5_chunk_file *cf, uint64_t first, int n,
+ *                      const unsigned char *cached, unsigned char *where)
+ * Purpose: Fill where[i] with the enum pa5_tier_where of chunk first + i.
+ *          A read passes cached, marking the chunks it has in memory; the
+ *          others count as tier hits or misses and may be promoted. A
+ *          write passes NULL.
+ */
+void pa5_tier_lookup(const struct pa5_chunk_file *cf, uint64_t first, int n,
+		     const unsigned char *cached, unsigned char *where);
+
+/* Sets where[i] to PA5_TIER_HIT for each chunk first + i that a write
+ * should send to the tier, and pa5_tier_written() records the ones that
+ * made it there as dirty. */
+void pa5_tier_place(const struct pa5_chunk_file *cf, uint64_t first, int n,
+		    unsigned char *where);
+void pa5_tier_written(const struct pa5_chunk_file *cf, uint64_t first, int n,
+		      const unsigned char *where);
+
+/* Records chunk index, whose slot has just been copied into the tier file,
+ * as a clean copy. */
+void pa5_tier_promoted(const struct pa5_chunk_file *cf, uint64_t index);
+
+/* Descriptor of the tier file of cf, creating it if create is set. It
+ * stays valid until pa5_tier_end(). */
+int pa5_tier_fd(const struct pa5_chunk_file *cf, int create);
+
+/* Forgets the chunks of cf from new_size bytes of plaintext on, old_size
+ * being the size before, and cuts the tier file to backing_len bytes,
+ * removing it when no chunk is left. */
+int pa5_tier_truncate(const struct pa5_chunk_file *cf, off_t old_size, off_t new_size,
+		      off_t backing_len);
+
+/* Writes back every chunk cf has dirty in the tier, so that the mirror
+ * alone holds the whole file. */
+int pa5_tier_writeback(const struct pa5_chunk_file *cf);
+
+/* Flushes the tier file of cf and the index to disk. */
+int pa5_tier_sync(const struct pa5_chunk_file *cf);
+
+/* Stats section with the tier's occupancy, hit rate and traffic. */
+void pa5_tier_stats(FILE *out);
+
+#endif
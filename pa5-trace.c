@@ -0,0 +1,323 @@
+/* pa5-trace.c
+ * Binary trace of every FUSE callback, for replay with pa5-replay.
+ *
+ * Each thread fills its own buffer and appends it to the trace with a single
+ * write() once it is full. The file is opened O_APPEND, so buffers from
+ * different threads never interleave and no lock is taken on the hot path.
+ * A thread's buffer is written out when it exits and again on stop.
+ *
+ * Paths are hashed with SipHash-2-4 under a key drawn when the trace starts
+ * and never stored, so a hash cannot be checked against a guessed name.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-trace.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <openssl/rand.h>
+
+#define BUF_RECORDS 64
+
+struct trace_buf
+{
+	unsigned char data[BUF_RECORDS * PA5_TRACE_RECORD_SIZE];
+	unsigned used;
+	uint16_t thread;
+	struct trace_buf *next;
+};
+
+int pa5_trace_active = 0;
+
+static pthread_mutex_t bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buf *bufs = NULL;
+static pthread_key_t buf_key;
+static pthread_once_t buf_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_buf *thread_buf = NULL;
+
+static int trace_fd = -1;
+static uint64_t trace_base;
+static uint64_t hash_key[2];
+static uint64_t root_hash;
+static uint16_t next_thread = 0;
+static unsigned long long records = 0;
+static unsigned long long dropped = 0;
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+	put_le32(p, (uint32_t)v);
+	put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+	return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+		v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+	} while (0)
+
+static uint64_t siphash(const char *data, size_t len)
+{
+	uint64_t v0 = hash_key[0] ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = hash_key[1] ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = hash_key[0] ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = hash_key[1] ^ 0x7465646279746573ULL;
+	const unsigned char *p = (const unsigned char *)data;
+	size_t left = len;
+	uint64_t m;
+	unsigned i;
+
+	for (; left >= 8; p += 8, left -= 8)
+	{
+		m = get_le64(p);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	m = (uint64_t)len << 56;
+	for (i = 0; i < left; i++)
+		m |= (uint64_t)p[i] << (8 * i);
+	v3 ^= m;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* Hashes path and its parent directory. Entries in the root have the hash
+ * of "/" as their parent, and "/" itself has none. */
+static void hash_path(const char *path, uint64_t *hash, uint64_t *parent)
+{
+	const char *slash = strrchr(path, '/');
+	size_t len = strlen(path);
+
+	*hash = siphash(path, len);
+	if (len <= 1 || !slash)
+		*parent = 0;
+	else if (slash == path)
+		*parent = root_hash;
+	else
+		*parent = siphash(path, slash - path);
+}
+
+/* Appends the buffered records to the trace, or counts them as dropped. */
+static void flush_buf(struct trace_buf *buf)
+{
+	int fd = __atomic_load_n(&trace_fd, __ATOMIC_ACQUIRE);
+	size_t len = buf->used * PA5_TRACE_RECORD_SIZE;
+
+	if (buf->used == 0)
+		return;
+	if (fd >= 0 && write(fd, buf->data, len) == (ssize_t)len)
+		__atomic_add_fetch(&records, buf->used, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&dropped, buf->used, __ATOMIC_RELAXED);
+	buf->used = 0;
+}
+
+static void buf_release(void *ptr)
+{
+	struct trace_buf *buf = ptr;
+	struct trace_buf **link;
+
+	pa5_mutex_lock(&bufs_lock, PA5_LOCK_TRACE);
+	flush_buf(buf);
+	for (link = &bufs; *link; link = &(*link)->next)
+	{
+		if (*link == buf)
+		{
+			*link = buf->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bufs_lock);
+	free(buf);
+}
+
+static void buf_key_create(void)
+{
+	pthread_key_create(&buf_key, buf_release);
+}
+
+static struct trace_buf *get_buf(void)
+{
+	if (thread_buf)
+		return thread_buf;
+
+	pthread_once(&buf_once, buf_key_create);
+	struct trace_buf *buf = calloc(1, sizeof(*buf));
+	if (!buf)
+		return NULL;
+
+	pa5_mutex_lock(&bufs_lock, PA5_LOCK_TRACE);
+	buf->thread = next_thread++;
+	buf->next = bufs;
+	bufs = buf;
+	pthread_mutex_unlock(&bufs_lock);
+
+	pthread_setspecific(buf_key, buf);
+	thread_buf = buf;
+	return buf;
+}
+
+static void encode(unsigned char *p, const struct pa5_trace_record *rec)
+{
+	put_le64(p, rec->start);
+	put_le32(p + 8, rec->latency);
+	put_le32(p + 12, (uint32_t)rec->res);
+	p[16] = rec->op;
+	p[17] = rec->op >> 8;
+	p[18] = rec->thread;
+	p[19] = rec->thread >> 8;
+	put_le32(p + 20, rec->flags);
+	put_le32(p + 24, rec->mode);
+	put_le32(p + 28, rec->size);
+	put_le64(p + 32, rec->offset);
+	put_le64(p + 40, rec->handle);
+	put_le64(p + 48, rec->path);
+	put_le64(p + 56, rec->parent);
+	put_le64(p + 64, rec->path2);
+	put_le64(p + 72, rec->parent2);
+}
+
+void pa5_trace_decode(const unsigned char *p, struct pa5_trace_record *rec)
+{
+	rec->start = get_le64(p);
+	rec->latency = get_le32(p + 8);
+	rec->res = (int32_t)get_le32(p + 12);
+	rec->op = p[16] | (p[17] << 8);
+	rec->thread = p[18] | (p[19] << 8);
+	rec->flags = get_le32(p + 20);
+	rec->mode = get_le32(p + 24);
+	rec->size = get_le32(p + 28);
+	rec->offset = get_le64(p + 32);
+	rec->handle = get_le64(p + 40);
+	rec->path = get_le64(p + 48);
+	rec->parent = get_le64(p + 56);
+	rec->path2 = get_le64(p + 64);
+	rec->parent2 = get_le64(p + 72);
+}
+
+int pa5_trace_parse_header(const unsigned char *hdr, uint64_t *root)
+{
+	if (memcmp(hdr, PA5_TRACE_MAGIC, 4) != 0 || get_le32(hdr + 4) != PA5_TRACE_VERSION ||
+	    get_le32(hdr + 8) != PA5_TRACE_RECORD_SIZE)
+		return -EINVAL;
+	*root = get_le64(hdr + 16);
+	return 0;
+}
+
+int pa5_trace_start(int fd)
+{
+	unsigned char hdr[PA5_TRACE_HEADER_SIZE] = { 0 };
+
+	if (RAND_bytes((unsigned char *)hash_key, sizeof(hash_key)) != 1)
+		return -EIO;
+	root_hash = siphash("/", 1);
+
+	memcpy(hdr, PA5_TRACE_MAGIC, 4);
+	put_le32(hdr + 4, PA5_TRACE_VERSION);
+	put_le32(hdr + 8, PA5_TRACE_RECORD_SIZE);
+	put_le64(hdr + 16, root_hash);
+	put_le64(hdr + 24, (uint64_t)time(NULL));
+	if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr))
+		return errno ? -errno : -EIO;
+
+	trace_base = pa5_stats_now();
+	__atomic_store_n(&trace_fd, fd, __ATOMIC_RELEASE);
+	__atomic_store_n(&pa5_trace_active, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void pa5_trace_stop(void)
+{
+	struct trace_buf *buf;
+
+	if (!__atomic_exchange_n(&pa5_trace_active, 0, __ATOMIC_ACQ_REL))
+		return;
+
+	pa5_mutex_lock(&bufs_lock, PA5_LOCK_TRACE);
+	for (buf = bufs; buf; buf = buf->next)
+		flush_buf(buf);
+	close(trace_fd);
+	__atomic_store_n(&trace_fd, -1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&bufs_lock);
+}
+
+void pa5_trace_op(enum pa5_timer op, uint64_t start, int res, const char *path,
+		  const char *path2, uint64_t offset, uint64_t size, uint32_t flags,
+		  uint32_t mode, uint64_t handle)
+{
+	struct pa5_trace_record rec;
+	struct trace_buf *buf = get_buf();
+	uint64_t latency = pa5_stats_now() - start;
+
+	if (!buf)
+	{
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec.start = start - trace_base;
+	rec.latency = latency > UINT32_MAX ? UINT32_MAX : latency;
+	rec.res = res;
+	rec.op = op;
+	rec.thread = buf->thread;
+	rec.flags = flags;
+	rec.mode = mode;
+	rec.size = size > UINT32_MAX ? UINT32_MAX : size;
+	rec.offset = offset;
+	rec.handle = handle;
+	hash_path(path, &rec.path, &rec.parent);
+	rec.path2 = rec.parent2 = 0;
+	if (path2)
+		hash_path(path2, &rec.path2, &rec.parent2);
+
+	encode(buf->data + buf->used * PA5_TRACE_RECORD_SIZE, &rec);
+	if (++buf->used == BUF_RECORDS)
+		flush_buf(buf);
+}
+
+unsigned long long pa5_trace_records(void)
+{
+	return __atomic_load_n(&records, __ATOMIC_RELAXED);
+}
+
+unsigned long long pa5_trace_dropped(void)
+{
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
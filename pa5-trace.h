@@ -0,0 +1,73 @@
+/* pa5-trace.h
+ * Binary trace of every FUSE callback, for replay with pa5-replay.
+ *
+ * A trace records the shape of a workload without its data: which callback
+ * ran on which thread, when and for how long, its result, and its offset,
+ * size, flags and file handle. Paths are stored as keyed 64-bit hashes, with
+ * a hash of the parent directory so the tree can be rebuilt, and the key is
+ * thrown away when the trace ends. File names and contents never reach the
+ * trace, so it can leave the machine it was recorded on.
+ *
+ * The file is a PA5_TRACE_HEADER_SIZE header followed by fixed-size
+ * little-endian records. Records are buffered per thread and appended a
+ * buffer at a time, so they are only roughly in time order.
+ */
+
+#ifndef PA5_TRACE_H
+#define PA5_TRACE_H
+
+#include <stdint.h>
+
+#include "pa5-stats.h"
+
+#define PA5_TRACE_MAGIC "PA5T"
+#define PA5_TRACE_VERSION 1
+#define PA5_TRACE_HEADER_SIZE 32
+#define PA5_TRACE_RECORD_SIZE 80
+
+struct pa5_trace_record
+{
+	uint64_t start;      /* Nanoseconds since the trace started. */
+	uint32_t latency;    /* Nanoseconds, saturating. */
+	int32_t res;         /* Callback result. */
+	uint16_t op;         /* enum pa5_timer, a PA5_OP_* value. */
+	uint16_t thread;     /* Daemon thread, numbered in order of first use. */
+	uint32_t flags;      /* Open flags, access mask, datasync, xattr flags or uid. */
+	uint32_t mode;       /* Mode bits, or gid for chown. */
+	uint32_t size;       /* Bytes asked for. */
+	uint64_t offset;     /* Offset, new length for truncate, or rdev for mknod. */
+	uint64_t handle;     /* fi->fh, or 0. */
+	uint64_t path;       /* Hash of the path, and of its parent directory. */
+	uint64_t parent;
+	uint64_t path2;      /* Second path of rename and link, or 0. */
+	uint64_t parent2;
+};
+
+extern int pa5_trace_active;
+
+#define pa5_tracing() __atomic_load_n(&pa5_trace_active, __ATOMIC_RELAXED)
+
+/* Writes the header to fd, which must be opened O_APPEND, and starts
+ * recording. fd belongs to the trace until pa5_trace_stop(), which writes
+ * out every buffered record and closes it. Returns 0 or -errno. */
+int pa5_trace_start(int fd);
+void pa5_trace_stop(void);
+
+/* Records one callback that began at start (a pa5_stats_now() value) and
+ * has just returned res. path2 may be NULL. */
+void pa5_trace_op(enum pa5_timer op, uint64_t start, int res, const char *path,
+		  const char *path2, uint64_t offset, uint64_t size, uint32_t flags,
+		  uint32_t mode, uint64_t handle);
+
+unsigned long long pa5_trace_records(void);
+unsigned long long pa5_trace_dropped(void);
+
+/* int pa5_trace_parse_header(const unsigned char *hdr, uint64_t *root)
+ * Purpose: Check a trace header and get the hash of "/" from it.
+ * Return: 0 on success, -EINVAL if this is not a trace we can read
+ */
+int pa5_trace_parse_header(const unsigned char *hdr, uint64_t *root);
+
+void pa5_trace_decode(const unsigned char *buf, struct pa5_trace_record *rec);
+
+#endif
@@ -0,0 +1,315 @@
+/* pa5-volume.c
+ * Volume configuration file holding the wrapped master key.
+ */
+
+#include "pa5-volume.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#define VOLUME_MAGIC "PA5V"
+#define VOLUME_SIZE 160
+#define VOLUME_ROUNDS 100000
+#define SALT_LEN 16
+#define NONCE_LEN 12
+#define TAG_LEN 16
+#define AAD_LEN 32
+#define PAYLOAD_OFF 64
+#define PAYLOAD_LEN 96
+
+/* Salt and rounds the chunk keys were derived with before the volume file
+ * existed. Only used to adopt the key of a mirror that already holds data. */
+#define LEGACY_SALT "pa5-encfs chunk keys"
+#define LEGACY_ROUNDS 100000
+
+/* What the volume file protects. */
+struct volume_secrets
+{
+	unsigned char master[32];
+	struct pa5_cbc_key cbc_key;
+};
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void volume_path(char *out, const char *rootdir, const char *name)
+{
+	snprintf(out, PATH_MAX, "%s/%s", rootdir, name);
+}
+
+static int derive_kek(const char *password, const unsigned char *salt, uint32_t rounds,
+		      unsigned char kek[32])
+{
+	if (!PKCS5_PBKDF2_HMAC(password, strlen(password), salt, SALT_LEN, rounds,
+			       EVP_sha256(), 32, kek))
+		return -EINVAL;
+	return 0;
+}
+
+static void pack_secrets(const struct volume_secrets *s, unsigned char *out)
+{
+	memcpy(out, s->master, 32);
+	memcpy(out + 32, s->cbc_key.key, 32);
+	memcpy(out + 64, s->cbc_key.iv, 32);
+}
+
+static void unpack_secrets(const unsigned char *in, struct volume_secrets *s)
+{
+	memcpy(s->master, in, 32);
+	memcpy(s->cbc_key.key, in + 32, 32);
+	memcpy(s->cbc_key.iv, in + 64, 32);
+}
+
+/* Builds the file image of s wrapped under password. */
+static int volume_wrap(const struct volume_secrets *s, const char *password,
+		       unsigned char img[VOLUME_SIZE])
+{
+	unsigned char kek[32];
+	unsigned char payload[PAYLOAD_LEN];
+	int outlen;
+	int ok;
+
+	memset(img, 0, VOLUME_SIZE);
+	memcpy(img, VOLUME_MAGIC, 4);
+	img[4] = PA5_VOLUME_VERSION;
+	put_le32(img + 8, VOLUME_ROUNDS);
+	if (RAND_bytes(img + 16, SALT_LEN) != 1 || RAND_bytes(img + 32, NONCE_LEN) != 1)
+		return -EIO;
+	if (derive_kek(password, img + 16, VOLUME_ROUNDS, kek) < 0)
+		return -EINVAL;
+
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (!ctx)
+	{
+		OPENSSL_cleanse(kek, sizeof(kek));
+		return -ENOMEM;
+	}
+
+	pack_secrets(s, payload);
+	ok = EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) &&
+	     EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, NONCE_LEN, NULL) &&
+	     EVP_EncryptInit_ex(ctx, NULL, NULL, kek, img + 32) &&
+	     EVP_EncryptUpdate(ctx, NULL, &outlen, img, AAD_LEN) &&
+	     EVP_EncryptUpdate(ctx, img + PAYLOAD_OFF, &outlen, payload, PAYLOAD_LEN) &&
+	     EVP_EncryptFinal_ex(ctx, img + PAYLOAD_OFF + outlen, &outlen) &&
+	     EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_LEN, img + 44);
+
+	EVP_CIPHER_CTX_free(ctx);
+	OPENSSL_cleanse(kek, sizeof(kek));
+	OPENSSL_cleanse(payload, sizeof(payload));
+	return ok ? 0 : -EIO;
+}
+
+/* Recovers the secrets from a file image. A wrong pass phrase and a damaged
+ * file look the same to GCM; both report -EACCES. */
+static int volume_unwrap(const unsigned char img[VOLUME_SIZE], const char *password,
+			 struct volume_secrets *s)
+{
+	unsigned char kek[32];
+	unsigned char payload[PAYLOAD_LEN];
+	unsigned char tag[TAG_LEN];
+	int outlen;
+	int ok;
+
+	if (memcmp(img, VOLUME_MAGIC, 4) != 0 || img[4] != PA5_VOLUME_VERSION)
+		return -EIO;
+
+	uint32_t rounds = get_le32(img + 8);
+	if (rounds == 0 || derive_kek(password, img + 16, rounds, kek) < 0)
+		return -EIO;
+
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (!ctx)
+	{
+		OPENSSL_cleanse(kek, sizeof(kek));
+		return -ENOMEM;
+	}
+
+	memcpy(tag, img + 44, TAG_LEN);
+	ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) &&
+	     EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, NONCE_LEN, NULL) &&
+	     EVP_DecryptInit_ex(ctx, NULL, NULL, kek, img + 32) &&
+	     EVP_DecryptUpdate(ctx, NULL, &outlen, img, AAD_LEN) &&
+	     EVP_DecryptUpdate(ctx, payload, &outlen, img + PAYLOAD_OFF, PAYLOAD_LEN) &&
+	     EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag) &&
+	     EVP_DecryptFinal_ex(ctx, payload + outlen, &outlen);
+
+	EVP_CIPHER_CTX_free(ctx);
+	OPENSSL_cleanse(kek, sizeof(kek));
+	if (ok)
+		unpack_secrets(payload, s);
+	OPENSSL_cleanse(payload, sizeof(payload));
+	return ok ? 0 : -EACCES;
+}
+
+static int volume_load(const char *rootdir, unsigned char img[VOLUME_SIZE])
+{
+	char path[PATH_MAX];
+	int res = 0;
+
+	volume_path(path, rootdir, PA5_VOLUME_FILE);
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+	if (pread(fd, img, VOLUME_SIZE, 0) != VOLUME_SIZE)
+		res = -EIO;
+	close(fd);
+	return res;
+}
+
+/* Writes img to a temporary file and moves it into place. With replace
+ * unset an existing file wins, so two processes creating the same volume
+ * at once end up agreeing on one master key. */
+static int volume_store(const char *rootdir, const unsigned char img[VOLUME_SIZE],
+			int replace)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	char name[64];
+	int res = 0;
+
+	snprintf(name, sizeof(name), "%s.%ld.tmp", PA5_VOLUME_FILE, (long)getpid());
+	volume_path(path, rootdir, PA5_VOLUME_FILE);
+	volume_path(tmp, rootdir, name);
+
+	int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (fd == -1)
+		return -errno;
+	if (pwrite(fd, img, VOLUME_SIZE, 0) != VOLUME_SIZE || fsync(fd) == -1)
+		res = -EIO;
+	close(fd);
+
+	if (res == 0)
+	{
+		if (replace)
+			res = (rename(tmp, path) == 0) ? 0 : -errno;
+		else
+			res = (link(tmp, path) == 0) ? 0 : -errno;
+	}
+	unlink(tmp);
+
+	if (res == 0)
+	{
+		int dir = open(rootdir, O_RDONLY | O_DIRECTORY);
+		if (dir != -1)
+		{
+			fsync(dir);
+			close(dir);
+		}
+	}
+	return res;
+}
+
+/* Returns 1 if the mirror holds anything but internal files. */
+static int mirror_in_use(const char *rootdir)
+{
+	struct dirent *de;
+	int used = 0;
+
+	DIR *dp = opendir(rootdir);
+	if (!dp)
+		return -errno;
+
+	while (!used && (de = readdir(dp)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0 &&
+		    strncmp(de->d_name, ".pa5-", 5) != 0)
+			used = 1;
+	}
+	closedir(dp);
+	return used;
+}
+
+/* First mount: pick the master key and wrap it. */
+static int volume_create(const char *rootdir, const char *password, struct volume_secrets *s)
+{
+	unsigned char img[VOLUME_SIZE];
+	int res;
+
+	if ((res = mirror_in_use(rootdir)) < 0)
+		return res;
+
+	if (res)
+	{
+		/* Existing chunk files were keyed straight from the pass phrase. */
+		if (!PKCS5_PBKDF2_HMAC(password, strlen(password),
+				       (const unsigned char *)LEGACY_SALT, strlen(LEGACY_SALT),
+				       LEGACY_ROUNDS, EVP_sha256(), 32, s->master))
+			return -EINVAL;
+	}
+	else if (RAND_bytes(s->master, 32) != 1)
+		return -EIO;
+
+	if (pa5_cbc_derive_key(password, &s->cbc_key) != 0)
+		return -EINVAL;
+
+	if ((res = volume_wrap(s, password, img)) < 0)
+		return res;
+	return volume_store(rootdir, img, 0);
+}
+
+static int volume_secrets(const char *rootdir, const char *password, struct volume_secrets *s)
+{
+	unsigned char img[VOLUME_SIZE];
+	int res = volume_load(rootdir, img);
+
+	if (res == -ENOENT)
+	{
+		res = volume_create(rootdir, password, s);
+		if (res != -EEXIST)
+			return res;
+		/* Lost a race with another process; use its file. */
+		res = volume_load(rootdir, img);
+	}
+	if (res < 0)
+		return res;
+	return volume_unwrap(img, password, s);
+}
+
+int pa5_volume_open(const char *rootdir, const char *password,
+		    struct pa5_cbc_key *cbc_key, struct pa5_keys *keys)
+{
+	struct volume_secrets s;
+
+	int res = volume_secrets(rootdir, password, &s);
+	if (res == 0)
+	{
+		*cbc_key = s.cbc_key;
+		res = pa5_chunk_derive_keys(s.master, keys);
+	}
+	OPENSSL_cleanse(&s, sizeof(s));
+	return res;
+}
+
+int pa5_volume_rekey(const char *rootdir, const char *old_password,
+		     const char *new_password)
+{
+	struct volume_secrets s;
+	unsigned char img[VOLUME_SIZE];
+
+	int res = volume_secrets(rootdir, old_password, &s);
+	if (res == 0 && (res = volume_wrap(&s, new_password, img)) == 0)
+		res = volume_store(rootdir, img, 1);
+	OPENSSL_cleanse(&s, sizeof(s));
+	return res;
+}
@@ -0,0 +1,51 @@
+/* pa5-volume.h
+ * Volume configuration file holding the wrapped master key.
+ *
+ * The keys that encrypt file data are derived from a random master key, not
+ * from the pass phrase. The master key is stored in PA5_VOLUME_FILE in the
+ * mirror root, encrypted under a key derived from the pass phrase with a
+ * random salt. Changing the pass phrase only rewrites that file.
+ *
+ * Layout on disk (160 bytes):
+ *     0   magic "PA5V"
+ *     4   format version
+ *     8   PBKDF2 rounds, little endian
+ *     16  PBKDF2 salt
+ *     32  GCM nonce
+ *     44  GCM tag over bytes 0-31 and the ciphertext
+ *     64  AES-256-GCM ciphertext of the master key and the legacy CBC key/IV
+ *
+ * The legacy do_crypt() key is kept in the same wrapped payload, so files in
+ * the old format still decrypt after the pass phrase changes. A mirror that
+ * already holds data when the file is first created adopts the master key the
+ * pass phrase used to imply, so its chunk files stay readable.
+ *
+ * All functions return 0 on success and -errno on error.
+ */
+
+#ifndef PA5_VOLUME_H
+#define PA5_VOLUME_H
+
+#include "pa5-cbc.h"
+#include "pa5-chunk.h"
+
+#define PA5_VOLUME_FILE ".pa5-volume"
+#define PA5_VOLUME_VERSION 1
+
+/* int pa5_volume_open(const char *rootdir, ...)
+ * Purpose: Unwrap the keys of the volume at rootdir, creating its
+ *          configuration on first use.
+ * Return: 0 on success, -EACCES if the pass phrase is wrong, -errno otherwise
+ */
+int pa5_volume_open(const char *rootdir, const char *password,
+		    struct pa5_cbc_key *cbc_key, struct pa5_keys *keys);
+
+/* int pa5_volume_rekey(const char *rootdir, ...)
+ * Purpose: Rewrap the master key under a new pass phrase. File data is not
+ *          touched, and mounted instances keep working.
+ * Return: 0 on success, -EACCES if old_password is wrong, -errno otherwise
+ */
+int pa5_volume_rekey(const char *rootdir, const char *old_password,
+		     const char *new_password);
+
+#endif
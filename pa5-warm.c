@@ -0,0 +1,565 @@
+/* pa5-warm.c
+ * Warming the chunk cache after a remount.
+ *
+ * The worker warms first and saves afterwards, so the first save after a
+ * mount already includes the chunks it warmed. A mount that is unmounted
+ * before warming finished keeps the old manifest, rather than replace it
+ * with the little it got to. Files are read without a handle counted in
+ * pa5-inode, under the inode lock for each chunk as a FUSE read would be;
+ * a file unlinked or replaced meanwhile only makes its remaining reads fail
+ * or warm chunks of a file nobody opens.
+ */
+
+#define _GNU_SOURCE
+
+#include "pa5-warm.h"
+#include "pa5-cache.h"
+#include "pa5-inode.h"
+#include "pa5-sched.h"
+#include "pa5-log.h"
+#include "pa5-lock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#define WARM_MAGIC "PA5H"
+#define WARM_HEADER 64
+#define WARM_ENTRY 24
+#define WARM_TMP PA5_WARM_FILE ".tmp"
+#define HIDDEN_PREFIX ".pa5-"
+
+struct entry
+{
+	uint64_t ino;
+	uint64_t file_id;       /* First 8 bytes of the file id. */
+	uint64_t chunk;
+};
+
+/* A file of the manifest and the run of its entries. */
+struct file_ref
+{
+	uint64_t ino;
+	size_t first;
+	size_t count;
+	char *path;             /* Once found in the mirror. */
+};
+
+/* An opened file, by the slot of its cache id. */
+struct note
+{
+	uint64_t cache_id;
+	uint64_t ino;
+	uint64_t file_id;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	char *rootdir;
+	unsigned char key[32];
+	const struct pa5_keys *keys;
+	unsigned interval;
+	int ready;
+	int running;
+	int warmed;             /* Warming is over and saves may begin. */
+	pthread_t worker;
+	struct note notes[PA5_WARM_FILES];
+
+	struct entry *entries;  /* The manifest loaded, until warmed. */
+	size_t nentries;
+	struct file_ref *files;
+	size_t nfiles;
+	size_t found;
+
+	const char *state;
+	unsigned long long stale;
+	unsigned long long chunks;
+	unsigned long long failed;
+	unsigned long long warm_ms;
+	unsigned long long saves;
+	unsigned long long save_errors;
+	size_t saved;
+} warm = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.state = "off"
+};
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+	put_le32(p, (uint32_t)v);
+	put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+	return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static void hmac_sha256(const unsigned char *key, const void *data, size_t len,
+			unsigned char out[32])
+{
+	unsigned int outlen = 32;
+	HMAC(EVP_sha256(), key, 32, data, len, out, &outlen);
+}
+
+/* MAC of a manifest image, with its MAC field taken as zero. */
+static void manifest_mac(unsigned char *buf, size_t len, unsigned char mac[32])
+{
+	unsigned char saved[32];
+
+	memcpy(saved, buf + 32, 32);
+	memset(buf + 32, 0, 32);
+	hmac_sha256(warm.key, buf, len, mac);
+	memcpy(buf + 32, saved, 32);
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct entry *x = a;
+	const struct entry *y = b;
+
+	if (x->ino != y->ino)
+		return (x->ino < y->ino) ? -1 : 1;
+	if (x->chunk != y->chunk)
+		return (x->chunk < y->chunk) ? -1 : 1;
+	return 0;
+}
+
+static int ref_cmp(const void *key, const void *elem)
+{
+	uint64_t ino = *(const uint64_t *)key;
+	const struct file_ref *ref = elem;
+
+	return (ino < ref->ino) ? -1 : (ino > ref->ino);
+}
+
+/* Reads the manifest into warm.entries, sorted by inode and chunk, and
+ * groups them by file. A manifest that fails its checks is ignored.
+ * Return: 0 on success or when there is none, -errno on error */
+static int manifest_load(void)
+{
+	char path[PATH_MAX];
+	unsigned char *buf = NULL;
+	unsigned char mac[32];
+	struct stat st;
+	size_t i;
+	int res = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", warm.rootdir, PA5_WARM_FILE);
+	int fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1)
+		return (errno == ENOENT) ? 0 : -errno;
+	if (fstat(fd, &st) == -1)
+	{
+		res = -errno;
+		goto out;
+	}
+	if (st.st_size < WARM_HEADER ||
+	    st.st_size > WARM_HEADER + (off_t)PA5_WARM_MAX_ENTRIES * WARM_ENTRY ||
+	    (buf = malloc(st.st_size)) == NULL ||
+	    pread(fd, buf, st.st_size, 0) != st.st_size)
+		goto bad;
+
+	uint64_t count = get_le64(buf + 8);
+	manifest_mac(buf, st.st_size, mac);
+	if (memcmp(buf, WARM_MAGIC, 4) != 0 || buf[4] != PA5_WARM_VERSION ||
+	    count != (uint64_t)(st.st_size - WARM_HEADER) / WARM_ENTRY ||
+	    (st.st_size - WARM_HEADER) % WARM_ENTRY != 0 ||
+	    CRYPTO_memcmp(mac, buf + 32, 32) != 0)
+		goto bad;
+	if (count == 0)
+		goto out;
+
+	if ((warm.entries = malloc(count * sizeof(*warm.entries))) == NULL ||
+	    (warm.files = calloc(count, sizeof(*warm.files))) == NULL)
+	{
+		res = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < count; i++)
+	{
+		const unsigned char *p = buf + WARM_HEADER + i * WARM_ENTRY;
+		warm.entries[i].ino = get_le64(p);
+		warm.entries[i].file_id = get_le64(p + 8);
+		warm.entries[i].chunk = get_le64(p + 16);
+	}
+	warm.nentries = count;
+	qsort(warm.entries, count, sizeof(*warm.entries), entry_cmp);
+
+	for (i = 0; i < count; i++)
+	{
+		if (warm.nfiles == 0 || warm.files[warm.nfiles - 1].ino != warm.entries[i].ino)
+		{
+			warm.files[warm.nfiles].ino = warm.entries[i].ino;
+			warm.files[warm.nfiles].first = i;
+			warm.nfiles++;
+		}
+		warm.files[warm.nfiles - 1].count++;
+	}
+	goto out;
+
+bad:
+	pa5_warn("Warm manifest is not valid, ignoring it.");
+out:
+	free(buf);
+	close(fd);
+	return res;
+}
+
+/* Writes the keys of the hottest cached chunks whose files are known to a
+ * new manifest, and moves it over the old one.
+ * Return: 0 on success, -errno on error */
+static int manifest_save(void)
+{
+	struct pa5_cache_key *keys = malloc(PA5_WARM_MAX_ENTRIES * sizeof(*keys));
+	unsigned char *buf = NULL;
+	unsigned char mac[32];
+	char tmppath[PATH_MAX];
+	char path[PATH_MAX];
+	size_t n, m = 0;
+	size_t i;
+	int res = 0;
+
+	if (!keys)
+		return -ENOMEM;
+	n = pa5_cache_hot(keys, PA5_WARM_MAX_ENTRIES);
+	if ((buf = calloc(1, WARM_HEADER + n * WARM_ENTRY)) == NULL)
+	{
+		free(keys);
+		return -ENOMEM;
+	}
+
+	pa5_mutex_lock(&warm.lock, PA5_LOCK_WARM);
+	for (i = 0; i < n; i++)
+	{
+		const struct note *note = &warm.notes[keys[i].file % PA5_WARM_FILES];
+		if (note->cache_id != keys[i].file)
+			continue;
+		unsigned char *p = buf + WARM_HEADER + m * WARM_ENTRY;
+		put_le64(p, note->ino);
+		put_le64(p + 8, note->file_id);
+		put_le64(p + 16, keys[i].chunk);
+		m++;
+	}
+	pthread_mutex_unlock(&warm.lock);
+	free(keys);
+
+	size_t len = WARM_HEADER + m * WARM_ENTRY;
+	memcpy(buf, WARM_MAGIC, 4);
+	buf[4] = PA5_WARM_VERSION;
+	put_le64(buf + 8, m);
+	put_le64(buf + 16, (uint64_t)time(NULL));
+	manifest_mac(buf, len, mac);
+	memcpy(buf + 32, mac, 32);
+
+	/* A crash may leave the new file torn, which its MAC catches. */
+	snprintf(path, sizeof(path), "%s/%s", warm.rootdir, PA5_WARM_FILE);
+	snprintf(tmppath, sizeof(tmppath), "%s/%s", warm.rootdir, WARM_TMP);
+	int fd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY | O_NOFOLLOW, 0600);
+	if (fd == -1)
+		res = -errno;
+	else
+	{
+		if (write(fd, buf, len) != (ssize_t)len)
+			res = -EIO;
+		close(fd);
+		if (res == 0 && rename(tmppath, path) == -1)
+			res = -errno;
+		if (res < 0)
+			unlink(tmppath);
+	}
+	free(buf);
+
+	pa5_mutex_lock(&warm.lock, PA5_LOCK_WARM);
+	if (res == 0)
+	{
+		warm.saves++;
+		warm.saved = m;
+	}
+	else
+		warm.save_errors++;
+	pthread_mutex_unlock(&warm.lock);
+	return res;
+}
+
+static int is_running(void)
+{
+	pa5_mutex_lock(&warm.lock, PA5_LOCK_WARM);
+	int running = warm.running;
+	pthread_mutex_unlock(&warm.lock);
+	return running;
+}
+
+/* Finds the paths of the manifest's files, skipping the daemon's own
+ * directories, and stops once it has them all. */
+static int find_visit(const char *fpath, const struct stat *st, int type, struct FTW *ftw)
+{
+	struct file_ref *ref;
+	uint64_t ino = st->st_ino;
+
+	if (!is_running())
+		return FTW_STOP;
+	if (type == FTW_D && ftw->level > 0 &&
+	    strncmp(fpath + ftw->base, HIDDEN_PREFIX, strlen(HIDDEN_PREFIX)) == 0)
+		return FTW_SKIP_SUBTREE;
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return FTW_CONTINUE;
+
+	ref = bsearch(&ino, warm.files, warm.nfiles, sizeof(*warm.files), ref_cmp);
+	if (ref && !ref->path && (ref->path = strdup(fpath)) != NULL &&
+	    ++warm.found == warm.nfiles)
+		return FTW_STOP;
+	return FTW_CONTINUE;
+}
+
+/* Reads the chunks of one file of the manifest into the cache. */
+static void warm_file(const struct file_ref *ref)
+{
+	struct pa5_chunk_file cf;
+	struct stat st;
+	uint64_t file_id;
+	char *buf;
+	size_t i;
+	int res;
+
+	int fd = open(ref->path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1)
+		goto stale;
+	if (fstat(fd, &st) == -1 || st.st_ino != ref->ino)
+	{
+		close(fd);
+		goto stale;
+	}
+
+	pthread_rwlock_t *lock = pa5_inode_lock(st.st_dev, st.st_ino);
+	pa5_rwlock_rdlock(lock, PA5_LOCK_INODE);
+	res = (pa5_chunk_probe(fd) == PA5_CHUNK_VERSION) ? pa5_chunk_open(fd, warm.keys, &cf) : -EINVAL;
+	pthread_rwlock_unlock(lock);
+	if (res < 0)
+	{
+		close(fd);
+		goto stale;
+	}
+	memcpy(&file_id, cf.file_id, sizeof(file_id));
+	if (file_id != warm.entries[ref->first].file_id ||
+	    (buf = malloc(cf.chunk_size)) == NULL)
+	{
+		pa5_chunk_close(&cf);
+		close(fd);
+		goto stale;
+	}
+
+	for (i = ref->first; i < ref->first + ref->count && is_running(); i++)
+	{
+		pa5_rwlock_rdlock(lock, PA5_LOCK_INODE);
+		res = pa5_chunk_read(&cf, buf, cf.chunk_size,
+				     (off_t)warm.entries[i].chunk * cf.chunk_size);
+		pthread_rwlock_unlock(lock);
+
+		pa5_mutex_lock(&warm.lock, PA5_LOCK_WARM);
+		if (res > 0)
+			warm.chunks++;
+		else if (res < 0)
+			warm.failed++;
+		pthread_mutex_unlock(&warm.lock);
+	}
+	free(buf);
+	pa5_chunk_close(&cf);
+	close(fd);
+	return;
+
+stale:
+	pa5_mutex_lock(&warm.lock, PA5_LOCK_WARM);
+	warm.stale++;
+	pthread_mutex_unlock(&warm.lock);
+}
+
+/* Warms the cache from the manifest loaded at open.
+ * Return: 1 if it got through it, 0 if stopped */
+static int warm_cache(void)
+{
+	struct timespec start, end;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (warm.nfiles > 0)
+	{
+		pa5_info("Warming the cache with %zu chunks of %zu files.", warm.nentries, warm.nfiles);
+		nftw(warm.rootdir, find_visit, 16, FTW_PHYS | FTW_MOUNT | FTW_ACTIONRETVAL);
+
+		pa5_mutex_lock(&warm.lock, PA5_LOCK_WARM);
+		warm.state = "warming";
+		warm.stale += warm.nfiles - warm.found;
+		pthread_mutex_unlock(&warm.lock);
+		for (i = 0; i < warm.nfiles && is_running(); i++)
+			if (warm.files[i].path)
+				warm_file(&warm.files[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pa5_mutex_lock(&warm.lock, PA5_LOCK_WARM);
+	int done = warm.running;
+	warm.warm_ms = (end.tv_sec - start.tv_sec) * 1000ULL +
+		       (end.tv_nsec - start.tv_nsec) / 1000000;
+	warm.state = done ? "done" : "stopped";
+	warm.warmed = done;
+	pthread_mutex_unlock(&warm.lock);
+	if (done && warm.nfiles > 0)
+		pa5_info("Warmed %llu chunks in %llu ms.", warm.chunks, warm.warm_ms);
+
+	for (i = 0; i < warm.nfiles; i++)
+		free(warm.files[i].path);
+	free(warm.files);
+	free(warm.entries);
+	warm.files = NULL;
+	warm.entries = NULL;
+	warm.nfiles = warm.nentries = 0;
+	return done;
+}
+
+static void *warm_worker(void *arg)
+{
+	(void) arg;
+
+	pa5_sched_set_class(PA5_SCHED_PREFETCH);
+	if (!warm_cache())
+		return NULL;
+
+	pa5_mutex_lock(&warm.lock, PA5_LOCK_WARM);
+	while (warm.running)
+	{
+		struct timespec until = { time(NULL) + warm.interval, 0 };
+		if (pthread_cond_timedwait(&warm.wake, &warm.lock, &until) != ETIMEDOUT)
+			continue;
+		pthread_mutex_unlock(&warm.lock);
+		if (manifest_save() < 0)
+			pa5_warn("Could not save the warm manifest.");
+		pa5_mutex_lock(&warm.lock, PA5_LOCK_WARM);
+	}
+	pthread_mutex_unlock(&warm.lock);
+	return NULL;
+}
+
+int pa5_warm_open(const char *rootdir, const struct pa5_keys *keys, unsigned interval)
+{
+	char path[PATH_MAX];
+	int res;
+
+	if (interval == 0)
+	{
+		snprintf(path, sizeof(path), "%s/%s", rootdir, PA5_WARM_FILE);
+		if (unlink(path) == -1 && errno != ENOENT)
+			return -errno;
+		return 0;
+	}
+
+	if ((warm.rootdir = strdup(rootdir)) == NULL)
+		return -ENOMEM;
+	warm.keys = keys;
+	warm.interval = interval;
+	hmac_sha256(keys->header_mac, "pa5 warm", 8, warm.key);
+	if ((res = manifest_load()) < 0)
+	{
+		free(warm.rootdir);
+		warm.rootdir = NULL;
+		return res;
+	}
+	warm.ready = 1;
+	warm.state = "scanning";
+	return 0;
+}
+
+void pa5_warm_note(const struct pa5_chunk_file *cf, ino_t ino)
+{
+	struct note *note = &warm.notes[cf->cache_id % PA5_WARM_FILES];
+
+	if (!warm.ready)
+		return;
+	pa5_mutex_lock(&warm.lock, PA5_LOCK_WARM);
+	note->cache_id = cf->cache_id;
+	note->ino = ino;
+	memcpy(&note->file_id, cf->file_id, sizeof(note->file_id));
+	pthread_mutex_unlock(&warm.lock);
+}
+
+int pa5_warm_start(void)
+{
+	int res;
+
+	if (!warm.ready)
+		return 0;
+	warm.running = 1;
+	if ((res = pthread_create(&warm.worker, NULL, warm_worker, NULL)) != 0)
+	{
+		warm.running = 0;
+		return -res;
+	}
+	return 0;
+}
+
+void pa5_warm_close(void)
+{
+	int started = warm.running;
+
+	if (!warm.ready)
+		return;
+	pa5_mutex_lock(&warm.lock, PA5_LOCK_WARM);
+	warm.running = 0;
+	pthread_cond_signal(&warm.wake);
+	pthread_mutex_unlock(&warm.lock);
+	if (started)
+		pthread_join(warm.worker, NULL);
+
+	if (warm.warmed && manifest_save() < 0)
+		pa5_warn("Could not save the warm manifest.");
+	warm.ready = 0;
+	warm.state = "off";
+	free(warm.rootdir);
+	warm.rootdir = NULL;
+}
+
+void pa5_warm_stats(FILE *out)
+{
+	pa5_mutex_lock(&warm.lock, PA5_LOCK_WARM);
+	fprintf(out, "enabled %d\n", warm.ready);
+	if (warm.ready)
+	{
+		fprintf(out, "interval %u\n", warm.interval);
+		fprintf(out, "state %s\n", warm.state);
+		fprintf(out, "chunks_warmed %llu\n", warm.chunks);
+		fprintf(out, "chunks_failed %llu\n", warm.failed);
+		fprintf(out, "files_stale %llu\n", warm.stale);
+		fprintf(out, "warm_ms %llu\n", warm.warm_ms);
+		fprintf(out, "saves %llu\n", warm.saves);
+		fprintf(out, "save_errors %llu\n", warm.save_errors);
+		fprintf(out, "saved_chunks %zu\n", warm.saved);
+	}
+	pthread_mutex_unlock(&warm.lock);
+}
@@ -0,0 +1,62 @@
+/* pa5-warm.h
+ * Warming the chunk cache after a remount.
+ *
+ * Every PA5_WARM_DEFAULT_INTERVAL seconds, and at unmount, the keys of the
+ * most recently used chunks in pa5-cache are saved to PA5_WARM_FILE in the
+ * mirror root as the backing inode number, the first half of the file id
+ * and the chunk index, nothing else, under a MAC. At the next mount a
+ * worker finds those inodes in the mirror and reads their chunks at
+ * PA5_SCHED_PREFETCH priority, so that foreground requests go first and
+ * find the cache already filled. A file whose id changed since is skipped.
+ *
+ * The file holds a 64-byte header, then its entries back to back:
+ *
+ *   0   magic "PA5H"
+ *   4   version
+ *   8   entry count, little endian like every field below
+ *   16  time it was written
+ *   32  HMAC-SHA256 of the first 32 bytes and the entries under a key
+ *       derived from the volume header key
+ *   64  entries: inode, file id, chunk index, 8 bytes each
+ *
+ * Cache keys are traced back to inodes through a table filled when files
+ * are opened, so chunks of a file whose entry was since overwritten there
+ * are left out.
+ */
+
+#ifndef PA5_WARM_H
+#define PA5_WARM_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "pa5-chunk.h"
+
+#define PA5_WARM_FILE ".pa5-warm"
+#define PA5_WARM_VERSION 1
+#define PA5_WARM_DEFAULT_INTERVAL 60   /* Seconds between saves. */
+#define PA5_WARM_MAX_ENTRIES 65536     /* 1 GiB of default-size chunks. */
+#define PA5_WARM_FILES 4096            /* Files remembered for the manifest. */
+
+/* int pa5_warm_open(const char *rootdir, const struct pa5_keys *keys, unsigned interval)
+ * Purpose: Load the manifest of the mirror at rootdir, if it has one, and
+ *          save a new one every interval seconds. An interval of 0 turns
+ *          warming off and removes the manifest.
+ * Return: 0 on success, -errno on error
+ */
+int pa5_warm_open(const char *rootdir, const struct pa5_keys *keys, unsigned interval);
+
+/* Records that cf was opened from the backing file with inode ino. */
+void pa5_warm_note(const struct pa5_chunk_file *cf, ino_t ino);
+
+/* Starts the worker, which warms the cache and then saves the manifest
+ * periodically. Called once the daemon has forked. */
+int pa5_warm_start(void);
+
+/* Stops the worker and saves the manifest a last time. */
+void pa5_warm_close(void);
+
+/* Stats section with the progress of warming and of the saves. */
+void pa5_warm_stats(FILE *out);
+
+#endif